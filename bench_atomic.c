@@ -0,0 +1,269 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include "./bpf_map.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+#define NR_RUNS		200000
+#define NR_OPS		16	/* counter updates per run */
+#define MAX_LEN		128
+#define VALUE_SIZE	128	/* keeps counters on distinct cache lines */
+
+/* Counter update flavours, from the weakest to the strongest. */
+enum bench_order {
+	ORDER_RELAXED,		/* BPF_ATOMIC | BPF_ADD */
+	ORDER_ACQ_REL,		/* load-acquire, add, store-release */
+	ORDER_SEQ_CST,		/* BPF_ATOMIC | BPF_ADD | BPF_FETCH */
+};
+
+static const char *const order_names[] = {
+	[ORDER_RELAXED] = "relaxed",
+	[ORDER_ACQ_REL] = "acq_rel",
+	[ORDER_SEQ_CST] = "seq_cst",
+};
+
+struct bench_thread {
+	pthread_t		tid;
+	struct bpf_prog		*prog;
+	__u32			key;
+	int			ret;
+};
+
+static pthread_barrier_t barrier;
+
+static
+__u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Look up the counter whose key is in the context, then update it
+ * NR_OPS times with @order.
+ */
+static
+size_t gen_counter(struct bpf_insn *bytecode, enum bench_order order)
+{
+	size_t len = 0;
+	int i;
+
+	bytecode[len++] = (struct bpf_insn) {
+		.code = BPF_LDX | BPF_W | BPF_MEM,
+		.dst_reg = BPF_REG_2,
+		.src_reg = BPF_REG_1,
+	};
+	bytecode[len++] = (struct bpf_insn) {
+		.code = BPF_STX | BPF_W | BPF_MEM,
+		.dst_reg = BPF_REG_10,
+		.src_reg = BPF_REG_2,
+		.off = -4,
+	};
+	bytecode[len++] = (struct bpf_insn) {
+		.code = BPF_LD | BPF_DW | BPF_IMM,
+		.dst_reg = BPF_REG_1,
+		.src_reg = BPF_PSEUDO_MAP_IDX,
+	};
+	bytecode[len++] = (struct bpf_insn) {
+		.code = BPF_LD | BPF_W | BPF_IMM,
+	};
+	bytecode[len++] = (struct bpf_insn) {
+		.code = BPF_ALU64 | BPF_MOV | BPF_X,
+		.dst_reg = BPF_REG_2,
+		.src_reg = BPF_REG_10,
+	};
+	bytecode[len++] = (struct bpf_insn) {
+		.code = BPF_ALU64 | BPF_ADD | BPF_K,
+		.dst_reg = BPF_REG_2,
+		.imm = -4,
+	};
+	bytecode[len++] = (struct bpf_insn) {
+		.code = BPF_JMP | BPF_CALL,
+		.imm = BPF_FUNC_map_lookup_elem,
+	};
+	bytecode[len++] = (struct bpf_insn) {
+		.code = BPF_JMP | BPF_JEQ | BPF_K,
+		.dst_reg = BPF_REG_0,
+		.off = 3 * NR_OPS,
+	};
+	for (i = 0; i < NR_OPS; i++) {
+		switch (order) {
+		case ORDER_RELAXED:
+		case ORDER_SEQ_CST:
+			bytecode[len++] = (struct bpf_insn) {
+				.code = BPF_ALU64 | BPF_MOV | BPF_K,
+				.dst_reg = BPF_REG_1,
+				.imm = 1,
+			};
+			bytecode[len++] = (struct bpf_insn) {
+				.code = BPF_STX | BPF_DW | BPF_ATOMIC,
+				.dst_reg = BPF_REG_0,
+				.src_reg = BPF_REG_1,
+				.imm = order == ORDER_RELAXED ?
+					BPF_ADD : BPF_ADD | BPF_FETCH,
+			};
+			/* Same length as the acq_rel sequence. */
+			bytecode[len++] = (struct bpf_insn) {
+				.code = BPF_ALU64 | BPF_MOV | BPF_X,
+				.dst_reg = BPF_REG_2,
+				.src_reg = BPF_REG_1,
+			};
+			break;
+		case ORDER_ACQ_REL:
+			bytecode[len++] = (struct bpf_insn) {
+				.code = BPF_LDX | BPF_DW | BPF_MEM_ACQ_REL,
+				.dst_reg = BPF_REG_1,
+				.src_reg = BPF_REG_0,
+			};
+			bytecode[len++] = (struct bpf_insn) {
+				.code = BPF_ALU64 | BPF_ADD | BPF_K,
+				.dst_reg = BPF_REG_1,
+				.imm = 1,
+			};
+			bytecode[len++] = (struct bpf_insn) {
+				.code = BPF_STX | BPF_DW | BPF_MEM_ACQ_REL,
+				.dst_reg = BPF_REG_0,
+				.src_reg = BPF_REG_1,
+			};
+			break;
+		}
+	}
+	return len;
+}
+
+static
+void *bench_thread(void *arg)
+{
+	struct bench_thread *t = arg;
+	__u64 r0;
+	int i;
+
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < NR_RUNS; i++) {
+		if (bpf_prog_run(t->prog, &t->key, sizeof(t->key), &r0)) {
+			t->ret = -1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Run the counter program from @nr_threads threads, on one shared
+ * counter or on a counter per thread, and check the final counts.
+ */
+static
+int bench_threads(struct bpf_map *map, struct bpf_prog *prog,
+		enum bench_order order, bool shared, int nr_threads)
+{
+	struct bench_thread *threads;
+	__u64 start, end, total = 0, expect, *counter;
+	__u8 zero[VALUE_SIZE] = { 0 };
+	int i, ret = 0;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		return -1;
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].key = shared ? 0 : i;
+		if (bpf_map_update_elem(map, &threads[i].key, zero, BPF_ANY)) {
+			free(threads);
+			return -1;
+		}
+	}
+	pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].prog = prog;
+		if (pthread_create(&threads[i].tid, NULL, bench_thread,
+				&threads[i])) {
+			/* Threads already started wait on the barrier forever. */
+			fprintf(stderr, "Error: pthread_create\n");
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		ret |= threads[i].ret;
+	}
+	end = now_ns();
+	pthread_barrier_destroy(&barrier);
+	for (i = 0; i < (shared ? 1 : nr_threads); i++) {
+		counter = bpf_map_lookup_elem(map, &threads[i].key);
+		total += *counter;
+	}
+	expect = (__u64) nr_threads * NR_RUNS * NR_OPS;
+	printf("%-8s %-7s %3d threads %8.2f Mops/s %6.2f ns/op%s\n",
+		order_names[order], shared ? "shared" : "private", nr_threads,
+		(double) expect * 1000 / (end - start),
+		(double) (end - start) * nr_threads / expect,
+		total == expect ? "" : " (lost updates)");
+	/* Only atomic read-modify-writes may share a counter. */
+	if (total != expect && (!shared || order != ORDER_ACQ_REL))
+		ret = -1;
+	free(threads);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct bpf_map_attr attr = {
+		.type = BPF_MAP_TYPE_HASH,
+		.key_size = sizeof(__u32),
+		.value_size = VALUE_SIZE,
+		.max_entries = nr_cpus,
+	};
+	struct bpf_map *map;
+	struct bpf_prog_opts opts = {
+		.ctx_size = sizeof(__u32),
+		.maps = &map,
+		.nr_maps = 1,
+	};
+	enum bpf_engine engines[] = { BPF_ENGINE_THREADED, BPF_ENGINE_JIT };
+	const char *engine_names[] = { "threaded", "jit" };
+	struct bpf_insn bytecode[MAX_LEN];
+	struct bpf_prog *prog;
+	int e, order, shared, n, ret = 0;
+	size_t len;
+
+	map = bpf_map_create(&attr);
+	if (!map)
+		return -1;
+	printf("counter updates: %d runs of %d updates per thread, %ld cpus\n",
+		NR_RUNS, NR_OPS, nr_cpus);
+	for (e = 0; e < ARRAY_SIZE(engines) && !ret; e++) {
+		printf("%s:\n", engine_names[e]);
+		opts.engine = engines[e];
+		for (order = ORDER_RELAXED; order <= ORDER_SEQ_CST && !ret; order++) {
+			len = gen_counter(bytecode, order);
+			prog = bpf_prog_load(bytecode, len, &opts);
+			if (!prog) {
+				ret = -1;
+				break;
+			}
+			for (shared = 0; shared <= 1 && !ret; shared++) {
+				for (n = 1; n <= nr_cpus && !ret;
+				     n = n * 2 > nr_cpus && n < nr_cpus ?
+						nr_cpus : n * 2)
+					ret = bench_threads(map, prog, order,
+						shared, n);
+			}
+			bpf_prog_destroy(prog);
+		}
+	}
+	bpf_map_destroy(map);
+	return ret;
+}
@@ -0,0 +1,535 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+/*
+ * Each measurement runs a program NR_WARMUP times, then NR_REPS
+ * repetitions of a batch of runs sized to last about REP_NS. The
+ * percentiles are over the repetitions.
+ */
+#define NR_WARMUP	1000
+#define NR_REPS		31
+#define REP_NS		2000000
+#define MAX_LEN		1024
+#define MICRO_LEN	512
+
+struct event {
+	__u64 ts;
+	__u32 pid;
+	__u32 cpu;
+	__u16 type;
+	__u8 flags;
+	__u8 prio;
+	__u32 len;
+};
+
+static
+__u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Microbenchmarks: straight-line programs of MICRO_LEN instructions of
+ * one class, after r0-r5 are loaded from the context so that no
+ * engine can fold them. Every instruction executes: conditional jumps
+ * branch to the next instruction.
+ */
+static
+size_t gen_setup(struct bpf_insn *bytecode)
+{
+	size_t len = 0;
+	int i;
+
+	/* r1 last, it points to the context. */
+	for (i = BPF_REG_0; i <= BPF_REG_5; i++) {
+		if (i == BPF_REG_1)
+			continue;
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_LDX | BPF_W | BPF_MEM,
+			.dst_reg = i,
+			.src_reg = BPF_REG_1,
+			.off = 4 * (i % 4),
+		};
+	}
+	bytecode[len++] = (struct bpf_insn) {
+		.code = BPF_LDX | BPF_W | BPF_MEM,
+		.dst_reg = BPF_REG_1,
+		.src_reg = BPF_REG_1,
+		.off = 4,
+	};
+	return len;
+}
+
+static
+size_t gen_alu(struct bpf_insn *bytecode, __u8 bpf_class)
+{
+	static const struct {
+		__u8 op;
+		__s32 imm;
+	} ops[] = {
+		{ BPF_ADD | BPF_K, 7 },
+		{ BPF_SUB | BPF_X },
+		{ BPF_MUL | BPF_K, 3 },
+		{ BPF_OR | BPF_X },
+		{ BPF_AND | BPF_K, 0xffff },
+		{ BPF_XOR | BPF_X },
+		{ BPF_LSH | BPF_K, 3 },
+		{ BPF_RSH | BPF_K, 5 },
+		{ BPF_ARSH | BPF_K, 7 },
+		{ BPF_DIV | BPF_K, 3 },
+		{ BPF_MOD | BPF_K, 1000 },
+		{ BPF_MOV | BPF_X },
+		{ BPF_NEG },
+	};
+	size_t len = gen_setup(bytecode), i;
+
+	for (i = 0; len < MICRO_LEN; i++) {
+		bytecode[len++] = (struct bpf_insn) {
+			.code = bpf_class | ops[i % ARRAY_SIZE(ops)].op,
+			.dst_reg = i % 6,
+			.src_reg = (i + 1) % 6,
+			.imm = ops[i % ARRAY_SIZE(ops)].imm,
+		};
+	}
+	bytecode[len++] = (struct bpf_insn) { .code = BPF_JMP | BPF_EXIT };
+	return len;
+}
+
+static
+size_t gen_jmp(struct bpf_insn *bytecode, __u8 bpf_class)
+{
+	static const __u8 ops[] = {
+		BPF_JEQ | BPF_K, BPF_JNE | BPF_X, BPF_JGT | BPF_K,
+		BPF_JGE | BPF_X, BPF_JLT | BPF_K, BPF_JLE | BPF_X,
+		BPF_JSGT | BPF_K, BPF_JSGE | BPF_X, BPF_JSLT | BPF_K,
+		BPF_JSLE | BPF_X, BPF_JSET | BPF_K,
+	};
+	size_t len = gen_setup(bytecode), i;
+
+	for (i = 0; len < MICRO_LEN; i++) {
+		bytecode[len++] = (struct bpf_insn) {
+			.code = bpf_class | ops[i % ARRAY_SIZE(ops)],
+			.dst_reg = i % 6,
+			.src_reg = (i + 1) % 6,
+			.imm = 0x1234567 * (i % 7),
+		};
+	}
+	bytecode[len++] = (struct bpf_insn) { .code = BPF_JMP | BPF_EXIT };
+	return len;
+}
+
+/* Loads and stores of all sizes on 64 bytes of stack. */
+static
+size_t gen_mem(struct bpf_insn *bytecode, __u8 mode)
+{
+	static const __u8 sizes[] = { BPF_DW, BPF_W, BPF_H, BPF_B };
+	static const __u8 classes[] = { BPF_LDX, BPF_STX, BPF_LDX, BPF_ST };
+	size_t len = gen_setup(bytecode), i;
+
+	for (i = 1; i <= 8; i++) {
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_ST | BPF_DW | BPF_MEM,
+			.dst_reg = BPF_REG_10,
+			.off = -8 * i,
+			.imm = i,
+		};
+	}
+	for (i = 0; len < MICRO_LEN; i++) {
+		__u8 bpf_class = classes[i % ARRAY_SIZE(classes)];
+		struct bpf_insn insn = {
+			.code = bpf_class | sizes[(i / 4) % ARRAY_SIZE(sizes)] | mode,
+			.off = -8 * (i % 8 + 1),
+			.imm = i,
+		};
+
+		if (bpf_class == BPF_LDX) {
+			insn.dst_reg = i % 6;
+			insn.src_reg = BPF_REG_10;
+		} else {
+			insn.dst_reg = BPF_REG_10;
+			insn.src_reg = (i + 1) % 6;
+		}
+		bytecode[len++] = insn;
+	}
+	bytecode[len++] = (struct bpf_insn) { .code = BPF_JMP | BPF_EXIT };
+	return len;
+}
+
+/*
+ * Filter-like program: the context (r1) is a struct event, kept in r9.
+ * Loads fields, combines them and compares them against constants,
+ * without taking any branch, so every instruction executes.
+ */
+static
+size_t gen_filter(struct bpf_insn *bytecode, size_t max_len)
+{
+	size_t len = 0;
+
+	bytecode[len++] = (struct bpf_insn) {
+		.code = BPF_ALU64 | BPF_MOV | BPF_X,
+		.dst_reg = BPF_REG_9,
+		.src_reg = BPF_REG_1,
+	};
+	while (len + 8 <= max_len) {
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_LDX | BPF_W | BPF_MEM,
+			.dst_reg = BPF_REG_1,
+			.src_reg = BPF_REG_9,
+			.off = offsetof(struct event, pid),
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_JMP | BPF_JEQ | BPF_K,
+			.dst_reg = BPF_REG_1,
+			.imm = 1,
+			.off = 0,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_LDX | BPF_H | BPF_MEM,
+			.dst_reg = BPF_REG_2,
+			.src_reg = BPF_REG_9,
+			.off = offsetof(struct event, type),
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_ALU64 | BPF_AND | BPF_K,
+			.dst_reg = BPF_REG_2,
+			.imm = 0xff,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_ALU64 | BPF_LSH | BPF_K,
+			.dst_reg = BPF_REG_2,
+			.imm = 3,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_ALU64 | BPF_ADD | BPF_X,
+			.dst_reg = BPF_REG_0,
+			.src_reg = BPF_REG_2,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_ALU | BPF_XOR | BPF_X,
+			.dst_reg = BPF_REG_0,
+			.src_reg = BPF_REG_1,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_JMP32 | BPF_JGT | BPF_K,
+			.dst_reg = BPF_REG_0,
+			.imm = -1,
+			.off = 0,
+		};
+	}
+	return len;
+}
+
+enum bench_prog_type {
+	PROG_ALU32,
+	PROG_ALU64,
+	PROG_JMP,
+	PROG_JMP32,
+	PROG_MEM,
+	PROG_MEM_ACQ_REL,
+	PROG_FILTER_64,
+	PROG_FILTER_256,
+	PROG_FILTER_1024,
+	NR_PROGS,
+};
+
+static const char *const prog_names[NR_PROGS] = {
+	[PROG_ALU32] = "alu32",
+	[PROG_ALU64] = "alu64",
+	[PROG_JMP] = "jmp",
+	[PROG_JMP32] = "jmp32",
+	[PROG_MEM] = "mem",
+	[PROG_MEM_ACQ_REL] = "mem_acq_rel",
+	[PROG_FILTER_64] = "filter64",
+	[PROG_FILTER_256] = "filter256",
+	[PROG_FILTER_1024] = "filter1024",
+};
+
+static
+size_t gen_prog(struct bpf_insn *bytecode, enum bench_prog_type type)
+{
+	switch (type) {
+	case PROG_ALU32:
+		return gen_alu(bytecode, BPF_ALU);
+	case PROG_ALU64:
+		return gen_alu(bytecode, BPF_ALU64);
+	case PROG_JMP:
+		return gen_jmp(bytecode, BPF_JMP);
+	case PROG_JMP32:
+		return gen_jmp(bytecode, BPF_JMP32);
+	case PROG_MEM:
+		return gen_mem(bytecode, BPF_MEM);
+	case PROG_MEM_ACQ_REL:
+		return gen_mem(bytecode, BPF_MEM_ACQ_REL);
+	case PROG_FILTER_64:
+		return gen_filter(bytecode, 64);
+	case PROG_FILTER_256:
+		return gen_filter(bytecode, 256);
+	default:
+		return gen_filter(bytecode, 1024);
+	}
+}
+
+struct bench_engine {
+	const char		*name;
+	enum bpf_engine		engine;
+};
+
+static const struct bench_engine all_engines[] = {
+	{ "switch", BPF_ENGINE_SWITCH },
+	{ "threaded", BPF_ENGINE_THREADED },
+	{ "jit", BPF_ENGINE_JIT },
+	{ "aot", BPF_ENGINE_AOT },
+	{ "tiered", BPF_ENGINE_TIERED },
+};
+
+/* Per-run times of each repetition, in ns. */
+struct bench_result {
+	double			p50, p90, p99;
+};
+
+static
+int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Events of bpf_prog_run_strided() batches, with -B. */
+#define BATCH_SIZE	1024
+
+static bool use_batch_api;
+
+static
+int run_batch(struct bpf_prog *prog, struct event *ev, long nr_runs)
+{
+	static struct event evs[BATCH_SIZE];
+	static __u64 r0s[BATCH_SIZE];
+	__u64 r0;
+	long i, n;
+	int err;
+
+	if (!use_batch_api) {
+		for (i = 0; i < nr_runs; i++) {
+			if (bpf_prog_run(prog, ev, sizeof(*ev), &r0))
+				return -1;
+		}
+		return 0;
+	}
+	if (evs[0].ts != ev->ts) {
+		for (i = 0; i < BATCH_SIZE; i++)
+			evs[i] = *ev;
+	}
+	for (i = 0; i < nr_runs; i += n) {
+		n = nr_runs - i < BATCH_SIZE ? nr_runs - i : BATCH_SIZE;
+		if (bpf_prog_run_strided(prog, evs, sizeof(evs[0]), n,
+				sizeof(evs[0]), r0s, &err) != n)
+			return -1;
+	}
+	return 0;
+}
+
+static
+int bench_engine(const struct bench_engine *e, unsigned int flags,
+		const struct bpf_insn *bytecode, size_t len, struct event *ev,
+		struct bench_result *res)
+{
+	struct bpf_prog_opts opts = {
+		.engine = e->engine,
+		.ctx_size = sizeof(*ev),
+		.flags = flags,
+	};
+	static int nr_aot;
+	double times[NR_REPS];
+	struct bpf_prog *prog;
+	char path[64];
+	__u64 start, end;
+	long nr_runs;
+	int i, ret = -1;
+
+	if (e->engine == BPF_ENGINE_AOT) {
+		snprintf(path, sizeof(path), "/tmp/bench_bpf_%d_%d.so",
+			(int) getpid(), nr_aot++);
+		if (bpf_prog_aot_compile(bytecode, len, &opts, path))
+			return -1;
+		opts.aot_path = path;
+	}
+	prog = bpf_prog_load(bytecode, len, &opts);
+	if (e->engine == BPF_ENGINE_AOT)
+		unlink(path);
+	if (!prog)
+		return -1;
+
+	/* Warm up, promoting tiered programs, then size the batches. */
+	if (run_batch(prog, ev, NR_WARMUP))
+		goto end;
+	if (e->engine == BPF_ENGINE_TIERED) {
+		while (bpf_prog_engine(prog) != BPF_ENGINE_JIT)
+			usleep(1000);
+	}
+	start = now_ns();
+	if (run_batch(prog, ev, NR_WARMUP))
+		goto end;
+	end = now_ns();
+	nr_runs = (double) REP_NS * NR_WARMUP / (end - start + 1) + 1;
+
+	for (i = 0; i < NR_REPS; i++) {
+		start = now_ns();
+		if (run_batch(prog, ev, nr_runs))
+			goto end;
+		end = now_ns();
+		times[i] = (double) (end - start) / nr_runs;
+	}
+	qsort(times, NR_REPS, sizeof(times[0]), cmp_double);
+	res->p50 = times[NR_REPS / 2];
+	res->p90 = times[NR_REPS * 90 / 100];
+	res->p99 = times[NR_REPS * 99 / 100];
+	ret = 0;
+end:
+	if (ret)
+		fprintf(stderr, "Error: %s run failed\n", e->name);
+	bpf_prog_destroy(prog);
+	return ret;
+}
+
+static
+void usage(const char *name)
+{
+	int i;
+
+	fprintf(stderr, "Usage: %s [-O] [-B] [-S] [-e engine[,engine...]] [program...]\n"
+		"  -O  optimize programs (BPF_F_OPTIMIZE)\n"
+		"  -B  run batches of %d events with bpf_prog_run_strided()\n"
+		"  -S  run the batches in SIMD lanes (BPF_F_SIMD), implies -B\n"
+		"  -e  engines to compare, default switch,threaded,jit,aot\n"
+		"programs:", name, BATCH_SIZE);
+	for (i = 0; i < NR_PROGS; i++)
+		fprintf(stderr, " %s", prog_names[i]);
+	fprintf(stderr, "\nengines:");
+	for (i = 0; i < ARRAY_SIZE(all_engines); i++)
+		fprintf(stderr, " %s", all_engines[i].name);
+	fprintf(stderr, "\n");
+}
+
+static
+int parse_engines(char *list, const struct bench_engine **engines)
+{
+	int nr = 0, i;
+	char *name;
+
+	for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		for (i = 0; i < ARRAY_SIZE(all_engines); i++) {
+			if (!strcmp(name, all_engines[i].name))
+				break;
+		}
+		if (i == ARRAY_SIZE(all_engines) || nr == ARRAY_SIZE(all_engines)) {
+			fprintf(stderr, "Error: unknown engine %s\n", name);
+			return -1;
+		}
+		engines[nr++] = &all_engines[i];
+	}
+	return nr;
+}
+
+/*
+ * Run each selected program on each selected engine. Times are per
+ * instruction of the original program, and the last column is the
+ * speedup over the first engine.
+ */
+int main(int argc, char **argv)
+{
+	const struct bench_engine *engines[ARRAY_SIZE(all_engines)];
+	bool selected[NR_PROGS] = { false };
+	struct bpf_insn bytecode[MAX_LEN + 1];
+	struct event ev = {
+		.ts = 123456789,
+		.pid = 42,
+		.cpu = 3,
+		.type = 7,
+		.len = 100,
+	};
+	unsigned int flags = 0;
+	int nr_engines = 4, opt, i, j;
+	bool all = true;
+	size_t len;
+
+	for (i = 0; i < nr_engines; i++)
+		engines[i] = &all_engines[i];
+	while ((opt = getopt(argc, argv, "OBSe:")) != -1) {
+		switch (opt) {
+		case 'O':
+			flags |= BPF_F_OPTIMIZE;
+			break;
+		case 'B':
+			use_batch_api = true;
+			break;
+		case 'S':
+			flags |= BPF_F_SIMD;
+			use_batch_api = true;
+			break;
+		case 'e':
+			nr_engines = parse_engines(optarg, engines);
+			if (nr_engines <= 0)
+				return 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	for (i = optind; i < argc; i++) {
+		for (j = 0; j < NR_PROGS; j++) {
+			if (!strcmp(argv[i], prog_names[j]))
+				break;
+		}
+		if (j == NR_PROGS) {
+			usage(argv[0]);
+			return 1;
+		}
+		selected[j] = true;
+		all = false;
+	}
+
+	printf("%d warm-up runs, %d repetitions of ~%d ms%s%s%s\n", NR_WARMUP,
+		NR_REPS, REP_NS / 1000000,
+		flags & BPF_F_OPTIMIZE ? ", optimized" : "",
+		use_batch_api ? ", batched" : "",
+		flags & BPF_F_SIMD ? " in SIMD lanes" : "");
+	printf("%-12s %5s %-9s %9s %8s %9s %8s %8s %7s\n", "program", "insn",
+		"engine", "ns/run", "ns/insn", "Minsn/s", "p90", "p99",
+		"speedup");
+	for (i = 0; i < NR_PROGS; i++) {
+		double base = 0;
+
+		if (!all && !selected[i])
+			continue;
+		len = gen_prog(bytecode, i);
+		for (j = 0; j < nr_engines; j++) {
+			struct bench_result res;
+
+			if (bench_engine(engines[j], flags, bytecode, len, &ev,
+					&res))
+				return 1;
+			if (!j)
+				base = res.p50;
+			printf("%-12s %5zu %-9s %9.2f %8.3f %9.1f %8.2f %8.2f %6.2fx\n",
+				prog_names[i], len, engines[j]->name, res.p50,
+				res.p50 / len, len * 1000 / res.p50, res.p90,
+				res.p99, base / res.p50);
+		}
+	}
+	return 0;
+}
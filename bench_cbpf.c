@@ -0,0 +1,281 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include "./bpf_cbpf.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+/*
+ * Each measurement runs a filter over NR_PACKETS synthetic packets,
+ * NR_REPS times. Times are the median per packet.
+ */
+#define NR_PACKETS	4096
+#define SNAPLEN		128
+#define NR_REPS		31
+
+/* tcpdump -d "ip and tcp dst port 80" */
+static const struct bpf_cbpf_insn http_filter[] = {
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x800, 0, 8),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 6),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+	BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),
+	BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 80, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, 262144),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+/* tcpdump -d "ip and (tcp or udp) and (port 80 or port 53)", IPv4 only */
+static const struct bpf_cbpf_insn ports_filter[] = {
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x800, 0, 13),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 1, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 17, 0, 10),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 8, 0),
+	BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),
+	BPF_STMT(BPF_LD | BPF_H | BPF_IND, 14),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 80, 4, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 53, 3, 0),
+	BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 80, 1, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 53, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, 262144),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+/*
+ * Flow hash of the IPv4 addresses and ports, assuming no IP options: a
+ * run of constant-offset loads, bounds checked once.
+ */
+static const struct bpf_cbpf_insn hash_filter[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 26),
+	BPF_STMT(BPF_MISC | BPF_TAX, 0),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 30),
+	BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+	BPF_STMT(BPF_MISC | BPF_TAX, 0),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 34),
+	BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+	BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+	BPF_STMT(BPF_MISC | BPF_TAX, 0),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 36),
+	BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+	BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 3),
+	BPF_STMT(BPF_RET | BPF_A, 0),
+};
+
+static const struct {
+	const char			*name;
+	const struct bpf_cbpf_insn	*filter;
+	size_t				len;
+} filters[] = {
+	{ "http", http_filter, ARRAY_SIZE(http_filter) },
+	{ "ports", ports_filter, ARRAY_SIZE(ports_filter) },
+	{ "hash", hash_filter, ARRAY_SIZE(hash_filter) },
+};
+
+struct bench_engine {
+	const char		*name;
+	enum bpf_engine		engine;
+};
+
+static const struct bench_engine engines[] = {
+	{ "switch", BPF_ENGINE_SWITCH },
+	{ "threaded", BPF_ENGINE_THREADED },
+	{ "jit", BPF_ENGINE_JIT },
+	{ "aot", BPF_ENGINE_AOT },
+};
+
+static
+__u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Mostly IPv4 traffic, TCP or UDP with the usual ports, a few
+ * fragments, and truncated captures.
+ */
+static
+void gen_packets(struct bpf_packet *pkts, __u8 (*data)[SNAPLEN])
+{
+	static const __u16 ports[] = { 80, 443, 53, 22, 8080, 123 };
+	size_t i, j;
+
+	srandom(42);
+	for (i = 0; i < NR_PACKETS; i++) {
+		__u8 *p = data[i];
+		__u16 sport = ports[random() % ARRAY_SIZE(ports)];
+		__u16 dport = ports[random() % ARRAY_SIZE(ports)];
+
+		for (j = 0; j < SNAPLEN; j++)
+			p[j] = random();
+		if (random() % 10) {
+			p[12] = 0x08;
+			p[13] = 0x00;
+		}
+		p[14] = 0x45;
+		p[20] = random() % 20 ? 0x40 : 0x20;
+		p[21] = 0;
+		p[23] = random() % 2 ? 6 : 17;
+		p[34] = sport >> 8;
+		p[35] = sport;
+		p[36] = dport >> 8;
+		p[37] = dport;
+		pkts[i].data = p;
+		pkts[i].len = random() % 20 ? SNAPLEN : random() % SNAPLEN;
+	}
+}
+
+static
+double time_cbpf(size_t f, const struct bpf_packet *pkts, size_t *matched)
+{
+	__u64 start = now_ns();
+	size_t i;
+
+	*matched = 0;
+	for (i = 0; i < NR_PACKETS; i++)
+		*matched += !!cbpf_run(filters[f].filter, filters[f].len,
+				&pkts[i]);
+	return (double) (now_ns() - start) / NR_PACKETS;
+}
+
+static
+double time_prog(const struct bpf_prog *prog, struct bpf_packet *pkts,
+		size_t *matched)
+{
+	__u64 start = now_ns(), r0;
+	size_t i;
+
+	*matched = 0;
+	for (i = 0; i < NR_PACKETS; i++) {
+		if (bpf_prog_run(prog, &pkts[i], sizeof(pkts[i]), &r0))
+			return -1;
+		*matched += !!r0;
+	}
+	return (double) (now_ns() - start) / NR_PACKETS;
+}
+
+static
+struct bpf_prog *load_engine(size_t f, const struct bench_engine *e,
+		unsigned int flags)
+{
+	struct bpf_prog_opts opts = {
+		.engine = e->engine,
+		.ctx_size = sizeof(struct bpf_packet),
+		.flags = flags,
+	};
+	struct bpf_prog *prog;
+	struct bpf_insn *insns;
+	char path[64];
+	size_t len;
+	int ret;
+
+	if (e->engine != BPF_ENGINE_AOT)
+		return bpf_cbpf_load(filters[f].filter, filters[f].len, &opts);
+	if (bpf_cbpf_translate(filters[f].filter, filters[f].len, &insns, &len))
+		return NULL;
+	snprintf(path, sizeof(path), "/tmp/bench_cbpf_%d_%zu.so",
+		(int) getpid(), f);
+	ret = bpf_prog_aot_compile(insns, len, &opts, path);
+	free(insns);
+	if (ret)
+		return NULL;
+	opts.aot_path = path;
+	prog = bpf_cbpf_load(filters[f].filter, filters[f].len, &opts);
+	unlink(path);
+	return prog;
+}
+
+/*
+ * Run each classic filter over the packets with the naive classic
+ * interpreter, then translated on each engine. The last column is the
+ * speedup over the classic interpreter.
+ */
+int main(int argc, char **argv)
+{
+	static __u8 data[NR_PACKETS][SNAPLEN];
+	static struct bpf_packet pkts[NR_PACKETS];
+	unsigned int flags = 0;
+	double times[NR_REPS];
+	size_t f, e, expected, matched;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "O")) != -1) {
+		switch (opt) {
+		case 'O':
+			flags |= BPF_F_OPTIMIZE;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-O]\n"
+				"  -O  optimize translated programs (BPF_F_OPTIMIZE)\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	gen_packets(pkts, data);
+
+	printf("%d packets of up to %d bytes, %d repetitions%s\n", NR_PACKETS,
+		SNAPLEN, NR_REPS, flags ? ", optimized" : "");
+	printf("%-8s %5s %-9s %9s %9s %8s\n", "filter", "match", "engine",
+		"ns/pkt", "Mpkt/s", "speedup");
+	for (f = 0; f < ARRAY_SIZE(filters); f++) {
+		double base;
+
+		time_cbpf(f, pkts, &expected);
+		for (i = 0; i < NR_REPS; i++)
+			times[i] = time_cbpf(f, pkts, &matched);
+		qsort(times, NR_REPS, sizeof(times[0]), cmp_double);
+		base = times[NR_REPS / 2];
+		printf("%-8s %5zu %-9s %9.2f %9.1f %7.2fx\n", filters[f].name,
+			expected, "cbpf", base, 1000 / base, 1.0);
+
+		for (e = 0; e < ARRAY_SIZE(engines); e++) {
+			struct bpf_prog *prog = load_engine(f, &engines[e], flags);
+
+			if (!prog) {
+				fprintf(stderr, "Error: loading %s on %s\n",
+					filters[f].name, engines[e].name);
+				return 1;
+			}
+			for (i = 0; i < NR_REPS; i++) {
+				times[i] = time_prog(prog, pkts, &matched);
+				if (times[i] < 0 || matched != expected) {
+					fprintf(stderr, "Error: %s on %s matched %zu packets, expected %zu\n",
+						filters[f].name, engines[e].name,
+						matched, expected);
+					bpf_prog_destroy(prog);
+					return 1;
+				}
+			}
+			bpf_prog_destroy(prog);
+			qsort(times, NR_REPS, sizeof(times[0]), cmp_double);
+			printf("%-8s %5zu %-9s %9.2f %9.1f %7.2fx\n",
+				filters[f].name, matched, engines[e].name,
+				times[NR_REPS / 2], 1000 / times[NR_REPS / 2],
+				base / times[NR_REPS / 2]);
+		}
+	}
+	return 0;
+}
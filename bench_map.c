@@ -0,0 +1,309 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include "./bpf_map.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+#define NR_KEYS		(1U << 16)
+#define NR_LARGE_KEYS	(1U << 23)	/* larger than most LLCs */
+#define NR_LOOKUPS	2000000
+#define BATCH_SIZE	1024
+
+enum bench_mode {
+	BENCH_LOOKUP,		/* native lookups of random keys */
+	BENCH_PROG,		/* program runs, random keys in the context */
+	BENCH_BATCH,		/* batches of BATCH_SIZE program runs */
+	BENCH_ATOMIC,		/* native atomic add to a shared counter */
+};
+
+struct bench_thread {
+	pthread_t		tid;
+	enum bench_mode		mode;
+	struct bpf_map		*map;
+	__u32			nr_keys;
+	struct bpf_prog		*prog;
+	unsigned int		seed;
+	__u64			sum;
+	int			ret;
+};
+
+static pthread_barrier_t barrier;
+
+static
+__u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Lookup the key found in the context:
+ *
+ *	r2 = *(u32 *) (r1 + 0)
+ *	*(u32 *) (r10 - 4) = r2
+ *	r1 = map[0]
+ *	r2 = r10 - 4
+ *	call map_lookup_elem
+ *	if r0 == 0 goto out
+ *	r0 = *(u64 *) (r0 + 0)
+ * out:
+ *	exit
+ */
+static const struct bpf_insn lookup_prog[] = {
+	{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2,
+	  .src_reg = BPF_REG_1 },
+	{ .code = BPF_STX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10,
+	  .src_reg = BPF_REG_2, .off = -4 },
+	{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1,
+	  .src_reg = BPF_PSEUDO_MAP_IDX },
+	{ .code = BPF_LD | BPF_W | BPF_IMM },
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2,
+	  .src_reg = BPF_REG_10 },
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2,
+	  .imm = -4 },
+	{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_lookup_elem },
+	{ .code = BPF_JMP | BPF_JEQ | BPF_K, .dst_reg = BPF_REG_0, .off = 1 },
+	{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_0,
+	  .src_reg = BPF_REG_0 },
+	{ .code = BPF_JMP | BPF_EXIT },
+};
+
+/* Count key 0 in a per-CPU map, through map_percpu_add. */
+static const struct bpf_insn percpu_add_prog[] = {
+	{ .code = BPF_ST | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .off = -4 },
+	{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1,
+	  .src_reg = BPF_PSEUDO_MAP_IDX },
+	{ .code = BPF_LD | BPF_W | BPF_IMM },
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2,
+	  .src_reg = BPF_REG_10 },
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2,
+	  .imm = -4 },
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3,
+	  .imm = 1 },
+	{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_percpu_add },
+	{ .code = BPF_JMP | BPF_EXIT },
+};
+
+/* Program runs on batches of random keys. */
+static
+void *bench_batch(struct bench_thread *t)
+{
+	__u32 keys[BATCH_SIZE];
+	__u64 r0[BATCH_SIZE];
+	int i, j, err;
+
+	for (i = 0; i < NR_LOOKUPS; i += BATCH_SIZE) {
+		for (j = 0; j < BATCH_SIZE; j++)
+			keys[j] = rand_r(&t->seed) % t->nr_keys;
+		if (bpf_prog_run_strided(t->prog, keys, sizeof(keys[0]),
+				BATCH_SIZE, sizeof(keys[0]), r0, &err)
+		    != BATCH_SIZE) {
+			t->ret = -1;
+			return NULL;
+		}
+		for (j = 0; j < BATCH_SIZE; j++)
+			t->sum += r0[j];
+	}
+	return NULL;
+}
+
+static
+void *bench_thread(void *arg)
+{
+	struct bench_thread *t = arg;
+	__u64 r0, *value;
+	__u32 key = 0;
+	int i;
+
+	pthread_barrier_wait(&barrier);
+	if (t->mode == BENCH_BATCH)
+		return bench_batch(t);
+	for (i = 0; i < NR_LOOKUPS; i++) {
+		switch (t->mode) {
+		case BENCH_LOOKUP:
+			key = rand_r(&t->seed) % t->nr_keys;
+			value = bpf_map_lookup_elem(t->map, &key);
+			r0 = value ? *value : 0;
+			break;
+		case BENCH_PROG:
+			key = rand_r(&t->seed) % t->nr_keys;
+			if (bpf_prog_run(t->prog, &key, sizeof(key), &r0)) {
+				t->ret = -1;
+				return NULL;
+			}
+			break;
+		case BENCH_ATOMIC:
+			value = bpf_map_lookup_elem(t->map, &key);
+			r0 = __atomic_add_fetch(value, 1, __ATOMIC_RELAXED);
+			break;
+		default:
+			break;
+		}
+		t->sum += r0;
+	}
+	return NULL;
+}
+
+static
+int bench_threads(const char *name, enum bench_mode mode,
+		struct bpf_map *map, __u32 nr_keys, struct bpf_prog *prog,
+		int nr_threads)
+{
+	struct bench_thread *threads;
+	__u64 start, end, sum = 0;
+	int i, ret = 0;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		return -1;
+	pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].mode = mode;
+		threads[i].map = map;
+		threads[i].nr_keys = nr_keys;
+		threads[i].prog = prog;
+		threads[i].seed = i + 1;
+		if (pthread_create(&threads[i].tid, NULL, bench_thread,
+				&threads[i])) {
+			/* Threads already started wait on the barrier forever. */
+			fprintf(stderr, "Error: pthread_create\n");
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		sum += threads[i].sum;
+		ret |= threads[i].ret;
+	}
+	end = now_ns();
+	pthread_barrier_destroy(&barrier);
+	printf("%-10s %3d threads %10.2f Mops/s (sum %llu)\n", name,
+		nr_threads, (double) nr_threads * NR_LOOKUPS * 1000 / (end - start),
+		(unsigned long long) sum);
+	free(threads);
+	return ret;
+}
+
+/*
+ * Lookups of random keys in a hash map of @nr_keys keys: native, from
+ * program runs one at a time, in batches, and in interleaved batches.
+ */
+static
+int bench_table(__u32 nr_keys, long nr_cpus)
+{
+	struct bpf_map_attr attr = {
+		.type = BPF_MAP_TYPE_HASH,
+		.key_size = sizeof(__u32),
+		.value_size = sizeof(__u64),
+		.max_entries = nr_keys,
+	};
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_JIT,
+		.ctx_size = sizeof(__u32),
+		.nr_maps = 1,
+	};
+	struct bpf_prog *prog = NULL, *interleave_prog = NULL;
+	struct bpf_map *map;
+	__u32 key;
+	__u64 value;
+	int n, ret = -1;
+
+	map = bpf_map_create(&attr);
+	if (!map)
+		return -1;
+	for (key = 0; key < nr_keys; key++) {
+		value = key;
+		if (bpf_map_update_elem(map, &key, &value, BPF_NOEXIST))
+			goto end;
+	}
+	opts.maps = &map;
+	prog = bpf_prog_load(lookup_prog, ARRAY_SIZE(lookup_prog), &opts);
+	opts.flags = BPF_F_INTERLEAVE;
+	interleave_prog = bpf_prog_load(lookup_prog, ARRAY_SIZE(lookup_prog),
+			&opts);
+	if (!prog || !interleave_prog)
+		goto end;
+	printf("hash map: %u keys, %d lookups per thread, %ld cpus\n",
+		nr_keys, NR_LOOKUPS, nr_cpus);
+	for (n = 1; n <= nr_cpus; n = n * 2 > nr_cpus && n < nr_cpus ?
+			nr_cpus : n * 2) {
+		if (bench_threads("native", BENCH_LOOKUP, map, nr_keys, NULL, n)
+		    || bench_threads("jit", BENCH_PROG, map, nr_keys, prog, n)
+		    || bench_threads("batch", BENCH_BATCH, map, nr_keys, prog, n)
+		    || bench_threads("interleave", BENCH_BATCH, map, nr_keys,
+				interleave_prog, n))
+			goto end;
+	}
+	ret = 0;
+end:
+	bpf_prog_destroy(interleave_prog);
+	bpf_prog_destroy(prog);
+	bpf_map_destroy(map);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct bpf_map_attr attr = {
+		.type = BPF_MAP_TYPE_PERCPU_ARRAY,
+		.key_size = sizeof(__u32),
+		.value_size = sizeof(__u64),
+		.max_entries = 1,
+	};
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_JIT,
+		.ctx_size = sizeof(__u32),
+		.nr_maps = 1,
+	};
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct bpf_prog *percpu_prog = NULL;
+	struct bpf_map *map, *percpu_map = NULL;
+	__u32 key = 0;
+	__u64 value = 0;
+	int n, ret = -1;
+
+	if (bench_table(NR_KEYS, nr_cpus) || bench_table(NR_LARGE_KEYS, nr_cpus))
+		return -1;
+
+	/* Counting: one shared counter against per-CPU slots. */
+	attr.type = BPF_MAP_TYPE_HASH;
+	map = bpf_map_create(&attr);
+	if (!map || bpf_map_update_elem(map, &key, &value, BPF_NOEXIST))
+		goto end;
+	attr.type = BPF_MAP_TYPE_PERCPU_ARRAY;
+	percpu_map = bpf_map_create(&attr);
+	if (!percpu_map)
+		goto end;
+	opts.maps = &percpu_map;
+	percpu_prog = bpf_prog_load(percpu_add_prog,
+		ARRAY_SIZE(percpu_add_prog), &opts);
+	if (!percpu_prog)
+		goto end;
+	printf("counter: %d increments per thread\n", NR_LOOKUPS);
+	for (n = 1; n <= nr_cpus; n = n * 2 > nr_cpus && n < nr_cpus ?
+			nr_cpus : n * 2) {
+		if (bench_threads("atomic", BENCH_ATOMIC, map, 1, NULL, n)
+		    || bench_threads("percpu", BENCH_PROG, percpu_map, 1,
+				percpu_prog, n))
+			goto end;
+	}
+	ret = 0;
+end:
+	bpf_prog_destroy(percpu_prog);
+	bpf_map_destroy(percpu_map);
+	bpf_map_destroy(map);
+	return ret;
+}
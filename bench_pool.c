@@ -0,0 +1,209 @@
+#include "./bpf.h"
+#include "./bpf_prog.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+/*
+ * Each measurement runs a trace analysis program over NR_EVENTS trace
+ * events, as NR_WORKS work items submitted at once to a pool, NR_REPS
+ * times. Times are the median per event.
+ */
+#define NR_EVENTS	(1U << 20)
+#define NR_WORKS	16
+#define NR_REPS		11
+
+struct trace_event {
+	__u64	ts;
+	__u32	pid;
+	__u32	cpu;
+	__u64	latency;
+	__u64	flags;
+};
+
+/*
+ * Bucket of the event: the log2 of its latency, for slow events of
+ * pids in a hashed sample, else 0.
+ */
+static const struct bpf_insn trace_prog[] = {
+	{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = 8 },
+	{ .code = BPF_ALU64 | BPF_MUL | BPF_K, .dst_reg = BPF_REG_2, .imm = 0x9e3779b1 },
+	{ .code = BPF_ALU64 | BPF_RSH | BPF_K, .dst_reg = BPF_REG_2, .imm = 29 },
+	{ .code = BPF_ALU64 | BPF_AND | BPF_K, .dst_reg = BPF_REG_2, .imm = 3 },
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 0 },
+	{ .code = BPF_JMP | BPF_JNE | BPF_K, .dst_reg = BPF_REG_2, .off = 14 },
+	{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_1, .off = 16 },
+	{ .code = BPF_JMP | BPF_JLT | BPF_K, .dst_reg = BPF_REG_3, .off = 12, .imm = 1000 },
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 1 },
+	{ .code = BPF_ALU64 | BPF_RSH | BPF_K, .dst_reg = BPF_REG_3, .imm = 10 },
+	{ .code = BPF_JMP | BPF_JLT | BPF_K, .dst_reg = BPF_REG_3, .off = 2, .imm = 1 << 16 },
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_0, .imm = 16 },
+	{ .code = BPF_ALU64 | BPF_RSH | BPF_K, .dst_reg = BPF_REG_3, .imm = 16 },
+	{ .code = BPF_JMP | BPF_JLT | BPF_K, .dst_reg = BPF_REG_3, .off = 2, .imm = 1 << 8 },
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_0, .imm = 8 },
+	{ .code = BPF_ALU64 | BPF_RSH | BPF_K, .dst_reg = BPF_REG_3, .imm = 8 },
+	{ .code = BPF_JMP | BPF_JLT | BPF_K, .dst_reg = BPF_REG_3, .off = 2, .imm = 1 << 4 },
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_0, .imm = 4 },
+	{ .code = BPF_ALU64 | BPF_RSH | BPF_K, .dst_reg = BPF_REG_3, .imm = 4 },
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_3 },
+	{ .code = BPF_JMP | BPF_EXIT },
+};
+
+static
+__u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static
+__u64 sum_r0(const __u64 *r0)
+{
+	__u64 sum = 0;
+	size_t i;
+
+	for (i = 0; i < NR_EVENTS; i++)
+		sum += r0[i];
+	return sum;
+}
+
+/* Time of the batch on the calling thread, in ns per event. */
+static
+double time_batch(const struct bpf_prog *prog, struct trace_event *evs,
+		__u64 *r0)
+{
+	__u64 start = now_ns();
+	int err;
+
+	if (bpf_prog_run_strided(prog, evs, sizeof(evs[0]), NR_EVENTS,
+			sizeof(evs[0]), r0, &err) != NR_EVENTS)
+		return -1;
+	return (double) (now_ns() - start) / NR_EVENTS;
+}
+
+/* Time of NR_WORKS work items in @pool, in ns per event. */
+static
+double time_pool(struct bpf_pool *pool, const struct bpf_prog *prog,
+		struct trace_event *evs, __u64 *r0)
+{
+	struct bpf_work works[NR_WORKS];
+	size_t i, per_work = NR_EVENTS / NR_WORKS;
+	__u64 start = now_ns();
+	int ret = 0;
+
+	memset(works, 0, sizeof(works));
+	for (i = 0; i < NR_WORKS; i++) {
+		works[i].prog = prog;
+		works[i].base = evs + i * per_work;
+		works[i].stride = sizeof(evs[0]);
+		works[i].nr = per_work;
+		works[i].ctx_len = sizeof(evs[0]);
+		works[i].r0 = r0 + i * per_work;
+		bpf_pool_submit(pool, &works[i]);
+	}
+	for (i = 0; i < NR_WORKS; i++)
+		ret |= bpf_work_wait(&works[i]);
+	if (ret)
+		return -1;
+	return (double) (now_ns() - start) / NR_EVENTS;
+}
+
+/*
+ * Run the program over the events on the calling thread, then in
+ * pools of 1 to N threads, N the number of online CPUs (-t to
+ * override). The last column is the speedup over the calling thread.
+ */
+int main(int argc, char **argv)
+{
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_JIT,
+		.ctx_size = sizeof(struct trace_event),
+	};
+	long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	struct trace_event *evs;
+	struct bpf_prog *prog;
+	double times[NR_REPS], base;
+	__u64 *r0, expected;
+	size_t i;
+	long n;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			nr_threads = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-t threads]\n"
+				"  -t  largest pool (default: online CPUs)\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (nr_threads < 1)
+		nr_threads = 1;
+	evs = malloc(NR_EVENTS * sizeof(*evs));
+	r0 = malloc(NR_EVENTS * sizeof(*r0));
+	prog = bpf_prog_load(trace_prog, ARRAY_SIZE(trace_prog), &opts);
+	if (!evs || !r0 || !prog)
+		return 1;
+	srandom(42);
+	for (i = 0; i < NR_EVENTS; i++) {
+		evs[i].ts = i * 1000;
+		evs[i].pid = random() % 4096;
+		evs[i].cpu = random() % 64;
+		evs[i].latency = (__u64) random() % (1U << (random() % 31));
+		evs[i].flags = random();
+	}
+
+	printf("%u events, %d work items, %d repetitions, %ld cpus\n",
+		NR_EVENTS, NR_WORKS, NR_REPS, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%-8s %9s %9s %8s\n", "threads", "ns/event", "Mevent/s",
+		"speedup");
+	for (i = 0; i < NR_REPS; i++)
+		times[i] = time_batch(prog, evs, r0);
+	expected = sum_r0(r0);
+	qsort(times, NR_REPS, sizeof(times[0]), cmp_double);
+	base = times[NR_REPS / 2];
+	printf("%-8s %9.2f %9.1f %7.2fx\n", "caller", base, 1000 / base, 1.0);
+
+	for (n = 1; n <= nr_threads; n = n * 2 > nr_threads && n < nr_threads ?
+			nr_threads : n * 2) {
+		struct bpf_pool *pool = bpf_pool_create(n);
+
+		if (!pool)
+			return 1;
+		for (i = 0; i < NR_REPS; i++) {
+			memset(r0, 0, NR_EVENTS * sizeof(*r0));
+			times[i] = time_pool(pool, prog, evs, r0);
+			if (times[i] < 0 || sum_r0(r0) != expected) {
+				fprintf(stderr, "Error: pool of %ld threads computed other results\n",
+					n);
+				bpf_pool_destroy(pool);
+				return 1;
+			}
+		}
+		bpf_pool_destroy(pool);
+		qsort(times, NR_REPS, sizeof(times[0]), cmp_double);
+		printf("%-8ld %9.2f %9.1f %7.2fx\n", n, times[NR_REPS / 2],
+			1000 / times[NR_REPS / 2], base / times[NR_REPS / 2]);
+	}
+	bpf_prog_destroy(prog);
+	free(r0);
+	free(evs);
+	return 0;
+}
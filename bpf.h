@@ -20,7 +20,8 @@
 
 /* ld/ldx fields */
 #define BPF_DW		0x18	/* double word (64-bit) */
-#define BPF_XADD	0xc0	/* exclusive add */
+#define BPF_ATOMIC	0xc0	/* atomic memory ops - op type in immediate */
+#define BPF_XADD	0xc0	/* exclusive add - legacy name */
 
 /* alu/jmp fields */
 #define BPF_MOV		0xb0	/* mov reg to reg */
@@ -71,4 +72,38 @@ struct bpf_insn {
 	__s32	imm;		/* signed immediate constant */
 };
 
+/*
+ * When src_reg of a 64-bit immediate load is BPF_PSEUDO_MAP_IDX, imm
+ * is an index into the maps given when loading the program, and the
+ * destination register receives a pointer to that map.
+ */
+/* atomic op type fields (stored in immediate) */
+#define BPF_FETCH	0x01	/* not an opcode on its own, used to build others */
+#define BPF_XCHG	(0xe0 | BPF_FETCH)	/* atomic exchange */
+#define BPF_CMPXCHG	(0xf0 | BPF_FETCH)	/* atomic compare-and-write */
+
+#define BPF_PSEUDO_MAP_IDX	5
+
+enum bpf_map_type {
+	BPF_MAP_TYPE_UNSPEC,
+	BPF_MAP_TYPE_HASH,
+	BPF_MAP_TYPE_PERCPU_HASH,
+	BPF_MAP_TYPE_PERCPU_ARRAY,
+};
+
+/* flags for BPF_MAP_UPDATE_ELEM command */
+#define BPF_ANY		0 /* create new element or update existing */
+#define BPF_NOEXIST	1 /* create new element if it didn't exist */
+#define BPF_EXIST	2 /* update existing element */
+
+/* Built-in helper functions, see bpf_map.h. */
+enum bpf_func_id {
+	BPF_FUNC_unspec,
+	BPF_FUNC_map_lookup_elem,	/* void *map_lookup_elem(map, key) */
+	BPF_FUNC_map_update_elem,	/* int map_update_elem(map, key, value, flags) */
+	BPF_FUNC_map_delete_elem,	/* int map_delete_elem(map, key) */
+	BPF_FUNC_map_percpu_add,	/* int map_percpu_add(map, key, delta) */
+	__BPF_FUNC_MAX_ID,
+};
+
 #endif /* _UAPI__LINUX_BPF_H__ */
@@ -0,0 +1,597 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+/*
+ * Ahead-of-time compilation: validated bytecode is translated to a C
+ * function with the semantics of the interpreters, built into a shared
+ * object by the system compiler, and bound to a program at load time
+ * with dlopen(). Unlike the JIT, no code is generated at runtime.
+ *
+ * The shared object exports:
+ *
+ *	bpf_aot_abi		ABI version, BPF_AOT_ABI
+ *	bpf_aot_len		bytecode length
+ *	bpf_aot_bytecode	bytecode it was built from, map indexes unresolved
+ *	bpf_aot_run		int (__s64 *reg, size_t *pc, struct bpf_map **maps,
+ *				     bpf_helper_fn_t *helpers)
+ *
+ * bpf_aot_run() has the register file and pc conventions of the other
+ * engines. BPF_PSEUDO_MAP_IDX loads read @maps at runtime, and the nth
+ * helper call of the bytecode calls @helpers[n], so the object does
+ * not depend on addresses of the loading process.
+ */
+
+#define BPF_AOT_ABI	1
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+/* Flags keeping the C semantics of the interpreters. */
+static const char *const cc_flags[] = {
+	"-O2", "-shared", "-fPIC", "-fwrapv", "-fno-strict-aliasing", "-w",
+};
+
+static
+const char *mem_type(__u16 op)
+{
+	switch (BPF_SIZE(op)) {
+	case BPF_B:
+		return "uint8_t";
+	case BPF_H:
+		return "uint16_t";
+	case BPF_W:
+		return "uint32_t";
+	default:
+		return "uint64_t";
+	}
+}
+
+static
+void emit_error(FILE *out, size_t pc, int err)
+{
+	fprintf(out, "\t{ pc = %zu; ret = %d; goto out; }\n", pc, err);
+}
+
+static
+bool is_jmp_insn(const struct bpf_dinsn *insn)
+{
+	unsigned int bpf_class = BPF_CLASS(insn->op);
+
+	if (insn->op == (BPF_JMP | BPF_CALL) || insn->op == (BPF_JMP | BPF_EXIT))
+		return false;
+	return insn->op < 0x100 && (bpf_class == BPF_JMP || bpf_class == BPF_JMP32);
+}
+
+/* Source operand: register, or immediate widened to 64-bit. */
+static
+void format_src(char *buf, size_t size, const struct bpf_dinsn *insn)
+{
+	if (BPF_SRC(insn->op) == BPF_X)
+		snprintf(buf, size, "r%d", insn->src);
+	else
+		snprintf(buf, size, "(int64_t) 0x%llxULL",
+			(unsigned long long) insn->imm);
+}
+
+static
+int emit_alu(FILE *out, const struct bpf_dinsn *insn, size_t pc)
+{
+	bool alu32 = BPF_CLASS(insn->op) == BPF_ALU;
+	int dst = insn->dst, bits = alu32 ? 32 : 64;
+	char src[64];
+
+	format_src(src, sizeof(src), insn);
+	switch (BPF_OP(insn->op)) {
+	case BPF_ADD:
+		fprintf(out, "\tr%d += %s;\n", dst, src);
+		break;
+	case BPF_SUB:
+		fprintf(out, "\tr%d -= %s;\n", dst, src);
+		break;
+	case BPF_MUL:
+		fprintf(out, "\tr%d *= %s;\n", dst, src);
+		break;
+	case BPF_DIV:
+		fprintf(out, "\tif (!%s)\n\t", src);
+		emit_error(out, pc, BPF_ERR_DIV_BY_ZERO);
+		/* INT64_MIN / -1 traps, division by -1 negates. */
+		fprintf(out, "\tr%d = %s == -1 ? (int64_t) -(uint64_t) r%d : r%d / %s;\n",
+			dst, src, dst, dst, src);
+		break;
+	case BPF_MOD:
+		fprintf(out, "\tif (%s <= 0)\n\t", src);
+		emit_error(out, pc, BPF_ERR_MODULO);
+		fprintf(out, "\tr%d %%= %s;\n", dst, src);
+		break;
+	case BPF_OR:
+		fprintf(out, "\tr%d |= %s;\n", dst, src);
+		break;
+	case BPF_AND:
+		fprintf(out, "\tr%d &= %s;\n", dst, src);
+		break;
+	case BPF_XOR:
+		fprintf(out, "\tr%d ^= %s;\n", dst, src);
+		break;
+	case BPF_LSH:
+	case BPF_RSH:
+	case BPF_ARSH:
+		fprintf(out, "\tif (%s >= %d || %s < 0)\n\t", src, bits, src);
+		emit_error(out, pc, BPF_ERR_SHIFT);
+		if (BPF_OP(insn->op) == BPF_ARSH)
+			fprintf(out, "\tr%d = r%d >> %s;\n", dst, dst, src);
+		else
+			fprintf(out, "\tr%d = (uint64_t) r%d %s %s;\n", dst, dst,
+				BPF_OP(insn->op) == BPF_LSH ? "<<" : ">>", src);
+		break;
+	case BPF_NEG:
+		if (BPF_SRC(insn->op) != BPF_K)
+			return -1;
+		fprintf(out, "\tr%d = -r%d;\n", dst, dst);
+		break;
+	case BPF_MOV:
+		fprintf(out, "\tr%d = %s;\n", dst, src);
+		break;
+	default:
+		return -1;
+	}
+	/* ALU32 operates on 64-bit values, then truncates. */
+	if (alu32)
+		fprintf(out, "\tr%d = (uint32_t) r%d;\n", dst, dst);
+	return 0;
+}
+
+static
+int emit_jmp(FILE *out, const struct bpf_dinsn *insn, size_t len)
+{
+	bool jmp32 = BPF_CLASS(insn->op) == BPF_JMP32;
+	const char *ucast = jmp32 ? "(uint32_t) " : "(uint64_t) ";
+	const char *scast = jmp32 ? "(int32_t) " : "(int64_t) ";
+	const char *cast, *cmp;
+	char src[64];
+
+	if (BPF_OP(insn->op) == BPF_JA) {
+		if (BPF_SRC(insn->op) != BPF_K)
+			return -1;
+		fprintf(out, "\tgoto ");
+	} else {
+		switch (BPF_OP(insn->op)) {
+		case BPF_JEQ:
+			cast = ucast;
+			cmp = "==";
+			break;
+		case BPF_JNE:
+			cast = ucast;
+			cmp = "!=";
+			break;
+		case BPF_JSET:
+			cast = ucast;
+			cmp = "&";
+			break;
+		case BPF_JGT:
+			cast = ucast;
+			cmp = ">";
+			break;
+		case BPF_JGE:
+			cast = ucast;
+			cmp = ">=";
+			break;
+		case BPF_JLT:
+			cast = ucast;
+			cmp = "<";
+			break;
+		case BPF_JLE:
+			cast = ucast;
+			cmp = "<=";
+			break;
+		case BPF_JSGT:
+			cast = scast;
+			cmp = ">";
+			break;
+		case BPF_JSGE:
+			cast = scast;
+			cmp = ">=";
+			break;
+		case BPF_JSLT:
+			cast = scast;
+			cmp = "<";
+			break;
+		case BPF_JSLE:
+			cast = scast;
+			cmp = "<=";
+			break;
+		default:
+			return -1;
+		}
+		format_src(src, sizeof(src), insn);
+		fprintf(out, "\tif (%sr%d %s %s%s)\n\t\tgoto ", cast, insn->dst,
+			cmp, cast, src);
+	}
+	if (insn->target > len)
+		fprintf(out, "pc_overflow;\n");
+	else
+		fprintf(out, "pc_%u;\n", insn->target);
+	return 0;
+}
+
+static const char *const atomic_fmt[BPF_NR_ATOMIC_OPS] = {
+	[BPF_AOP_ADD] = "\t__atomic_fetch_add(%s, r%d, __ATOMIC_RELAXED);\n",
+	[BPF_AOP_OR] = "\t__atomic_fetch_or(%s, r%d, __ATOMIC_RELAXED);\n",
+	[BPF_AOP_AND] = "\t__atomic_fetch_and(%s, r%d, __ATOMIC_RELAXED);\n",
+	[BPF_AOP_XOR] = "\t__atomic_fetch_xor(%s, r%d, __ATOMIC_RELAXED);\n",
+	[BPF_AOP_FETCH_ADD] = "\tr%2$d = __atomic_fetch_add(%1$s, r%2$d, __ATOMIC_SEQ_CST);\n",
+	[BPF_AOP_FETCH_OR] = "\tr%2$d = __atomic_fetch_or(%1$s, r%2$d, __ATOMIC_SEQ_CST);\n",
+	[BPF_AOP_FETCH_AND] = "\tr%2$d = __atomic_fetch_and(%1$s, r%2$d, __ATOMIC_SEQ_CST);\n",
+	[BPF_AOP_FETCH_XOR] = "\tr%2$d = __atomic_fetch_xor(%1$s, r%2$d, __ATOMIC_SEQ_CST);\n",
+	[BPF_AOP_XCHG] = "\tr%2$d = __atomic_exchange_n(%1$s, r%2$d, __ATOMIC_SEQ_CST);\n",
+};
+
+static
+void emit_atomic(FILE *out, const struct bpf_dinsn *insn)
+{
+	bool dw = insn->op >= BPF_DOP_ATOMIC_DW;
+	int aop = insn->op - (dw ? BPF_DOP_ATOMIC_DW : BPF_DOP_ATOMIC_W);
+	const char *type = dw ? "uint64_t" : "uint32_t";
+	char addr[64];
+
+	snprintf(addr, sizeof(addr), "(%s *) (uintptr_t) (r%d + %d)", type,
+		insn->dst, insn->off);
+	if (aop == BPF_AOP_CMPXCHG) {
+		fprintf(out, "\t{\n\t\t%s old = r0;\n\n", type);
+		fprintf(out, "\t\t__atomic_compare_exchange_n(%s, &old, r%d, 0,\n"
+			"\t\t\t__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);\n", addr,
+			insn->src);
+		fprintf(out, "\t\tr0 = old;\n\t}\n");
+		return;
+	}
+	fprintf(out, atomic_fmt[aop], addr, insn->src);
+}
+
+/* Packet load, see struct bpf_packet, whose layout is repeated. */
+static
+void emit_packet_load(FILE *out, const struct bpf_dinsn *insn, size_t pc)
+{
+	int size = BPF_SIZE(insn->op) == BPF_W ? 4
+		: BPF_SIZE(insn->op) == BPF_H ? 2 : 1;
+
+	fprintf(out, "\t{\n\t\tconst struct { const uint8_t *data; uint32_t len; } *pkt =\n"
+		"\t\t\t(const void *) (uintptr_t) r6;\n");
+	if (BPF_MODE(insn->op) == BPF_IND) {
+		fprintf(out, "\t\tuint32_t off = r%d + (int64_t) 0x%llxULL;\n",
+			insn->src, (unsigned long long) insn->imm);
+		fprintf(out, "\t\tconst uint8_t *p;\n\n");
+		fprintf(out, "\t\tif (pkt->len < %d || off > pkt->len - %d) {\n"
+			"\t\t\tr0 = 0;\n\t\t\tpc = %zu;\n\t\t\tgoto out;\n\t\t}\n",
+			size, size, pc);
+	} else {
+		fprintf(out, "\t\tuint32_t off = 0x%x;\n", DINSN_ABS_OFF(insn));
+		fprintf(out, "\t\tconst uint8_t *p;\n\n");
+		/* Checked by the first load of the run if 0. */
+		if (DINSN_ABS_CHECK(insn))
+			fprintf(out, "\t\tif (pkt->len < 0x%xU) {\n"
+				"\t\t\tr0 = 0;\n\t\t\tpc = %zu;\n\t\t\tgoto out;\n\t\t}\n",
+				DINSN_ABS_CHECK(insn), pc);
+	}
+	fprintf(out, "\t\tp = pkt->data + off;\n");
+	switch (size) {
+	case 1:
+		fprintf(out, "\t\tr0 = p[0];\n");
+		break;
+	case 2:
+		fprintf(out, "\t\tr0 = (p[0] << 8) | p[1];\n");
+		break;
+	default:
+		fprintf(out, "\t\tr0 = ((uint32_t) p[0] << 24) | (p[1] << 16) "
+			"| (p[2] << 8) | p[3];\n");
+		break;
+	}
+	fprintf(out, "\t}\n");
+}
+
+static
+void emit_insn(FILE *out, const struct bpf_dinsn *insn, size_t pc, size_t len,
+		size_t *nr_calls)
+{
+	const char *type = mem_type(insn->op);
+	int dst = insn->dst, src = insn->src, off = insn->off;
+	unsigned long long imm = insn->imm;
+
+	switch (BPF_CLASS(insn->op)) {
+	case BPF_ALU:
+	case BPF_ALU64:
+		if (insn->op < 0x100 && !emit_alu(out, insn, pc))
+			return;
+		break;
+	case BPF_JMP:
+	case BPF_JMP32:
+		if (insn->op == (BPF_JMP | BPF_CALL)) {
+			fprintf(out, "\tr0 = helpers[%zu](r1, r2, r3, r4, r5);\n",
+				(*nr_calls)++);
+			return;
+		}
+		if (insn->op == (BPF_JMP | BPF_EXIT)) {
+			fprintf(out, "\tpc = %zu;\n\tgoto out;\n", pc);
+			return;
+		}
+		if (is_jmp_insn(insn) && !emit_jmp(out, insn, len))
+			return;
+		break;
+	}
+
+	switch (insn->op) {
+		/* Load from immediate. */
+	case BPF_LD | BPF_W | BPF_IMM:
+		fprintf(out, "\tr%d = (int64_t) 0x%llxULL;\n", dst, imm);
+		return;
+	case BPF_LD | BPF_DW | BPF_IMM:
+		if (src == BPF_PSEUDO_MAP_IDX)
+			fprintf(out, "\tr%d = (int64_t) (uintptr_t) maps[%llu];\n",
+				dst, imm);
+		else
+			fprintf(out, "\tr%d = (int64_t) 0x%llxULL;\n", dst, imm);
+		return;
+
+		/* Load from packet. */
+	case BPF_LD | BPF_W | BPF_ABS:
+	case BPF_LD | BPF_H | BPF_ABS:
+	case BPF_LD | BPF_B | BPF_ABS:
+	case BPF_LD | BPF_W | BPF_IND:
+	case BPF_LD | BPF_H | BPF_IND:
+	case BPF_LD | BPF_B | BPF_IND:
+		emit_packet_load(out, insn, pc);
+		return;
+
+		/* Load from address. */
+	case BPF_LDX | BPF_W | BPF_MEM:
+	case BPF_LDX | BPF_H | BPF_MEM:
+	case BPF_LDX | BPF_B | BPF_MEM:
+	case BPF_LDX | BPF_DW | BPF_MEM:
+		fprintf(out, "\tr%d = *(%s *) (uintptr_t) (r%d + %d);\n",
+			dst, type, src, off);
+		return;
+	case BPF_LDX | BPF_W | BPF_MEM_ACQ_REL:
+	case BPF_LDX | BPF_H | BPF_MEM_ACQ_REL:
+	case BPF_LDX | BPF_B | BPF_MEM_ACQ_REL:
+	case BPF_LDX | BPF_DW | BPF_MEM_ACQ_REL:
+		fprintf(out, "\tr%d = __atomic_load_n((%s *) (uintptr_t) (r%d + %d),\n"
+			"\t\t__ATOMIC_ACQUIRE);\n", dst, type, src, off);
+		return;
+
+		/* Store to address. */
+	case BPF_ST | BPF_W | BPF_MEM:
+	case BPF_ST | BPF_H | BPF_MEM:
+	case BPF_ST | BPF_B | BPF_MEM:
+	case BPF_ST | BPF_DW | BPF_MEM:
+		fprintf(out, "\t*(%s *) (uintptr_t) (r%d + %d) = 0x%llxULL;\n",
+			type, dst, off, imm);
+		return;
+	case BPF_ST | BPF_W | BPF_MEM_ACQ_REL:
+	case BPF_ST | BPF_H | BPF_MEM_ACQ_REL:
+	case BPF_ST | BPF_B | BPF_MEM_ACQ_REL:
+	case BPF_ST | BPF_DW | BPF_MEM_ACQ_REL:
+		fprintf(out, "\t__atomic_store_n((%s *) (uintptr_t) (r%d + %d),\n"
+			"\t\t0x%llxULL, __ATOMIC_RELEASE);\n", type, dst, off, imm);
+		return;
+	case BPF_STX | BPF_W | BPF_MEM:
+	case BPF_STX | BPF_H | BPF_MEM:
+	case BPF_STX | BPF_B | BPF_MEM:
+	case BPF_STX | BPF_DW | BPF_MEM:
+		fprintf(out, "\t*(%s *) (uintptr_t) (r%d + %d) = r%d;\n",
+			type, dst, off, src);
+		return;
+	case BPF_STX | BPF_W | BPF_MEM_ACQ_REL:
+	case BPF_STX | BPF_H | BPF_MEM_ACQ_REL:
+	case BPF_STX | BPF_B | BPF_MEM_ACQ_REL:
+	case BPF_STX | BPF_DW | BPF_MEM_ACQ_REL:
+		fprintf(out, "\t__atomic_store_n((%s *) (uintptr_t) (r%d + %d),\n"
+			"\t\tr%d, __ATOMIC_RELEASE);\n", type, dst, off, src);
+		return;
+	}
+
+	if (insn->op >= BPF_DOP_ATOMIC_W
+	    && insn->op < BPF_DOP_ATOMIC_DW + BPF_NR_ATOMIC_OPS) {
+		emit_atomic(out, insn);
+		return;
+	}
+	/* Like the interpreters, only fail if executed. */
+	emit_error(out, pc, BPF_ERR_UNSUPPORTED);
+}
+
+/*
+ * Write the C translation of @bytecode to @out. @bytecode must be
+ * validated, with map indexes not yet resolved. Returns 0 on success,
+ * -1 on error.
+ */
+int aot_emit(const struct bpf_insn *bytecode, size_t len, FILE *out)
+{
+	struct bpf_dinsn *insns;
+	bool *is_target;
+	size_t i, nr_calls = 0;
+
+	insns = decode_bytecode(bytecode, len);
+	if (!insns)
+		return -1;
+	is_target = calloc(len + 1, sizeof(*is_target));
+	if (!is_target) {
+		free(insns);
+		return -1;
+	}
+	for (i = 0; i < len; i++) {
+		if (is_jmp_insn(&insns[i]) && insns[i].target <= len)
+			is_target[insns[i].target] = true;
+	}
+
+	fprintf(out, "/* Generated by bpf_prog_aot_emit(), do not edit. */\n\n");
+	fprintf(out, "#include <stddef.h>\n#include <stdint.h>\n\n");
+	fprintf(out, "typedef uint64_t (*bpf_helper_fn_t)(uint64_t, uint64_t, "
+		"uint64_t, uint64_t, uint64_t);\n\n");
+	fprintf(out, "const unsigned int bpf_aot_abi = %d;\n", BPF_AOT_ABI);
+	fprintf(out, "const size_t bpf_aot_len = %zu;\n", len);
+	fprintf(out, "const uint64_t bpf_aot_bytecode[] = {\n");
+	for (i = 0; i < len; i++) {
+		__u64 word;
+
+		memcpy(&word, &bytecode[i], sizeof(word));
+		fprintf(out, "\t0x%016llxULL,\n", (unsigned long long) word);
+	}
+	fprintf(out, "};\n\n");
+	fprintf(out, "int bpf_aot_run(int64_t *reg, size_t *pcp, "
+		"void *const *maps,\n\t\tconst bpf_helper_fn_t *helpers)\n{\n");
+	for (i = 0; i < MAX_BPF_REG; i++)
+		fprintf(out, "\tint64_t r%zu = reg[%zu];\n", i, i);
+	fprintf(out, "\tsize_t pc;\n\tint ret = 0;\n\n");
+
+	for (i = 0; i < len; i++) {
+		const struct bpf_dinsn *insn = &insns[i];
+
+		if (is_target[i])
+			fprintf(out, "pc_%zu:\n", i);
+		emit_insn(out, insn, i, len, &nr_calls);
+		if (insn->op == (BPF_LD | BPF_DW | BPF_IMM)) {
+			if (i + 1 == len) {
+				emit_error(out, i, BPF_ERR_PC_OVERFLOW);
+			} else if (is_target[i + 1]) {
+				/* Skip the second half, which is a jump target. */
+				fprintf(out, "\tgoto pc_%zu;\n", i + 2);
+				is_target[i + 2] = true;
+			} else {
+				i++;
+			}
+		}
+	}
+
+	/* Bytecode terminates. */
+	fprintf(out, "pc_%zu:\n\tpc = %zu;\n\tgoto out;\n", len, len);
+	fprintf(out, "pc_overflow:\n\tpc = %zu;\n\tret = %d;\n", len + 1,
+		BPF_ERR_PC_OVERFLOW);
+	fprintf(out, "out:\n");
+	for (i = 0; i < MAX_BPF_REG; i++)
+		fprintf(out, "\treg[%zu] = r%zu;\n", i, i);
+	fprintf(out, "\t*pcp = pc;\n\treturn ret;\n}\n");
+	free(is_target);
+	free(insns);
+	if (ferror(out)) {
+		fprintf(stderr, "Error: writing C translation\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Compile the C file at @c_path into a shared object at @so_path,
+ * with $CC or cc. Returns 0 on success, -1 on error.
+ */
+int aot_build(const char *c_path, const char *so_path)
+{
+	const char *argv[ARRAY_SIZE(cc_flags) + 5];
+	extern char **environ;
+	const char *cc = getenv("CC");
+	size_t i, argc = 0;
+	int status;
+	pid_t pid;
+
+	if (!cc || !*cc)
+		cc = "cc";
+	argv[argc++] = cc;
+	for (i = 0; i < ARRAY_SIZE(cc_flags); i++)
+		argv[argc++] = cc_flags[i];
+	argv[argc++] = "-o";
+	argv[argc++] = so_path;
+	argv[argc++] = c_path;
+	argv[argc] = NULL;
+	if (posix_spawnp(&pid, cc, NULL, NULL, (char *const *) argv, environ)) {
+		fprintf(stderr, "Error: cannot run %s\n", cc);
+		return -1;
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)
+	    || WEXITSTATUS(status)) {
+		fprintf(stderr, "Error: %s failed on %s\n", cc, c_path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Open the shared object at @path and check that it was built from
+ * @bytecode, with map indexes not yet resolved. Returns NULL on error.
+ */
+struct bpf_aot *aot_open(const char *path, const struct bpf_insn *bytecode,
+		size_t len)
+{
+	const unsigned int *abi;
+	const size_t *aot_len;
+	const void *aot_bytecode;
+	struct bpf_aot *aot;
+	size_t i, nr_calls = 0;
+
+	aot = calloc(1, sizeof(*aot));
+	if (!aot)
+		return NULL;
+	aot->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!aot->handle) {
+		fprintf(stderr, "Error: %s\n", dlerror());
+		goto error;
+	}
+	abi = dlsym(aot->handle, "bpf_aot_abi");
+	aot_len = dlsym(aot->handle, "bpf_aot_len");
+	aot_bytecode = dlsym(aot->handle, "bpf_aot_bytecode");
+	aot->func = (bpf_aot_func_t) dlsym(aot->handle, "bpf_aot_run");
+	if (!abi || !aot_len || !aot_bytecode || !aot->func) {
+		fprintf(stderr, "Error: %s is not a compiled program\n", path);
+		goto error;
+	}
+	if (*abi != BPF_AOT_ABI || *aot_len != len
+	    || memcmp(aot_bytecode, bytecode, len * sizeof(*bytecode))) {
+		fprintf(stderr, "Error: %s was built from other bytecode\n", path);
+		goto error;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (bytecode[i].code == (BPF_JMP | BPF_CALL))
+			nr_calls++;
+	}
+	aot->helpers = calloc(nr_calls, sizeof(*aot->helpers));
+	if (nr_calls && !aot->helpers)
+		goto error;
+	for (i = 0, nr_calls = 0; i < len; i++) {
+		const struct bpf_helper *helper;
+
+		if (bytecode[i].code != (BPF_JMP | BPF_CALL))
+			continue;
+		helper = bpf_helper_lookup(bytecode[i].imm);
+		if (!helper) {
+			fprintf(stderr, "Error: unknown helper %d at pc %zu\n",
+				bytecode[i].imm, i);
+			goto error;
+		}
+		aot->helpers[nr_calls++] = helper->fn;
+	}
+	return aot;
+
+error:
+	aot_free(aot);
+	return NULL;
+}
+
+void aot_free(struct bpf_aot *aot)
+{
+	if (!aot)
+		return;
+	if (aot->handle)
+		dlclose(aot->handle);
+	free(aot->helpers);
+	free(aot);
+}
+
+/* Run compiled code, returns an enum bpf_error. */
+int run_aot(const struct bpf_aot *aot, struct bpf_map **maps, __s64 *reg,
+		size_t *pc)
+{
+	return aot->func(reg, pc, maps, aot->helpers);
+}
@@ -0,0 +1,92 @@
+#include "./bpf.h"
+#include "./bpf_prog.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Ahead-of-time compiler: build raw bytecode (an array of struct
+ * bpf_insn, as written in memory) into a shared object for
+ * BPF_ENGINE_AOT, or print its C translation with -S.
+ */
+
+#define MAX_FILE_INSNS	BPF_MAXINSNS
+
+static
+void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-S] [-O] [-c ctx_size] bytecode output\n"
+		"  -S           write C instead of a shared object\n"
+		"  -O           optimize (load with BPF_F_OPTIMIZE)\n"
+		"  -c ctx_size  bytes the program may access at r1\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_AOT,
+	};
+	struct bpf_insn *bytecode;
+	bool emit_c = false;
+	size_t len;
+	FILE *in, *out;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "SOc:")) != -1) {
+		switch (opt) {
+		case 'S':
+			emit_c = true;
+			break;
+		case 'O':
+			opts.flags |= BPF_F_OPTIMIZE;
+			break;
+		case 'c':
+			opts.ctx_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	bytecode = calloc(MAX_FILE_INSNS + 1, sizeof(*bytecode));
+	if (!bytecode)
+		return 1;
+	in = fopen(argv[optind], "rb");
+	if (!in) {
+		perror(argv[optind]);
+		free(bytecode);
+		return 1;
+	}
+	len = fread(bytecode, sizeof(*bytecode), MAX_FILE_INSNS + 1, in);
+	fclose(in);
+	if (len > MAX_FILE_INSNS) {
+		fprintf(stderr, "Error: %s exceeds %d insn\n", argv[optind],
+			MAX_FILE_INSNS);
+		free(bytecode);
+		return 1;
+	}
+
+	if (emit_c) {
+		out = fopen(argv[optind + 1], "w");
+		if (!out) {
+			perror(argv[optind + 1]);
+			free(bytecode);
+			return 1;
+		}
+		ret = bpf_prog_aot_emit(bytecode, len, &opts, out);
+		if (fclose(out))
+			ret = -1;
+	} else {
+		ret = bpf_prog_aot_compile(bytecode, len, &opts, argv[optind + 1]);
+	}
+	free(bytecode);
+	return ret ? 1 : 0;
+}
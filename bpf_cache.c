@@ -0,0 +1,297 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include "./bpf_prog.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Verified-program cache: one file per program and configuration in
+ * the cache directory, named after a hash of both. An entry holds the
+ * bytecode given to bpf_prog_load(), for collision checks, the
+ * validated (and optimized) bytecode, and the fused decoded form for
+ * the threaded and tiered engines. Map indexes are left unresolved and
+ * helper calls are relinked at load, so entries are valid across
+ * processes.
+ *
+ * Entries are mapped private and writable: programs run them in place,
+ * and only the pages patched by map resolution are copied. A checksum
+ * of the payload catches corrupted entries, and the cached bytecode is
+ * validated again, which is cheap next to optimizing and decoding it.
+ * The decoded form is only checked for opcodes, registers and jump
+ * targets within bounds: like the shared objects of the AOT engine, entries must come
+ * from trusted writers.
+ */
+
+#define CACHE_MAGIC		"BPFCACHE"
+#define CACHE_VERSION		3
+
+struct bpf_cache_hdr {
+	char	magic[8];
+	__u64	key;
+	__u32	version;
+	__u32	dinsn_size;	/* sizeof(struct bpf_dinsn) */
+	__u32	dop_max;	/* BPF_DOP_MAX */
+	__u32	engine;
+	__u32	flags;
+	__u32	pad;
+	__u64	ctx_size;
+	__u64	orig_len;	/* bytecode given to bpf_prog_load() */
+	__u64	len;		/* validated bytecode */
+	__u64	nr_dinsns;	/* decoded form, 0 if absent */
+	__u64	checksum;	/* of all that follows */
+	/* struct bpf_insn orig[orig_len], insns[len]; struct bpf_dinsn[] */
+};
+
+struct bpf_cache {
+	void		*addr;
+	size_t		size;
+};
+
+static
+__u64 fnv1a(__u64 hash, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+#define FNV1A_BASIS		0xcbf29ce484222325ULL
+
+/*
+ * Hash everything validation depends on: the bytecode, the load
+ * configuration, the map attributes and the signatures of the helpers
+ * called.
+ */
+static
+__u64 cache_key(const struct bpf_prog *prog, const struct bpf_insn *insns,
+		size_t len, const struct bpf_prog_opts *opts)
+{
+	__u64 hash = FNV1A_BASIS;
+	__u32 config[] = {
+		CACHE_VERSION, sizeof(struct bpf_dinsn), BPF_DOP_MAX,
+		prog->engine, opts->flags,
+	};
+	size_t i;
+
+	hash = fnv1a(hash, config, sizeof(config));
+	hash = fnv1a(hash, &prog->ctx_size, sizeof(prog->ctx_size));
+	hash = fnv1a(hash, &len, sizeof(len));
+	hash = fnv1a(hash, insns, len * sizeof(*insns));
+	for (i = 0; i < prog->nr_maps; i++) {
+		const struct bpf_map *map = prog->maps[i];
+		__u32 attr[] = {
+			map->type, map->key_size, map->value_size,
+			map->max_entries,
+		};
+
+		hash = fnv1a(hash, attr, sizeof(attr));
+	}
+	for (i = 0; i < len; i++) {
+		const struct bpf_helper *helper;
+
+		if (insns[i].code != (BPF_JMP | BPF_CALL))
+			continue;
+		helper = bpf_helper_lookup(insns[i].imm);
+		if (!helper)
+			continue;
+		hash = fnv1a(hash, helper->args, sizeof(helper->args));
+		hash = fnv1a(hash, &helper->ret, sizeof(helper->ret));
+	}
+	return hash;
+}
+
+static
+void cache_path(char *path, size_t size, const char *dir, __u64 key)
+{
+	snprintf(path, size, "%s/%016llx.bpfc", dir, (unsigned long long) key);
+}
+
+static
+bool cache_keeps_dinsns(const struct bpf_prog *prog)
+{
+	return prog->engine == BPF_ENGINE_THREADED
+		|| prog->engine == BPF_ENGINE_TIERED;
+}
+
+/*
+ * Decoded form of @len instructions, with opcodes, registers and jump
+ * targets in bounds.
+ */
+static
+bool cache_check_dinsns(const struct bpf_dinsn *dinsns, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len + 2; i++) {
+		if (dinsns[i].op >= BPF_DOP_MAX || dinsns[i].dst >= MAX_BPF_REG
+		    || dinsns[i].src >= MAX_BPF_REG
+		    || dinsns[i].target >= len + 2)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Look @insns up in the cache directory @dir, for @prog whose engine,
+ * context size and maps are set. On a hit, point prog->insns and
+ * prog->dinsns (if cached) into the mapped entry, once validated, and
+ * return 0. Return -1 on a miss.
+ */
+int cache_lookup(struct bpf_prog *prog, const char *dir,
+		const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts)
+{
+	const struct bpf_cache_hdr *hdr;
+	const struct bpf_insn *orig;
+	struct bpf_dinsn *dinsns;
+	struct bpf_cache *cache;
+	char path[4096];
+	struct stat st;
+	size_t size;
+	__u64 key;
+	void *addr;
+	int fd;
+
+	key = cache_key(prog, insns, len, opts);
+	cache_path(path, sizeof(path), dir, key);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -1;
+	}
+	size = st.st_size;
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return -1;
+
+	hdr = addr;
+	orig = (const struct bpf_insn *) (hdr + 1);
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic))
+	    || hdr->key != key || hdr->version != CACHE_VERSION
+	    || hdr->dinsn_size != sizeof(struct bpf_dinsn)
+	    || hdr->dop_max != BPF_DOP_MAX || hdr->engine != prog->engine
+	    || hdr->flags != opts->flags || hdr->ctx_size != prog->ctx_size
+	    || hdr->orig_len != len || !hdr->len || hdr->len > len
+	    || (hdr->nr_dinsns && hdr->nr_dinsns != hdr->len + 2)
+	    || size != sizeof(*hdr)
+			+ (hdr->orig_len + hdr->len) * sizeof(struct bpf_insn)
+			+ hdr->nr_dinsns * sizeof(struct bpf_dinsn)
+	    || hdr->checksum != fnv1a(FNV1A_BASIS, orig, size - sizeof(*hdr))
+	    || memcmp(orig, insns, len * sizeof(*insns)))
+		goto miss;
+	dinsns = (struct bpf_dinsn *) (orig + hdr->orig_len + hdr->len);
+	if (hdr->nr_dinsns && !cache_check_dinsns(dinsns, hdr->len))
+		goto miss;
+	prog->len = hdr->len;
+	prog->insns = (struct bpf_insn *) orig + hdr->orig_len;
+	if (validate_bytecode(prog->insns, prog->len) || validate_types(prog)) {
+		fprintf(stderr, "Error: invalid cache entry %s\n", path);
+		prog->len = 0;
+		prog->insns = NULL;
+		goto miss;
+	}
+	cache = malloc(sizeof(*cache));
+	if (!cache) {
+		prog->len = 0;
+		prog->insns = NULL;
+		goto miss;
+	}
+	cache->addr = addr;
+	cache->size = size;
+	prog->cache = cache;
+	prog->insns_borrowed = true;
+	if (hdr->nr_dinsns) {
+		prog->dinsns = dinsns;
+		prog->dinsns_borrowed = true;
+	}
+	return 0;
+
+miss:
+	munmap(addr, size);
+	return -1;
+}
+
+/*
+ * Store the validated, unresolved form of @prog loaded from @insns in
+ * the cache directory @dir. Entries are written to a temporary file
+ * then renamed, so concurrent loads only see complete entries.
+ * Returns 0 on success, -1 on error.
+ */
+int cache_store(const struct bpf_prog *prog, const char *dir,
+		const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts)
+{
+	struct bpf_cache_hdr hdr = {
+		.magic = CACHE_MAGIC,
+		.version = CACHE_VERSION,
+		.dinsn_size = sizeof(struct bpf_dinsn),
+		.dop_max = BPF_DOP_MAX,
+		.engine = prog->engine,
+		.flags = opts->flags,
+		.ctx_size = prog->ctx_size,
+		.orig_len = len,
+		.len = prog->len,
+	};
+	char path[4096], tmp_path[4096 + 16];
+	FILE *out;
+	int fd, ret = 0;
+
+	if (prog->dinsns && cache_keeps_dinsns(prog))
+		hdr.nr_dinsns = prog->len + 2;
+	hdr.checksum = fnv1a(FNV1A_BASIS, insns, len * sizeof(*insns));
+	hdr.checksum = fnv1a(hdr.checksum, prog->insns,
+		prog->len * sizeof(*prog->insns));
+	hdr.checksum = fnv1a(hdr.checksum, prog->dinsns,
+		hdr.nr_dinsns * sizeof(*prog->dinsns));
+	hdr.key = cache_key(prog, insns, len, opts);
+	cache_path(path, sizeof(path), dir, hdr.key);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		fprintf(stderr, "Error: cannot create cache entry in %s\n", dir);
+		return -1;
+	}
+	out = fdopen(fd, "wb");
+	if (!out) {
+		close(fd);
+		unlink(tmp_path);
+		return -1;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1
+	    || fwrite(insns, sizeof(*insns), len, out) != len
+	    || fwrite(prog->insns, sizeof(*insns), prog->len, out) != prog->len
+	    || fwrite(prog->dinsns, sizeof(*prog->dinsns), hdr.nr_dinsns, out)
+			!= hdr.nr_dinsns)
+		ret = -1;
+	if (fclose(out))
+		ret = -1;
+	if (!ret && rename(tmp_path, path))
+		ret = -1;
+	if (ret) {
+		fprintf(stderr, "Error: cannot write cache entry %s\n", path);
+		unlink(tmp_path);
+	}
+	return ret;
+}
+
+void cache_free(struct bpf_cache *cache)
+{
+	if (!cache)
+		return;
+	munmap(cache->addr, cache->size);
+	free(cache);
+}
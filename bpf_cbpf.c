@@ -0,0 +1,657 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include "./bpf_prog.h"
+#include "./bpf_cbpf.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Classic BPF translation. A classic instruction becomes one or a few
+ * eBPF instructions, the same number in both passes: the first sizes
+ * each translation to place jump targets, the second emits them.
+ * Classic jumps are forward only, as eBPF ones must be here.
+ *
+ * A and X are kept zero-extended in r0 and r7, as ALU32 instructions
+ * and packet loads leave them: the engines divide those as unsigned
+ * 32-bit values. Registers other than r1, r2 and r10 are zero on
+ * entry, so A and X need no initialization.
+ */
+
+#define CBPF_REG_A	BPF_REG_0
+#define CBPF_REG_X	BPF_REG_7
+#define CBPF_REG_PKT	BPF_REG_6
+#define CBPF_REG_TMP	BPF_REG_2	/* clobbered by packet loads anyway */
+#define CBPF_REG_SAVE	BPF_REG_8	/* A across BPF_MSH loads */
+
+struct cbpf_ctx {
+	const struct bpf_cbpf_insn *filter;
+	size_t			len;
+	const bool		*reachable;	/* from pc 0, by classic insn */
+	size_t			*start;		/* eBPF pc of each classic insn */
+	size_t			ret0;		/* eBPF pc of the return 0 block */
+	struct bpf_insn		*out;		/* NULL when sizing */
+	size_t			nr;		/* eBPF insns emitted */
+};
+
+static
+void emit(struct cbpf_ctx *ctx, __u8 code, __u8 dst, __u8 src, __s16 off,
+		__s32 imm)
+{
+	if (ctx->out) {
+		struct bpf_insn *insn = &ctx->out[ctx->nr];
+
+		insn->code = code;
+		insn->dst_reg = dst;
+		insn->src_reg = src;
+		insn->off = off;
+		insn->imm = imm;
+	}
+	ctx->nr++;
+}
+
+/* Jump to eBPF pc @target, which is 0 while sizing. */
+static
+void emit_jmp(struct cbpf_ctx *ctx, __u8 code, __u8 dst, __u8 src,
+		__s32 imm, size_t target)
+{
+	__s16 off = 0;
+
+	if (ctx->out)
+		off = target - ctx->nr - 1;
+	emit(ctx, code, dst, src, off, imm);
+}
+
+static
+__s16 mem_off(__u32 k)
+{
+	return -4 * (BPF_MEMWORDS - k);
+}
+
+static
+bool alu_op_valid(__u8 op)
+{
+	switch (op) {
+	case BPF_ADD:
+	case BPF_SUB:
+	case BPF_MUL:
+	case BPF_DIV:
+	case BPF_OR:
+	case BPF_AND:
+	case BPF_LSH:
+	case BPF_RSH:
+	case BPF_NEG:
+	case BPF_MOD:
+	case BPF_XOR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Mark the instructions of the checked @filter reachable from pc 0 in
+ * @reachable, which the kernel accepts but the eBPF validator does
+ * not: they are not translated. Set bit k of *@mem_read for each
+ * scratch slot read, and *@need_ret0 when an instruction returns 0 on
+ * a zero X, among reachable instructions. Classic jumps are forward,
+ * so that predecessors come first.
+ */
+static
+void cbpf_reach(const struct bpf_cbpf_insn *filter, size_t len,
+		bool *reachable, __u16 *mem_read, bool *need_ret0)
+{
+	const struct bpf_cbpf_insn *insn;
+	size_t pc;
+
+	memset(reachable, 0, len * sizeof(*reachable));
+	reachable[0] = true;
+	*mem_read = 0;
+	*need_ret0 = false;
+	for (pc = 0; pc < len; pc++) {
+		if (!reachable[pc])
+			continue;
+		insn = &filter[pc];
+		switch (BPF_CLASS(insn->code)) {
+		case BPF_RET:
+			continue;
+		case BPF_JMP:
+			if (insn->code == (BPF_JMP | BPF_JA)) {
+				reachable[pc + 1 + insn->k] = true;
+			} else {
+				reachable[pc + 1 + insn->jt] = true;
+				reachable[pc + 1 + insn->jf] = true;
+			}
+			continue;
+		case BPF_LD:
+		case BPF_LDX:
+			if (BPF_MODE(insn->code) == BPF_MEM)
+				*mem_read |= 1U << insn->k;
+			break;
+		case BPF_ALU:
+			if (BPF_SRC(insn->code) == BPF_X
+			    && (BPF_OP(insn->code) == BPF_DIV
+			        || BPF_OP(insn->code) == BPF_MOD))
+				*need_ret0 = true;
+			break;
+		}
+		reachable[pc + 1] = true;
+	}
+}
+
+/*
+ * Check @filter as the kernel checks classic programs. Returns 0 on
+ * success, -1 on error.
+ */
+static
+int cbpf_check(const struct bpf_cbpf_insn *filter, size_t len)
+{
+	size_t pc;
+
+	if (!len || len > BPF_MAXINSNS) {
+		fprintf(stderr, "Error: Invalid classic program length %zu\n", len);
+		return -1;
+	}
+	if (BPF_CLASS(filter[len - 1].code) != BPF_RET) {
+		fprintf(stderr, "Error: Classic program does not end with ret\n");
+		return -1;
+	}
+	for (pc = 0; pc < len; pc++) {
+		const struct bpf_cbpf_insn *insn = &filter[pc];
+		__u16 code = insn->code;
+		__u32 k = insn->k;
+		size_t left = len - pc - 1;
+
+		switch (BPF_CLASS(code)) {
+		case BPF_LD:
+		case BPF_LDX:
+			switch (code) {
+			case BPF_LD | BPF_W | BPF_ABS:
+			case BPF_LD | BPF_H | BPF_ABS:
+			case BPF_LD | BPF_B | BPF_ABS:
+			case BPF_LDX | BPF_B | BPF_MSH:
+				if (k >= 1U << 31) {
+					fprintf(stderr, "Error: Unsupported ancillary load at pc %zu\n",
+						pc);
+					return -1;
+				}
+				continue;
+			case BPF_LD | BPF_W | BPF_IND:
+			case BPF_LD | BPF_H | BPF_IND:
+			case BPF_LD | BPF_B | BPF_IND:
+			case BPF_LD | BPF_W | BPF_LEN:
+			case BPF_LDX | BPF_W | BPF_LEN:
+			case BPF_LD | BPF_W | BPF_IMM:
+			case BPF_LDX | BPF_W | BPF_IMM:
+				continue;
+			case BPF_LD | BPF_W | BPF_MEM:
+			case BPF_LDX | BPF_W | BPF_MEM:
+				if (k >= BPF_MEMWORDS)
+					break;
+				continue;
+			}
+			break;
+		case BPF_ST:
+		case BPF_STX:
+			if (code != BPF_CLASS(code) || k >= BPF_MEMWORDS)
+				break;
+			continue;
+		case BPF_ALU:
+			if (code & ~(BPF_CLASS(code) | BPF_OP(code) | BPF_SRC(code))
+			    || !alu_op_valid(BPF_OP(code)))
+				break;
+			if (BPF_SRC(code) == BPF_K) {
+				if ((BPF_OP(code) == BPF_DIV || BPF_OP(code) == BPF_MOD)
+				    && !k) {
+					fprintf(stderr, "Error: Division by zero at pc %zu\n",
+						pc);
+					return -1;
+				}
+				if ((BPF_OP(code) == BPF_LSH || BPF_OP(code) == BPF_RSH)
+				    && k >= 32)
+					break;
+			}
+			continue;
+		case BPF_JMP:
+			if (code == (BPF_JMP | BPF_JA)) {
+				if (k >= left)
+					goto out_of_range;
+				continue;
+			}
+			if (code & ~(BPF_CLASS(code) | BPF_OP(code) | BPF_SRC(code)))
+				break;
+			switch (BPF_OP(code)) {
+			case BPF_JEQ:
+			case BPF_JGT:
+			case BPF_JGE:
+			case BPF_JSET:
+				if (insn->jt >= left || insn->jf >= left)
+					goto out_of_range;
+				continue;
+			}
+			break;
+		case BPF_RET:
+			switch (code) {
+			case BPF_RET | BPF_K:
+			case BPF_RET | BPF_A:
+			case BPF_RET | BPF_X:
+				continue;
+			}
+			break;
+		case BPF_MISC:
+			if (code == (BPF_MISC | BPF_TAX) || code == (BPF_MISC | BPF_TXA))
+				continue;
+			break;
+		}
+		fprintf(stderr, "Error: Invalid classic insn code 0x%x (k %u) at pc %zu\n",
+			code, k, pc);
+		return -1;
+
+	out_of_range:
+		fprintf(stderr, "Error: Classic jump out of range at pc %zu\n", pc);
+		return -1;
+	}
+	return 0;
+}
+
+static
+__u8 jmp_inverse(__u8 op)
+{
+	switch (op) {
+	case BPF_JEQ:
+		return BPF_JNE;
+	case BPF_JGT:
+		return BPF_JLE;
+	case BPF_JGE:
+		return BPF_JLT;
+	default:
+		return 0;	/* BPF_JSET has none */
+	}
+}
+
+static
+void cbpf_emit_alu(struct cbpf_ctx *ctx, const struct bpf_cbpf_insn *insn)
+{
+	__u8 op = BPF_OP(insn->code);
+
+	if (op == BPF_NEG) {
+		emit(ctx, BPF_ALU | BPF_NEG, CBPF_REG_A, 0, 0, 0);
+		return;
+	}
+	if (BPF_SRC(insn->code) == BPF_K) {
+		if ((op == BPF_DIV || op == BPF_MOD) && insn->k >= 1U << 31) {
+			/* Immediates are signed: divide by the zero-extended k. */
+			emit(ctx, BPF_ALU | BPF_MOV | BPF_K, CBPF_REG_TMP, 0, 0,
+				insn->k);
+			emit(ctx, BPF_ALU | op | BPF_X, CBPF_REG_A, CBPF_REG_TMP,
+				0, 0);
+			return;
+		}
+		emit(ctx, BPF_ALU | op | BPF_K, CBPF_REG_A, 0, 0, insn->k);
+		return;
+	}
+	switch (op) {
+	case BPF_DIV:
+	case BPF_MOD:
+		emit_jmp(ctx, BPF_JMP32 | BPF_JEQ | BPF_K, CBPF_REG_X, 0, 0,
+			ctx->ret0);
+		break;
+	case BPF_LSH:
+	case BPF_RSH:
+		emit(ctx, BPF_ALU | BPF_MOV | BPF_X, CBPF_REG_TMP, CBPF_REG_X, 0, 0);
+		emit(ctx, BPF_ALU | BPF_AND | BPF_K, CBPF_REG_TMP, 0, 0, 31);
+		emit(ctx, BPF_ALU | op | BPF_X, CBPF_REG_A, CBPF_REG_TMP, 0, 0);
+		return;
+	}
+	emit(ctx, BPF_ALU | op | BPF_X, CBPF_REG_A, CBPF_REG_X, 0, 0);
+}
+
+static
+void cbpf_emit_jmp(struct cbpf_ctx *ctx, size_t pc)
+{
+	const struct bpf_cbpf_insn *insn = &ctx->filter[pc];
+	__u8 op = BPF_OP(insn->code), src = 0;
+	size_t jt = pc + 1 + insn->jt, jf = pc + 1 + insn->jf;
+	__s32 imm = 0;
+
+	if (insn->code == (BPF_JMP | BPF_JA)) {
+		if (insn->k)
+			emit_jmp(ctx, BPF_JMP | BPF_JA, 0, 0, 0,
+				ctx->start[pc + 1 + insn->k]);
+		return;
+	}
+	if (BPF_SRC(insn->code) == BPF_X)
+		src = CBPF_REG_X;
+	else
+		imm = insn->k;
+	if (jt == jf) {
+		if (insn->jt)
+			emit_jmp(ctx, BPF_JMP | BPF_JA, 0, 0, 0, ctx->start[jt]);
+	} else if (jf == pc + 1) {
+		emit_jmp(ctx, BPF_JMP32 | op | BPF_SRC(insn->code), CBPF_REG_A,
+			src, imm, ctx->start[jt]);
+	} else if (jt == pc + 1 && jmp_inverse(op)) {
+		emit_jmp(ctx, BPF_JMP32 | jmp_inverse(op) | BPF_SRC(insn->code),
+			CBPF_REG_A, src, imm, ctx->start[jf]);
+	} else {
+		emit_jmp(ctx, BPF_JMP32 | op | BPF_SRC(insn->code), CBPF_REG_A,
+			src, imm, ctx->start[jt]);
+		emit_jmp(ctx, BPF_JMP | BPF_JA, 0, 0, 0, ctx->start[jf]);
+	}
+}
+
+static
+void cbpf_emit_insn(struct cbpf_ctx *ctx, size_t pc)
+{
+	const struct bpf_cbpf_insn *insn = &ctx->filter[pc];
+	__u8 dst = BPF_CLASS(insn->code) == BPF_LDX ? CBPF_REG_X : CBPF_REG_A;
+
+	switch (insn->code) {
+	case BPF_LD | BPF_W | BPF_ABS:
+	case BPF_LD | BPF_H | BPF_ABS:
+	case BPF_LD | BPF_B | BPF_ABS:
+		emit(ctx, insn->code, 0, 0, 0, insn->k);
+		break;
+	case BPF_LD | BPF_W | BPF_IND:
+	case BPF_LD | BPF_H | BPF_IND:
+	case BPF_LD | BPF_B | BPF_IND:
+		emit(ctx, insn->code, 0, CBPF_REG_X, 0, insn->k);
+		break;
+	case BPF_LD | BPF_W | BPF_LEN:
+	case BPF_LDX | BPF_W | BPF_LEN:
+		emit(ctx, BPF_LDX | BPF_W | BPF_MEM, dst, CBPF_REG_PKT,
+			offsetof(struct bpf_packet, len), 0);
+		break;
+	case BPF_LD | BPF_W | BPF_IMM:
+	case BPF_LDX | BPF_W | BPF_IMM:
+		emit(ctx, BPF_ALU | BPF_MOV | BPF_K, dst, 0, 0, insn->k);
+		break;
+	case BPF_LD | BPF_W | BPF_MEM:
+	case BPF_LDX | BPF_W | BPF_MEM:
+		emit(ctx, BPF_LDX | BPF_W | BPF_MEM, dst, BPF_REG_10,
+			mem_off(insn->k), 0);
+		break;
+	case BPF_LDX | BPF_B | BPF_MSH:
+		/* X = 4 * (P[k] & 0xf), through A. */
+		emit(ctx, BPF_ALU64 | BPF_MOV | BPF_X, CBPF_REG_SAVE, CBPF_REG_A,
+			0, 0);
+		emit(ctx, BPF_LD | BPF_B | BPF_ABS, 0, 0, 0, insn->k);
+		emit(ctx, BPF_ALU | BPF_AND | BPF_K, CBPF_REG_A, 0, 0, 0xf);
+		emit(ctx, BPF_ALU | BPF_LSH | BPF_K, CBPF_REG_A, 0, 0, 2);
+		emit(ctx, BPF_ALU | BPF_MOV | BPF_X, CBPF_REG_X, CBPF_REG_A, 0, 0);
+		emit(ctx, BPF_ALU64 | BPF_MOV | BPF_X, CBPF_REG_A, CBPF_REG_SAVE,
+			0, 0);
+		break;
+	case BPF_ST:
+		emit(ctx, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, CBPF_REG_A,
+			mem_off(insn->k), 0);
+		break;
+	case BPF_STX:
+		emit(ctx, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, CBPF_REG_X,
+			mem_off(insn->k), 0);
+		break;
+	case BPF_RET | BPF_K:
+		emit(ctx, BPF_ALU | BPF_MOV | BPF_K, CBPF_REG_A, 0, 0, insn->k);
+		emit(ctx, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+		break;
+	case BPF_RET | BPF_A:
+		emit(ctx, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+		break;
+	case BPF_RET | BPF_X:
+		emit(ctx, BPF_ALU | BPF_MOV | BPF_X, CBPF_REG_A, CBPF_REG_X, 0, 0);
+		emit(ctx, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+		break;
+	case BPF_MISC | BPF_TAX:
+		emit(ctx, BPF_ALU | BPF_MOV | BPF_X, CBPF_REG_X, CBPF_REG_A, 0, 0);
+		break;
+	case BPF_MISC | BPF_TXA:
+		emit(ctx, BPF_ALU | BPF_MOV | BPF_X, CBPF_REG_A, CBPF_REG_X, 0, 0);
+		break;
+	default:
+		if (BPF_CLASS(insn->code) == BPF_ALU)
+			cbpf_emit_alu(ctx, insn);
+		else
+			cbpf_emit_jmp(ctx, pc);
+		break;
+	}
+}
+
+static
+void cbpf_emit(struct cbpf_ctx *ctx, __u16 mem_read, bool need_ret0)
+{
+	size_t pc;
+	__u32 k;
+
+	ctx->nr = 0;
+	emit(ctx, BPF_ALU64 | BPF_MOV | BPF_X, CBPF_REG_PKT, BPF_REG_1, 0, 0);
+	for (k = 0; k < BPF_MEMWORDS; k++) {
+		if (mem_read & (1U << k))
+			emit(ctx, BPF_ST | BPF_W | BPF_MEM, BPF_REG_10, 0,
+				mem_off(k), 0);
+	}
+	for (pc = 0; pc < ctx->len; pc++) {
+		ctx->start[pc] = ctx->nr;
+		if (ctx->reachable[pc])
+			cbpf_emit_insn(ctx, pc);
+	}
+	if (need_ret0) {
+		ctx->ret0 = ctx->nr;
+		emit(ctx, BPF_ALU | BPF_MOV | BPF_K, CBPF_REG_A, 0, 0, 0);
+		emit(ctx, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+	}
+}
+
+int bpf_cbpf_translate(const struct bpf_cbpf_insn *filter, size_t len,
+		struct bpf_insn **insns, size_t *insns_len)
+{
+	struct cbpf_ctx ctx = {
+		.filter = filter,
+		.len = len,
+	};
+	bool need_ret0, *reachable;
+	__u16 mem_read;
+
+	if (cbpf_check(filter, len))
+		return -1;
+	ctx.start = malloc(len * sizeof(*ctx.start));
+	reachable = malloc(len * sizeof(*reachable));
+	if (!ctx.start || !reachable)
+		goto error;
+	cbpf_reach(filter, len, reachable, &mem_read, &need_ret0);
+	ctx.reachable = reachable;
+	cbpf_emit(&ctx, mem_read, need_ret0);
+	if (ctx.nr > BPF_MAXINSNS) {
+		fprintf(stderr, "Error: Translated program too long (%zu insns)\n",
+			ctx.nr);
+		goto error;
+	}
+	ctx.out = calloc(ctx.nr, sizeof(*ctx.out));
+	if (!ctx.out)
+		goto error;
+	cbpf_emit(&ctx, mem_read, need_ret0);
+	free(reachable);
+	free(ctx.start);
+	*insns = ctx.out;
+	*insns_len = ctx.nr;
+	return 0;
+
+error:
+	free(reachable);
+	free(ctx.start);
+	return -1;
+}
+
+struct bpf_prog *bpf_cbpf_load(const struct bpf_cbpf_insn *filter, size_t len,
+		const struct bpf_prog_opts *opts)
+{
+	struct bpf_prog_opts cbpf_opts = { 0 };
+	struct bpf_prog *prog;
+	struct bpf_insn *insns;
+	size_t insns_len;
+
+	if (opts)
+		cbpf_opts = *opts;
+	cbpf_opts.ctx_size = sizeof(struct bpf_packet);
+	if (bpf_cbpf_translate(filter, len, &insns, &insns_len))
+		return NULL;
+	prog = bpf_prog_load(insns, insns_len, &cbpf_opts);
+	free(insns);
+	return prog;
+}
+
+static
+bool cbpf_load(const struct bpf_packet *pkt, __u32 off, __u32 size, __u32 *val)
+{
+	const __u8 *data = pkt->data;
+	__u32 i;
+
+	if (off > pkt->len || size > pkt->len - off)
+		return false;
+	*val = 0;
+	for (i = 0; i < size; i++)
+		*val = *val << 8 | data[off + i];
+	return true;
+}
+
+/*
+ * Reference classic interpreter, for tests and benchmarks: runs
+ * @filter, checked by bpf_cbpf_translate(), on @pkt the naive way.
+ */
+__u32 cbpf_run(const struct bpf_cbpf_insn *filter, size_t len,
+		const struct bpf_packet *pkt)
+{
+	__u32 A = 0, X = 0, M[BPF_MEMWORDS] = { 0 };
+	size_t pc;
+
+	for (pc = 0; pc < len; pc++) {
+		const struct bpf_cbpf_insn *insn = &filter[pc];
+		__u32 k = insn->k, size = 0, val;
+		bool cond;
+
+		switch (insn->code) {
+		case BPF_LD | BPF_W | BPF_ABS:
+		case BPF_LD | BPF_W | BPF_IND:
+			size += 2;
+			/* fallthrough */
+		case BPF_LD | BPF_H | BPF_ABS:
+		case BPF_LD | BPF_H | BPF_IND:
+			size++;
+			/* fallthrough */
+		case BPF_LD | BPF_B | BPF_ABS:
+		case BPF_LD | BPF_B | BPF_IND:
+			size++;
+			if (BPF_MODE(insn->code) == BPF_IND)
+				k += X;
+			if (!cbpf_load(pkt, k, size, &A))
+				return 0;
+			break;
+		case BPF_LD | BPF_W | BPF_LEN:
+			A = pkt->len;
+			break;
+		case BPF_LDX | BPF_W | BPF_LEN:
+			X = pkt->len;
+			break;
+		case BPF_LD | BPF_W | BPF_IMM:
+			A = k;
+			break;
+		case BPF_LDX | BPF_W | BPF_IMM:
+			X = k;
+			break;
+		case BPF_LD | BPF_W | BPF_MEM:
+			A = M[k];
+			break;
+		case BPF_LDX | BPF_W | BPF_MEM:
+			X = M[k];
+			break;
+		case BPF_LDX | BPF_B | BPF_MSH:
+			if (!cbpf_load(pkt, k, 1, &val))
+				return 0;
+			X = (val & 0xf) << 2;
+			break;
+		case BPF_ST:
+			M[k] = A;
+			break;
+		case BPF_STX:
+			M[k] = X;
+			break;
+		case BPF_RET | BPF_K:
+			return k;
+		case BPF_RET | BPF_A:
+			return A;
+		case BPF_RET | BPF_X:
+			return X;
+		case BPF_MISC | BPF_TAX:
+			X = A;
+			break;
+		case BPF_MISC | BPF_TXA:
+			A = X;
+			break;
+		case BPF_JMP | BPF_JA:
+			pc += k;
+			break;
+		default:
+			if (BPF_SRC(insn->code) == BPF_X)
+				k = X;
+			if (BPF_CLASS(insn->code) == BPF_JMP) {
+				switch (BPF_OP(insn->code)) {
+				case BPF_JEQ:
+					cond = A == k;
+					break;
+				case BPF_JGT:
+					cond = A > k;
+					break;
+				case BPF_JGE:
+					cond = A >= k;
+					break;
+				default:
+					cond = A & k;
+					break;
+				}
+				pc += cond ? insn->jt : insn->jf;
+				break;
+			}
+			switch (BPF_OP(insn->code)) {
+			case BPF_ADD:
+				A += k;
+				break;
+			case BPF_SUB:
+				A -= k;
+				break;
+			case BPF_MUL:
+				A *= k;
+				break;
+			case BPF_DIV:
+				if (!k)
+					return 0;
+				A /= k;
+				break;
+			case BPF_MOD:
+				if (!k)
+					return 0;
+				A %= k;
+				break;
+			case BPF_OR:
+				A |= k;
+				break;
+			case BPF_AND:
+				A &= k;
+				break;
+			case BPF_XOR:
+				A ^= k;
+				break;
+			case BPF_LSH:
+				A <<= k & 31;
+				break;
+			case BPF_RSH:
+				A >>= k & 31;
+				break;
+			case BPF_NEG:
+				A = -A;
+				break;
+			}
+			break;
+		}
+	}
+	return 0;
+}
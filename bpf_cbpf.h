@@ -0,0 +1,67 @@
+#ifndef _BPF_CBPF_H
+#define _BPF_CBPF_H
+
+/*
+ * Classic BPF (cBPF) translator, for pcap and seccomp style filters.
+ * Programs are translated into eBPF running on a struct bpf_packet
+ * context, as the kernel converts socket filters:
+ *
+ *	A		r0 (32-bit)
+ *	X		r7 (32-bit)
+ *	M[0-15]		32-bit stack slots, zeroed on entry when read
+ *	packet		struct bpf_packet context, kept in r6
+ *
+ * BPF_ABS and BPF_IND loads become eBPF packet loads, which also
+ * return 0 from the filter out of the packet. Division or modulo by a
+ * zero X returns 0, and shifts by X use its low 5 bits, as in the
+ * kernel. Ancillary loads (negative BPF_ABS offsets, SKF_AD_OFF and
+ * SKF_NET_OFF) are not supported.
+ */
+
+#include "./bpf.h"
+#include "./bpf_prog.h"
+#include <stddef.h>
+
+/* Classic instruction, as struct sock_filter of linux/filter.h. */
+struct bpf_cbpf_insn {
+	__u16	code;
+	__u8	jt;
+	__u8	jf;
+	__u32	k;
+};
+
+/* Classic fields and opcodes, as in linux/filter.h. */
+#define BPF_RVAL(code)		((code) & 0x18)
+#define		BPF_A		0x10
+#define BPF_MISCOP(code)	((code) & 0xf8)
+#define		BPF_TAX		0x00
+#define		BPF_TXA		0x80
+
+#define BPF_MEMWORDS		16
+
+#ifndef BPF_STMT
+#define BPF_STMT(code, k)		{ (__u16) (code), 0, 0, (k) }
+#endif
+#ifndef BPF_JUMP
+#define BPF_JUMP(code, k, jt, jf)	{ (__u16) (code), (jt), (jf), (k) }
+#endif
+
+/*
+ * Translate the classic program @filter of @len instructions, after
+ * checking it like the kernel does. Instructions unreachable from the
+ * first one are checked but not translated. On success, store the eBPF
+ * program into *@insns (free with free()) and its length into
+ * *@insns_len, and return 0. Return -1 on error.
+ */
+int bpf_cbpf_translate(const struct bpf_cbpf_insn *filter, size_t len,
+		struct bpf_insn **insns, size_t *insns_len);
+
+/*
+ * Translate @filter and load it like bpf_prog_load() with @opts (which
+ * may be NULL), with a ctx_size of sizeof(struct bpf_packet). Run the
+ * program on a struct bpf_packet, its result is the filter result.
+ */
+struct bpf_prog *bpf_cbpf_load(const struct bpf_cbpf_insn *filter, size_t len,
+		const struct bpf_prog_opts *opts);
+
+#endif /* _BPF_CBPF_H */
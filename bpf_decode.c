@@ -0,0 +1,310 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+static
+bool is_jmp(const struct bpf_insn *insn)
+{
+	unsigned int bpf_class = BPF_CLASS(insn->code);
+
+	if (BPF_OP(insn->code) == BPF_CALL || BPF_OP(insn->code) == BPF_EXIT)
+		return false;
+	return bpf_class == BPF_JMP || bpf_class == BPF_JMP32;
+}
+
+static
+int packet_load_size(__u8 code)
+{
+	switch (BPF_SIZE(code)) {
+	case BPF_W:
+		return 4;
+	case BPF_H:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * Instructions which may lie between the packet loads of a run: they
+ * have no side effect visible after exit (stores are to the stack
+ * only) and cannot fail, other than by a packet load exiting with
+ * r0 = 0, so exiting at the first load of the run instead gives the
+ * same result.
+ */
+static
+bool packet_run_continues(const struct bpf_insn *insn)
+{
+	switch (BPF_CLASS(insn->code)) {
+	case BPF_LD:
+		return true;	/* 64-bit immediates and packet loads */
+	case BPF_LDX:
+		return BPF_MODE(insn->code) == BPF_MEM;
+	case BPF_ST:
+	case BPF_STX:
+		return BPF_MODE(insn->code) == BPF_MEM
+			&& insn->dst_reg == BPF_REG_10;
+	case BPF_ALU:
+	case BPF_ALU64:
+		switch (BPF_OP(insn->code)) {
+		case BPF_ADD:
+		case BPF_SUB:
+		case BPF_MUL:
+		case BPF_OR:
+		case BPF_AND:
+		case BPF_XOR:
+		case BPF_NEG:
+		case BPF_MOV:
+			return true;
+		case BPF_LSH:
+		case BPF_RSH:
+		case BPF_ARSH:
+			return BPF_SRC(insn->code) == BPF_K && insn->imm >= 0
+				&& insn->imm < (BPF_CLASS(insn->code) == BPF_ALU ? 32 : 64);
+		default:
+			return false;	/* division errors, BPF_END */
+		}
+	default:
+		return false;
+	}
+}
+
+/*
+ * Hoist packet bounds checks: the first BPF_ABS load of a run of
+ * straight-line instructions checks the packet length for all the
+ * BPF_ABS loads of the run, which then load unchecked. Runs end at
+ * jumps, jump targets and instructions with side effects. The check
+ * holds for the whole run as the packet cannot change while the
+ * program runs: the validator rejects context stores in programs with
+ * packet loads.
+ */
+static
+void hoist_packet_checks(const struct bpf_insn *bytecode,
+		struct bpf_dinsn *decoded, size_t len, const bool *is_target)
+{
+	struct bpf_dinsn *head = NULL;
+	__u32 head_off = 0, end;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		const struct bpf_insn *insn = &bytecode[i];
+
+		if (is_target[i] || !packet_run_continues(insn))
+			head = NULL;
+		if (BPF_CLASS(insn->code) != BPF_LD
+		    || BPF_MODE(insn->code) != BPF_ABS) {
+			if (is_imm64(insn))
+				i++;
+			continue;
+		}
+		end = (__u32) insn->imm + packet_load_size(insn->code);
+		if (!head) {
+			head = &decoded[i];
+			head_off = insn->imm;
+			head->imm = (__s64) ((__u64) end << 32 | head_off);
+		} else {
+			decoded[i].imm = (__u32) insn->imm;
+			if (end > DINSN_ABS_CHECK(head))
+				head->imm = (__s64) ((__u64) end << 32 | head_off);
+		}
+	}
+}
+
+/*
+ * Decode validated bytecode into its internal form, so the interpreter
+ * does not have to extract register bitfields, sign-extend immediates,
+ * rebuild 64-bit immediates or compute jump targets at runtime.
+ *
+ * The result has one entry per bytecode slot, so pc values are the
+ * same in both forms. It is followed by BPF_DOP_END, reached when
+ * execution falls off the end of the bytecode, and by
+ * BPF_DOP_PC_OVERFLOW, which is the target of out of range jumps.
+ * Helper calls are resolved to the helper function, and atomic
+ * operations to one pseudo-opcode per operation and size. Packet
+ * bounds checks are hoisted, see DINSN_ABS_CHECK().
+ * Returns NULL on error. Free with free().
+ */
+struct bpf_dinsn *decode_bytecode(const struct bpf_insn *bytecode, size_t len)
+{
+	struct bpf_dinsn *decoded;
+	bool *is_target;
+	size_t i;
+
+	if (len > BPF_MAXINSNS) {
+		fprintf(stderr, "Error: bytecode length (%zu) exceeds %d insn\n",
+			len, BPF_MAXINSNS);
+		return NULL;
+	}
+	decoded = calloc(len + 2, sizeof(*decoded));
+	if (!decoded)
+		return NULL;
+
+	for (i = 0; i < len; i++) {
+		const struct bpf_insn *insn = &bytecode[i];
+		struct bpf_dinsn *dinsn = &decoded[i];
+
+		dinsn->op = insn->code;
+		dinsn->dst = insn->dst_reg;
+		dinsn->src = insn->src_reg;
+		dinsn->off = insn->off;
+		dinsn->imm = insn->imm;
+		if (is_imm64(insn) && i + 1 < len)
+			dinsn->imm = ((__u64) (insn + 1)->imm << 32) | (__u32) insn->imm;
+		if (is_jmp(insn)) {
+			ssize_t target = (ssize_t) i + insn->off + 1;
+
+			if (target < 0 || target > len)
+				target = len + 1;
+			dinsn->target = target;
+		}
+		if (insn->code == (BPF_JMP | BPF_CALL)) {
+			const struct bpf_helper *helper = bpf_helper_lookup(insn->imm);
+
+			if (!helper) {
+				fprintf(stderr, "Error: unknown helper %d at pc %zu\n",
+					insn->imm, i);
+				free(decoded);
+				return NULL;
+			}
+			dinsn->fn = helper->fn;
+		}
+		if (insn->code == (BPF_STX | BPF_W | BPF_ATOMIC)
+		    && atomic_op(insn->imm) >= 0)
+			dinsn->op = BPF_DOP_ATOMIC_W + atomic_op(insn->imm);
+		if (insn->code == (BPF_STX | BPF_DW | BPF_ATOMIC)
+		    && atomic_op(insn->imm) >= 0)
+			dinsn->op = BPF_DOP_ATOMIC_DW + atomic_op(insn->imm);
+	}
+	decoded[len].op = BPF_DOP_END;
+	decoded[len + 1].op = BPF_DOP_PC_OVERFLOW;
+
+	is_target = calloc(len + 2, sizeof(*is_target));
+	if (!is_target) {
+		free(decoded);
+		return NULL;
+	}
+	for (i = 0; i < len; i++) {
+		if (is_jmp(&bytecode[i]))
+			is_target[decoded[i].target] = true;
+	}
+	hoist_packet_checks(bytecode, decoded, len, is_target);
+	free(is_target);
+	return decoded;
+}
+
+static
+int fuse_ldx_jmp(const struct bpf_dinsn *insn)
+{
+	const struct bpf_dinsn *next = insn + 1;
+	int size;
+
+	switch (insn->op) {
+	case BPF_LDX | BPF_B | BPF_MEM:
+		size = 0;
+		break;
+	case BPF_LDX | BPF_H | BPF_MEM:
+		size = 1;
+		break;
+	case BPF_LDX | BPF_W | BPF_MEM:
+		size = 2;
+		break;
+	case BPF_LDX | BPF_DW | BPF_MEM:
+		size = 3;
+		break;
+	default:
+		return -1;
+	}
+	switch (next->op) {
+	case BPF_JMP | BPF_JEQ | BPF_K:
+		return BPF_FUSE_LDX_B_JEQ_K + size;
+	case BPF_JMP | BPF_JNE | BPF_K:
+		return BPF_FUSE_LDX_B_JNE_K + size;
+	default:
+		return -1;
+	}
+}
+
+static
+int fuse_mov_alu(const struct bpf_dinsn *insn)
+{
+	const struct bpf_dinsn *next = insn + 1;
+
+	if (insn->op != (BPF_ALU64 | BPF_MOV | BPF_X) || next->dst != insn->dst)
+		return -1;
+	switch (next->op) {
+	case BPF_ALU64 | BPF_ADD | BPF_K:
+		return BPF_FUSE_MOV_ADD_K;
+	case BPF_ALU64 | BPF_AND | BPF_K:
+		return BPF_FUSE_MOV_AND_K;
+	case BPF_ALU64 | BPF_OR | BPF_K:
+		return BPF_FUSE_MOV_OR_K;
+	case BPF_ALU64 | BPF_XOR | BPF_K:
+		return BPF_FUSE_MOV_XOR_K;
+	case BPF_ALU64 | BPF_LSH | BPF_K:
+	case BPF_ALU64 | BPF_RSH | BPF_K:
+		/* Keep out of range shift errors in the unfused form. */
+		if (next->imm < 0 || next->imm >= 64)
+			return -1;
+		return BPF_OP(next->op) == BPF_LSH ?
+			BPF_FUSE_MOV_LSH_K : BPF_FUSE_MOV_RSH_K;
+	default:
+		return -1;
+	}
+}
+
+static
+int fuse_ld_imm64(const struct bpf_dinsn *insn)
+{
+	const struct bpf_dinsn *next = insn + 2;
+
+	if (insn->op != (BPF_LD | BPF_DW | BPF_IMM) || next->src != insn->dst)
+		return -1;
+	switch (next->op) {
+	case BPF_JMP | BPF_JEQ | BPF_X:
+		return BPF_FUSE_LD_IMM64_JEQ_X;
+	case BPF_JMP | BPF_JNE | BPF_X:
+		return BPF_FUSE_LD_IMM64_JNE_X;
+	case BPF_ALU64 | BPF_ADD | BPF_X:
+		return BPF_FUSE_LD_IMM64_ADD_X;
+	case BPF_ALU64 | BPF_AND | BPF_X:
+		return BPF_FUSE_LD_IMM64_AND_X;
+	case BPF_ALU64 | BPF_OR | BPF_X:
+		return BPF_FUSE_LD_IMM64_OR_X;
+	case BPF_ALU64 | BPF_XOR | BPF_X:
+		return BPF_FUSE_LD_IMM64_XOR_X;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Replace the opcode of decoded instructions starting a common pair
+ * with a superinstruction, see enum bpf_fusion. The superinstruction
+ * reads the operands of the second instruction from its own entry,
+ * which is left unchanged: jumps to the second instruction run it
+ * alone, and pc values still match the bytecode. Only pairs which
+ * cannot fail at runtime are fused, so errors are reported at the
+ * same pc. The JIT expects the unfused form.
+ * Returns the number of fused pairs.
+ */
+size_t fuse_decoded(struct bpf_dinsn *insns, size_t len)
+{
+	size_t i, nr_fused = 0;
+	int fusion;
+
+	for (i = 0; i + 1 < len; i++) {
+		fusion = fuse_ldx_jmp(&insns[i]);
+		if (fusion < 0)
+			fusion = fuse_mov_alu(&insns[i]);
+		if (fusion < 0 && i + 2 < len)
+			fusion = fuse_ld_imm64(&insns[i]);
+		if (fusion < 0)
+			continue;
+		insns[i].op = BPF_DOP_FUSED + fusion;
+		nr_fused++;
+	}
+	return nr_fused;
+}
@@ -0,0 +1,526 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include "./bpf_prog.h"
+#include "./bpf_map.h"
+#include "./bpf_elf.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifndef EM_BPF
+#define EM_BPF			247
+#endif
+#ifndef R_BPF_64_64
+#define R_BPF_NONE		0
+#define R_BPF_64_64		1
+#endif
+
+#define MAPS_SECTION		"maps"
+
+struct bpf_elf_prog {
+	const char		*name;		/* section name, in the image */
+	size_t			shndx;
+	struct bpf_insn		*insns;		/* in the image, or relocated copy */
+	size_t			len;
+	bool			relocated;	/* insns is a private copy */
+};
+
+struct bpf_elf_map {
+	const char		*name;		/* symbol name, in the image */
+	__u64			offset;		/* in the maps section */
+	struct bpf_map		*map;
+};
+
+struct bpf_elf {
+	const void		*image;		/* copy of the object file */
+	size_t			size;
+	const Elf64_Ehdr	*ehdr;
+	const Elf64_Shdr	*shdrs;
+	const Elf64_Sym		*syms;
+	size_t			nr_syms;
+	const char		*strtab;	/* symbol names */
+	size_t			strtab_size;
+	struct bpf_elf_prog	*progs;
+	size_t			nr_progs;
+	struct bpf_elf_map	*maps;
+	size_t			nr_maps;
+	size_t			maps_shndx;	/* 0 without maps */
+};
+
+/* Section data, NULL if out of the image. */
+static
+const void *elf_data(const struct bpf_elf *obj, const Elf64_Shdr *shdr)
+{
+	if (shdr->sh_type == SHT_NOBITS || shdr->sh_offset > obj->size
+	    || shdr->sh_size > obj->size - shdr->sh_offset)
+		return NULL;
+	return (const char *) obj->image + shdr->sh_offset;
+}
+
+/* String at @off of string table section @shndx, NULL if invalid. */
+static
+const char *elf_string(const struct bpf_elf *obj, size_t shndx, size_t off)
+{
+	const Elf64_Shdr *shdr;
+	const char *strings;
+
+	if (shndx >= obj->ehdr->e_shnum)
+		return NULL;
+	shdr = &obj->shdrs[shndx];
+	strings = elf_data(obj, shdr);
+	if (!strings || shdr->sh_type != SHT_STRTAB || off >= shdr->sh_size
+	    || !memchr(strings + off, '\0', shdr->sh_size - off))
+		return NULL;
+	return strings + off;
+}
+
+static
+int elf_check_header(struct bpf_elf *obj)
+{
+	const Elf64_Ehdr *ehdr = obj->image;
+
+	if (obj->size < sizeof(*ehdr)
+	    || memcmp(ehdr->e_ident, ELFMAG, SELFMAG)
+	    || ehdr->e_ident[EI_CLASS] != ELFCLASS64) {
+		fprintf(stderr, "Error: not a 64-bit ELF object\n");
+		return -1;
+	}
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (ehdr->e_ident[EI_DATA] != ELFDATA2LSB) {
+#else
+	if (ehdr->e_ident[EI_DATA] != ELFDATA2MSB) {
+#endif
+		fprintf(stderr, "Error: ELF object of foreign byte order\n");
+		return -1;
+	}
+	if (ehdr->e_machine != EM_BPF || ehdr->e_type != ET_REL) {
+		fprintf(stderr, "Error: not a BPF relocatable object\n");
+		return -1;
+	}
+	if (ehdr->e_shentsize != sizeof(Elf64_Shdr)
+	    || ehdr->e_shoff > obj->size
+	    || (size_t) ehdr->e_shnum * sizeof(Elf64_Shdr)
+			> obj->size - ehdr->e_shoff
+	    || ehdr->e_shoff % __alignof__(Elf64_Shdr)) {
+		fprintf(stderr, "Error: invalid ELF section headers\n");
+		return -1;
+	}
+	obj->ehdr = ehdr;
+	obj->shdrs = (const Elf64_Shdr *) ((const char *) obj->image
+			+ ehdr->e_shoff);
+	return 0;
+}
+
+static
+int elf_find_symtab(struct bpf_elf *obj)
+{
+	size_t i;
+
+	for (i = 0; i < obj->ehdr->e_shnum; i++) {
+		const Elf64_Shdr *shdr = &obj->shdrs[i];
+
+		if (shdr->sh_type != SHT_SYMTAB)
+			continue;
+		obj->syms = elf_data(obj, shdr);
+		if (!obj->syms || shdr->sh_entsize != sizeof(Elf64_Sym)
+		    || shdr->sh_offset % __alignof__(Elf64_Sym)
+		    || !elf_string(obj, shdr->sh_link, 0)) {
+			fprintf(stderr, "Error: invalid symbol table\n");
+			return -1;
+		}
+		obj->nr_syms = shdr->sh_size / sizeof(Elf64_Sym);
+		obj->strtab = elf_string(obj, shdr->sh_link, 0);
+		obj->strtab_size = obj->shdrs[shdr->sh_link].sh_size;
+		return 0;
+	}
+	return 0;
+}
+
+static
+const char *sym_name(const struct bpf_elf *obj, const Elf64_Sym *sym)
+{
+	if (sym->st_name >= obj->strtab_size
+	    || !memchr(obj->strtab + sym->st_name, '\0',
+			obj->strtab_size - sym->st_name))
+		return NULL;
+	return obj->strtab + sym->st_name;
+}
+
+static
+int cmp_map_offset(const void *a, const void *b)
+{
+	const struct bpf_elf_map *x = a, *y = b;
+
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* Kernel map types, as found in objects, to ours. */
+static
+enum bpf_map_type map_type(__u32 type)
+{
+	switch (type) {
+	case 1:
+		return BPF_MAP_TYPE_HASH;
+	case 5:
+		return BPF_MAP_TYPE_PERCPU_HASH;
+	case 6:
+		return BPF_MAP_TYPE_PERCPU_ARRAY;
+	default:
+		return BPF_MAP_TYPE_UNSPEC;
+	}
+}
+
+/*
+ * Create a map for each symbol of the maps section. Definitions are
+ * evenly sized, possibly larger than struct bpf_elf_map_def.
+ */
+static
+int elf_create_maps(struct bpf_elf *obj)
+{
+	const Elf64_Shdr *shdr = &obj->shdrs[obj->maps_shndx];
+	const char *data = elf_data(obj, shdr);
+	size_t i, def_size;
+
+	if (!data) {
+		fprintf(stderr, "Error: invalid maps section\n");
+		return -1;
+	}
+	for (i = 0; i < obj->nr_syms; i++) {
+		if (obj->syms[i].st_shndx == obj->maps_shndx
+		    && ELF64_ST_TYPE(obj->syms[i].st_info) != STT_SECTION)
+			obj->nr_maps++;
+	}
+	if (!obj->nr_maps)
+		return 0;
+	obj->maps = calloc(obj->nr_maps, sizeof(*obj->maps));
+	if (!obj->maps)
+		return -1;
+	obj->nr_maps = 0;
+	for (i = 0; i < obj->nr_syms; i++) {
+		const Elf64_Sym *sym = &obj->syms[i];
+		struct bpf_elf_map *m;
+
+		if (sym->st_shndx != obj->maps_shndx
+		    || ELF64_ST_TYPE(sym->st_info) == STT_SECTION)
+			continue;
+		m = &obj->maps[obj->nr_maps++];
+		m->name = sym_name(obj, sym);
+		m->offset = sym->st_value;
+		if (!m->name) {
+			fprintf(stderr, "Error: invalid map symbol name\n");
+			return -1;
+		}
+	}
+	qsort(obj->maps, obj->nr_maps, sizeof(*obj->maps), cmp_map_offset);
+
+	def_size = shdr->sh_size / obj->nr_maps;
+	if (def_size < sizeof(struct bpf_elf_map_def)) {
+		fprintf(stderr, "Error: map definitions too small\n");
+		return -1;
+	}
+	for (i = 0; i < obj->nr_maps; i++) {
+		struct bpf_elf_map *m = &obj->maps[i];
+		struct bpf_elf_map_def def;
+		struct bpf_map_attr attr;
+
+		if (m->offset != i * def_size) {
+			fprintf(stderr, "Error: map %s misplaced\n", m->name);
+			return -1;
+		}
+		memcpy(&def, data + m->offset, sizeof(def));
+		attr = (struct bpf_map_attr) {
+			.type = map_type(def.type),
+			.key_size = def.key_size,
+			.value_size = def.value_size,
+			.max_entries = def.max_entries,
+		};
+		m->map = bpf_map_create(&attr);
+		if (!m->map) {
+			fprintf(stderr, "Error: cannot create map %s\n", m->name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static
+int elf_add_progs(struct bpf_elf *obj)
+{
+	size_t i;
+
+	obj->progs = calloc(obj->ehdr->e_shnum, sizeof(*obj->progs));
+	if (!obj->progs)
+		return -1;
+	for (i = 0; i < obj->ehdr->e_shnum; i++) {
+		const Elf64_Shdr *shdr = &obj->shdrs[i];
+		struct bpf_elf_prog *prog;
+
+		if (shdr->sh_type != SHT_PROGBITS
+		    || !(shdr->sh_flags & SHF_EXECINSTR) || !shdr->sh_size)
+			continue;
+		prog = &obj->progs[obj->nr_progs++];
+		prog->shndx = i;
+		prog->name = elf_string(obj, obj->ehdr->e_shstrndx,
+				shdr->sh_name);
+		prog->insns = (struct bpf_insn *) elf_data(obj, shdr);
+		prog->len = shdr->sh_size / sizeof(struct bpf_insn);
+		if (!prog->name || !prog->insns
+		    || shdr->sh_size % sizeof(struct bpf_insn)) {
+			fprintf(stderr, "Error: invalid program section %zu\n", i);
+			return -1;
+		}
+		if (shdr->sh_offset % __alignof__(struct bpf_insn)) {
+			/* Unaligned in the file, work on a copy. */
+			prog->insns = malloc(shdr->sh_size);
+			if (!prog->insns)
+				return -1;
+			memcpy(prog->insns, elf_data(obj, shdr), shdr->sh_size);
+			prog->relocated = true;
+		}
+	}
+	return 0;
+}
+
+static
+struct bpf_elf_prog *elf_prog_of_section(struct bpf_elf *obj, size_t shndx)
+{
+	size_t i;
+
+	for (i = 0; i < obj->nr_progs; i++) {
+		if (obj->progs[i].shndx == shndx)
+			return &obj->progs[i];
+	}
+	return NULL;
+}
+
+static
+int elf_relocate_insn(struct bpf_elf *obj, struct bpf_elf_prog *prog,
+		const Elf64_Rel *rel)
+{
+	size_t pc = rel->r_offset / sizeof(struct bpf_insn), symi, i;
+	struct bpf_insn *insn;
+	const Elf64_Sym *sym;
+	__u64 imm;
+
+	if (ELF64_R_TYPE(rel->r_info) == R_BPF_NONE)
+		return 0;
+	if (ELF64_R_TYPE(rel->r_info) != R_BPF_64_64) {
+		fprintf(stderr, "Error: %s: unsupported relocation type %u\n",
+			prog->name, (unsigned int) ELF64_R_TYPE(rel->r_info));
+		return -1;
+	}
+	symi = ELF64_R_SYM(rel->r_info);
+	if (rel->r_offset % sizeof(struct bpf_insn) || pc + 1 >= prog->len
+	    || !is_imm64(&prog->insns[pc]) || symi >= obj->nr_syms) {
+		fprintf(stderr, "Error: %s: invalid relocation at pc %zu\n",
+			prog->name, pc);
+		return -1;
+	}
+	if (!prog->relocated) {
+		/* Copy on the first relocation, the image is left as read. */
+		insn = malloc(prog->len * sizeof(*insn));
+		if (!insn)
+			return -1;
+		memcpy(insn, prog->insns, prog->len * sizeof(*insn));
+		prog->insns = insn;
+		prog->relocated = true;
+	}
+	insn = &prog->insns[pc];
+	sym = &obj->syms[symi];
+	if (obj->maps_shndx && sym->st_shndx == obj->maps_shndx) {
+		for (i = 0; i < obj->nr_maps; i++) {
+			if (obj->maps[i].offset == sym->st_value + insn->imm)
+				break;
+		}
+		if (i == obj->nr_maps) {
+			fprintf(stderr, "Error: %s: no map at pc %zu\n",
+				prog->name, pc);
+			return -1;
+		}
+		insn->src_reg = BPF_PSEUDO_MAP_IDX;
+		insn->imm = i;
+		(insn + 1)->imm = 0;
+	} else if (sym->st_shndx == SHN_ABS) {
+		imm = ((__u64) (insn + 1)->imm << 32) | (__u32) insn->imm;
+		imm += sym->st_value;
+		insn->imm = (__u32) imm;
+		(insn + 1)->imm = imm >> 32;
+	} else {
+		fprintf(stderr, "Error: %s: relocation against unsupported section at pc %zu\n",
+			prog->name, pc);
+		return -1;
+	}
+	return 0;
+}
+
+static
+int elf_relocate(struct bpf_elf *obj)
+{
+	size_t i, j;
+
+	for (i = 0; i < obj->ehdr->e_shnum; i++) {
+		const Elf64_Shdr *shdr = &obj->shdrs[i];
+		struct bpf_elf_prog *prog;
+		const Elf64_Rel *rels;
+
+		if ((shdr->sh_type != SHT_REL && shdr->sh_type != SHT_RELA)
+		    || shdr->sh_info >= obj->ehdr->e_shnum)
+			continue;
+		prog = elf_prog_of_section(obj, shdr->sh_info);
+		if (!prog)
+			continue;	/* e.g. debug info */
+		rels = elf_data(obj, shdr);
+		if (shdr->sh_type != SHT_REL || !rels || !obj->syms
+		    || shdr->sh_entsize != sizeof(*rels)
+		    || shdr->sh_offset % __alignof__(Elf64_Rel)) {
+			fprintf(stderr, "Error: %s: invalid relocation section\n",
+				prog->name);
+			return -1;
+		}
+		for (j = 0; j < shdr->sh_size / sizeof(*rels); j++) {
+			if (elf_relocate_insn(obj, prog, &rels[j]))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+struct bpf_elf *bpf_elf_open(const char *path)
+{
+	struct bpf_elf *obj;
+	const char *name;
+	struct stat st;
+	void *image;
+	ssize_t ret;
+	size_t i;
+	int fd;
+
+	obj = calloc(1, sizeof(*obj));
+	if (!obj)
+		return NULL;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		free(obj);
+		return NULL;
+	}
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		free(obj);
+		return NULL;
+	}
+	/*
+	 * Read the file rather than map it: programs run from the image
+	 * once validated, and a rebuild of the object in place would
+	 * change them, or truncate the mapping under them.
+	 */
+	obj->size = st.st_size;
+	image = obj->size ? malloc(obj->size) : NULL;
+	for (i = 0; image && i < obj->size; i += ret) {
+		ret = pread(fd, (char *) image + i, obj->size - i, i);
+		if (ret <= 0)
+			break;
+	}
+	close(fd);
+	obj->image = image;
+	if (!image || i < obj->size) {
+		fprintf(stderr, "Error: cannot read %s\n", path);
+		goto error;
+	}
+	if (elf_check_header(obj) || elf_find_symtab(obj))
+		goto error;
+	for (i = 1; i < obj->ehdr->e_shnum; i++) {
+		name = elf_string(obj, obj->ehdr->e_shstrndx,
+				obj->shdrs[i].sh_name);
+		if (name && !strcmp(name, MAPS_SECTION))
+			obj->maps_shndx = i;
+	}
+	if (obj->maps_shndx && obj->syms && elf_create_maps(obj))
+		goto error;
+	if (elf_add_progs(obj) || elf_relocate(obj))
+		goto error;
+	return obj;
+
+error:
+	bpf_elf_close(obj);
+	return NULL;
+}
+
+void bpf_elf_close(struct bpf_elf *obj)
+{
+	size_t i;
+
+	if (!obj)
+		return;
+	for (i = 0; i < obj->nr_progs; i++) {
+		if (obj->progs[i].relocated)
+			free(obj->progs[i].insns);
+	}
+	for (i = 0; i < obj->nr_maps; i++)
+		bpf_map_destroy(obj->maps[i].map);
+	free(obj->progs);
+	free(obj->maps);
+	free((void *) obj->image);
+	free(obj);
+}
+
+size_t bpf_elf_nr_progs(const struct bpf_elf *obj)
+{
+	return obj->nr_progs;
+}
+
+const char *bpf_elf_prog_name(const struct bpf_elf *obj, size_t i)
+{
+	return i < obj->nr_progs ? obj->progs[i].name : NULL;
+}
+
+struct bpf_prog *bpf_elf_load_prog(const struct bpf_elf *obj,
+		const char *name, const struct bpf_prog_opts *opts)
+{
+	struct bpf_prog_opts elf_opts = { .engine = BPF_DEFAULT_ENGINE };
+	const struct bpf_elf_prog *elf_prog = NULL;
+	struct bpf_map **maps = NULL;
+	struct bpf_prog *prog;
+	size_t i;
+
+	for (i = 0; i < obj->nr_progs; i++) {
+		if (!strcmp(obj->progs[i].name, name))
+			elf_prog = &obj->progs[i];
+	}
+	if (!elf_prog) {
+		fprintf(stderr, "Error: no program section %s\n", name);
+		return NULL;
+	}
+	if (opts)
+		elf_opts = *opts;
+	if (obj->nr_maps) {
+		maps = calloc(obj->nr_maps, sizeof(*maps));
+		if (!maps)
+			return NULL;
+		for (i = 0; i < obj->nr_maps; i++)
+			maps[i] = obj->maps[i].map;
+	}
+	elf_opts.maps = maps;
+	elf_opts.nr_maps = obj->nr_maps;
+	/* The program keeps its own copy of the map pointers. */
+	prog = prog_load(elf_prog->insns, elf_prog->len, &elf_opts, true);
+	free(maps);
+	return prog;
+}
+
+struct bpf_map *bpf_elf_map(const struct bpf_elf *obj, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < obj->nr_maps; i++) {
+		if (!strcmp(obj->maps[i].name, name))
+			return obj->maps[i].map;
+	}
+	return NULL;
+}
@@ -0,0 +1,65 @@
+#ifndef _BPF_ELF_H
+#define _BPF_ELF_H
+
+/*
+ * ELF object loader, for objects built with clang -target bpf (or
+ * llc -march=bpf). The object file is read into memory when opened,
+ * and each executable section is a program, named after the section.
+ *
+ * Maps are defined in the "maps" section as an array of struct
+ * bpf_elf_map_def, named by their symbols, and created when the object
+ * is opened. The map types are the kernel ones (BPF_MAP_TYPE_HASH = 1,
+ * BPF_MAP_TYPE_PERCPU_HASH = 5, BPF_MAP_TYPE_PERCPU_ARRAY = 6), as in
+ * linux/bpf.h used to build the object.
+ *
+ * Relocations of 64-bit immediate loads are applied: against a map
+ * symbol, the load becomes a BPF_PSEUDO_MAP_IDX load of the map, and
+ * against an absolute symbol, the symbol value is added to the
+ * immediate. Other relocations (bpf-to-bpf calls, global data) are
+ * rejected.
+ *
+ * Sections without relocation are validated and run in place, from
+ * the memory of the object, unless the program is optimized. Changes
+ * to the file after bpf_elf_open(), such as a rebuild, do not affect
+ * the object nor the programs loaded from it.
+ */
+
+#include "./bpf.h"
+#include "./bpf_prog.h"
+#include <stddef.h>
+
+/* Legacy map definition, as in the libbpf "maps" section. */
+struct bpf_elf_map_def {
+	__u32	type;
+	__u32	key_size;
+	__u32	value_size;
+	__u32	max_entries;
+	__u32	map_flags;	/* ignored */
+};
+
+struct bpf_elf;
+
+/* Map and parse the object at @path, and create its maps. */
+struct bpf_elf *bpf_elf_open(const char *path);
+
+/*
+ * Destroy the maps of @obj and unmap it. Programs loaded from @obj
+ * must be destroyed first.
+ */
+void bpf_elf_close(struct bpf_elf *obj);
+
+size_t bpf_elf_nr_progs(const struct bpf_elf *obj);
+const char *bpf_elf_prog_name(const struct bpf_elf *obj, size_t i);
+
+/*
+ * Load the program of section @name, like bpf_prog_load() with @opts
+ * (which may be NULL), and the maps of @obj instead of @opts->maps.
+ * Returns NULL on error.
+ */
+struct bpf_prog *bpf_elf_load_prog(const struct bpf_elf *obj,
+		const char *name, const struct bpf_prog_opts *opts);
+
+/* Map created for the symbol @name, NULL if there is none. */
+struct bpf_map *bpf_elf_map(const struct bpf_elf *obj, const char *name);
+
+#endif /* _BPF_ELF_H */
@@ -0,0 +1,132 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include "./bpf_map.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+# if __has_include(<linux/membarrier.h>)
+#  include <linux/membarrier.h>
+# endif
+#endif
+
+/*
+ * Epoch-based reclamation of map elements.
+ *
+ * Readers are program runs using maps, and hosts between
+ * bpf_map_read_lock() and bpf_map_read_unlock(). A reader entering its
+ * read section publishes the global epoch it saw in its thread's
+ * struct bpf_reader. The global epoch moves on when every reader in a
+ * read section has seen it, so that once it is two epochs past the
+ * unlink of an element, no reader can still hold a pointer to it.
+ *
+ * As in the membarrier flavor of liburcu, readers order the store of
+ * their epoch before their loads with a compiler barrier only, and
+ * bpf_epoch_advance() issues a membarrier() making it a full barrier
+ * on all running threads. Without membarrier(), readers use a fence.
+ */
+
+#if defined(__NR_membarrier) && defined(MEMBARRIER_CMD_PRIVATE_EXPEDITED)
+# define HAVE_MEMBARRIER
+#endif
+
+__u64 bpf_epoch = 1;
+bool bpf_epoch_reader_fence;
+__thread struct bpf_reader bpf_reader;
+
+/* Protected by readers_lock. */
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bpf_reader *readers;
+static pthread_key_t reader_key;
+static bool readers_init;
+static bool use_membarrier;
+
+static
+void reader_unregister(void *arg)
+{
+	struct bpf_reader *r = arg;
+
+	pthread_mutex_lock(&readers_lock);
+	*r->pprev = r->next;
+	if (r->next)
+		r->next->pprev = r->pprev;
+	pthread_mutex_unlock(&readers_lock);
+}
+
+void bpf_reader_register(void)
+{
+	struct bpf_reader *r = &bpf_reader;
+
+	pthread_mutex_lock(&readers_lock);
+	if (!readers_init) {
+		if (pthread_key_create(&reader_key, reader_unregister))
+			abort();
+#ifdef HAVE_MEMBARRIER
+		use_membarrier = !syscall(__NR_membarrier,
+			MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0);
+#endif
+		if (!use_membarrier)
+			__atomic_store_n(&bpf_epoch_reader_fence, true,
+				__ATOMIC_RELAXED);
+		readers_init = true;
+	}
+	r->next = readers;
+	r->pprev = &readers;
+	if (readers)
+		readers->pprev = &r->next;
+	readers = r;
+	pthread_setspecific(reader_key, r);
+	r->registered = true;
+	pthread_mutex_unlock(&readers_lock);
+}
+
+void bpf_map_read_lock(void)
+{
+	bpf_read_lock();
+}
+
+void bpf_map_read_unlock(void)
+{
+	bpf_read_unlock();
+}
+
+/* Epoch to tag an element with, once it is unlinked. */
+__u64 bpf_epoch_retire(void)
+{
+	/* Order the unlink before the epoch load. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&bpf_epoch, __ATOMIC_RELAXED);
+}
+
+/*
+ * Move the global epoch on if every reader in a read section saw it.
+ * Returns the global epoch: elements tagged with an epoch at least two
+ * below can be reused.
+ */
+__u64 bpf_epoch_advance(void)
+{
+	struct bpf_reader *r;
+	__u64 epoch, seen;
+
+	pthread_mutex_lock(&readers_lock);
+	epoch = __atomic_load_n(&bpf_epoch, __ATOMIC_RELAXED);
+#ifdef HAVE_MEMBARRIER
+	if (use_membarrier)
+		syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+	else
+#endif
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (r = readers; r; r = r->next) {
+		seen = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+		if (seen && seen != epoch)
+			break;
+	}
+	if (!r) {
+		epoch++;
+		__atomic_store_n(&bpf_epoch, epoch, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&readers_lock);
+	return epoch;
+}
@@ -0,0 +1,508 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Hash map with preallocated elements.
+ *
+ * Lookups take no lock: they walk the bucket chain with acquire loads.
+ * Updates and deletes serialize on a per-bucket spinlock. Chains end
+ * with a "nulls" marker encoding the bucket index, so a lookup which
+ * ends up on the wrong chain notices it and restarts.
+ *
+ * Values are not written in place: an update links a new element
+ * before unlinking the old one. Deleted and replaced elements wait in
+ * a FIFO limbo list, tagged with the epoch of their unlink, until the
+ * epoch is two past it (see bpf_epoch.c): by then no read section may
+ * still hold them, and they go back to a lock-free freelist. Lookups
+ * outside read sections may still walk an element once reused, which
+ * the nulls markers catch. The pool has a few spare elements above
+ * max_entries for the elements in limbo.
+ *
+ * Per-CPU hash elements hold one cache-line aligned slot per CPU after
+ * the key. Updates of an existing key write the current CPU slot in
+ * place, as other CPUs may be writing theirs.
+ */
+
+#define HTAB_NR_SPARE		64
+#define HTAB_RECLAIM_TRIES	3	/* in a read section, see htab_alloc_elem() */
+#define HTAB_FREELIST_EMPTY	UINT32_MAX
+#define CACHE_LINE_SIZE		64
+
+struct htab_elem {
+	struct htab_elem	*next;		/* chain, or nulls marker */
+	__u32			hash;
+	__u32			free_next;	/* freelist and limbo link */
+	__u64			retired;	/* limbo: epoch of the unlink */
+	char			key[];		/* value follows, 8-byte aligned */
+};
+
+struct htab_bucket {
+	struct htab_elem	*head;
+	__u32			lock;
+};
+
+struct bpf_htab {
+	struct bpf_map		map;
+	struct htab_bucket	*buckets;
+	__u32			n_buckets;	/* power of 2 */
+	__u32			elem_size;
+	__u32			value_off;	/* from the element start */
+	__u32			slot_size;	/* per-CPU maps: value stride */
+	__u32			count;		/* elements in the map */
+	__u64			freelist;	/* ABA tag << 32 | element index */
+	__u32			limbo_lock;
+	__u32			limbo_head;	/* element indexes, oldest first */
+	__u32			limbo_tail;
+	char			*elems;
+};
+
+static inline
+void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static
+void spin_lock(__u32 *lock)
+{
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+			cpu_relax();
+	}
+}
+
+static
+void spin_unlock(__u32 *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static inline
+struct htab_elem *nulls_marker(__u32 bucket)
+{
+	return (struct htab_elem *) (((uintptr_t) bucket << 1) | 1);
+}
+
+static inline
+bool is_nulls(const struct htab_elem *p)
+{
+	return (uintptr_t) p & 1;
+}
+
+static inline
+__u32 nulls_value(const struct htab_elem *p)
+{
+	return (uintptr_t) p >> 1;
+}
+
+static inline
+struct htab_elem *get_elem(struct bpf_htab *htab, __u32 idx)
+{
+	return (struct htab_elem *) (htab->elems + (size_t) idx * htab->elem_size);
+}
+
+static inline
+__u32 elem_index(struct bpf_htab *htab, struct htab_elem *elem)
+{
+	return ((char *) elem - htab->elems) / htab->elem_size;
+}
+
+static inline
+void *elem_value(struct bpf_htab *htab, struct htab_elem *elem)
+{
+	return (char *) elem + htab->value_off;
+}
+
+static inline
+void *elem_slot(struct bpf_htab *htab, struct htab_elem *elem, int cpu)
+{
+	return (char *) elem_value(htab, elem) + (size_t) cpu * htab->slot_size;
+}
+
+static
+__u32 htab_hash(const void *key, __u32 size)
+{
+	const __u8 *p = key;
+	__u64 h = 0x9e3779b97f4a7c15ULL ^ size, v;
+
+	for (; size >= 8; size -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		h = (h ^ v) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	if (size) {
+		v = 0;
+		memcpy(&v, p, size);
+		h = (h ^ v) * 0xff51afd7ed558ccdULL;
+	}
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* Treiber stack of element indexes, with a tag against ABA. */
+static
+void freelist_push(struct bpf_htab *htab, struct htab_elem *elem)
+{
+	__u32 idx = elem_index(htab, elem);
+	__u64 old, new;
+
+	old = __atomic_load_n(&htab->freelist, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&elem->free_next, (__u32) old, __ATOMIC_RELAXED);
+		new = ((old >> 32) + 1) << 32 | idx;
+	} while (!__atomic_compare_exchange_n(&htab->freelist, &old, new, true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static
+struct htab_elem *freelist_pop(struct bpf_htab *htab)
+{
+	struct htab_elem *elem;
+	__u64 old, new;
+
+	old = __atomic_load_n(&htab->freelist, __ATOMIC_ACQUIRE);
+	do {
+		if ((__u32) old == HTAB_FREELIST_EMPTY)
+			return NULL;
+		elem = get_elem(htab, (__u32) old);
+		new = ((old >> 32) + 1) << 32
+			| __atomic_load_n(&elem->free_next, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&htab->freelist, &old, new, true,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return elem;
+}
+
+/* Queue @elem, unlinked from its chain, until no reader may hold it. */
+static
+void limbo_push(struct bpf_htab *htab, struct htab_elem *elem)
+{
+	__u32 idx = elem_index(htab, elem);
+	__u64 epoch = bpf_epoch_retire();
+
+	spin_lock(&htab->limbo_lock);
+	elem->retired = epoch;
+	/* Stale freelist pops may read it. */
+	__atomic_store_n(&elem->free_next, HTAB_FREELIST_EMPTY, __ATOMIC_RELAXED);
+	if (htab->limbo_tail == HTAB_FREELIST_EMPTY)
+		__atomic_store_n(&htab->limbo_head, idx, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(&get_elem(htab, htab->limbo_tail)->free_next,
+			idx, __ATOMIC_RELAXED);
+	htab->limbo_tail = idx;
+	spin_unlock(&htab->limbo_lock);
+}
+
+/*
+ * Advance the epoch, and free the elements in limbo which no reader
+ * may hold anymore. Returns false if the limbo was empty.
+ */
+static
+bool limbo_reclaim(struct bpf_htab *htab)
+{
+	struct htab_elem *elem;
+	__u64 epoch;
+
+	if (__atomic_load_n(&htab->limbo_head, __ATOMIC_RELAXED)
+			== HTAB_FREELIST_EMPTY)
+		return false;
+	epoch = bpf_epoch_advance();
+	spin_lock(&htab->limbo_lock);
+	while (htab->limbo_head != HTAB_FREELIST_EMPTY) {
+		elem = get_elem(htab, htab->limbo_head);
+		if (elem->retired + 2 > epoch)
+			break;
+		__atomic_store_n(&htab->limbo_head, elem->free_next,
+			__ATOMIC_RELAXED);
+		freelist_push(htab, elem);
+	}
+	if (htab->limbo_head == HTAB_FREELIST_EMPTY)
+		htab->limbo_tail = HTAB_FREELIST_EMPTY;
+	spin_unlock(&htab->limbo_lock);
+	return true;
+}
+
+/*
+ * Free element for an update, reclaiming the limbo when the freelist
+ * is empty. This waits for the readers, as synchronize_rcu() would,
+ * but in a read section, where the caller may be the reader holding
+ * the limbo: then it gives up after HTAB_RECLAIM_TRIES epochs. Also
+ * returns NULL when concurrent updates hold all the spares.
+ */
+static
+struct htab_elem *htab_alloc_elem(struct bpf_htab *htab)
+{
+	struct htab_elem *elem;
+	int tries = 0;
+
+	for (;;) {
+		elem = freelist_pop(htab);
+		if (elem || !limbo_reclaim(htab))
+			return elem;
+		if (bpf_reader.nesting && ++tries >= HTAB_RECLAIM_TRIES)
+			return freelist_pop(htab);
+	}
+}
+
+static
+struct htab_elem *htab_lookup_elem(struct bpf_map *map, const void *key)
+{
+	struct bpf_htab *htab = (struct bpf_htab *) map;
+	__u32 hash = htab_hash(key, map->key_size);
+	__u32 idx = hash & (htab->n_buckets - 1);
+	struct htab_bucket *b = &htab->buckets[idx];
+	struct htab_elem *p;
+
+again:
+	for (p = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE); !is_nulls(p);
+	     p = __atomic_load_n(&p->next, __ATOMIC_ACQUIRE)) {
+		if (__atomic_load_n(&p->hash, __ATOMIC_RELAXED) == hash
+		    && !memcmp(p->key, key, map->key_size))
+			return p;
+	}
+	/* The element we walked was moved to another chain. */
+	if (nulls_value(p) != idx)
+		goto again;
+	return NULL;
+}
+
+static
+void *htab_lookup(struct bpf_map *map, const void *key)
+{
+	struct htab_elem *elem = htab_lookup_elem(map, key);
+
+	return elem ? elem_value((struct bpf_htab *) map, elem) : NULL;
+}
+
+static
+void *htab_percpu_lookup_cpu(struct bpf_map *map, const void *key, int cpu)
+{
+	struct htab_elem *elem = htab_lookup_elem(map, key);
+
+	return elem ? elem_slot((struct bpf_htab *) map, elem, cpu) : NULL;
+}
+
+static
+void *htab_percpu_lookup(struct bpf_map *map, const void *key)
+{
+	return htab_percpu_lookup_cpu(map, key, bpf_current_cpu());
+}
+
+/*
+ * Lookups read the bucket, then walk its chain: prefetch the bucket,
+ * then the first element, for interleaved runs (see bpf_interleave.c).
+ */
+static
+bool htab_prefetch(struct bpf_map *map, const void *key, unsigned int step)
+{
+	struct bpf_htab *htab = (struct bpf_htab *) map;
+	__u32 idx = htab_hash(key, map->key_size) & (htab->n_buckets - 1);
+	struct htab_elem *p;
+
+	switch (step) {
+	case 0:
+		__builtin_prefetch(&htab->buckets[idx]);
+		return true;
+	case 1:
+		/* A hint only, the element may move before the lookup. */
+		p = __atomic_load_n(&htab->buckets[idx].head, __ATOMIC_RELAXED);
+		if (is_nulls(p))
+			return false;
+		__builtin_prefetch(p);
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Find @key in a locked bucket, along with the link pointing to it. */
+static
+struct htab_elem *bucket_find(struct bpf_htab *htab, struct htab_bucket *b,
+		__u32 hash, const void *key, struct htab_elem ***linkp)
+{
+	struct htab_elem **link, *p;
+
+	for (link = &b->head; !is_nulls(p = *link); link = &p->next) {
+		if (p->hash == hash && !memcmp(p->key, key, htab->map.key_size)) {
+			*linkp = link;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static
+int htab_update(struct bpf_map *map, const void *key, const void *value,
+		__u64 flags)
+{
+	struct bpf_htab *htab = (struct bpf_htab *) map;
+	__u32 hash = htab_hash(key, map->key_size);
+	struct htab_bucket *b = &htab->buckets[hash & (htab->n_buckets - 1)];
+	struct htab_elem *old, *new = NULL, *retired = NULL, **link;
+	int ret = 0;
+
+	/*
+	 * Take the new element before locking the bucket, as reclaiming
+	 * the limbo waits for the readers. Per-CPU updates of existing
+	 * keys write in place, and do not need one.
+	 */
+	if (!htab->slot_size || !htab_lookup_elem(map, key))
+		new = htab_alloc_elem(htab);
+again:
+	spin_lock(&b->lock);
+	old = bucket_find(htab, b, hash, key, &link);
+	if (old && flags == BPF_NOEXIST) {
+		ret = -EEXIST;
+		goto unlock;
+	}
+	if (!old && flags == BPF_EXIST) {
+		ret = -ENOENT;
+		goto unlock;
+	}
+	if (old && htab->slot_size) {
+		memcpy(elem_slot(htab, old, bpf_current_cpu()), value,
+			map->value_size);
+		goto unlock;
+	}
+	if (!old && __atomic_add_fetch(&htab->count, 1, __ATOMIC_RELAXED)
+			> map->max_entries) {
+		__atomic_sub_fetch(&htab->count, 1, __ATOMIC_RELAXED);
+		ret = -E2BIG;
+		goto unlock;
+	}
+	if (!new) {
+		if (!old)
+			__atomic_sub_fetch(&htab->count, 1, __ATOMIC_RELAXED);
+		spin_unlock(&b->lock);
+		/* The per-CPU key was deleted since the lookup. */
+		if (htab->slot_size && !old) {
+			new = htab_alloc_elem(htab);
+			if (new)
+				goto again;
+		}
+		return -E2BIG;
+	}
+	__atomic_store_n(&new->hash, hash, __ATOMIC_RELAXED);
+	memcpy(new->key, key, map->key_size);
+	if (htab->slot_size) {
+		memset(elem_value(htab, new), 0, (size_t) htab->slot_size
+			* bpf_num_possible_cpus());
+		memcpy(elem_slot(htab, new, bpf_current_cpu()), value,
+			map->value_size);
+	} else {
+		memcpy(elem_value(htab, new), value, map->value_size);
+	}
+	if (old) {
+		/* Take the place of the old element. */
+		__atomic_store_n(&new->next, old->next, __ATOMIC_RELAXED);
+		__atomic_store_n(link, new, __ATOMIC_RELEASE);
+		retired = old;
+	} else {
+		__atomic_store_n(&new->next, b->head, __ATOMIC_RELAXED);
+		__atomic_store_n(&b->head, new, __ATOMIC_RELEASE);
+	}
+	new = NULL;
+unlock:
+	spin_unlock(&b->lock);
+	if (new)
+		freelist_push(htab, new);
+	if (retired)
+		limbo_push(htab, retired);
+	return ret;
+}
+
+static
+int htab_delete(struct bpf_map *map, const void *key)
+{
+	struct bpf_htab *htab = (struct bpf_htab *) map;
+	__u32 hash = htab_hash(key, map->key_size);
+	struct htab_bucket *b = &htab->buckets[hash & (htab->n_buckets - 1)];
+	struct htab_elem *elem, **link;
+
+	spin_lock(&b->lock);
+	elem = bucket_find(htab, b, hash, key, &link);
+	if (elem) {
+		__atomic_store_n(link, elem->next, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&htab->count, 1, __ATOMIC_RELAXED);
+	}
+	spin_unlock(&b->lock);
+	if (!elem)
+		return -ENOENT;
+	limbo_push(htab, elem);
+	return 0;
+}
+
+static
+void htab_free(struct bpf_map *map)
+{
+	struct bpf_htab *htab = (struct bpf_htab *) map;
+
+	free(htab->elems);
+	free(htab->buckets);
+	free(htab);
+}
+
+static const struct bpf_map_ops htab_ops = {
+	.lookup = htab_lookup,
+	.update = htab_update,
+	.delete = htab_delete,
+	.free = htab_free,
+	.prefetch = htab_prefetch,
+};
+
+static const struct bpf_map_ops htab_percpu_ops = {
+	.lookup = htab_percpu_lookup,
+	.update = htab_update,
+	.delete = htab_delete,
+	.free = htab_free,
+	.lookup_cpu = htab_percpu_lookup_cpu,
+	.prefetch = htab_prefetch,
+};
+
+struct bpf_map *htab_map_alloc(const struct bpf_map_attr *attr)
+{
+	struct bpf_htab *htab;
+	__u32 i, nr_elems = attr->max_entries + HTAB_NR_SPARE;
+
+	htab = calloc(1, sizeof(*htab));
+	if (!htab)
+		return NULL;
+	for (htab->n_buckets = 1; htab->n_buckets < attr->max_entries;)
+		htab->n_buckets <<= 1;
+	htab->buckets = calloc(htab->n_buckets, sizeof(*htab->buckets));
+	if (attr->type == BPF_MAP_TYPE_PERCPU_HASH) {
+		htab->map.ops = &htab_percpu_ops;
+		htab->value_off = (sizeof(struct htab_elem) + attr->key_size
+			+ CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+		htab->slot_size = (attr->value_size + CACHE_LINE_SIZE - 1)
+			& ~(CACHE_LINE_SIZE - 1);
+		htab->elem_size = htab->value_off + htab->slot_size
+			* bpf_num_possible_cpus();
+		htab->elems = aligned_alloc(CACHE_LINE_SIZE,
+			(size_t) nr_elems * htab->elem_size);
+	} else {
+		htab->map.ops = &htab_ops;
+		htab->value_off = (sizeof(struct htab_elem) + attr->key_size
+			+ 7) & ~7U;
+		htab->elem_size = (htab->value_off + attr->value_size + 7) & ~7U;
+		htab->elems = calloc(nr_elems, htab->elem_size);
+	}
+	if (!htab->buckets || !htab->elems) {
+		htab_free(&htab->map);
+		return NULL;
+	}
+	for (i = 0; i < htab->n_buckets; i++)
+		htab->buckets[i].head = nulls_marker(i);
+	htab->freelist = HTAB_FREELIST_EMPTY;
+	htab->limbo_head = HTAB_FREELIST_EMPTY;
+	htab->limbo_tail = HTAB_FREELIST_EMPTY;
+	for (i = nr_elems; i-- > 0;)
+		freelist_push(htab, get_elem(htab, i));
+	return &htab->map;
+}
@@ -0,0 +1,85 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include "./bpf_prog.h"
+#include <stdio.h>
+
+/* Helper registry, indexed by helper id, with the built-in helpers. */
+static struct bpf_helper helpers[BPF_MAX_HELPERS] = {
+	[BPF_FUNC_map_lookup_elem] = {
+		.id = BPF_FUNC_map_lookup_elem,
+		.name = "map_lookup_elem",
+		.fn = bpf_helper_map_lookup_elem,
+		.args = { BPF_ARG_CONST_MAP_PTR, BPF_ARG_PTR_TO_MAP_KEY },
+		.ret = BPF_RET_MAP_VALUE_OR_NULL,
+		.flags = BPF_HELPER_F_PURE,
+	},
+	[BPF_FUNC_map_update_elem] = {
+		.id = BPF_FUNC_map_update_elem,
+		.name = "map_update_elem",
+		.fn = bpf_helper_map_update_elem,
+		.args = { BPF_ARG_CONST_MAP_PTR, BPF_ARG_PTR_TO_MAP_KEY,
+			BPF_ARG_PTR_TO_MAP_VALUE, BPF_ARG_SCALAR },
+	},
+	[BPF_FUNC_map_delete_elem] = {
+		.id = BPF_FUNC_map_delete_elem,
+		.name = "map_delete_elem",
+		.fn = bpf_helper_map_delete_elem,
+		.args = { BPF_ARG_CONST_MAP_PTR, BPF_ARG_PTR_TO_MAP_KEY },
+	},
+	[BPF_FUNC_map_percpu_add] = {
+		.id = BPF_FUNC_map_percpu_add,
+		.name = "map_percpu_add",
+		.fn = bpf_helper_map_percpu_add,
+		.args = { BPF_ARG_CONST_MAP_PTR, BPF_ARG_PTR_TO_MAP_KEY,
+			BPF_ARG_SCALAR },
+	},
+};
+
+int bpf_helper_register(const struct bpf_helper *helper)
+{
+	int i;
+
+	if (helper->id >= BPF_MAX_HELPERS || !helper->fn) {
+		fprintf(stderr, "Error: invalid helper %u\n", helper->id);
+		return -1;
+	}
+	for (i = 0; i < 5; i++) {
+		enum bpf_arg_type type = helper->args[i];
+
+		/*
+		 * A memory argument is followed by its size, map keys and
+		 * values follow the map.
+		 */
+		if ((type == BPF_ARG_PTR_TO_MEM)
+		    != (i < 4 && helper->args[i + 1] == BPF_ARG_CONST_SIZE)
+		    || (type == BPF_ARG_CONST_SIZE
+		        && (!i || helper->args[i - 1] != BPF_ARG_PTR_TO_MEM))
+		    || ((type == BPF_ARG_PTR_TO_MAP_KEY
+		         || type == BPF_ARG_PTR_TO_MAP_VALUE)
+		        && helper->args[0] != BPF_ARG_CONST_MAP_PTR)) {
+			fprintf(stderr, "Error: invalid signature for helper %u\n",
+				helper->id);
+			return -1;
+		}
+	}
+	if (helper->ret == BPF_RET_MAP_VALUE_OR_NULL
+	    && helper->args[0] != BPF_ARG_CONST_MAP_PTR) {
+		fprintf(stderr, "Error: invalid signature for helper %u\n",
+			helper->id);
+		return -1;
+	}
+	if (helpers[helper->id].fn) {
+		fprintf(stderr, "Error: helper %u already registered\n",
+			helper->id);
+		return -1;
+	}
+	helpers[helper->id] = *helper;
+	return 0;
+}
+
+const struct bpf_helper *bpf_helper_lookup(__s32 id)
+{
+	if (id < 0 || id >= BPF_MAX_HELPERS || !helpers[id].fn)
+		return NULL;
+	return &helpers[id];
+}
@@ -0,0 +1,174 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Interleaved batch runs: BPF_INTERLEAVE_WAYS runs of the program are
+ * in flight as coroutines, each with its own registers, stack and pc,
+ * scheduled round-robin. A run goes on in the switch engine up to its
+ * next map lookup, asks the map to prefetch what the lookup reads
+ * first, and yields. When scheduled again, it prefetches the next step
+ * (the chain element after the hash bucket) and yields again, until
+ * the map has nothing left to prefetch: then it does the lookup, on
+ * cached lines if the other runs took long enough, and goes on to its
+ * next lookup. This is the group prefetching of hash join probes, with
+ * a lookup per stage.
+ *
+ * Programs have no loops but may jump backwards: a run stops at the
+ * first lookup after its pc, and does the lookups it jumps back to
+ * without yielding.
+ *
+ * Runs overlap, so they share read sections (see bpf_map.h): each
+ * section covers INTERLEAVE_SECTION runs, the runs in flight finishing
+ * before the next section starts.
+ */
+
+#define INTERLEAVE_SECTION	256
+
+struct interleave_run {
+	__s64		reg[MAX_BPF_REG];
+	__u64		stack[BPF_STACK_SIZE / sizeof(__u64)];
+	size_t		pc;
+	size_t		idx;		/* in the batch */
+	unsigned int	step;		/* next prefetch step */
+	bool		active;
+	bool		prefetching;	/* stopped at a lookup */
+};
+
+static
+bool is_lookup(const struct bpf_insn *insn)
+{
+	return insn->code == (BPF_JMP | BPF_CALL)
+		&& insn->imm == BPF_FUNC_map_lookup_elem;
+}
+
+/* Collect the pcs of the map lookups of @prog, in order. */
+int interleave_init(struct bpf_prog *prog)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < prog->len; i++)
+		n += is_lookup(&prog->insns[i]);
+	if (!n)
+		return 0;
+	prog->yield_pcs = malloc(n * sizeof(*prog->yield_pcs));
+	if (!prog->yield_pcs)
+		return -1;
+	for (i = 0; i < prog->len; i++) {
+		if (is_lookup(&prog->insns[i]))
+			prog->yield_pcs[prog->nr_yields++] = i;
+	}
+	return 0;
+}
+
+/* First lookup after @pc, or 0 (no stop) if there is none. */
+static
+size_t next_yield(const struct bpf_prog *prog, size_t pc)
+{
+	size_t lo = 0, hi = prog->nr_yields, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (prog->yield_pcs[mid] <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < prog->nr_yields ? prog->yield_pcs[lo] : 0;
+}
+
+/*
+ * Run @run up to its next yield. Returns BPF_SEGMENT_STOPPED when it
+ * yielded, or the enum bpf_error of the finished run.
+ */
+static
+int interleave_step(const struct bpf_prog *prog, struct interleave_run *run)
+{
+	struct bpf_map *map;
+	const void *key;
+	int ret;
+
+	if (run->prefetching) {
+		map = (struct bpf_map *) (unsigned long) run->reg[BPF_REG_1];
+		key = (const void *) (unsigned long) run->reg[BPF_REG_2];
+		if (map->ops->prefetch(map, key, run->step++))
+			return BPF_SEGMENT_STOPPED;
+		run->prefetching = false;
+	}
+	for (;;) {
+		ret = run_segment(prog->insns, prog->len, run->reg, &run->pc,
+				next_yield(prog, run->pc));
+		if (ret != BPF_SEGMENT_STOPPED)
+			return ret;
+		/* Or past a lookup, by a jump. */
+		if (!is_lookup(&prog->insns[run->pc]))
+			continue;
+		map = (struct bpf_map *) (unsigned long) run->reg[BPF_REG_1];
+		key = (const void *) (unsigned long) run->reg[BPF_REG_2];
+		if (map->ops->prefetch && map->ops->prefetch(map, key, 0)) {
+			run->step = 1;
+			run->prefetching = true;
+			return BPF_SEGMENT_STOPPED;
+		}
+	}
+}
+
+/*
+ * Batch of runs, see prog_run_batch(). Runs finish out of order: once
+ * one fails, no run after it starts, and the runs in flight finish.
+ */
+size_t interleave_run(const struct bpf_prog *prog, void *const *ctxs,
+		char *base, size_t stride, size_t nr, size_t ctx_len, __u64 *r0,
+		int *errp)
+{
+	struct interleave_run runs[BPF_INTERLEAVE_WAYS], *run;
+	size_t next = 0, fail = nr, section_end = INTERLEAVE_SECTION;
+	unsigned int w, nr_active = 0;
+	int ret, fail_err = BPF_ERR_NONE;
+
+	for (w = 0; w < BPF_INTERLEAVE_WAYS; w++)
+		runs[w].active = false;
+	bpf_read_lock();
+	for (w = 0; ; w = (w + 1) % BPF_INTERLEAVE_WAYS) {
+		run = &runs[w];
+		if (!run->active) {
+			if (next >= fail || next == section_end) {
+				if (nr_active)
+					continue;
+				if (next >= fail)
+					break;
+				bpf_read_unlock();
+				bpf_read_lock();
+				section_end = next + INTERLEAVE_SECTION;
+			}
+			memset(run->reg, 0, sizeof(run->reg));
+			run->reg[BPF_REG_1] = (unsigned long) (ctxs ? ctxs[next]
+				: base + next * stride);
+			run->reg[BPF_REG_2] = ctx_len;
+			run->reg[BPF_REG_10] = (unsigned long) run->stack
+				+ sizeof(run->stack);
+			run->pc = 0;
+			run->idx = next++;
+			run->prefetching = false;
+			run->active = true;
+			nr_active++;
+		}
+		ret = interleave_step(prog, run);
+		if (ret == BPF_SEGMENT_STOPPED)
+			continue;
+		if (ret && run->idx < fail) {
+			fail = run->idx;
+			fail_err = ret;
+		} else if (!ret) {
+			r0[run->idx] = run->reg[BPF_REG_0];
+		}
+		run->active = false;
+		nr_active--;
+	}
+	bpf_read_unlock();
+	*errp = fail_err;
+	return fail;
+}
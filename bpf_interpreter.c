@@ -4,8 +4,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
-
-#define MAX_NR_INTERPRETED_INSN		128
+#include <time.h>
 
 static
 void clear_regs(__s64 *reg, int nr_regs)
@@ -17,8 +16,7 @@ void clear_regs(__s64 *reg, int nr_regs)
 		reg[i] = 0;
 }
 
-static
-void show_regs(size_t pc, __s64 *reg, int nr_regs)
+void show_regs(size_t pc, const __s64 *reg, int nr_regs)
 {
 	int i;
 
@@ -28,32 +26,137 @@ void show_regs(size_t pc, __s64 *reg, int nr_regs)
 	}
 }
 
-int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
+#ifndef __always_inline
+#ifdef __GNUC__
+#define __always_inline		inline __attribute__((always_inline))
+#else
+#define __always_inline		inline
+#endif
+#endif
+
+/*
+ * Profiling clock: the time stamp counter on x86-64, nanoseconds
+ * elsewhere.
+ */
+static __always_inline
+__u64 profile_clock(void)
 {
-	__s64 reg[MAX_BPF_REG];
-	size_t pc = 0, nr_interpreted_insn = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Counters are shared by concurrent runs. Relaxed loads and stores
+ * keep them cheap, at the cost of lost counts under contention.
+ */
+static __always_inline
+void profile_add(__u64 *counter, __u64 v)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + v,
+		__ATOMIC_RELAXED);
+}
+
+/*
+ * Count the execution of @pc. On timed runs (@block is not NULL),
+ * charge the time since the previous basic block entry to *@block when
+ * @pc starts a new one.
+ */
+static __always_inline
+void profile_insn(struct bpf_profile *prof, size_t pc, size_t *block,
+		__u64 *start)
+{
+	__u64 now;
+
+	profile_add(&prof->counts[pc], 1);
+	if (!block || !prof->block_start[pc] || pc == *block)
+		return;
+	now = profile_clock();
+	profile_add(&prof->cycles[*block], now - *start);
+	profile_add(&prof->samples[pc], 1);
+	*block = pc;
+	*start = now;
+}
+
+/*
+ * Packet load of @size bytes at @off, see struct bpf_packet: store the
+ * big-endian value into @val, or return false when out of the packet.
+ */
+static __always_inline
+bool packet_load(const __s64 *reg, __u32 off, __u32 size, __s64 *val)
+{
+	const struct bpf_packet *pkt = (const struct bpf_packet *) reg[BPF_REG_6];
+
+	if (pkt->len < size || off > pkt->len - size)
+		return false;
+	*val = packet_read((const __u8 *) pkt->data + off, size);
+	return true;
+}
+
+/* Decoded BPF_ABS load, whose bounds check may be hoisted. */
+static __always_inline
+bool packet_load_abs(const __s64 *reg, const struct bpf_dinsn *insn,
+		__u32 size, __s64 *val)
+{
+	const struct bpf_packet *pkt = (const struct bpf_packet *) reg[BPF_REG_6];
+
+	if (pkt->len < DINSN_ABS_CHECK(insn))
+		return false;
+	*val = packet_read((const __u8 *) pkt->data + DINSN_ABS_OFF(insn), size);
+	return true;
+}
+
+/*
+ * Reference engine: decode and dispatch each instruction through a
+ * switch statement, checking pc bounds on every step. Runs on the
+ * register file @reg, stores the final pc into @pcp and returns an
+ * enum bpf_error.
+ *
+ * All engines expect bytecode accepted by validate_bytecode(), which
+ * proves termination, so none of them counts executed instructions.
+ *
+ * Inlined into run_bytecode(), run_profiled() and run_segment(): with
+ * a NULL @prof, the profiling code compiles away, and so does the stop
+ * check with a 0 @stop. Execution starts at @start.
+ */
+static __always_inline
+int switch_engine(const struct bpf_insn *bytecode, size_t len, __s64 *reg,
+		size_t *pcp, size_t start_pc, size_t stop, struct bpf_profile *prof)
+{
+	size_t pc = start_pc, block = 0, *timed = NULL;
+	__u64 start = 0;
 	int ret = 0;
 
-	clear_regs(reg, MAX_BPF_REG);
+	if (prof) {
+		/* Time one run out of prof->period. */
+		if (!(__atomic_fetch_add(&prof->nr_runs, 1, __ATOMIC_RELAXED)
+		      % prof->period)) {
+			timed = &block;
+			profile_add(&prof->samples[0], 1);
+			start = profile_clock();
+		}
+	}
 
 	for (;;) {
 		const struct bpf_insn *insn = bytecode + pc;
 
+		if (prof && pc < len)
+			profile_insn(prof, pc, timed, &start);
+		if (stop && pc >= stop) {
+			ret = BPF_SEGMENT_STOPPED;
+			goto end;
+		}
 		if (pc == len) {
 			/* Bytecode terminates. */
 			break;
 		}
 		if (pc > len) {
-			fprintf(stderr, "Error: pc (%zu) overflows bytecode length (%zu)\n",
-				pc, len);
-			ret = -1;
-			goto end;
-
-		}
-		if (nr_interpreted_insn++ >= MAX_NR_INTERPRETED_INSN) {
-			fprintf(stderr, "Error: Reached maximum number of interpreted insn (%d)\n",
-				MAX_NR_INTERPRETED_INSN);
-			ret = -1;
+			ret = BPF_ERR_PC_OVERFLOW;
 			goto end;
 		}
 
@@ -68,149 +171,263 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			pc += 2;	/* Skip next insn. */
 			break;
 
+			/* Load from packet, exit with r0 = 0 out of it. */
+		case BPF_LD | BPF_W | BPF_ABS:
+			if (!packet_load(reg, insn->imm, 4, &reg[BPF_REG_0]))
+				goto packet_out;
+			pc++;
+			break;
+		case BPF_LD | BPF_H | BPF_ABS:
+			if (!packet_load(reg, insn->imm, 2, &reg[BPF_REG_0]))
+				goto packet_out;
+			pc++;
+			break;
+		case BPF_LD | BPF_B | BPF_ABS:
+			if (!packet_load(reg, insn->imm, 1, &reg[BPF_REG_0]))
+				goto packet_out;
+			pc++;
+			break;
+		case BPF_LD | BPF_W | BPF_IND:
+			if (!packet_load(reg, reg[insn->src_reg] + insn->imm, 4,
+					&reg[BPF_REG_0]))
+				goto packet_out;
+			pc++;
+			break;
+		case BPF_LD | BPF_H | BPF_IND:
+			if (!packet_load(reg, reg[insn->src_reg] + insn->imm, 2,
+					&reg[BPF_REG_0]))
+				goto packet_out;
+			pc++;
+			break;
+		case BPF_LD | BPF_B | BPF_IND:
+			if (!packet_load(reg, reg[insn->src_reg] + insn->imm, 1,
+					&reg[BPF_REG_0]))
+				goto packet_out;
+			pc++;
+			break;
+
 			/* Load from address. */
 		case BPF_LDX | BPF_W | BPF_MEM:
-			/* TODO: validate pointer. */
 			reg[insn->dst_reg] = *(__u32 *) (reg[insn->src_reg] + insn->off);
 			pc++;
 			break;
 		case BPF_LDX | BPF_H | BPF_MEM:
-			/* TODO: validate pointer. */
 			reg[insn->dst_reg] = *(__u16 *) (reg[insn->src_reg] + insn->off);
 			pc++;
 			break;
 		case BPF_LDX | BPF_B | BPF_MEM:
-			/* TODO: validate pointer. */
 			reg[insn->dst_reg] = *(__u8 *) (reg[insn->src_reg] + insn->off);
 			pc++;
 			break;
 		case BPF_LDX | BPF_DW | BPF_MEM:
-			/* TODO: validate pointer. */
 			reg[insn->dst_reg] = *(__u64 *) (reg[insn->src_reg] + insn->off);
 			pc++;
 			break;
 
 			/* Load from address with acquire semantic. */
 		case BPF_LDX | BPF_W | BPF_MEM_ACQ_REL:
-			/* TODO: validate pointer. */
-			/* TODO: load acquire */
-			reg[insn->dst_reg] = *(__u32 *) (reg[insn->src_reg] + insn->off);
+			reg[insn->dst_reg] = __atomic_load_n((__u32 *) (reg[insn->src_reg] + insn->off),
+				__ATOMIC_ACQUIRE);
 			pc++;
 			break;
 		case BPF_LDX | BPF_H | BPF_MEM_ACQ_REL:
-			/* TODO: validate pointer. */
-			/* TODO: load acquire */
-			reg[insn->dst_reg] = *(__u16 *) (reg[insn->src_reg] + insn->off);
+			reg[insn->dst_reg] = __atomic_load_n((__u16 *) (reg[insn->src_reg] + insn->off),
+				__ATOMIC_ACQUIRE);
 			pc++;
 			break;
 		case BPF_LDX | BPF_B | BPF_MEM_ACQ_REL:
-			/* TODO: validate pointer. */
-			/* TODO: load acquire */
-			reg[insn->dst_reg] = *(__u8 *) (reg[insn->src_reg] + insn->off);
+			reg[insn->dst_reg] = __atomic_load_n((__u8 *) (reg[insn->src_reg] + insn->off),
+				__ATOMIC_ACQUIRE);
 			pc++;
 			break;
 		case BPF_LDX | BPF_DW | BPF_MEM_ACQ_REL:
-			/* TODO: validate pointer. */
-			/* TODO: load acquire */
-			reg[insn->dst_reg] = *(__u64 *) (reg[insn->src_reg] + insn->off);
+			reg[insn->dst_reg] = __atomic_load_n((__u64 *) (reg[insn->src_reg] + insn->off),
+				__ATOMIC_ACQUIRE);
 			pc++;
 			break;
 
 			/* Store from immediate to address. */
 		case BPF_ST | BPF_W | BPF_MEM:
-			/* TODO: validate pointer. */
 			*(__u32 *) (reg[insn->dst_reg] + insn->off) = insn->imm;
 			pc++;
 			break;
 		case BPF_ST | BPF_H | BPF_MEM:
-			/* TODO: validate pointer. */
 			*(__u16 *) (reg[insn->dst_reg] + insn->off) = insn->imm;
 			pc++;
 			break;
 		case BPF_ST | BPF_B | BPF_MEM:
-			/* TODO: validate pointer. */
 			*(__u8 *) (reg[insn->dst_reg] + insn->off) = insn->imm;
 			pc++;
 			break;
 		case BPF_ST | BPF_DW | BPF_MEM:
-			/* TODO: validate pointer. */
 			*(__u64 *) (reg[insn->dst_reg] + insn->off) = insn->imm;
 			pc++;
 			break;
 
 			/* Store from immediate to address with release semantic. */
 		case BPF_ST | BPF_W | BPF_MEM_ACQ_REL:
-			/* TODO: validate pointer. */
-			/* TODO: store release. */
-			*(__u32 *) (reg[insn->dst_reg] + insn->off) = insn->imm;
+			__atomic_store_n((__u32 *) (reg[insn->dst_reg] + insn->off), insn->imm,
+				__ATOMIC_RELEASE);
 			pc++;
 			break;
 		case BPF_ST | BPF_H | BPF_MEM_ACQ_REL:
-			/* TODO: validate pointer. */
-			/* TODO: store release. */
-			*(__u16 *) (reg[insn->dst_reg] + insn->off) = insn->imm;
+			__atomic_store_n((__u16 *) (reg[insn->dst_reg] + insn->off), insn->imm,
+				__ATOMIC_RELEASE);
 			pc++;
 			break;
 		case BPF_ST | BPF_B | BPF_MEM_ACQ_REL:
-			/* TODO: validate pointer. */
-			/* TODO: store release. */
-			*(__u8 *) (reg[insn->dst_reg] + insn->off) = insn->imm;
+			__atomic_store_n((__u8 *) (reg[insn->dst_reg] + insn->off), insn->imm,
+				__ATOMIC_RELEASE);
 			pc++;
 			break;
 		case BPF_ST | BPF_DW | BPF_MEM_ACQ_REL:
-			/* TODO: validate pointer. */
-			/* TODO: store release. */
-			*(__u64 *) (reg[insn->dst_reg] + insn->off) = insn->imm;
+			__atomic_store_n((__u64 *) (reg[insn->dst_reg] + insn->off), insn->imm,
+				__ATOMIC_RELEASE);
 			pc++;
 			break;
 
 			/* Store from register to address. */
 		case BPF_STX | BPF_W | BPF_MEM:
-			/* TODO: validate pointer. */
 			*(__u32 *) (reg[insn->dst_reg] + insn->off) = reg[insn->src_reg];
 			pc++;
 			break;
 		case BPF_STX | BPF_H | BPF_MEM:
-			/* TODO: validate pointer. */
 			*(__u16 *) (reg[insn->dst_reg] + insn->off) = reg[insn->src_reg];
 			pc++;
 			break;
 		case BPF_STX | BPF_B | BPF_MEM:
-			/* TODO: validate pointer. */
 			*(__u8 *) (reg[insn->dst_reg] + insn->off) = reg[insn->src_reg];
 			pc++;
 			break;
 		case BPF_STX | BPF_DW | BPF_MEM:
-			/* TODO: validate pointer. */
 			*(__u64 *) (reg[insn->dst_reg] + insn->off) = reg[insn->src_reg];
 			pc++;
 			break;
 
 			/* Store from register to address with release semantic. */
 		case BPF_STX | BPF_W | BPF_MEM_ACQ_REL:
-			/* TODO: validate pointer. */
-			/* TODO: store release. */
-			*(__u32 *) (reg[insn->dst_reg] + insn->off) = reg[insn->src_reg];
+			__atomic_store_n((__u32 *) (reg[insn->dst_reg] + insn->off), reg[insn->src_reg],
+				__ATOMIC_RELEASE);
 			pc++;
 			break;
 		case BPF_STX | BPF_H | BPF_MEM_ACQ_REL:
-			/* TODO: validate pointer. */
-			/* TODO: store release. */
-			*(__u16 *) (reg[insn->dst_reg] + insn->off) = reg[insn->src_reg];
+			__atomic_store_n((__u16 *) (reg[insn->dst_reg] + insn->off), reg[insn->src_reg],
+				__ATOMIC_RELEASE);
 			pc++;
 			break;
 		case BPF_STX | BPF_B | BPF_MEM_ACQ_REL:
-			/* TODO: validate pointer. */
-			/* TODO: store release. */
-			*(__u8 *) (reg[insn->dst_reg] + insn->off) = reg[insn->src_reg];
+			__atomic_store_n((__u8 *) (reg[insn->dst_reg] + insn->off), reg[insn->src_reg],
+				__ATOMIC_RELEASE);
 			pc++;
 			break;
 		case BPF_STX | BPF_DW | BPF_MEM_ACQ_REL:
-			/* TODO: validate pointer. */
-			/* TODO: store release. */
-			*(__u64 *) (reg[insn->dst_reg] + insn->off) = reg[insn->src_reg];
+			__atomic_store_n((__u64 *) (reg[insn->dst_reg] + insn->off), reg[insn->src_reg],
+				__ATOMIC_RELEASE);
+			pc++;
+			break;
+
+			/* Atomic read-modify-write, operation in imm. */
+		case BPF_STX | BPF_W | BPF_ATOMIC:
+		{
+			__u32 *p = (__u32 *) (reg[insn->dst_reg] + insn->off), old;
+
+			switch (insn->imm) {
+			case BPF_ADD:
+				__atomic_fetch_add(p, reg[insn->src_reg], __ATOMIC_RELAXED);
+				break;
+			case BPF_OR:
+				__atomic_fetch_or(p, reg[insn->src_reg], __ATOMIC_RELAXED);
+				break;
+			case BPF_AND:
+				__atomic_fetch_and(p, reg[insn->src_reg], __ATOMIC_RELAXED);
+				break;
+			case BPF_XOR:
+				__atomic_fetch_xor(p, reg[insn->src_reg], __ATOMIC_RELAXED);
+				break;
+			case BPF_ADD | BPF_FETCH:
+				reg[insn->src_reg] = __atomic_fetch_add(p, reg[insn->src_reg],
+					__ATOMIC_SEQ_CST);
+				break;
+			case BPF_OR | BPF_FETCH:
+				reg[insn->src_reg] = __atomic_fetch_or(p, reg[insn->src_reg],
+					__ATOMIC_SEQ_CST);
+				break;
+			case BPF_AND | BPF_FETCH:
+				reg[insn->src_reg] = __atomic_fetch_and(p, reg[insn->src_reg],
+					__ATOMIC_SEQ_CST);
+				break;
+			case BPF_XOR | BPF_FETCH:
+				reg[insn->src_reg] = __atomic_fetch_xor(p, reg[insn->src_reg],
+					__ATOMIC_SEQ_CST);
+				break;
+			case BPF_XCHG:
+				reg[insn->src_reg] = __atomic_exchange_n(p, reg[insn->src_reg],
+					__ATOMIC_SEQ_CST);
+				break;
+			case BPF_CMPXCHG:
+				old = reg[BPF_REG_0];
+				__atomic_compare_exchange_n(p, &old, reg[insn->src_reg], false,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+				reg[BPF_REG_0] = old;
+				break;
+			default:
+				ret = BPF_ERR_UNSUPPORTED;
+				goto end;
+			}
+			pc++;
+			break;
+		}
+
+		case BPF_STX | BPF_DW | BPF_ATOMIC:
+		{
+			__u64 *p = (__u64 *) (reg[insn->dst_reg] + insn->off), old;
+
+			switch (insn->imm) {
+			case BPF_ADD:
+				__atomic_fetch_add(p, reg[insn->src_reg], __ATOMIC_RELAXED);
+				break;
+			case BPF_OR:
+				__atomic_fetch_or(p, reg[insn->src_reg], __ATOMIC_RELAXED);
+				break;
+			case BPF_AND:
+				__atomic_fetch_and(p, reg[insn->src_reg], __ATOMIC_RELAXED);
+				break;
+			case BPF_XOR:
+				__atomic_fetch_xor(p, reg[insn->src_reg], __ATOMIC_RELAXED);
+				break;
+			case BPF_ADD | BPF_FETCH:
+				reg[insn->src_reg] = __atomic_fetch_add(p, reg[insn->src_reg],
+					__ATOMIC_SEQ_CST);
+				break;
+			case BPF_OR | BPF_FETCH:
+				reg[insn->src_reg] = __atomic_fetch_or(p, reg[insn->src_reg],
+					__ATOMIC_SEQ_CST);
+				break;
+			case BPF_AND | BPF_FETCH:
+				reg[insn->src_reg] = __atomic_fetch_and(p, reg[insn->src_reg],
+					__ATOMIC_SEQ_CST);
+				break;
+			case BPF_XOR | BPF_FETCH:
+				reg[insn->src_reg] = __atomic_fetch_xor(p, reg[insn->src_reg],
+					__ATOMIC_SEQ_CST);
+				break;
+			case BPF_XCHG:
+				reg[insn->src_reg] = __atomic_exchange_n(p, reg[insn->src_reg],
+					__ATOMIC_SEQ_CST);
+				break;
+			case BPF_CMPXCHG:
+				old = reg[BPF_REG_0];
+				__atomic_compare_exchange_n(p, &old, reg[insn->src_reg], false,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+				reg[BPF_REG_0] = old;
+				break;
+			default:
+				ret = BPF_ERR_UNSUPPORTED;
+				goto end;
+			}
 			pc++;
 			break;
+		}
 
 		case BPF_ALU | BPF_ADD | BPF_K:
 			reg[insn->dst_reg] += insn->imm;
@@ -244,21 +461,20 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			break;
 		case BPF_ALU | BPF_DIV | BPF_K:
 			if (!insn->imm) {
-				fprintf(stderr, "error: Divide by 0\n");
-				ret = -1;
+				ret = BPF_ERR_DIV_BY_ZERO;
 				goto end;
 			}
-			reg[insn->dst_reg] /= insn->imm;
+			reg[insn->dst_reg] = bpf_sdiv(reg[insn->dst_reg], insn->imm);
 			reg[insn->dst_reg] = (__u32) reg[insn->dst_reg];
 			pc++;
 			break;
 		case BPF_ALU | BPF_DIV | BPF_X:
 			if (!reg[insn->src_reg]) {
-				fprintf(stderr, "Error: Divide by 0\n");
-				ret = -1;
+				ret = BPF_ERR_DIV_BY_ZERO;
 				goto end;
 			}
-			reg[insn->dst_reg] /= reg[insn->src_reg];
+			reg[insn->dst_reg] = bpf_sdiv(reg[insn->dst_reg],
+				reg[insn->src_reg]);
 			reg[insn->dst_reg] = (__u32) reg[insn->dst_reg];
 			pc++;
 			break;
@@ -284,9 +500,7 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			break;
 		case BPF_ALU | BPF_LSH | BPF_K:
 			if (insn->imm >= 32 || insn->imm < 0) {
-				fprintf(stderr, "Error: Left shift by %d undefined.\n",
-					insn->imm);
-				ret = -1;
+				ret = BPF_ERR_SHIFT;
 				goto end;
 			}
 			reg[insn->dst_reg] = (__u64) reg[insn->dst_reg] << insn->imm;
@@ -295,9 +509,7 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			break;
 		case BPF_ALU | BPF_LSH | BPF_X:
 			if (reg[insn->src_reg] >= 32 || reg[insn->src_reg] < 0) {
-				fprintf(stderr, "Error: Left shift by %lld undefined.\n",
-					reg[insn->src_reg]);
-				ret = -1;
+				ret = BPF_ERR_SHIFT;
 				goto end;
 			}
 			reg[insn->dst_reg] = (__u64) reg[insn->dst_reg] << reg[insn->src_reg];
@@ -306,9 +518,7 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			break;
 		case BPF_ALU | BPF_RSH | BPF_K:
 			if (insn->imm >= 32 || insn->imm < 0) {
-				fprintf(stderr, "Error: Right shift by %d undefined.\n",
-					insn->imm);
-				ret = -1;
+				ret = BPF_ERR_SHIFT;
 				goto end;
 			}
 			reg[insn->dst_reg] = (__u64) reg[insn->dst_reg] >> insn->imm;
@@ -317,9 +527,7 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			break;
 		case BPF_ALU | BPF_RSH | BPF_X:
 			if (reg[insn->src_reg] >= 32 || reg[insn->src_reg] < 0) {
-				fprintf(stderr, "Error: Right shift by %lld undefined.\n",
-					reg[insn->src_reg]);
-				ret = -1;
+				ret = BPF_ERR_SHIFT;
 				goto end;
 			}
 			reg[insn->dst_reg] = (__u64) reg[insn->dst_reg] >> reg[insn->src_reg];
@@ -333,8 +541,7 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			break;
 		case BPF_ALU | BPF_MOD | BPF_K:
 			if (insn->imm <= 0) {
-				fprintf(stderr, "Error: Modulo by %d\n", insn->imm);
-				ret = -1;
+				ret = BPF_ERR_MODULO;
 				goto end;
 			}
 			reg[insn->dst_reg] %= insn->imm;
@@ -343,11 +550,10 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			break;
 		case BPF_ALU | BPF_MOD | BPF_X:
 			if (reg[insn->src_reg] <= 0) {
-				fprintf(stderr, "Error: Modulo by %lld\n", reg[insn->src_reg]);
-				ret = -1;
+				ret = BPF_ERR_MODULO;
 				goto end;
 			}
-			reg[insn->dst_reg] %= insn->imm;
+			reg[insn->dst_reg] %= reg[insn->src_reg];
 			reg[insn->dst_reg] = (__u32) reg[insn->dst_reg];
 			pc++;
 			break;
@@ -362,7 +568,7 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			pc++;
 			break;
 		case BPF_ALU | BPF_MOV | BPF_K:
-			reg[insn->dst_reg] = insn->imm;
+			reg[insn->dst_reg] = (__u32) insn->imm;
 			pc++;
 			break;
 		case BPF_ALU | BPF_MOV | BPF_X:
@@ -372,9 +578,7 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			break;
 		case BPF_ALU | BPF_ARSH | BPF_K:
 			if (insn->imm >= 32 || insn->imm < 0) {
-				fprintf(stderr, "Error: Right shift by %d undefined.\n",
-					insn->imm);
-				ret = -1;
+				ret = BPF_ERR_SHIFT;
 				goto end;
 			}
 			reg[insn->dst_reg] = reg[insn->dst_reg] >> insn->imm;
@@ -383,9 +587,7 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			break;
 		case BPF_ALU | BPF_ARSH | BPF_X:
 			if (reg[insn->src_reg] >= 32 || reg[insn->src_reg] < 0) {
-				fprintf(stderr, "Error: Right shift by %lld undefined.\n",
-					reg[insn->src_reg]);
-				ret = -1;
+				ret = BPF_ERR_SHIFT;
 				goto end;
 			}
 			reg[insn->dst_reg] = reg[insn->dst_reg] >> reg[insn->src_reg];
@@ -419,20 +621,19 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			break;
 		case BPF_ALU64 | BPF_DIV | BPF_K:
 			if (!insn->imm) {
-				fprintf(stderr, "Error: divide by 0\n");
-				ret = -1;
+				ret = BPF_ERR_DIV_BY_ZERO;
 				goto end;
 			}
-			reg[insn->dst_reg] /= insn->imm;
+			reg[insn->dst_reg] = bpf_sdiv(reg[insn->dst_reg], insn->imm);
 			pc++;
 			break;
 		case BPF_ALU64 | BPF_DIV | BPF_X:
 			if (!reg[insn->src_reg]) {
-				fprintf(stderr, "Error: Divide by 0\n");
-				ret = -1;
+				ret = BPF_ERR_DIV_BY_ZERO;
 				goto end;
 			}
-			reg[insn->dst_reg] /= reg[insn->src_reg];
+			reg[insn->dst_reg] = bpf_sdiv(reg[insn->dst_reg],
+				reg[insn->src_reg]);
 			pc++;
 			break;
 		case BPF_ALU64 | BPF_OR | BPF_K:
@@ -452,40 +653,32 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			pc++;
 			break;
 		case BPF_ALU64 | BPF_LSH | BPF_K:
-			if (insn->imm >= 32 || insn->imm < 0) {
-				fprintf(stderr, "Error: Left shift by %d undefined.\n",
-					insn->imm);
-				ret = -1;
+			if (insn->imm >= 64 || insn->imm < 0) {
+				ret = BPF_ERR_SHIFT;
 				goto end;
 			}
 			reg[insn->dst_reg] = (__u64) reg[insn->dst_reg] << insn->imm;
 			pc++;
 			break;
 		case BPF_ALU64 | BPF_LSH | BPF_X:
-			if (reg[insn->src_reg] >= 32 || reg[insn->src_reg] < 0) {
-				fprintf(stderr, "Error: Left shift by %lld undefined.\n",
-					reg[insn->src_reg]);
-				ret = -1;
+			if (reg[insn->src_reg] >= 64 || reg[insn->src_reg] < 0) {
+				ret = BPF_ERR_SHIFT;
 				goto end;
 			}
 			reg[insn->dst_reg] = (__u64) reg[insn->dst_reg] << reg[insn->src_reg];
 			pc++;
 			break;
 		case BPF_ALU64 | BPF_RSH | BPF_K:
-			if (insn->imm >= 32 || insn->imm < 0) {
-				fprintf(stderr, "Error: Right shift by %d undefined.\n",
-					insn->imm);
-				ret = -1;
+			if (insn->imm >= 64 || insn->imm < 0) {
+				ret = BPF_ERR_SHIFT;
 				goto end;
 			}
 			reg[insn->dst_reg] = (__u64) reg[insn->dst_reg] >> insn->imm;
 			pc++;
 			break;
 		case BPF_ALU64 | BPF_RSH | BPF_X:
-			if (reg[insn->src_reg] >= 32 || reg[insn->src_reg] < 0) {
-				fprintf(stderr, "Error: Right shift by %lld undefined.\n",
-					reg[insn->src_reg]);
-				ret = -1;
+			if (reg[insn->src_reg] >= 64 || reg[insn->src_reg] < 0) {
+				ret = BPF_ERR_SHIFT;
 				goto end;
 			}
 			reg[insn->dst_reg] = (__u64) reg[insn->dst_reg] >> reg[insn->src_reg];
@@ -497,8 +690,7 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			break;
 		case BPF_ALU64 | BPF_MOD | BPF_K:
 			if (insn->imm <= 0) {
-				fprintf(stderr, "Error: modulo by %d\n", insn->imm);
-				ret = -1;
+				ret = BPF_ERR_MODULO;
 				goto end;
 			}
 			reg[insn->dst_reg] %= insn->imm;
@@ -506,11 +698,10 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			break;
 		case BPF_ALU64 | BPF_MOD | BPF_X:
 			if (reg[insn->src_reg] <= 0) {
-				fprintf(stderr, "Error: modulo by %lld\n", reg[insn->src_reg]);
-				ret = -1;
+				ret = BPF_ERR_MODULO;
 				goto end;
 			}
-			reg[insn->dst_reg] %= insn->imm;
+			reg[insn->dst_reg] %= reg[insn->src_reg];
 			pc++;
 			break;
 		case BPF_ALU64 | BPF_XOR | BPF_K:
@@ -530,20 +721,16 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			pc++;
 			break;
 		case BPF_ALU64 | BPF_ARSH | BPF_K:
-			if (insn->imm >= 32 || insn->imm < 0) {
-				fprintf(stderr, "Error: Right shift by %d undefined.\n",
-					insn->imm);
-				ret = -1;
+			if (insn->imm >= 64 || insn->imm < 0) {
+				ret = BPF_ERR_SHIFT;
 				goto end;
 			}
 			reg[insn->dst_reg] = reg[insn->dst_reg] >> insn->imm;
 			pc++;
 			break;
 		case BPF_ALU64 | BPF_ARSH | BPF_X:
-			if (reg[insn->src_reg] >= 32 || reg[insn->src_reg] < 0) {
-				fprintf(stderr, "Error: Right shift by %lld undefined.\n",
-					reg[insn->src_reg]);
-				ret = -1;
+			if (reg[insn->src_reg] >= 64 || reg[insn->src_reg] < 0) {
+				ret = BPF_ERR_SHIFT;
 				goto end;
 			}
 			reg[insn->dst_reg] = reg[insn->dst_reg] >> reg[insn->src_reg];
@@ -585,11 +772,13 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			pc++;
 			break;
 		case BPF_JMP | BPF_JSET | BPF_K:
-			/* TODO */
+			if ((__u64) reg[insn->dst_reg] & (__u64) insn->imm)
+				pc += insn->off;
 			pc++;
 			break;
 		case BPF_JMP | BPF_JSET | BPF_X:
-			/* TODO */
+			if ((__u64) reg[insn->dst_reg] & (__u64) reg[insn->src_reg])
+				pc += insn->off;
 			pc++;
 			break;
 		case BPF_JMP | BPF_JNE | BPF_K:
@@ -666,6 +855,7 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 		case BPF_JMP32 | BPF_JA:
 			pc += insn->off;
 			pc++;
+			break;
 		case BPF_JMP32 | BPF_JEQ | BPF_K:
 			if ((__u32) reg[insn->dst_reg] == (__u32) insn->imm)
 				pc += insn->off;
@@ -697,11 +887,13 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			pc++;
 			break;
 		case BPF_JMP32 | BPF_JSET | BPF_K:
-			/* TODO */
+			if ((__u32) reg[insn->dst_reg] & (__u32) insn->imm)
+				pc += insn->off;
 			pc++;
 			break;
 		case BPF_JMP32 | BPF_JSET | BPF_X:
-			/* TODO */
+			if ((__u32) reg[insn->dst_reg] & (__u32) reg[insn->src_reg])
+				pc += insn->off;
 			pc++;
 			break;
 		case BPF_JMP32 | BPF_JNE | BPF_K:
@@ -775,14 +967,1268 @@ int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
 			pc++;
 			break;
 
+		case BPF_JMP | BPF_CALL:
+		{
+			const struct bpf_helper *helper = bpf_helper_lookup(insn->imm);
+
+			if (!helper) {
+				ret = BPF_ERR_UNSUPPORTED;
+				goto end;
+			}
+			reg[BPF_REG_0] = helper->fn(reg[BPF_REG_1], reg[BPF_REG_2],
+				reg[BPF_REG_3], reg[BPF_REG_4], reg[BPF_REG_5]);
+			pc++;
+			break;
+		}
+		case BPF_JMP | BPF_EXIT:
+			goto end;
+
 		default:
-			fprintf(stderr, "Error: Unsupported insn code %d\n",
-				insn->code);
-			ret = -1;
+			ret = BPF_ERR_UNSUPPORTED;
 			goto end;
 		}
 	}
+	goto end;
+packet_out:
+	reg[BPF_REG_0] = 0;
 end:
-	show_regs(pc, reg, MAX_BPF_REG);
+	if (timed)
+		profile_add(&prof->cycles[block], profile_clock() - start);
+	*pcp = pc;
 	return ret;
 }
+
+int run_bytecode(const struct bpf_insn *bytecode, size_t len, __s64 *reg,
+		size_t *pcp)
+{
+	return switch_engine(bytecode, len, reg, pcp, 0, 0, NULL);
+}
+
+/* Reference engine, updating the execution profile @prof. */
+int run_profiled(const struct bpf_insn *bytecode, size_t len,
+		struct bpf_profile *prof, __s64 *reg, size_t *pcp)
+{
+	return switch_engine(bytecode, len, reg, pcp, 0, 0, prof);
+}
+
+/*
+ * Reference engine, from *@pcp up to the first pc at or above @stop (if
+ * not 0), where it returns BPF_SEGMENT_STOPPED. Registers and memory
+ * are left as is, to resume the run from the same pc.
+ */
+int run_segment(const struct bpf_insn *bytecode, size_t len, __s64 *reg,
+		size_t *pcp, size_t stop)
+{
+	return switch_engine(bytecode, len, reg, pcp, *pcp, stop, NULL);
+}
+
+#ifdef __GNUC__
+/*
+ * Direct-threaded engine: run the pre-decoded form of the bytecode,
+ * dispatching with a computed goto at the end of each handler.
+ *
+ * Falling off the end of the bytecode reaches the BPF_DOP_END
+ * sentinel, and out of range jumps reach BPF_DOP_PC_OVERFLOW, so no
+ * pc bounds check is needed.
+ */
+int run_decoded(const struct bpf_dinsn *insns, size_t len, __s64 *reg,
+		size_t *pcp)
+{
+	static const void *const dispatch[BPF_DOP_MAX] = {
+		[0 ... BPF_DOP_MAX - 1] = &&do_unsupported,
+		[BPF_LD | BPF_W | BPF_IMM] = &&do_ld_w_imm,
+		[BPF_LD | BPF_DW | BPF_IMM] = &&do_ld_dw_imm,
+		[BPF_LD | BPF_W | BPF_ABS] = &&do_ld_w_abs,
+		[BPF_LD | BPF_H | BPF_ABS] = &&do_ld_h_abs,
+		[BPF_LD | BPF_B | BPF_ABS] = &&do_ld_b_abs,
+		[BPF_LD | BPF_W | BPF_IND] = &&do_ld_w_ind,
+		[BPF_LD | BPF_H | BPF_IND] = &&do_ld_h_ind,
+		[BPF_LD | BPF_B | BPF_IND] = &&do_ld_b_ind,
+		[BPF_LDX | BPF_W | BPF_MEM] = &&do_ldx_w_mem,
+		[BPF_LDX | BPF_H | BPF_MEM] = &&do_ldx_h_mem,
+		[BPF_LDX | BPF_B | BPF_MEM] = &&do_ldx_b_mem,
+		[BPF_LDX | BPF_DW | BPF_MEM] = &&do_ldx_dw_mem,
+		[BPF_LDX | BPF_W | BPF_MEM_ACQ_REL] = &&do_ldx_w_mem_acq_rel,
+		[BPF_LDX | BPF_H | BPF_MEM_ACQ_REL] = &&do_ldx_h_mem_acq_rel,
+		[BPF_LDX | BPF_B | BPF_MEM_ACQ_REL] = &&do_ldx_b_mem_acq_rel,
+		[BPF_LDX | BPF_DW | BPF_MEM_ACQ_REL] = &&do_ldx_dw_mem_acq_rel,
+		[BPF_ST | BPF_W | BPF_MEM] = &&do_st_w_mem,
+		[BPF_ST | BPF_H | BPF_MEM] = &&do_st_h_mem,
+		[BPF_ST | BPF_B | BPF_MEM] = &&do_st_b_mem,
+		[BPF_ST | BPF_DW | BPF_MEM] = &&do_st_dw_mem,
+		[BPF_ST | BPF_W | BPF_MEM_ACQ_REL] = &&do_st_w_mem_acq_rel,
+		[BPF_ST | BPF_H | BPF_MEM_ACQ_REL] = &&do_st_h_mem_acq_rel,
+		[BPF_ST | BPF_B | BPF_MEM_ACQ_REL] = &&do_st_b_mem_acq_rel,
+		[BPF_ST | BPF_DW | BPF_MEM_ACQ_REL] = &&do_st_dw_mem_acq_rel,
+		[BPF_STX | BPF_W | BPF_MEM] = &&do_stx_w_mem,
+		[BPF_STX | BPF_H | BPF_MEM] = &&do_stx_h_mem,
+		[BPF_STX | BPF_B | BPF_MEM] = &&do_stx_b_mem,
+		[BPF_STX | BPF_DW | BPF_MEM] = &&do_stx_dw_mem,
+		[BPF_STX | BPF_W | BPF_MEM_ACQ_REL] = &&do_stx_w_mem_acq_rel,
+		[BPF_STX | BPF_H | BPF_MEM_ACQ_REL] = &&do_stx_h_mem_acq_rel,
+		[BPF_STX | BPF_B | BPF_MEM_ACQ_REL] = &&do_stx_b_mem_acq_rel,
+		[BPF_STX | BPF_DW | BPF_MEM_ACQ_REL] = &&do_stx_dw_mem_acq_rel,
+		[BPF_ALU | BPF_ADD | BPF_K] = &&do_alu_add_k,
+		[BPF_ALU | BPF_ADD | BPF_X] = &&do_alu_add_x,
+		[BPF_ALU | BPF_SUB | BPF_K] = &&do_alu_sub_k,
+		[BPF_ALU | BPF_SUB | BPF_X] = &&do_alu_sub_x,
+		[BPF_ALU | BPF_MUL | BPF_K] = &&do_alu_mul_k,
+		[BPF_ALU | BPF_MUL | BPF_X] = &&do_alu_mul_x,
+		[BPF_ALU | BPF_DIV | BPF_K] = &&do_alu_div_k,
+		[BPF_ALU | BPF_DIV | BPF_X] = &&do_alu_div_x,
+		[BPF_ALU | BPF_OR | BPF_K] = &&do_alu_or_k,
+		[BPF_ALU | BPF_OR | BPF_X] = &&do_alu_or_x,
+		[BPF_ALU | BPF_AND | BPF_K] = &&do_alu_and_k,
+		[BPF_ALU | BPF_AND | BPF_X] = &&do_alu_and_x,
+		[BPF_ALU | BPF_LSH | BPF_K] = &&do_alu_lsh_k,
+		[BPF_ALU | BPF_LSH | BPF_X] = &&do_alu_lsh_x,
+		[BPF_ALU | BPF_RSH | BPF_K] = &&do_alu_rsh_k,
+		[BPF_ALU | BPF_RSH | BPF_X] = &&do_alu_rsh_x,
+		[BPF_ALU | BPF_NEG] = &&do_alu_neg,
+		[BPF_ALU | BPF_MOD | BPF_K] = &&do_alu_mod_k,
+		[BPF_ALU | BPF_MOD | BPF_X] = &&do_alu_mod_x,
+		[BPF_ALU | BPF_XOR | BPF_K] = &&do_alu_xor_k,
+		[BPF_ALU | BPF_XOR | BPF_X] = &&do_alu_xor_x,
+		[BPF_ALU | BPF_MOV | BPF_K] = &&do_alu_mov_k,
+		[BPF_ALU | BPF_MOV | BPF_X] = &&do_alu_mov_x,
+		[BPF_ALU | BPF_ARSH | BPF_K] = &&do_alu_arsh_k,
+		[BPF_ALU | BPF_ARSH | BPF_X] = &&do_alu_arsh_x,
+		[BPF_ALU64 | BPF_ADD | BPF_K] = &&do_alu64_add_k,
+		[BPF_ALU64 | BPF_ADD | BPF_X] = &&do_alu64_add_x,
+		[BPF_ALU64 | BPF_SUB | BPF_K] = &&do_alu64_sub_k,
+		[BPF_ALU64 | BPF_SUB | BPF_X] = &&do_alu64_sub_x,
+		[BPF_ALU64 | BPF_MUL | BPF_K] = &&do_alu64_mul_k,
+		[BPF_ALU64 | BPF_MUL | BPF_X] = &&do_alu64_mul_x,
+		[BPF_ALU64 | BPF_DIV | BPF_K] = &&do_alu64_div_k,
+		[BPF_ALU64 | BPF_DIV | BPF_X] = &&do_alu64_div_x,
+		[BPF_ALU64 | BPF_OR | BPF_K] = &&do_alu64_or_k,
+		[BPF_ALU64 | BPF_OR | BPF_X] = &&do_alu64_or_x,
+		[BPF_ALU64 | BPF_AND | BPF_K] = &&do_alu64_and_k,
+		[BPF_ALU64 | BPF_AND | BPF_X] = &&do_alu64_and_x,
+		[BPF_ALU64 | BPF_LSH | BPF_K] = &&do_alu64_lsh_k,
+		[BPF_ALU64 | BPF_LSH | BPF_X] = &&do_alu64_lsh_x,
+		[BPF_ALU64 | BPF_RSH | BPF_K] = &&do_alu64_rsh_k,
+		[BPF_ALU64 | BPF_RSH | BPF_X] = &&do_alu64_rsh_x,
+		[BPF_ALU64 | BPF_NEG] = &&do_alu64_neg,
+		[BPF_ALU64 | BPF_MOD | BPF_K] = &&do_alu64_mod_k,
+		[BPF_ALU64 | BPF_MOD | BPF_X] = &&do_alu64_mod_x,
+		[BPF_ALU64 | BPF_XOR | BPF_K] = &&do_alu64_xor_k,
+		[BPF_ALU64 | BPF_XOR | BPF_X] = &&do_alu64_xor_x,
+		[BPF_ALU64 | BPF_MOV | BPF_K] = &&do_alu64_mov_k,
+		[BPF_ALU64 | BPF_MOV | BPF_X] = &&do_alu64_mov_x,
+		[BPF_ALU64 | BPF_ARSH | BPF_K] = &&do_alu64_arsh_k,
+		[BPF_ALU64 | BPF_ARSH | BPF_X] = &&do_alu64_arsh_x,
+		[BPF_JMP | BPF_JA] = &&do_jmp_ja,
+		[BPF_JMP | BPF_JEQ | BPF_K] = &&do_jmp_jeq_k,
+		[BPF_JMP | BPF_JEQ | BPF_X] = &&do_jmp_jeq_x,
+		[BPF_JMP | BPF_JGT | BPF_K] = &&do_jmp_jgt_k,
+		[BPF_JMP | BPF_JGT | BPF_X] = &&do_jmp_jgt_x,
+		[BPF_JMP | BPF_JGE | BPF_K] = &&do_jmp_jge_k,
+		[BPF_JMP | BPF_JGE | BPF_X] = &&do_jmp_jge_x,
+		[BPF_JMP | BPF_JSET | BPF_K] = &&do_jmp_jset_k,
+		[BPF_JMP | BPF_JSET | BPF_X] = &&do_jmp_jset_x,
+		[BPF_JMP | BPF_JNE | BPF_K] = &&do_jmp_jne_k,
+		[BPF_JMP | BPF_JNE | BPF_X] = &&do_jmp_jne_x,
+		[BPF_JMP | BPF_JLT | BPF_K] = &&do_jmp_jlt_k,
+		[BPF_JMP | BPF_JLT | BPF_X] = &&do_jmp_jlt_x,
+		[BPF_JMP | BPF_JLE | BPF_K] = &&do_jmp_jle_k,
+		[BPF_JMP | BPF_JLE | BPF_X] = &&do_jmp_jle_x,
+		[BPF_JMP | BPF_JSGT | BPF_K] = &&do_jmp_jsgt_k,
+		[BPF_JMP | BPF_JSGT | BPF_X] = &&do_jmp_jsgt_x,
+		[BPF_JMP | BPF_JSGE | BPF_K] = &&do_jmp_jsge_k,
+		[BPF_JMP | BPF_JSGE | BPF_X] = &&do_jmp_jsge_x,
+		[BPF_JMP | BPF_JSLT | BPF_K] = &&do_jmp_jslt_k,
+		[BPF_JMP | BPF_JSLT | BPF_X] = &&do_jmp_jslt_x,
+		[BPF_JMP | BPF_JSLE | BPF_K] = &&do_jmp_jsle_k,
+		[BPF_JMP | BPF_JSLE | BPF_X] = &&do_jmp_jsle_x,
+		[BPF_JMP32 | BPF_JA] = &&do_jmp32_ja,
+		[BPF_JMP32 | BPF_JEQ | BPF_K] = &&do_jmp32_jeq_k,
+		[BPF_JMP32 | BPF_JEQ | BPF_X] = &&do_jmp32_jeq_x,
+		[BPF_JMP32 | BPF_JGT | BPF_K] = &&do_jmp32_jgt_k,
+		[BPF_JMP32 | BPF_JGT | BPF_X] = &&do_jmp32_jgt_x,
+		[BPF_JMP32 | BPF_JGE | BPF_K] = &&do_jmp32_jge_k,
+		[BPF_JMP32 | BPF_JGE | BPF_X] = &&do_jmp32_jge_x,
+		[BPF_JMP32 | BPF_JSET | BPF_K] = &&do_jmp32_jset_k,
+		[BPF_JMP32 | BPF_JSET | BPF_X] = &&do_jmp32_jset_x,
+		[BPF_JMP32 | BPF_JNE | BPF_K] = &&do_jmp32_jne_k,
+		[BPF_JMP32 | BPF_JNE | BPF_X] = &&do_jmp32_jne_x,
+		[BPF_JMP32 | BPF_JLT | BPF_K] = &&do_jmp32_jlt_k,
+		[BPF_JMP32 | BPF_JLT | BPF_X] = &&do_jmp32_jlt_x,
+		[BPF_JMP32 | BPF_JLE | BPF_K] = &&do_jmp32_jle_k,
+		[BPF_JMP32 | BPF_JLE | BPF_X] = &&do_jmp32_jle_x,
+		[BPF_JMP32 | BPF_JSGT | BPF_K] = &&do_jmp32_jsgt_k,
+		[BPF_JMP32 | BPF_JSGT | BPF_X] = &&do_jmp32_jsgt_x,
+		[BPF_JMP32 | BPF_JSGE | BPF_K] = &&do_jmp32_jsge_k,
+		[BPF_JMP32 | BPF_JSGE | BPF_X] = &&do_jmp32_jsge_x,
+		[BPF_JMP32 | BPF_JSLT | BPF_K] = &&do_jmp32_jslt_k,
+		[BPF_JMP32 | BPF_JSLT | BPF_X] = &&do_jmp32_jslt_x,
+		[BPF_JMP32 | BPF_JSLE | BPF_K] = &&do_jmp32_jsle_k,
+		[BPF_JMP32 | BPF_JSLE | BPF_X] = &&do_jmp32_jsle_x,
+		[BPF_JMP | BPF_CALL] = &&do_jmp_call,
+		[BPF_JMP | BPF_EXIT] = &&do_jmp_exit,
+		[BPF_DOP_END] = &&do_end,
+		[BPF_DOP_PC_OVERFLOW] = &&do_pc_overflow,
+		[BPF_DOP_ATOMIC_W + BPF_AOP_ADD] = &&do_atomic_w_add,
+		[BPF_DOP_ATOMIC_W + BPF_AOP_OR] = &&do_atomic_w_or,
+		[BPF_DOP_ATOMIC_W + BPF_AOP_AND] = &&do_atomic_w_and,
+		[BPF_DOP_ATOMIC_W + BPF_AOP_XOR] = &&do_atomic_w_xor,
+		[BPF_DOP_ATOMIC_W + BPF_AOP_FETCH_ADD] = &&do_atomic_w_fetch_add,
+		[BPF_DOP_ATOMIC_W + BPF_AOP_FETCH_OR] = &&do_atomic_w_fetch_or,
+		[BPF_DOP_ATOMIC_W + BPF_AOP_FETCH_AND] = &&do_atomic_w_fetch_and,
+		[BPF_DOP_ATOMIC_W + BPF_AOP_FETCH_XOR] = &&do_atomic_w_fetch_xor,
+		[BPF_DOP_ATOMIC_W + BPF_AOP_XCHG] = &&do_atomic_w_xchg,
+		[BPF_DOP_ATOMIC_W + BPF_AOP_CMPXCHG] = &&do_atomic_w_cmpxchg,
+		[BPF_DOP_ATOMIC_DW + BPF_AOP_ADD] = &&do_atomic_dw_add,
+		[BPF_DOP_ATOMIC_DW + BPF_AOP_OR] = &&do_atomic_dw_or,
+		[BPF_DOP_ATOMIC_DW + BPF_AOP_AND] = &&do_atomic_dw_and,
+		[BPF_DOP_ATOMIC_DW + BPF_AOP_XOR] = &&do_atomic_dw_xor,
+		[BPF_DOP_ATOMIC_DW + BPF_AOP_FETCH_ADD] = &&do_atomic_dw_fetch_add,
+		[BPF_DOP_ATOMIC_DW + BPF_AOP_FETCH_OR] = &&do_atomic_dw_fetch_or,
+		[BPF_DOP_ATOMIC_DW + BPF_AOP_FETCH_AND] = &&do_atomic_dw_fetch_and,
+		[BPF_DOP_ATOMIC_DW + BPF_AOP_FETCH_XOR] = &&do_atomic_dw_fetch_xor,
+		[BPF_DOP_ATOMIC_DW + BPF_AOP_XCHG] = &&do_atomic_dw_xchg,
+		[BPF_DOP_ATOMIC_DW + BPF_AOP_CMPXCHG] = &&do_atomic_dw_cmpxchg,
+		[BPF_DOP_FUSED + BPF_FUSE_LDX_B_JEQ_K] = &&do_fused_ldx_b_jeq_k,
+		[BPF_DOP_FUSED + BPF_FUSE_LDX_H_JEQ_K] = &&do_fused_ldx_h_jeq_k,
+		[BPF_DOP_FUSED + BPF_FUSE_LDX_W_JEQ_K] = &&do_fused_ldx_w_jeq_k,
+		[BPF_DOP_FUSED + BPF_FUSE_LDX_DW_JEQ_K] = &&do_fused_ldx_dw_jeq_k,
+		[BPF_DOP_FUSED + BPF_FUSE_LDX_B_JNE_K] = &&do_fused_ldx_b_jne_k,
+		[BPF_DOP_FUSED + BPF_FUSE_LDX_H_JNE_K] = &&do_fused_ldx_h_jne_k,
+		[BPF_DOP_FUSED + BPF_FUSE_LDX_W_JNE_K] = &&do_fused_ldx_w_jne_k,
+		[BPF_DOP_FUSED + BPF_FUSE_LDX_DW_JNE_K] = &&do_fused_ldx_dw_jne_k,
+		[BPF_DOP_FUSED + BPF_FUSE_MOV_ADD_K] = &&do_fused_mov_add_k,
+		[BPF_DOP_FUSED + BPF_FUSE_MOV_AND_K] = &&do_fused_mov_and_k,
+		[BPF_DOP_FUSED + BPF_FUSE_MOV_OR_K] = &&do_fused_mov_or_k,
+		[BPF_DOP_FUSED + BPF_FUSE_MOV_XOR_K] = &&do_fused_mov_xor_k,
+		[BPF_DOP_FUSED + BPF_FUSE_MOV_LSH_K] = &&do_fused_mov_lsh_k,
+		[BPF_DOP_FUSED + BPF_FUSE_MOV_RSH_K] = &&do_fused_mov_rsh_k,
+		[BPF_DOP_FUSED + BPF_FUSE_LD_IMM64_JEQ_X] = &&do_fused_ld_imm64_jeq_x,
+		[BPF_DOP_FUSED + BPF_FUSE_LD_IMM64_JNE_X] = &&do_fused_ld_imm64_jne_x,
+		[BPF_DOP_FUSED + BPF_FUSE_LD_IMM64_ADD_X] = &&do_fused_ld_imm64_add_x,
+		[BPF_DOP_FUSED + BPF_FUSE_LD_IMM64_AND_X] = &&do_fused_ld_imm64_and_x,
+		[BPF_DOP_FUSED + BPF_FUSE_LD_IMM64_OR_X] = &&do_fused_ld_imm64_or_x,
+		[BPF_DOP_FUSED + BPF_FUSE_LD_IMM64_XOR_X] = &&do_fused_ld_imm64_xor_x,
+	};
+	const struct bpf_dinsn *insn = insns;
+	int ret = 0;
+
+#define DISPATCH()	goto *dispatch[insn->op]
+
+#define BRANCH()							\
+	do {								\
+		insn = insns + insn->target;				\
+		DISPATCH();						\
+	} while (0)
+
+	DISPATCH();
+
+	/* Load from immediate. */
+do_ld_w_imm:
+	reg[insn->dst] = insn->imm;
+	insn++;
+	DISPATCH();
+do_ld_dw_imm:
+	reg[insn->dst] = insn->imm;
+	insn += 2;	/* Skip next insn. */
+	DISPATCH();
+
+	/* Load from packet, exit with r0 = 0 out of it. */
+do_ld_w_abs:
+	if (!packet_load_abs(reg, insn, 4, &reg[BPF_REG_0]))
+		goto packet_out;
+	insn++;
+	DISPATCH();
+do_ld_h_abs:
+	if (!packet_load_abs(reg, insn, 2, &reg[BPF_REG_0]))
+		goto packet_out;
+	insn++;
+	DISPATCH();
+do_ld_b_abs:
+	if (!packet_load_abs(reg, insn, 1, &reg[BPF_REG_0]))
+		goto packet_out;
+	insn++;
+	DISPATCH();
+do_ld_w_ind:
+	if (!packet_load(reg, reg[insn->src] + insn->imm, 4, &reg[BPF_REG_0]))
+		goto packet_out;
+	insn++;
+	DISPATCH();
+do_ld_h_ind:
+	if (!packet_load(reg, reg[insn->src] + insn->imm, 2, &reg[BPF_REG_0]))
+		goto packet_out;
+	insn++;
+	DISPATCH();
+do_ld_b_ind:
+	if (!packet_load(reg, reg[insn->src] + insn->imm, 1, &reg[BPF_REG_0]))
+		goto packet_out;
+	insn++;
+	DISPATCH();
+
+	/* Load from address. */
+do_ldx_w_mem:
+	reg[insn->dst] = *(__u32 *) (reg[insn->src] + insn->off);
+	insn++;
+	DISPATCH();
+do_ldx_h_mem:
+	reg[insn->dst] = *(__u16 *) (reg[insn->src] + insn->off);
+	insn++;
+	DISPATCH();
+do_ldx_b_mem:
+	reg[insn->dst] = *(__u8 *) (reg[insn->src] + insn->off);
+	insn++;
+	DISPATCH();
+do_ldx_dw_mem:
+	reg[insn->dst] = *(__u64 *) (reg[insn->src] + insn->off);
+	insn++;
+	DISPATCH();
+
+	/* Load from address with acquire semantic. */
+do_ldx_w_mem_acq_rel:
+	reg[insn->dst] = __atomic_load_n((__u32 *) (reg[insn->src] + insn->off),
+		__ATOMIC_ACQUIRE);
+	insn++;
+	DISPATCH();
+do_ldx_h_mem_acq_rel:
+	reg[insn->dst] = __atomic_load_n((__u16 *) (reg[insn->src] + insn->off),
+		__ATOMIC_ACQUIRE);
+	insn++;
+	DISPATCH();
+do_ldx_b_mem_acq_rel:
+	reg[insn->dst] = __atomic_load_n((__u8 *) (reg[insn->src] + insn->off),
+		__ATOMIC_ACQUIRE);
+	insn++;
+	DISPATCH();
+do_ldx_dw_mem_acq_rel:
+	reg[insn->dst] = __atomic_load_n((__u64 *) (reg[insn->src] + insn->off),
+		__ATOMIC_ACQUIRE);
+	insn++;
+	DISPATCH();
+
+	/* Store from immediate to address. */
+do_st_w_mem:
+	*(__u32 *) (reg[insn->dst] + insn->off) = insn->imm;
+	insn++;
+	DISPATCH();
+do_st_h_mem:
+	*(__u16 *) (reg[insn->dst] + insn->off) = insn->imm;
+	insn++;
+	DISPATCH();
+do_st_b_mem:
+	*(__u8 *) (reg[insn->dst] + insn->off) = insn->imm;
+	insn++;
+	DISPATCH();
+do_st_dw_mem:
+	*(__u64 *) (reg[insn->dst] + insn->off) = insn->imm;
+	insn++;
+	DISPATCH();
+
+	/* Store from immediate to address with release semantic. */
+do_st_w_mem_acq_rel:
+	__atomic_store_n((__u32 *) (reg[insn->dst] + insn->off), insn->imm,
+		__ATOMIC_RELEASE);
+	insn++;
+	DISPATCH();
+do_st_h_mem_acq_rel:
+	__atomic_store_n((__u16 *) (reg[insn->dst] + insn->off), insn->imm,
+		__ATOMIC_RELEASE);
+	insn++;
+	DISPATCH();
+do_st_b_mem_acq_rel:
+	__atomic_store_n((__u8 *) (reg[insn->dst] + insn->off), insn->imm,
+		__ATOMIC_RELEASE);
+	insn++;
+	DISPATCH();
+do_st_dw_mem_acq_rel:
+	__atomic_store_n((__u64 *) (reg[insn->dst] + insn->off), insn->imm,
+		__ATOMIC_RELEASE);
+	insn++;
+	DISPATCH();
+
+	/* Store from register to address. */
+do_stx_w_mem:
+	*(__u32 *) (reg[insn->dst] + insn->off) = reg[insn->src];
+	insn++;
+	DISPATCH();
+do_stx_h_mem:
+	*(__u16 *) (reg[insn->dst] + insn->off) = reg[insn->src];
+	insn++;
+	DISPATCH();
+do_stx_b_mem:
+	*(__u8 *) (reg[insn->dst] + insn->off) = reg[insn->src];
+	insn++;
+	DISPATCH();
+do_stx_dw_mem:
+	*(__u64 *) (reg[insn->dst] + insn->off) = reg[insn->src];
+	insn++;
+	DISPATCH();
+
+	/* Store from register to address with release semantic. */
+do_stx_w_mem_acq_rel:
+	__atomic_store_n((__u32 *) (reg[insn->dst] + insn->off), reg[insn->src],
+		__ATOMIC_RELEASE);
+	insn++;
+	DISPATCH();
+do_stx_h_mem_acq_rel:
+	__atomic_store_n((__u16 *) (reg[insn->dst] + insn->off), reg[insn->src],
+		__ATOMIC_RELEASE);
+	insn++;
+	DISPATCH();
+do_stx_b_mem_acq_rel:
+	__atomic_store_n((__u8 *) (reg[insn->dst] + insn->off), reg[insn->src],
+		__ATOMIC_RELEASE);
+	insn++;
+	DISPATCH();
+do_stx_dw_mem_acq_rel:
+	__atomic_store_n((__u64 *) (reg[insn->dst] + insn->off), reg[insn->src],
+		__ATOMIC_RELEASE);
+	insn++;
+	DISPATCH();
+
+	/* Atomic read-modify-write, 32-bit. */
+do_atomic_w_add:
+	__atomic_fetch_add((__u32 *) (reg[insn->dst] + insn->off), reg[insn->src],
+		__ATOMIC_RELAXED);
+	insn++;
+	DISPATCH();
+do_atomic_w_or:
+	__atomic_fetch_or((__u32 *) (reg[insn->dst] + insn->off), reg[insn->src],
+		__ATOMIC_RELAXED);
+	insn++;
+	DISPATCH();
+do_atomic_w_and:
+	__atomic_fetch_and((__u32 *) (reg[insn->dst] + insn->off), reg[insn->src],
+		__ATOMIC_RELAXED);
+	insn++;
+	DISPATCH();
+do_atomic_w_xor:
+	__atomic_fetch_xor((__u32 *) (reg[insn->dst] + insn->off), reg[insn->src],
+		__ATOMIC_RELAXED);
+	insn++;
+	DISPATCH();
+do_atomic_w_fetch_add:
+	reg[insn->src] = __atomic_fetch_add((__u32 *) (reg[insn->dst] + insn->off),
+		reg[insn->src], __ATOMIC_SEQ_CST);
+	insn++;
+	DISPATCH();
+do_atomic_w_fetch_or:
+	reg[insn->src] = __atomic_fetch_or((__u32 *) (reg[insn->dst] + insn->off),
+		reg[insn->src], __ATOMIC_SEQ_CST);
+	insn++;
+	DISPATCH();
+do_atomic_w_fetch_and:
+	reg[insn->src] = __atomic_fetch_and((__u32 *) (reg[insn->dst] + insn->off),
+		reg[insn->src], __ATOMIC_SEQ_CST);
+	insn++;
+	DISPATCH();
+do_atomic_w_fetch_xor:
+	reg[insn->src] = __atomic_fetch_xor((__u32 *) (reg[insn->dst] + insn->off),
+		reg[insn->src], __ATOMIC_SEQ_CST);
+	insn++;
+	DISPATCH();
+do_atomic_w_xchg:
+	reg[insn->src] = __atomic_exchange_n((__u32 *) (reg[insn->dst] + insn->off),
+		reg[insn->src], __ATOMIC_SEQ_CST);
+	insn++;
+	DISPATCH();
+do_atomic_w_cmpxchg:
+{
+	__u32 old = reg[BPF_REG_0];
+
+	__atomic_compare_exchange_n((__u32 *) (reg[insn->dst] + insn->off), &old,
+		reg[insn->src], false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	reg[BPF_REG_0] = old;
+	insn++;
+	DISPATCH();
+}
+
+	/* Atomic read-modify-write, 64-bit. */
+do_atomic_dw_add:
+	__atomic_fetch_add((__u64 *) (reg[insn->dst] + insn->off), reg[insn->src],
+		__ATOMIC_RELAXED);
+	insn++;
+	DISPATCH();
+do_atomic_dw_or:
+	__atomic_fetch_or((__u64 *) (reg[insn->dst] + insn->off), reg[insn->src],
+		__ATOMIC_RELAXED);
+	insn++;
+	DISPATCH();
+do_atomic_dw_and:
+	__atomic_fetch_and((__u64 *) (reg[insn->dst] + insn->off), reg[insn->src],
+		__ATOMIC_RELAXED);
+	insn++;
+	DISPATCH();
+do_atomic_dw_xor:
+	__atomic_fetch_xor((__u64 *) (reg[insn->dst] + insn->off), reg[insn->src],
+		__ATOMIC_RELAXED);
+	insn++;
+	DISPATCH();
+do_atomic_dw_fetch_add:
+	reg[insn->src] = __atomic_fetch_add((__u64 *) (reg[insn->dst] + insn->off),
+		reg[insn->src], __ATOMIC_SEQ_CST);
+	insn++;
+	DISPATCH();
+do_atomic_dw_fetch_or:
+	reg[insn->src] = __atomic_fetch_or((__u64 *) (reg[insn->dst] + insn->off),
+		reg[insn->src], __ATOMIC_SEQ_CST);
+	insn++;
+	DISPATCH();
+do_atomic_dw_fetch_and:
+	reg[insn->src] = __atomic_fetch_and((__u64 *) (reg[insn->dst] + insn->off),
+		reg[insn->src], __ATOMIC_SEQ_CST);
+	insn++;
+	DISPATCH();
+do_atomic_dw_fetch_xor:
+	reg[insn->src] = __atomic_fetch_xor((__u64 *) (reg[insn->dst] + insn->off),
+		reg[insn->src], __ATOMIC_SEQ_CST);
+	insn++;
+	DISPATCH();
+do_atomic_dw_xchg:
+	reg[insn->src] = __atomic_exchange_n((__u64 *) (reg[insn->dst] + insn->off),
+		reg[insn->src], __ATOMIC_SEQ_CST);
+	insn++;
+	DISPATCH();
+do_atomic_dw_cmpxchg:
+{
+	__u64 old = reg[BPF_REG_0];
+
+	__atomic_compare_exchange_n((__u64 *) (reg[insn->dst] + insn->off), &old,
+		reg[insn->src], false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	reg[BPF_REG_0] = old;
+	insn++;
+	DISPATCH();
+}
+
+do_alu_add_k:
+	reg[insn->dst] += insn->imm;
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_add_x:
+	reg[insn->dst] += reg[insn->src];
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_sub_k:
+	reg[insn->dst] -= insn->imm;
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_sub_x:
+	reg[insn->dst] -= reg[insn->src];
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_mul_k:
+	reg[insn->dst] *= insn->imm;
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_mul_x:
+	reg[insn->dst] *= reg[insn->src];
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_div_k:
+	if (!insn->imm) {
+		ret = BPF_ERR_DIV_BY_ZERO;
+		goto end;
+	}
+	reg[insn->dst] = bpf_sdiv(reg[insn->dst], insn->imm);
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_div_x:
+	if (!reg[insn->src]) {
+		ret = BPF_ERR_DIV_BY_ZERO;
+		goto end;
+	}
+	reg[insn->dst] = bpf_sdiv(reg[insn->dst], reg[insn->src]);
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_or_k:
+	reg[insn->dst] |= insn->imm;
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_or_x:
+	reg[insn->dst] |= reg[insn->src];
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_and_k:
+	reg[insn->dst] &= insn->imm;
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_and_x:
+	reg[insn->dst] &= reg[insn->src];
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_lsh_k:
+	if (insn->imm >= 32 || insn->imm < 0) {
+		ret = BPF_ERR_SHIFT;
+		goto end;
+	}
+	reg[insn->dst] = (__u64) reg[insn->dst] << insn->imm;
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_lsh_x:
+	if (reg[insn->src] >= 32 || reg[insn->src] < 0) {
+		ret = BPF_ERR_SHIFT;
+		goto end;
+	}
+	reg[insn->dst] = (__u64) reg[insn->dst] << reg[insn->src];
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_rsh_k:
+	if (insn->imm >= 32 || insn->imm < 0) {
+		ret = BPF_ERR_SHIFT;
+		goto end;
+	}
+	reg[insn->dst] = (__u64) reg[insn->dst] >> insn->imm;
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_rsh_x:
+	if (reg[insn->src] >= 32 || reg[insn->src] < 0) {
+		ret = BPF_ERR_SHIFT;
+		goto end;
+	}
+	reg[insn->dst] = (__u64) reg[insn->dst] >> reg[insn->src];
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_neg:
+	reg[insn->dst] = -reg[insn->dst];
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_mod_k:
+	if (insn->imm <= 0) {
+		ret = BPF_ERR_MODULO;
+		goto end;
+	}
+	reg[insn->dst] %= insn->imm;
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_mod_x:
+	if (reg[insn->src] <= 0) {
+		ret = BPF_ERR_MODULO;
+		goto end;
+	}
+	reg[insn->dst] %= reg[insn->src];
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_xor_k:
+	reg[insn->dst] ^= insn->imm;
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_xor_x:
+	reg[insn->dst] ^= reg[insn->src];
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_mov_k:
+	reg[insn->dst] = (__u32) insn->imm;
+	insn++;
+	DISPATCH();
+do_alu_mov_x:
+	reg[insn->dst] = reg[insn->src];
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_arsh_k:
+	if (insn->imm >= 32 || insn->imm < 0) {
+		ret = BPF_ERR_SHIFT;
+		goto end;
+	}
+	reg[insn->dst] = reg[insn->dst] >> insn->imm;
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu_arsh_x:
+	if (reg[insn->src] >= 32 || reg[insn->src] < 0) {
+		ret = BPF_ERR_SHIFT;
+		goto end;
+	}
+	reg[insn->dst] = reg[insn->dst] >> reg[insn->src];
+	reg[insn->dst] = (__u32) reg[insn->dst];
+	insn++;
+	DISPATCH();
+
+do_alu64_add_k:
+	reg[insn->dst] += insn->imm;
+	insn++;
+	DISPATCH();
+do_alu64_add_x:
+	reg[insn->dst] += reg[insn->src];
+	insn++;
+	DISPATCH();
+do_alu64_sub_k:
+	reg[insn->dst] -= insn->imm;
+	insn++;
+	DISPATCH();
+do_alu64_sub_x:
+	reg[insn->dst] -= reg[insn->src];
+	insn++;
+	DISPATCH();
+do_alu64_mul_k:
+	reg[insn->dst] *= insn->imm;
+	insn++;
+	DISPATCH();
+do_alu64_mul_x:
+	reg[insn->dst] *= reg[insn->src];
+	insn++;
+	DISPATCH();
+do_alu64_div_k:
+	if (!insn->imm) {
+		ret = BPF_ERR_DIV_BY_ZERO;
+		goto end;
+	}
+	reg[insn->dst] = bpf_sdiv(reg[insn->dst], insn->imm);
+	insn++;
+	DISPATCH();
+do_alu64_div_x:
+	if (!reg[insn->src]) {
+		ret = BPF_ERR_DIV_BY_ZERO;
+		goto end;
+	}
+	reg[insn->dst] = bpf_sdiv(reg[insn->dst], reg[insn->src]);
+	insn++;
+	DISPATCH();
+do_alu64_or_k:
+	reg[insn->dst] |= insn->imm;
+	insn++;
+	DISPATCH();
+do_alu64_or_x:
+	reg[insn->dst] |= reg[insn->src];
+	insn++;
+	DISPATCH();
+do_alu64_and_k:
+	reg[insn->dst] &= insn->imm;
+	insn++;
+	DISPATCH();
+do_alu64_and_x:
+	reg[insn->dst] &= reg[insn->src];
+	insn++;
+	DISPATCH();
+do_alu64_lsh_k:
+	if (insn->imm >= 64 || insn->imm < 0) {
+		ret = BPF_ERR_SHIFT;
+		goto end;
+	}
+	reg[insn->dst] = (__u64) reg[insn->dst] << insn->imm;
+	insn++;
+	DISPATCH();
+do_alu64_lsh_x:
+	if (reg[insn->src] >= 64 || reg[insn->src] < 0) {
+		ret = BPF_ERR_SHIFT;
+		goto end;
+	}
+	reg[insn->dst] = (__u64) reg[insn->dst] << reg[insn->src];
+	insn++;
+	DISPATCH();
+do_alu64_rsh_k:
+	if (insn->imm >= 64 || insn->imm < 0) {
+		ret = BPF_ERR_SHIFT;
+		goto end;
+	}
+	reg[insn->dst] = (__u64) reg[insn->dst] >> insn->imm;
+	insn++;
+	DISPATCH();
+do_alu64_rsh_x:
+	if (reg[insn->src] >= 64 || reg[insn->src] < 0) {
+		ret = BPF_ERR_SHIFT;
+		goto end;
+	}
+	reg[insn->dst] = (__u64) reg[insn->dst] >> reg[insn->src];
+	insn++;
+	DISPATCH();
+do_alu64_neg:
+	reg[insn->dst] = -reg[insn->dst];
+	insn++;
+	DISPATCH();
+do_alu64_mod_k:
+	if (insn->imm <= 0) {
+		ret = BPF_ERR_MODULO;
+		goto end;
+	}
+	reg[insn->dst] %= insn->imm;
+	insn++;
+	DISPATCH();
+do_alu64_mod_x:
+	if (reg[insn->src] <= 0) {
+		ret = BPF_ERR_MODULO;
+		goto end;
+	}
+	reg[insn->dst] %= reg[insn->src];
+	insn++;
+	DISPATCH();
+do_alu64_xor_k:
+	reg[insn->dst] ^= insn->imm;
+	insn++;
+	DISPATCH();
+do_alu64_xor_x:
+	reg[insn->dst] ^= reg[insn->src];
+	insn++;
+	DISPATCH();
+do_alu64_mov_k:
+	reg[insn->dst] = insn->imm;
+	insn++;
+	DISPATCH();
+do_alu64_mov_x:
+	reg[insn->dst] = reg[insn->src];
+	insn++;
+	DISPATCH();
+do_alu64_arsh_k:
+	if (insn->imm >= 64 || insn->imm < 0) {
+		ret = BPF_ERR_SHIFT;
+		goto end;
+	}
+	reg[insn->dst] = reg[insn->dst] >> insn->imm;
+	insn++;
+	DISPATCH();
+do_alu64_arsh_x:
+	if (reg[insn->src] >= 64 || reg[insn->src] < 0) {
+		ret = BPF_ERR_SHIFT;
+		goto end;
+	}
+	reg[insn->dst] = reg[insn->dst] >> reg[insn->src];
+	insn++;
+	DISPATCH();
+
+do_jmp_ja:
+	BRANCH();
+do_jmp_jeq_k:
+	if (reg[insn->dst] == insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jeq_x:
+	if (reg[insn->dst] == reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jgt_k:
+	if ((__u64) reg[insn->dst] > (__u64) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jgt_x:
+	if ((__u64) reg[insn->dst] > (__u64) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jge_k:
+	if ((__u64) reg[insn->dst] >= (__u64) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jge_x:
+	if ((__u64) reg[insn->dst] >= (__u64) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jset_k:
+	if ((__u64) reg[insn->dst] & (__u64) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jset_x:
+	if ((__u64) reg[insn->dst] & (__u64) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jne_k:
+	if (reg[insn->dst] != insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jne_x:
+	if (reg[insn->dst] != reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jlt_k:
+	if ((__u64) reg[insn->dst] < (__u64) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jlt_x:
+	if ((__u64) reg[insn->dst] < (__u64) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jle_k:
+	if ((__u64) reg[insn->dst] <= (__u64) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jle_x:
+	if ((__u64) reg[insn->dst] <= (__u64) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jsgt_k:
+	if ((__s64) reg[insn->dst] > (__s64) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jsgt_x:
+	if ((__s64) reg[insn->dst] > (__s64) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jsge_k:
+	if ((__s64) reg[insn->dst] >= (__s64) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jsge_x:
+	if ((__s64) reg[insn->dst] >= (__s64) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jslt_k:
+	if ((__s64) reg[insn->dst] < (__s64) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jslt_x:
+	if ((__s64) reg[insn->dst] < (__s64) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jsle_k:
+	if ((__s64) reg[insn->dst] <= (__s64) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_jsle_x:
+	if ((__s64) reg[insn->dst] <= (__s64) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+
+do_jmp32_ja:
+	BRANCH();
+do_jmp32_jeq_k:
+	if ((__u32) reg[insn->dst] == (__u32) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jeq_x:
+	if ((__u32) reg[insn->dst] == (__u32) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jgt_k:
+	if ((__u32) reg[insn->dst] > (__u32) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jgt_x:
+	if ((__u32) reg[insn->dst] > (__u32) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jge_k:
+	if ((__u32) reg[insn->dst] >= (__u32) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jge_x:
+	if ((__u32) reg[insn->dst] >= (__u32) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jset_k:
+	if ((__u32) reg[insn->dst] & (__u32) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jset_x:
+	if ((__u32) reg[insn->dst] & (__u32) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jne_k:
+	if ((__u32) reg[insn->dst] != (__u32) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jne_x:
+	if ((__u32) reg[insn->dst] != (__u32) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jlt_k:
+	if ((__u32) reg[insn->dst] < (__u32) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jlt_x:
+	if ((__u32) reg[insn->dst] < (__u32) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jle_k:
+	if ((__u32) reg[insn->dst] <= (__u32) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jle_x:
+	if ((__u32) reg[insn->dst] <= (__u32) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jsgt_k:
+	if ((__s32) reg[insn->dst] > (__s32) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jsgt_x:
+	if ((__s32) reg[insn->dst] > (__s32) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jsge_k:
+	if ((__s32) reg[insn->dst] >= (__s32) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jsge_x:
+	if ((__s32) reg[insn->dst] >= (__s32) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jslt_k:
+	if ((__s32) reg[insn->dst] < (__s32) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jslt_x:
+	if ((__s32) reg[insn->dst] < (__s32) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jsle_k:
+	if ((__s32) reg[insn->dst] <= (__s32) insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp32_jsle_x:
+	if ((__s32) reg[insn->dst] <= (__s32) reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_jmp_call:
+	reg[BPF_REG_0] = insn->fn(reg[BPF_REG_1], reg[BPF_REG_2], reg[BPF_REG_3],
+		reg[BPF_REG_4], reg[BPF_REG_5]);
+	insn++;
+	DISPATCH();
+do_jmp_exit:
+	goto end;
+packet_out:
+	reg[BPF_REG_0] = 0;
+	goto end;
+
+	/*
+	 * Superinstructions, see fuse_decoded(). Operands of the second
+	 * instruction are read from its own entry, at insn[1], or insn[2]
+	 * after a 64-bit immediate load.
+	 */
+do_fused_ldx_b_jeq_k:
+	reg[insn->dst] = *(__u8 *) (reg[insn->src] + insn->off);
+	insn++;
+	if (reg[insn->dst] == insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_fused_ldx_b_jne_k:
+	reg[insn->dst] = *(__u8 *) (reg[insn->src] + insn->off);
+	insn++;
+	if (reg[insn->dst] != insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_fused_ldx_h_jeq_k:
+	reg[insn->dst] = *(__u16 *) (reg[insn->src] + insn->off);
+	insn++;
+	if (reg[insn->dst] == insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_fused_ldx_h_jne_k:
+	reg[insn->dst] = *(__u16 *) (reg[insn->src] + insn->off);
+	insn++;
+	if (reg[insn->dst] != insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_fused_ldx_w_jeq_k:
+	reg[insn->dst] = *(__u32 *) (reg[insn->src] + insn->off);
+	insn++;
+	if (reg[insn->dst] == insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_fused_ldx_w_jne_k:
+	reg[insn->dst] = *(__u32 *) (reg[insn->src] + insn->off);
+	insn++;
+	if (reg[insn->dst] != insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_fused_ldx_dw_jeq_k:
+	reg[insn->dst] = *(__u64 *) (reg[insn->src] + insn->off);
+	insn++;
+	if (reg[insn->dst] == insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_fused_ldx_dw_jne_k:
+	reg[insn->dst] = *(__u64 *) (reg[insn->src] + insn->off);
+	insn++;
+	if (reg[insn->dst] != insn->imm)
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_fused_mov_add_k:
+	reg[insn->dst] = reg[insn->src] + insn[1].imm;
+	insn += 2;
+	DISPATCH();
+do_fused_mov_and_k:
+	reg[insn->dst] = reg[insn->src] & insn[1].imm;
+	insn += 2;
+	DISPATCH();
+do_fused_mov_or_k:
+	reg[insn->dst] = reg[insn->src] | insn[1].imm;
+	insn += 2;
+	DISPATCH();
+do_fused_mov_xor_k:
+	reg[insn->dst] = reg[insn->src] ^ insn[1].imm;
+	insn += 2;
+	DISPATCH();
+do_fused_mov_lsh_k:
+	reg[insn->dst] = (__u64) reg[insn->src] << insn[1].imm;
+	insn += 2;
+	DISPATCH();
+do_fused_mov_rsh_k:
+	reg[insn->dst] = (__u64) reg[insn->src] >> insn[1].imm;
+	insn += 2;
+	DISPATCH();
+do_fused_ld_imm64_jeq_x:
+	reg[insn->dst] = insn->imm;
+	insn += 2;
+	if (reg[insn->dst] == reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_fused_ld_imm64_jne_x:
+	reg[insn->dst] = insn->imm;
+	insn += 2;
+	if (reg[insn->dst] != reg[insn->src])
+		BRANCH();
+	insn++;
+	DISPATCH();
+do_fused_ld_imm64_add_x:
+	reg[insn->dst] = insn->imm;
+	reg[insn[2].dst] += reg[insn->dst];
+	insn += 3;
+	DISPATCH();
+do_fused_ld_imm64_and_x:
+	reg[insn->dst] = insn->imm;
+	reg[insn[2].dst] &= reg[insn->dst];
+	insn += 3;
+	DISPATCH();
+do_fused_ld_imm64_or_x:
+	reg[insn->dst] = insn->imm;
+	reg[insn[2].dst] |= reg[insn->dst];
+	insn += 3;
+	DISPATCH();
+do_fused_ld_imm64_xor_x:
+	reg[insn->dst] = insn->imm;
+	reg[insn[2].dst] ^= reg[insn->dst];
+	insn += 3;
+	DISPATCH();
+
+do_unsupported:
+	ret = BPF_ERR_UNSUPPORTED;
+	goto end;
+
+do_pc_overflow:
+	ret = BPF_ERR_PC_OVERFLOW;
+	goto end;
+
+do_end:
+	/* Bytecode terminates. */
+end:
+	*pcp = insn - insns;
+	return ret;
+
+#undef BRANCH
+#undef DISPATCH
+}
+#endif
+
+int interpret_bytecode_engine(const struct bpf_insn *bytecode, size_t len,
+		enum bpf_engine engine)
+{
+	__s64 reg[MAX_BPF_REG];
+	struct bpf_dinsn *insns;
+	struct bpf_jit *jit;
+	size_t pc = 0;
+	int ret;
+
+#ifndef __GNUC__
+	/* Computed goto is unavailable, use the reference engine. */
+	if (engine == BPF_ENGINE_THREADED)
+		engine = BPF_ENGINE_SWITCH;
+#endif
+	clear_regs(reg, MAX_BPF_REG);
+
+	switch (engine) {
+	case BPF_ENGINE_SWITCH:
+		ret = run_bytecode(bytecode, len, reg, &pc);
+		break;
+	case BPF_ENGINE_THREADED:
+		insns = decode_bytecode(bytecode, len);
+		if (!insns)
+			return -1;
+		fuse_decoded(insns, len);
+		ret = run_decoded(insns, len, reg, &pc);
+		free(insns);
+		break;
+	case BPF_ENGINE_JIT:
+		insns = decode_bytecode(bytecode, len);
+		if (!insns)
+			return -1;
+		jit = jit_compile(insns, len);
+		free(insns);
+		if (!jit)
+			return -1;
+		ret = run_jit(jit, reg, &pc);
+		jit_free(jit);
+		break;
+	default:
+		fprintf(stderr, "Error: Unknown engine %d\n", engine);
+		return -1;
+	}
+	if (ret)
+		fprintf(stderr, "Error: %s at pc %zu\n", bpf_strerror(ret), pc);
+	show_regs(pc, reg, MAX_BPF_REG);
+	return ret ? -1 : 0;
+}
+
+int interpret_bytecode(const struct bpf_insn *bytecode, size_t len)
+{
+	return interpret_bytecode_engine(bytecode, len, BPF_DEFAULT_ENGINE);
+}
@@ -0,0 +1,1166 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+
+/* x86-64 register numbers. */
+enum {
+	RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+/*
+ * BPF registers are kept in host registers for the whole program.
+ * r1-r5 match the SysV argument registers, and r6-r10 live in
+ * callee-saved registers.
+ */
+static const int reg_map[MAX_BPF_REG] = {
+	[BPF_REG_0] = RAX,
+	[BPF_REG_1] = RDI,
+	[BPF_REG_2] = RSI,
+	[BPF_REG_3] = RDX,
+	[BPF_REG_4] = RCX,
+	[BPF_REG_5] = R8,
+	[BPF_REG_6] = RBX,
+	[BPF_REG_7] = R13,
+	[BPF_REG_8] = R14,
+	[BPF_REG_9] = R15,
+	[BPF_REG_10] = RBP,
+};
+
+#define AUX_REG		R9	/* register file pointer in prologue/epilogue */
+#define STATUS_REG	R10	/* enum bpf_error on exit */
+#define PC_REG		R11	/* pc on exit */
+#define TMP_REG		R11	/* scratch */
+
+/* Condition codes. */
+enum {
+	CC_B = 0x2,
+	CC_AE = 0x3,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_BE = 0x6,
+	CC_A = 0x7,
+	CC_L = 0xc,
+	CC_GE = 0xd,
+	CC_LE = 0xe,
+	CC_G = 0xf,
+};
+
+/* Group 1 ALU opcode extensions (0x81 /ext). */
+enum {
+	EXT_ADD = 0,
+	EXT_OR = 1,
+	EXT_AND = 4,
+	EXT_SUB = 5,
+	EXT_XOR = 6,
+	EXT_CMP = 7,
+};
+
+/* Group 2 shift opcode extensions (0xc1 / 0xd3 /ext). */
+enum {
+	EXT_SHL = 4,
+	EXT_SHR = 5,
+	EXT_SAR = 7,
+};
+
+enum jit_target_kind {
+	TARGET_INSN,		/* bytecode pc */
+	TARGET_STUB,		/* out-of-line error stub */
+};
+
+struct jit_fixup {
+	size_t pos;		/* offset of the rel32 field */
+	enum jit_target_kind kind;
+	size_t target;
+};
+
+struct jit_stub {
+	__u32 pc;
+	enum bpf_error err;
+	bool clear_r0;		/* exit with r0 = 0 */
+	size_t addr;
+};
+
+struct jit_ctx {
+	__u8 *buf;
+	size_t len, alloc_len;
+	size_t *addrs;		/* native offset of each insn, [len] is exit */
+	struct jit_fixup *fixups;
+	size_t nr_fixups, alloc_fixups;
+	struct jit_stub *stubs;
+	size_t nr_stubs, alloc_stubs;
+	bool nomem;
+};
+
+static
+void *grow(void *array, size_t *alloc, size_t nr, size_t size)
+{
+	size_t new_alloc;
+
+	if (nr < *alloc)
+		return array;
+	new_alloc = *alloc ? *alloc * 2 : 64;
+	array = realloc(array, new_alloc * size);
+	if (array)
+		*alloc = new_alloc;
+	return array;
+}
+
+static
+void emit1(struct jit_ctx *ctx, __u8 b)
+{
+	__u8 *buf;
+
+	buf = grow(ctx->buf, &ctx->alloc_len, ctx->len, 1);
+	if (!buf) {
+		ctx->nomem = true;
+		return;
+	}
+	ctx->buf = buf;
+	ctx->buf[ctx->len++] = b;
+}
+
+static
+void emit2(struct jit_ctx *ctx, __u16 v)
+{
+	emit1(ctx, v);
+	emit1(ctx, v >> 8);
+}
+
+static
+void emit4(struct jit_ctx *ctx, __u32 v)
+{
+	emit2(ctx, v);
+	emit2(ctx, v >> 16);
+}
+
+static
+void emit8(struct jit_ctx *ctx, __u64 v)
+{
+	emit4(ctx, v);
+	emit4(ctx, v >> 32);
+}
+
+/* Emit a REX prefix if any of its bits is needed, or if @force. */
+static
+void emit_rex(struct jit_ctx *ctx, bool w, int reg, int rm, bool force)
+{
+	__u8 rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+
+	if (rex != 0x40 || force)
+		emit1(ctx, rex);
+}
+
+static
+void emit_modrm_reg(struct jit_ctx *ctx, int reg, int rm)
+{
+	emit1(ctx, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* [base + disp32] operand. */
+static
+void emit_modrm_mem(struct jit_ctx *ctx, int reg, int base, __s32 disp)
+{
+	emit1(ctx, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP)
+		emit1(ctx, 0x24);	/* SIB: base only. */
+	emit4(ctx, disp);
+}
+
+/* op r/m, reg (add, sub, or, and, xor, cmp, test, mov). */
+static
+void emit_alu_rr(struct jit_ctx *ctx, __u8 opcode, bool w, int dst, int src)
+{
+	emit_rex(ctx, w, src, dst, false);
+	emit1(ctx, opcode);
+	emit_modrm_reg(ctx, src, dst);
+}
+
+/* op r/m, imm32 (group 1). */
+static
+void emit_alu_ri(struct jit_ctx *ctx, int ext, bool w, int dst, __s32 imm)
+{
+	emit_rex(ctx, w, 0, dst, false);
+	emit1(ctx, 0x81);
+	emit_modrm_reg(ctx, ext, dst);
+	emit4(ctx, imm);
+}
+
+static
+void emit_mov_rr(struct jit_ctx *ctx, bool w, int dst, int src)
+{
+	emit_alu_rr(ctx, 0x89, w, dst, src);
+}
+
+/* mov r32, imm32 zero-extends, mov r64, imm32 sign-extends. */
+static
+void emit_mov_imm32(struct jit_ctx *ctx, bool w, int dst, __s32 imm)
+{
+	if (w) {
+		emit_rex(ctx, true, 0, dst, false);
+		emit1(ctx, 0xc7);
+		emit_modrm_reg(ctx, 0, dst);
+	} else {
+		emit_rex(ctx, false, 0, dst, false);
+		emit1(ctx, 0xb8 + (dst & 7));
+	}
+	emit4(ctx, imm);
+}
+
+static
+void emit_mov_imm64(struct jit_ctx *ctx, int dst, __u64 imm)
+{
+	if ((__s64) imm == (__s32) imm) {
+		emit_mov_imm32(ctx, true, dst, imm);
+		return;
+	}
+	emit_rex(ctx, true, 0, dst, false);
+	emit1(ctx, 0xb8 + (dst & 7));
+	emit8(ctx, imm);
+}
+
+static
+void emit_push(struct jit_ctx *ctx, int reg)
+{
+	emit_rex(ctx, false, 0, reg, false);
+	emit1(ctx, 0x50 + (reg & 7));
+}
+
+static
+void emit_pop(struct jit_ctx *ctx, int reg)
+{
+	emit_rex(ctx, false, 0, reg, false);
+	emit1(ctx, 0x58 + (reg & 7));
+}
+
+/* Zero-extending load of @size from [base + off]. */
+static
+void emit_load(struct jit_ctx *ctx, int size, int dst, int base, __s16 off)
+{
+	switch (size) {
+	case BPF_B:
+		emit_rex(ctx, false, dst, base, false);
+		emit1(ctx, 0x0f);
+		emit1(ctx, 0xb6);
+		break;
+	case BPF_H:
+		emit_rex(ctx, false, dst, base, false);
+		emit1(ctx, 0x0f);
+		emit1(ctx, 0xb7);
+		break;
+	case BPF_W:
+		emit_rex(ctx, false, dst, base, false);
+		emit1(ctx, 0x8b);
+		break;
+	case BPF_DW:
+		emit_rex(ctx, true, dst, base, false);
+		emit1(ctx, 0x8b);
+		break;
+	}
+	emit_modrm_mem(ctx, dst, base, off);
+}
+
+static
+void emit_store_reg(struct jit_ctx *ctx, int size, int base, int src, __s16 off)
+{
+	switch (size) {
+	case BPF_B:
+		/* sil/dil/bpl/spl need a REX prefix. */
+		emit_rex(ctx, false, src, base, src >= RSP && src <= RDI);
+		emit1(ctx, 0x88);
+		break;
+	case BPF_H:
+		emit1(ctx, 0x66);
+		emit_rex(ctx, false, src, base, false);
+		emit1(ctx, 0x89);
+		break;
+	case BPF_W:
+		emit_rex(ctx, false, src, base, false);
+		emit1(ctx, 0x89);
+		break;
+	case BPF_DW:
+		emit_rex(ctx, true, src, base, false);
+		emit1(ctx, 0x89);
+		break;
+	}
+	emit_modrm_mem(ctx, src, base, off);
+}
+
+static
+void emit_store_imm(struct jit_ctx *ctx, int size, int base, __s16 off, __s32 imm)
+{
+	switch (size) {
+	case BPF_B:
+		emit_rex(ctx, false, 0, base, false);
+		emit1(ctx, 0xc6);
+		emit_modrm_mem(ctx, 0, base, off);
+		emit1(ctx, imm);
+		break;
+	case BPF_H:
+		emit1(ctx, 0x66);
+		emit_rex(ctx, false, 0, base, false);
+		emit1(ctx, 0xc7);
+		emit_modrm_mem(ctx, 0, base, off);
+		emit2(ctx, imm);
+		break;
+	case BPF_W:
+	case BPF_DW:
+		emit_rex(ctx, size == BPF_DW, 0, base, false);
+		emit1(ctx, 0xc7);
+		emit_modrm_mem(ctx, 0, base, off);
+		emit4(ctx, imm);
+		break;
+	}
+}
+
+static
+void add_fixup(struct jit_ctx *ctx, enum jit_target_kind kind, size_t target)
+{
+	struct jit_fixup *fixups;
+
+	fixups = grow(ctx->fixups, &ctx->alloc_fixups, ctx->nr_fixups,
+		sizeof(*fixups));
+	if (!fixups) {
+		ctx->nomem = true;
+		return;
+	}
+	ctx->fixups = fixups;
+	fixups[ctx->nr_fixups].pos = ctx->len;
+	fixups[ctx->nr_fixups].kind = kind;
+	fixups[ctx->nr_fixups].target = target;
+	ctx->nr_fixups++;
+	emit4(ctx, 0);
+}
+
+static
+size_t add_stub(struct jit_ctx *ctx, size_t pc, enum bpf_error err)
+{
+	struct jit_stub *stubs;
+
+	stubs = grow(ctx->stubs, &ctx->alloc_stubs, ctx->nr_stubs,
+		sizeof(*stubs));
+	if (!stubs) {
+		ctx->nomem = true;
+		return 0;
+	}
+	ctx->stubs = stubs;
+	stubs[ctx->nr_stubs].pc = pc;
+	stubs[ctx->nr_stubs].err = err;
+	stubs[ctx->nr_stubs].clear_r0 = false;
+	return ctx->nr_stubs++;
+}
+
+static
+void emit_jmp(struct jit_ctx *ctx, enum jit_target_kind kind, size_t target)
+{
+	emit1(ctx, 0xe9);
+	add_fixup(ctx, kind, target);
+}
+
+static
+void emit_jcc(struct jit_ctx *ctx, int cc, enum jit_target_kind kind, size_t target)
+{
+	emit1(ctx, 0x0f);
+	emit1(ctx, 0x80 + cc);
+	add_fixup(ctx, kind, target);
+}
+
+/* Jump to an error stub for @pc, unconditionally if @cc < 0. */
+static
+void emit_error(struct jit_ctx *ctx, int cc, size_t pc, enum bpf_error err)
+{
+	size_t stub = add_stub(ctx, pc, err);
+
+	if (cc < 0)
+		emit_jmp(ctx, TARGET_STUB, stub);
+	else
+		emit_jcc(ctx, cc, TARGET_STUB, stub);
+}
+
+/*
+ * Packet load, see struct bpf_packet. r1-r4 may be clobbered: rdi
+ * holds the packet data, rsi its length and rdx the offset, zero
+ * extended from 32 bits so that adding the size cannot overflow.
+ * BPF_ABS loads compare the length with their hoisted check, if any.
+ */
+static
+void emit_packet_load(struct jit_ctx *ctx, const struct bpf_dinsn *insn,
+		size_t pc)
+{
+	int size = BPF_SIZE(insn->op) == BPF_W ? 4
+		: BPF_SIZE(insn->op) == BPF_H ? 2 : 1;
+	bool is_abs = BPF_MODE(insn->op) == BPF_ABS;
+	size_t stub;
+
+	/* The index register may be one of them, read it first. */
+	if (is_abs) {
+		emit_mov_imm32(ctx, false, RDX, DINSN_ABS_OFF(insn));
+	} else {
+		emit_mov_rr(ctx, false, RDX, reg_map[insn->src]);
+		emit_alu_ri(ctx, EXT_ADD, false, RDX, insn->imm);
+	}
+	emit_load(ctx, BPF_DW, RDI, reg_map[BPF_REG_6],
+		offsetof(struct bpf_packet, data));
+	if (!is_abs || DINSN_ABS_CHECK(insn)) {
+		emit_load(ctx, BPF_W, RSI, reg_map[BPF_REG_6],
+			offsetof(struct bpf_packet, len));
+		if (is_abs) {
+			/* cmp esi, check; jb abort */
+			emit_alu_ri(ctx, EXT_CMP, false, RSI,
+				DINSN_ABS_CHECK(insn));
+		} else {
+			/* lea rcx, [rdx + size]; cmp rcx, rsi; ja abort */
+			emit_rex(ctx, true, RCX, RDX, false);
+			emit1(ctx, 0x8d);
+			emit_modrm_mem(ctx, RCX, RDX, size);
+			emit_alu_rr(ctx, 0x39, true, RCX, RSI);
+		}
+		stub = add_stub(ctx, pc, BPF_ERR_NONE);
+		if (!ctx->nomem)
+			ctx->stubs[stub].clear_r0 = true;
+		emit_jcc(ctx, is_abs ? CC_B : CC_A, TARGET_STUB, stub);
+	}
+	emit_alu_rr(ctx, 0x01, true, RDI, RDX);
+	emit_load(ctx, BPF_SIZE(insn->op), RAX, RDI, 0);
+	if (size == 4) {
+		emit1(ctx, 0x0f);	/* bswap eax */
+		emit1(ctx, 0xc8);
+	} else if (size == 2) {
+		emit1(ctx, 0x66);	/* rol ax, 8 */
+		emit1(ctx, 0xc1);
+		emit1(ctx, 0xc0);
+		emit1(ctx, 8);
+	}
+}
+
+/* Point the rel8 operand of the jump ending at @from to here. */
+static
+void patch_rel8(struct jit_ctx *ctx, size_t from)
+{
+	if (!ctx->nomem)
+		ctx->buf[from - 1] = ctx->len - from;
+}
+
+/*
+ * Signed division or modulo of @dst by @src (or @imm), with the same
+ * semantic as the interpreter: a 64-bit operation, truncated to 32 bits
+ * for BPF_ALU, and division by -1 negates, as idiv traps on
+ * INT64_MIN / -1. rax and rdx hold BPF r0 and r3, so they are
+ * preserved around idiv.
+ */
+static
+void emit_divmod(struct jit_ctx *ctx, const struct bpf_dinsn *insn, size_t pc,
+		bool is_mod, bool is_alu32)
+{
+	int dst = reg_map[insn->dst];
+	size_t div = 0, done = 0;
+
+	if (BPF_SRC(insn->op) == BPF_K) {
+		if (is_mod ? insn->imm <= 0 : !insn->imm) {
+			emit_error(ctx, -1, pc,
+				is_mod ? BPF_ERR_MODULO : BPF_ERR_DIV_BY_ZERO);
+			return;
+		}
+		if (insn->imm == -1) {
+			emit_rex(ctx, true, 0, dst, false);	/* neg */
+			emit1(ctx, 0xf7);
+			emit_modrm_reg(ctx, 3, dst);
+			goto truncate;
+		}
+		emit_mov_imm32(ctx, true, TMP_REG, insn->imm);
+	} else {
+		emit_mov_rr(ctx, true, TMP_REG, reg_map[insn->src]);
+		emit_alu_rr(ctx, 0x85, true, TMP_REG, TMP_REG);	/* test */
+		if (is_mod) {
+			emit_error(ctx, CC_LE, pc, BPF_ERR_MODULO);
+		} else {
+			emit_error(ctx, CC_E, pc, BPF_ERR_DIV_BY_ZERO);
+			/* cmp tmp, -1; jne div; neg dst; jmp done */
+			emit_alu_ri(ctx, EXT_CMP, true, TMP_REG, -1);
+			emit1(ctx, 0x70 + CC_NE);
+			emit1(ctx, 0);
+			div = ctx->len;
+			emit_rex(ctx, true, 0, dst, false);
+			emit1(ctx, 0xf7);
+			emit_modrm_reg(ctx, 3, dst);
+			emit1(ctx, 0xeb);
+			emit1(ctx, 0);
+			done = ctx->len;
+			patch_rel8(ctx, div);
+		}
+	}
+	emit_push(ctx, RAX);
+	emit_push(ctx, RDX);
+	if (dst != RAX)
+		emit_mov_rr(ctx, true, RAX, dst);
+	emit1(ctx, 0x48);	/* cqo */
+	emit1(ctx, 0x99);
+	emit_rex(ctx, true, 0, TMP_REG, false);	/* idiv */
+	emit1(ctx, 0xf7);
+	emit_modrm_reg(ctx, 7, TMP_REG);
+	emit_mov_rr(ctx, true, TMP_REG, is_mod ? RDX : RAX);
+	emit_pop(ctx, RDX);
+	emit_pop(ctx, RAX);
+	emit_mov_rr(ctx, true, dst, TMP_REG);
+	if (done)
+		patch_rel8(ctx, done);
+truncate:
+	if (is_alu32)
+		emit_mov_rr(ctx, false, dst, dst);
+}
+
+/*
+ * Shifts. Like the interpreter, BPF_ALU right shifts operate on the
+ * 64-bit register and truncate the result.
+ */
+static
+void emit_shift(struct jit_ctx *ctx, const struct bpf_dinsn *insn, size_t pc,
+		int ext, bool is_alu32)
+{
+	int dst = reg_map[insn->dst], src = reg_map[insn->src];
+	unsigned int width = is_alu32 ? 32 : 64;
+	bool w = !(is_alu32 && ext == EXT_SHL);
+
+	if (BPF_SRC(insn->op) == BPF_K) {
+		if (insn->imm >= width || insn->imm < 0) {
+			emit_error(ctx, -1, pc, BPF_ERR_SHIFT);
+			return;
+		}
+		emit_rex(ctx, w, 0, dst, false);
+		emit1(ctx, 0xc1);
+		emit_modrm_reg(ctx, ext, dst);
+		emit1(ctx, insn->imm);
+	} else {
+		/* Unsigned compare also catches negative shift counts. */
+		emit_alu_ri(ctx, EXT_CMP, true, src, width);
+		emit_error(ctx, CC_AE, pc, BPF_ERR_SHIFT);
+		/* The shift count must be in cl, which holds BPF r4. */
+		if (dst == RCX) {
+			emit_mov_rr(ctx, true, TMP_REG, RCX);
+			if (src != RCX)
+				emit_mov_rr(ctx, true, RCX, src);
+			emit_rex(ctx, w, 0, TMP_REG, false);
+			emit1(ctx, 0xd3);
+			emit_modrm_reg(ctx, ext, TMP_REG);
+			emit_mov_rr(ctx, true, RCX, TMP_REG);
+		} else {
+			emit_mov_rr(ctx, true, TMP_REG, RCX);
+			if (src != RCX)
+				emit_mov_rr(ctx, true, RCX, src);
+			emit_rex(ctx, w, 0, dst, false);
+			emit1(ctx, 0xd3);
+			emit_modrm_reg(ctx, ext, dst);
+			emit_mov_rr(ctx, true, RCX, TMP_REG);
+		}
+	}
+	if (is_alu32)
+		emit_mov_rr(ctx, false, dst, dst);
+}
+
+/*
+ * Atomic operations. Locked instructions are full barriers, so every
+ * operation is at least as strong as the interpreters'. Fetching and,
+ * or and xor have no x86 instruction and loop on cmpxchg, which works
+ * on rax (BPF r0): r0 is saved in STATUS_REG, and AUX_REG replaces it
+ * as base address.
+ */
+static
+void emit_atomic(struct jit_ctx *ctx, const struct bpf_dinsn *insn)
+{
+	static const __u8 alu_opcode[] = {
+		[BPF_AOP_ADD] = 0x01,
+		[BPF_AOP_OR] = 0x09,
+		[BPF_AOP_AND] = 0x21,
+		[BPF_AOP_XOR] = 0x31,
+	};
+	bool w = insn->op >= BPF_DOP_ATOMIC_DW;
+	int op = insn->op - (w ? BPF_DOP_ATOMIC_DW : BPF_DOP_ATOMIC_W);
+	int base = reg_map[insn->dst], src = reg_map[insn->src], val;
+	size_t loop;
+
+	switch (op) {
+	case BPF_AOP_ADD:
+	case BPF_AOP_OR:
+	case BPF_AOP_AND:
+	case BPF_AOP_XOR:
+		emit1(ctx, 0xf0);	/* lock op [base + off], src */
+		emit_rex(ctx, w, src, base, false);
+		emit1(ctx, alu_opcode[op]);
+		emit_modrm_mem(ctx, src, base, insn->off);
+		break;
+	case BPF_AOP_FETCH_ADD:
+		emit1(ctx, 0xf0);	/* lock xadd [base + off], src */
+		emit_rex(ctx, w, src, base, false);
+		emit1(ctx, 0x0f);
+		emit1(ctx, 0xc1);
+		emit_modrm_mem(ctx, src, base, insn->off);
+		break;
+	case BPF_AOP_XCHG:
+		emit_rex(ctx, w, src, base, false);	/* xchg [base + off], src */
+		emit1(ctx, 0x87);
+		emit_modrm_mem(ctx, src, base, insn->off);
+		break;
+	case BPF_AOP_CMPXCHG:
+		emit1(ctx, 0xf0);	/* lock cmpxchg [base + off], src */
+		emit_rex(ctx, w, src, base, false);
+		emit1(ctx, 0x0f);
+		emit1(ctx, 0xb1);
+		emit_modrm_mem(ctx, src, base, insn->off);
+		if (!w)
+			emit_mov_rr(ctx, false, RAX, RAX);
+		break;
+	case BPF_AOP_FETCH_OR:
+	case BPF_AOP_FETCH_AND:
+	case BPF_AOP_FETCH_XOR:
+		emit_mov_rr(ctx, true, STATUS_REG, RAX);
+		if (base == RAX) {
+			emit_mov_rr(ctx, true, AUX_REG, RAX);
+			base = AUX_REG;
+		}
+		val = src == RAX ? STATUS_REG : src;
+		emit_load(ctx, w ? BPF_DW : BPF_W, RAX, base, insn->off);
+		loop = ctx->len;
+		emit_mov_rr(ctx, w, TMP_REG, RAX);
+		emit_alu_rr(ctx, alu_opcode[op - BPF_AOP_FETCH_ADD], w, TMP_REG,
+			val);
+		emit1(ctx, 0xf0);	/* lock cmpxchg [base + off], tmp */
+		emit_rex(ctx, w, TMP_REG, base, false);
+		emit1(ctx, 0x0f);
+		emit1(ctx, 0xb1);
+		emit_modrm_mem(ctx, TMP_REG, base, insn->off);
+		emit1(ctx, 0x70 + CC_NE);	/* jne loop */
+		emit1(ctx, loop - (ctx->len + 1));
+		emit_mov_rr(ctx, w, src, RAX);
+		if (src != RAX)
+			emit_mov_rr(ctx, true, RAX, STATUS_REG);
+		break;
+	}
+}
+
+static
+int jmp_cc(unsigned int op)
+{
+	switch (op) {
+	case BPF_JEQ:	return CC_E;
+	case BPF_JNE:	return CC_NE;
+	case BPF_JSET:	return CC_NE;
+	case BPF_JGT:	return CC_A;
+	case BPF_JGE:	return CC_AE;
+	case BPF_JLT:	return CC_B;
+	case BPF_JLE:	return CC_BE;
+	case BPF_JSGT:	return CC_G;
+	case BPF_JSGE:	return CC_GE;
+	case BPF_JSLT:	return CC_L;
+	case BPF_JSLE:	return CC_LE;
+	default:	return -1;
+	}
+}
+
+static
+void emit_jump_target(struct jit_ctx *ctx, int cc, size_t pc, size_t target,
+		size_t len)
+{
+	if (target > len)
+		emit_error(ctx, cc, pc, BPF_ERR_PC_OVERFLOW);
+	else if (cc < 0)
+		emit_jmp(ctx, TARGET_INSN, target);
+	else
+		emit_jcc(ctx, cc, TARGET_INSN, target);
+}
+
+static
+void emit_cond_jmp(struct jit_ctx *ctx, const struct bpf_dinsn *insn,
+		size_t pc, size_t len)
+{
+	bool w = BPF_CLASS(insn->op) == BPF_JMP;
+	int dst = reg_map[insn->dst];
+	unsigned int op = BPF_OP(insn->op);
+
+	if (BPF_SRC(insn->op) == BPF_K) {
+		if (op == BPF_JSET) {
+			emit_rex(ctx, w, 0, dst, false);	/* test r/m, imm32 */
+			emit1(ctx, 0xf7);
+			emit_modrm_reg(ctx, 0, dst);
+			emit4(ctx, insn->imm);
+		} else {
+			emit_alu_ri(ctx, EXT_CMP, w, dst, insn->imm);
+		}
+	} else {
+		emit_alu_rr(ctx, op == BPF_JSET ? 0x85 : 0x39, w, dst,
+			reg_map[insn->src]);
+	}
+	emit_jump_target(ctx, jmp_cc(op), pc, insn->target, len);
+}
+
+static
+bool is_jmp_insn(const struct bpf_dinsn *insn)
+{
+	unsigned int bpf_class = BPF_CLASS(insn->op);
+
+	if (insn->op == (BPF_JMP | BPF_CALL) || insn->op == (BPF_JMP | BPF_EXIT))
+		return false;
+	return insn->op < 0x100 && (bpf_class == BPF_JMP || bpf_class == BPF_JMP32);
+}
+
+/*
+ * Jump targets. The validator rejects jumps into the second half of a
+ * 64-bit immediate load, but the decoded form of unvalidated bytecode
+ * may still contain them, and such a target needs its own code.
+ */
+static
+bool *find_jump_targets(const struct bpf_dinsn *insns, size_t len)
+{
+	bool *is_target;
+	size_t i;
+
+	is_target = calloc(len + 2, sizeof(*is_target));
+	if (!is_target)
+		return NULL;
+	for (i = 0; i < len; i++) {
+		const struct bpf_dinsn *insn = &insns[i];
+
+		if (is_jmp_insn(insn) && insn->target <= len)
+			is_target[insn->target] = true;
+	}
+	return is_target;
+}
+
+static
+void emit_prologue(struct jit_ctx *ctx)
+{
+	int i;
+
+	emit_push(ctx, RBP);
+	emit_push(ctx, RBX);
+	emit_push(ctx, R13);
+	emit_push(ctx, R14);
+	emit_push(ctx, R15);
+	emit_push(ctx, RDI);	/* register file, at [rsp + 8] */
+	emit_push(ctx, RSI);	/* pc, at [rsp] */
+	/* Seven pushes after the return address: rsp is 16-byte aligned. */
+	emit_mov_rr(ctx, true, AUX_REG, RDI);
+	for (i = 0; i < MAX_BPF_REG; i++)
+		emit_load(ctx, BPF_DW, reg_map[i], AUX_REG, i * sizeof(__s64));
+}
+
+/* Expects the status in STATUS_REG and the pc in PC_REG. */
+static
+void emit_epilogue(struct jit_ctx *ctx)
+{
+	int i;
+
+	emit_load(ctx, BPF_DW, AUX_REG, RSP, 8);
+	for (i = 0; i < MAX_BPF_REG; i++)
+		emit_store_reg(ctx, BPF_DW, AUX_REG, reg_map[i], i * sizeof(__s64));
+	emit_load(ctx, BPF_DW, AUX_REG, RSP, 0);
+	emit_store_reg(ctx, BPF_W, AUX_REG, PC_REG, 0);
+	emit_mov_rr(ctx, false, RAX, STATUS_REG);
+	emit_pop(ctx, RSI);
+	emit_pop(ctx, RDI);
+	emit_pop(ctx, R15);
+	emit_pop(ctx, R14);
+	emit_pop(ctx, R13);
+	emit_pop(ctx, RBX);
+	emit_pop(ctx, RBP);
+	emit1(ctx, 0xc3);	/* ret */
+}
+
+static
+void emit_insn(struct jit_ctx *ctx, const struct bpf_dinsn *insns, size_t pc,
+		size_t len)
+{
+	const struct bpf_dinsn *insn = &insns[pc];
+	int dst = reg_map[insn->dst], src = reg_map[insn->src];
+	bool w = BPF_CLASS(insn->op) == BPF_ALU64;
+
+	switch (insn->op) {
+		/* Load from immediate. */
+	case BPF_LD | BPF_W | BPF_IMM:
+		emit_mov_imm32(ctx, true, dst, insn->imm);
+		break;
+	case BPF_LD | BPF_DW | BPF_IMM:
+		emit_mov_imm64(ctx, dst, insn->imm);
+		break;
+
+		/* Load from packet. */
+	case BPF_LD | BPF_W | BPF_ABS:
+	case BPF_LD | BPF_H | BPF_ABS:
+	case BPF_LD | BPF_B | BPF_ABS:
+	case BPF_LD | BPF_W | BPF_IND:
+	case BPF_LD | BPF_H | BPF_IND:
+	case BPF_LD | BPF_B | BPF_IND:
+		emit_packet_load(ctx, insn, pc);
+		break;
+
+		/*
+		 * Load from address. x86 loads have acquire semantic and
+		 * stores have release semantic.
+		 */
+	case BPF_LDX | BPF_W | BPF_MEM:
+	case BPF_LDX | BPF_H | BPF_MEM:
+	case BPF_LDX | BPF_B | BPF_MEM:
+	case BPF_LDX | BPF_DW | BPF_MEM:
+	case BPF_LDX | BPF_W | BPF_MEM_ACQ_REL:
+	case BPF_LDX | BPF_H | BPF_MEM_ACQ_REL:
+	case BPF_LDX | BPF_B | BPF_MEM_ACQ_REL:
+	case BPF_LDX | BPF_DW | BPF_MEM_ACQ_REL:
+		emit_load(ctx, BPF_SIZE(insn->op), dst, src, insn->off);
+		break;
+
+		/* Store from immediate to address. */
+	case BPF_ST | BPF_W | BPF_MEM:
+	case BPF_ST | BPF_H | BPF_MEM:
+	case BPF_ST | BPF_B | BPF_MEM:
+	case BPF_ST | BPF_DW | BPF_MEM:
+	case BPF_ST | BPF_W | BPF_MEM_ACQ_REL:
+	case BPF_ST | BPF_H | BPF_MEM_ACQ_REL:
+	case BPF_ST | BPF_B | BPF_MEM_ACQ_REL:
+	case BPF_ST | BPF_DW | BPF_MEM_ACQ_REL:
+		emit_store_imm(ctx, BPF_SIZE(insn->op), dst, insn->off, insn->imm);
+		break;
+
+		/* Store from register to address. */
+	case BPF_STX | BPF_W | BPF_MEM:
+	case BPF_STX | BPF_H | BPF_MEM:
+	case BPF_STX | BPF_B | BPF_MEM:
+	case BPF_STX | BPF_DW | BPF_MEM:
+	case BPF_STX | BPF_W | BPF_MEM_ACQ_REL:
+	case BPF_STX | BPF_H | BPF_MEM_ACQ_REL:
+	case BPF_STX | BPF_B | BPF_MEM_ACQ_REL:
+	case BPF_STX | BPF_DW | BPF_MEM_ACQ_REL:
+		emit_store_reg(ctx, BPF_SIZE(insn->op), dst, src, insn->off);
+		break;
+
+	case BPF_DOP_ATOMIC_W ... BPF_DOP_MAX - 1:
+		emit_atomic(ctx, insn);
+		break;
+
+		/*
+		 * BPF_ALU results are truncated to 32 bits: 32-bit x86
+		 * operations zero-extend their destination.
+		 */
+	case BPF_ALU | BPF_ADD | BPF_K:
+	case BPF_ALU64 | BPF_ADD | BPF_K:
+		emit_alu_ri(ctx, EXT_ADD, w, dst, insn->imm);
+		break;
+	case BPF_ALU | BPF_ADD | BPF_X:
+	case BPF_ALU64 | BPF_ADD | BPF_X:
+		emit_alu_rr(ctx, 0x01, w, dst, src);
+		break;
+	case BPF_ALU | BPF_SUB | BPF_K:
+	case BPF_ALU64 | BPF_SUB | BPF_K:
+		emit_alu_ri(ctx, EXT_SUB, w, dst, insn->imm);
+		break;
+	case BPF_ALU | BPF_SUB | BPF_X:
+	case BPF_ALU64 | BPF_SUB | BPF_X:
+		emit_alu_rr(ctx, 0x29, w, dst, src);
+		break;
+	case BPF_ALU | BPF_MUL | BPF_K:
+	case BPF_ALU64 | BPF_MUL | BPF_K:
+		emit_rex(ctx, w, dst, dst, false);	/* imul r, r/m, imm32 */
+		emit1(ctx, 0x69);
+		emit_modrm_reg(ctx, dst, dst);
+		emit4(ctx, insn->imm);
+		break;
+	case BPF_ALU | BPF_MUL | BPF_X:
+	case BPF_ALU64 | BPF_MUL | BPF_X:
+		emit_rex(ctx, w, dst, src, false);	/* imul r, r/m */
+		emit1(ctx, 0x0f);
+		emit1(ctx, 0xaf);
+		emit_modrm_reg(ctx, dst, src);
+		break;
+	case BPF_ALU | BPF_DIV | BPF_K:
+	case BPF_ALU | BPF_DIV | BPF_X:
+	case BPF_ALU64 | BPF_DIV | BPF_K:
+	case BPF_ALU64 | BPF_DIV | BPF_X:
+		emit_divmod(ctx, insn, pc, false, !w);
+		break;
+	case BPF_ALU | BPF_MOD | BPF_K:
+	case BPF_ALU | BPF_MOD | BPF_X:
+	case BPF_ALU64 | BPF_MOD | BPF_K:
+	case BPF_ALU64 | BPF_MOD | BPF_X:
+		emit_divmod(ctx, insn, pc, true, !w);
+		break;
+	case BPF_ALU | BPF_OR | BPF_K:
+	case BPF_ALU64 | BPF_OR | BPF_K:
+		emit_alu_ri(ctx, EXT_OR, w, dst, insn->imm);
+		break;
+	case BPF_ALU | BPF_OR | BPF_X:
+	case BPF_ALU64 | BPF_OR | BPF_X:
+		emit_alu_rr(ctx, 0x09, w, dst, src);
+		break;
+	case BPF_ALU | BPF_AND | BPF_K:
+	case BPF_ALU64 | BPF_AND | BPF_K:
+		emit_alu_ri(ctx, EXT_AND, w, dst, insn->imm);
+		break;
+	case BPF_ALU | BPF_AND | BPF_X:
+	case BPF_ALU64 | BPF_AND | BPF_X:
+		emit_alu_rr(ctx, 0x21, w, dst, src);
+		break;
+	case BPF_ALU | BPF_XOR | BPF_K:
+	case BPF_ALU64 | BPF_XOR | BPF_K:
+		emit_alu_ri(ctx, EXT_XOR, w, dst, insn->imm);
+		break;
+	case BPF_ALU | BPF_XOR | BPF_X:
+	case BPF_ALU64 | BPF_XOR | BPF_X:
+		emit_alu_rr(ctx, 0x31, w, dst, src);
+		break;
+	case BPF_ALU | BPF_LSH | BPF_K:
+	case BPF_ALU | BPF_LSH | BPF_X:
+	case BPF_ALU64 | BPF_LSH | BPF_K:
+	case BPF_ALU64 | BPF_LSH | BPF_X:
+		emit_shift(ctx, insn, pc, EXT_SHL, !w);
+		break;
+	case BPF_ALU | BPF_RSH | BPF_K:
+	case BPF_ALU | BPF_RSH | BPF_X:
+	case BPF_ALU64 | BPF_RSH | BPF_K:
+	case BPF_ALU64 | BPF_RSH | BPF_X:
+		emit_shift(ctx, insn, pc, EXT_SHR, !w);
+		break;
+	case BPF_ALU | BPF_ARSH | BPF_K:
+	case BPF_ALU | BPF_ARSH | BPF_X:
+	case BPF_ALU64 | BPF_ARSH | BPF_K:
+	case BPF_ALU64 | BPF_ARSH | BPF_X:
+		emit_shift(ctx, insn, pc, EXT_SAR, !w);
+		break;
+	case BPF_ALU | BPF_NEG:
+	case BPF_ALU64 | BPF_NEG:
+		emit_rex(ctx, w, 0, dst, false);
+		emit1(ctx, 0xf7);
+		emit_modrm_reg(ctx, 3, dst);
+		break;
+	case BPF_ALU | BPF_MOV | BPF_K:
+	case BPF_ALU64 | BPF_MOV | BPF_K:
+		emit_mov_imm32(ctx, w, dst, insn->imm);
+		break;
+	case BPF_ALU | BPF_MOV | BPF_X:
+	case BPF_ALU64 | BPF_MOV | BPF_X:
+		emit_mov_rr(ctx, w, dst, src);
+		break;
+
+	case BPF_JMP | BPF_JA:
+	case BPF_JMP32 | BPF_JA:
+		emit_jump_target(ctx, -1, pc, insn->target, len);
+		break;
+	case BPF_JMP | BPF_JEQ | BPF_K:
+	case BPF_JMP | BPF_JEQ | BPF_X:
+	case BPF_JMP | BPF_JGT | BPF_K:
+	case BPF_JMP | BPF_JGT | BPF_X:
+	case BPF_JMP | BPF_JGE | BPF_K:
+	case BPF_JMP | BPF_JGE | BPF_X:
+	case BPF_JMP | BPF_JSET | BPF_K:
+	case BPF_JMP | BPF_JSET | BPF_X:
+	case BPF_JMP | BPF_JNE | BPF_K:
+	case BPF_JMP | BPF_JNE | BPF_X:
+	case BPF_JMP | BPF_JLT | BPF_K:
+	case BPF_JMP | BPF_JLT | BPF_X:
+	case BPF_JMP | BPF_JLE | BPF_K:
+	case BPF_JMP | BPF_JLE | BPF_X:
+	case BPF_JMP | BPF_JSGT | BPF_K:
+	case BPF_JMP | BPF_JSGT | BPF_X:
+	case BPF_JMP | BPF_JSGE | BPF_K:
+	case BPF_JMP | BPF_JSGE | BPF_X:
+	case BPF_JMP | BPF_JSLT | BPF_K:
+	case BPF_JMP | BPF_JSLT | BPF_X:
+	case BPF_JMP | BPF_JSLE | BPF_K:
+	case BPF_JMP | BPF_JSLE | BPF_X:
+	case BPF_JMP32 | BPF_JEQ | BPF_K:
+	case BPF_JMP32 | BPF_JEQ | BPF_X:
+	case BPF_JMP32 | BPF_JGT | BPF_K:
+	case BPF_JMP32 | BPF_JGT | BPF_X:
+	case BPF_JMP32 | BPF_JGE | BPF_K:
+	case BPF_JMP32 | BPF_JGE | BPF_X:
+	case BPF_JMP32 | BPF_JSET | BPF_K:
+	case BPF_JMP32 | BPF_JSET | BPF_X:
+	case BPF_JMP32 | BPF_JNE | BPF_K:
+	case BPF_JMP32 | BPF_JNE | BPF_X:
+	case BPF_JMP32 | BPF_JLT | BPF_K:
+	case BPF_JMP32 | BPF_JLT | BPF_X:
+	case BPF_JMP32 | BPF_JLE | BPF_K:
+	case BPF_JMP32 | BPF_JLE | BPF_X:
+	case BPF_JMP32 | BPF_JSGT | BPF_K:
+	case BPF_JMP32 | BPF_JSGT | BPF_X:
+	case BPF_JMP32 | BPF_JSGE | BPF_K:
+	case BPF_JMP32 | BPF_JSGE | BPF_X:
+	case BPF_JMP32 | BPF_JSLT | BPF_K:
+	case BPF_JMP32 | BPF_JSLT | BPF_X:
+	case BPF_JMP32 | BPF_JSLE | BPF_K:
+	case BPF_JMP32 | BPF_JSLE | BPF_X:
+		emit_cond_jmp(ctx, insn, pc, len);
+		break;
+
+	case BPF_JMP | BPF_CALL:
+		/*
+		 * r1-r5 already sit in the SysV argument registers and r0
+		 * in rax, and the prologue keeps rsp 16-byte aligned.
+		 */
+		emit_mov_imm64(ctx, TMP_REG, (unsigned long) insn->fn);
+		emit1(ctx, 0x41);	/* call *%r11 */
+		emit1(ctx, 0xff);
+		emit1(ctx, 0xd3);
+		break;
+	case BPF_JMP | BPF_EXIT:
+		/* Leave through a stub reporting success at this pc. */
+		emit_error(ctx, -1, pc, BPF_ERR_NONE);
+		break;
+
+	default:
+		/* Like the interpreters, only fail if executed. */
+		emit_error(ctx, -1, pc, BPF_ERR_UNSUPPORTED);
+		break;
+	}
+}
+
+static
+void jit_ctx_fini(struct jit_ctx *ctx)
+{
+	free(ctx->buf);
+	free(ctx->addrs);
+	free(ctx->fixups);
+	free(ctx->stubs);
+}
+
+/*
+ * Compile a decoded program into native code, in a mapping which is
+ * never writable and executable at the same time.
+ */
+struct bpf_jit *jit_compile(const struct bpf_dinsn *insns, size_t len)
+{
+	struct jit_ctx ctx = { 0 };
+	struct bpf_jit *jit = NULL;
+	bool *is_target = NULL;
+	size_t i, page_size, exit_addr;
+
+	for (i = 0; i < len; i++) {
+		if (insns[i].dst >= MAX_BPF_REG || insns[i].src >= MAX_BPF_REG) {
+			fprintf(stderr, "Error: invalid register at pc %zu\n", i);
+			return NULL;
+		}
+	}
+	ctx.addrs = calloc(len + 1, sizeof(*ctx.addrs));
+	is_target = find_jump_targets(insns, len);
+	if (!ctx.addrs || !is_target)
+		goto error;
+
+	emit_prologue(&ctx);
+	for (i = 0; i < len; i++) {
+		const struct bpf_dinsn *insn = &insns[i];
+
+		ctx.addrs[i] = ctx.len;
+		emit_insn(&ctx, insns, i, len);
+		if (insn->op == (BPF_LD | BPF_DW | BPF_IMM)) {
+			if (i + 1 == len) {
+				emit_error(&ctx, -1, i, BPF_ERR_PC_OVERFLOW);
+			} else if (is_target[i + 1]) {
+				/* Skip the second half, which is a jump target. */
+				emit_jmp(&ctx, TARGET_INSN, i + 2);
+			} else {
+				ctx.addrs[++i] = ctx.len;
+			}
+		}
+	}
+
+	/* Bytecode terminates. */
+	ctx.addrs[len] = ctx.len;
+	emit_alu_rr(&ctx, 0x31, false, STATUS_REG, STATUS_REG);	/* xor */
+	emit_mov_imm32(&ctx, false, PC_REG, len);
+	exit_addr = ctx.len;
+	emit_epilogue(&ctx);
+
+	for (i = 0; i < ctx.nr_stubs; i++) {
+		struct jit_stub *stub = &ctx.stubs[i];
+
+		stub->addr = ctx.len;
+		if (stub->clear_r0)
+			emit_alu_rr(&ctx, 0x31, false, RAX, RAX);	/* xor */
+		emit_mov_imm32(&ctx, false, STATUS_REG, stub->err);
+		emit_mov_imm32(&ctx, false, PC_REG, stub->pc);
+		emit1(&ctx, 0xe9);
+		emit4(&ctx, exit_addr - (ctx.len + 4));
+	}
+	if (ctx.nomem)
+		goto error;
+
+	for (i = 0; i < ctx.nr_fixups; i++) {
+		struct jit_fixup *fixup = &ctx.fixups[i];
+		size_t target;
+		__s32 rel;
+
+		if (fixup->kind == TARGET_INSN)
+			target = ctx.addrs[fixup->target];
+		else
+			target = ctx.stubs[fixup->target].addr;
+		rel = target - (fixup->pos + 4);
+		memcpy(ctx.buf + fixup->pos, &rel, sizeof(rel));
+	}
+
+	jit = calloc(1, sizeof(*jit));
+	if (!jit)
+		goto error;
+	page_size = sysconf(_SC_PAGESIZE);
+	jit->size = (ctx.len + page_size - 1) & ~(page_size - 1);
+	jit->image = mmap(NULL, jit->size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->image == MAP_FAILED) {
+		perror("mmap");
+		goto error;
+	}
+	memcpy(jit->image, ctx.buf, ctx.len);
+	if (mprotect(jit->image, jit->size, PROT_READ | PROT_EXEC)) {
+		perror("mprotect");
+		munmap(jit->image, jit->size);
+		goto error;
+	}
+	jit->func = (bpf_jit_func_t) jit->image;
+	free(is_target);
+	jit_ctx_fini(&ctx);
+	return jit;
+
+error:
+	fprintf(stderr, "Error: JIT compilation failed\n");
+	free(jit);
+	free(is_target);
+	jit_ctx_fini(&ctx);
+	return NULL;
+}
+
+void jit_free(struct bpf_jit *jit)
+{
+	if (!jit)
+		return;
+	munmap(jit->image, jit->size);
+	free(jit);
+}
+
+#else /* !__x86_64__ */
+
+struct bpf_jit *jit_compile(const struct bpf_dinsn *insns, size_t len)
+{
+	fprintf(stderr, "Error: JIT not supported on this architecture\n");
+	return NULL;
+}
+
+void jit_free(struct bpf_jit *jit)
+{
+}
+
+#endif /* !__x86_64__ */
+
+/* Run compiled code, returns an enum bpf_error. */
+int run_jit(const struct bpf_jit *jit, __s64 *reg, size_t *pc)
+{
+	__u32 jit_pc = 0;
+	int err;
+
+	err = jit->func(reg, &jit_pc);
+	*pc = jit_pc;
+	return err;
+}
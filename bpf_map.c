@@ -0,0 +1,145 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include "./bpf_map.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Limits keeping keys on the stack and values within pointer bounds. */
+#define BPF_MAX_KEY_SIZE	BPF_STACK_SIZE
+#define BPF_MAX_VALUE_SIZE	(1U << 20)
+/* Hash maps count buckets, a power of 2, and elements in 32 bits. */
+#define BPF_MAX_HASH_ENTRIES	(1U << 31)
+
+struct bpf_map *bpf_map_create(const struct bpf_map_attr *attr)
+{
+	struct bpf_map *map;
+
+	if (!attr->key_size || attr->key_size > BPF_MAX_KEY_SIZE
+	    || !attr->value_size || attr->value_size > BPF_MAX_VALUE_SIZE
+	    || !attr->max_entries) {
+		fprintf(stderr, "Error: invalid map attributes\n");
+		return NULL;
+	}
+	if ((attr->type == BPF_MAP_TYPE_HASH
+	     || attr->type == BPF_MAP_TYPE_PERCPU_HASH)
+	    && attr->max_entries > BPF_MAX_HASH_ENTRIES) {
+		fprintf(stderr, "Error: more than %u hash map entries\n",
+			BPF_MAX_HASH_ENTRIES);
+		return NULL;
+	}
+	switch (attr->type) {
+	case BPF_MAP_TYPE_HASH:
+		map = htab_map_alloc(attr);
+		break;
+	case BPF_MAP_TYPE_PERCPU_HASH:
+	case BPF_MAP_TYPE_PERCPU_ARRAY:
+		if (attr->value_size % sizeof(__u64)) {
+			fprintf(stderr, "Error: per-CPU values must be a multiple of 8 bytes\n");
+			return NULL;
+		}
+		if (attr->type == BPF_MAP_TYPE_PERCPU_HASH)
+			map = htab_map_alloc(attr);
+		else
+			map = percpu_array_map_alloc(attr);
+		break;
+	default:
+		fprintf(stderr, "Error: unknown map type %d\n", attr->type);
+		return NULL;
+	}
+	if (!map)
+		return NULL;
+	map->type = attr->type;
+	map->key_size = attr->key_size;
+	map->value_size = attr->value_size;
+	map->max_entries = attr->max_entries;
+	return map;
+}
+
+void bpf_map_destroy(struct bpf_map *map)
+{
+	if (!map)
+		return;
+	map->ops->free(map);
+}
+
+void *bpf_map_lookup_elem(struct bpf_map *map, const void *key)
+{
+	return map->ops->lookup(map, key);
+}
+
+int bpf_map_update_elem(struct bpf_map *map, const void *key,
+		const void *value, __u64 flags)
+{
+	if (flags > BPF_EXIST)
+		return -EINVAL;
+	return map->ops->update(map, key, value, flags);
+}
+
+int bpf_map_delete_elem(struct bpf_map *map, const void *key)
+{
+	return map->ops->delete(map, key);
+}
+
+int bpf_map_lookup_percpu_elem(struct bpf_map *map, const void *key,
+		void *values)
+{
+	int cpu, nr_cpus = bpf_num_possible_cpus();
+	void *slot;
+
+	if (!map->ops->lookup_cpu)
+		return -EINVAL;
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		slot = map->ops->lookup_cpu(map, key, cpu);
+		if (!slot)
+			return -ENOENT;
+		memcpy((char *) values + (size_t) cpu * map->value_size, slot,
+			map->value_size);
+	}
+	return 0;
+}
+
+int bpf_map_sum_percpu_elem(struct bpf_map *map, const void *key,
+		void *value)
+{
+	int cpu, nr_cpus = bpf_num_possible_cpus();
+	__u64 *sum = value, *slot;
+	__u32 i;
+
+	if (!map->ops->lookup_cpu)
+		return -EINVAL;
+	memset(sum, 0, map->value_size);
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		slot = map->ops->lookup_cpu(map, key, cpu);
+		if (!slot)
+			return -ENOENT;
+		/* Owners keep writing their slots, read each word once. */
+		for (i = 0; i < map->value_size / sizeof(__u64); i++)
+			sum[i] += __atomic_load_n(&slot[i], __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/* Helpers, with the signatures registered in bpf_helpers.c. */
+
+__u64 bpf_helper_map_lookup_elem(__u64 r1, __u64 r2, __u64 r3, __u64 r4,
+		__u64 r5)
+{
+	struct bpf_map *map = (struct bpf_map *) (unsigned long) r1;
+
+	return (unsigned long) map->ops->lookup(map, (void *) (unsigned long) r2);
+}
+
+__u64 bpf_helper_map_update_elem(__u64 r1, __u64 r2, __u64 r3, __u64 r4,
+		__u64 r5)
+{
+	return bpf_map_update_elem((struct bpf_map *) (unsigned long) r1,
+		(void *) (unsigned long) r2, (void *) (unsigned long) r3, r4);
+}
+
+__u64 bpf_helper_map_delete_elem(__u64 r1, __u64 r2, __u64 r3, __u64 r4,
+		__u64 r5)
+{
+	struct bpf_map *map = (struct bpf_map *) (unsigned long) r1;
+
+	return map->ops->delete(map, (void *) (unsigned long) r2);
+}
@@ -0,0 +1,95 @@
+#ifndef _BPF_MAP_H
+#define _BPF_MAP_H
+
+/*
+ * Maps hold state shared between program runs, threads and the host.
+ * Programs reach a map through a 64-bit immediate load with src_reg
+ * BPF_PSEUDO_MAP_IDX, and the BPF_FUNC_map_* helpers. Maps must outlive
+ * the programs using them.
+ *
+ * All memory is allocated at creation: lookups, updates and deletes
+ * never allocate, and can be called concurrently from any thread.
+ */
+
+#include "./bpf.h"
+
+struct bpf_map;
+
+struct bpf_map_attr {
+	enum bpf_map_type	type;
+	__u32			key_size;
+	__u32			value_size;
+	__u32			max_entries;
+};
+
+/* Returns NULL on invalid attributes: hash maps hold at most 2^31 entries. */
+struct bpf_map *bpf_map_create(const struct bpf_map_attr *attr);
+void bpf_map_destroy(struct bpf_map *map);
+
+/*
+ * Returns a pointer to the value stored for @key, or NULL.
+ *
+ * Hash map values are not written in place (but for the current CPU
+ * slot of per-CPU ones): an update links a new element, and deleted or
+ * replaced elements are reused only once every read section in
+ * progress at their removal has ended. Each program run using maps is
+ * a read section. Hosts reading values concurrently with updates
+ * must hold bpf_map_read_lock() from the lookup to their last access
+ * to the value, to see it in full and for its key.
+ */
+void *bpf_map_lookup_elem(struct bpf_map *map, const void *key);
+
+/*
+ * Read sections of the calling thread, which may nest. Updates and
+ * deletes are allowed within them, but the elements they remove are
+ * not reused before the section ends. Updates outside read sections
+ * wait for the read sections holding the spare elements to end.
+ */
+void bpf_map_read_lock(void);
+void bpf_map_read_unlock(void);
+
+/*
+ * Returns 0 on success, -EEXIST or -ENOENT when @flags (BPF_ANY,
+ * BPF_NOEXIST or BPF_EXIST) is not met, -E2BIG when the map is full,
+ * or, in a read section, when its spare elements wait for read
+ * sections to end.
+ */
+int bpf_map_update_elem(struct bpf_map *map, const void *key,
+		const void *value, __u64 flags);
+
+/* Returns 0 on success, -ENOENT if @key is not in the map. */
+int bpf_map_delete_elem(struct bpf_map *map, const void *key);
+
+/*
+ * Per-CPU maps (BPF_MAP_TYPE_PERCPU_*) hold one value per possible CPU
+ * for each key, each CPU's values on their own cache lines. Value
+ * sizes must be a multiple of 8.
+ *
+ * bpf_map_lookup_elem() returns the slot of the current CPU, and
+ * bpf_map_update_elem() writes it. A new hash element starts with the
+ * other CPUs' slots zeroed. Array elements always exist and cannot be
+ * deleted; array keys are __u32 indexes below max_entries.
+ *
+ * A read-modify-write of the current CPU slot may be lost if the thread
+ * migrates in the middle of it. Programs count exactly, and without
+ * atomic instructions, with the map_percpu_add helper, which adds to
+ * the first 64-bit word of the slot in a restartable sequence.
+ */
+int bpf_num_possible_cpus(void);
+
+/*
+ * Copy the value of every CPU, bpf_num_possible_cpus() * value_size
+ * bytes, into @values. Returns 0 on success, -ENOENT if @key is not in
+ * the map, -EINVAL if the map is not per-CPU.
+ */
+int bpf_map_lookup_percpu_elem(struct bpf_map *map, const void *key,
+		void *values);
+
+/*
+ * Sum the values of all CPUs into @value, as arrays of __u64. Same
+ * return values as bpf_map_lookup_percpu_elem().
+ */
+int bpf_map_sum_percpu_elem(struct bpf_map *map, const void *key,
+		void *value);
+
+#endif /* _BPF_MAP_H */
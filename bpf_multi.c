@@ -0,0 +1,319 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include "./bpf_prog.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Multi-program evaluation. The programs are arranged in a prefix
+ * tree: a node holds programs whose bytecode is identical up to its
+ * lcp (longest common prefix), and its children partition them by
+ * their instruction at lcp. Programs which end at lcp form their own
+ * child, whose programs are identical.
+ *
+ * Programs of a node are at the same pc with the same registers and
+ * stack as long as the run stays below lcp, so the node runs its
+ * prefix once for all of them, with the bytecode of any of them. When
+ * the run reaches lcp or above, each child resumes it from the same
+ * state: the registers and the stack are saved before the first child
+ * and restored before the others.
+ */
+
+struct bpf_multi_node {
+	const struct bpf_insn	*insns;		/* of the first program */
+	size_t			len;
+	size_t			lcp;
+	size_t			*progs;		/* indexes in the program set */
+	size_t			nr_progs;
+	struct bpf_multi_node	**children;
+	size_t			nr_children;
+};
+
+struct bpf_multi {
+	struct bpf_prog		**progs;
+	size_t			nr_progs;
+	size_t			ctx_size;	/* largest of the programs */
+	size_t			nr_insns;	/* distinct instructions */
+	struct bpf_multi_node	*root;
+};
+
+static
+void multi_node_free(struct bpf_multi_node *node)
+{
+	size_t i;
+
+	if (!node)
+		return;
+	for (i = 0; i < node->nr_children; i++)
+		multi_node_free(node->children[i]);
+	free(node->children);
+	free(node->progs);
+	free(node);
+}
+
+/* Same instruction at @pc, both slots for 64-bit immediate loads. */
+static
+bool same_insn(const struct bpf_prog *a, const struct bpf_prog *b, size_t pc)
+{
+	size_t n = is_imm64(&a->insns[pc]) ? 2 : 1;
+
+	if (pc + n > b->len)
+		return false;
+	return !memcmp(&a->insns[pc], &b->insns[pc], n * sizeof(*a->insns));
+}
+
+/*
+ * Build the node of programs @progs, identical up to @from. Takes
+ * ownership of @progs.
+ */
+static
+struct bpf_multi_node *multi_build(struct bpf_multi *multi, size_t *progs,
+		size_t nr_progs, size_t from)
+{
+	const struct bpf_prog *first = multi->progs[progs[0]];
+	struct bpf_multi_node *node;
+	size_t pc = from, i, j, n;
+	bool *placed;
+
+	node = calloc(1, sizeof(*node));
+	if (!node) {
+		free(progs);
+		return NULL;
+	}
+	node->insns = first->insns;
+	node->len = first->len;
+	node->progs = progs;
+	node->nr_progs = nr_progs;
+
+	/* Extend the common prefix. */
+	while (pc < first->len) {
+		for (i = 1; i < nr_progs; i++) {
+			if (!same_insn(first, multi->progs[progs[i]], pc))
+				break;
+		}
+		if (i < nr_progs)
+			break;
+		pc += is_imm64(&first->insns[pc]) ? 2 : 1;
+	}
+	node->lcp = pc;
+	multi->nr_insns += pc - from;
+	for (i = 0; i < nr_progs; i++) {
+		if (multi->progs[progs[i]]->len != pc)
+			break;
+	}
+	if (i == nr_progs)
+		return node;	/* identical programs */
+
+	/* Partition by the instruction at lcp, or by the end. */
+	placed = calloc(nr_progs, sizeof(*placed));
+	node->children = calloc(nr_progs, sizeof(*node->children));
+	if (!placed || !node->children)
+		goto error;
+	for (i = 0; i < nr_progs; i++) {
+		const struct bpf_prog *prog = multi->progs[progs[i]];
+		size_t *child;
+
+		if (placed[i])
+			continue;
+		child = malloc(nr_progs * sizeof(*child));
+		if (!child)
+			goto error;
+		for (j = i, n = 0; j < nr_progs; j++) {
+			const struct bpf_prog *other = multi->progs[progs[j]];
+
+			if (placed[j])
+				continue;
+			if (prog->len == pc ? other->len == pc
+			    : other->len != pc && same_insn(prog, other, pc)) {
+				child[n++] = progs[j];
+				placed[j] = true;
+			}
+		}
+		node->children[node->nr_children] = multi_build(multi, child, n,
+				pc);
+		if (!node->children[node->nr_children])
+			goto error;
+		node->nr_children++;
+	}
+	free(placed);
+	return node;
+
+error:
+	free(placed);
+	multi_node_free(node);
+	return NULL;
+}
+
+/*
+ * Only stores to the stack, and calls to helpers without side effects,
+ * are allowed: the stack is restored between the children of a node,
+ * the context and maps are not.
+ */
+static
+int multi_check_prog(const struct bpf_prog *prog)
+{
+	const struct bpf_helper *helper;
+	size_t i;
+
+	for (i = 0; i < prog->len; i++) {
+		const struct bpf_insn *insn = &prog->insns[i];
+		unsigned int bpf_class = BPF_CLASS(insn->code);
+
+		if ((bpf_class == BPF_ST || bpf_class == BPF_STX)
+		    && insn->dst_reg != BPF_REG_10) {
+			fprintf(stderr, "Error: store outside the stack at pc %zu\n",
+				i);
+			return -1;
+		}
+		if (insn->code == (BPF_JMP | BPF_CALL)) {
+			helper = bpf_helper_lookup(insn->imm);
+			if (!helper || !(helper->flags & BPF_HELPER_F_PURE)) {
+				fprintf(stderr, "Error: call to helper %d with side effects at pc %zu\n",
+					insn->imm, i);
+				return -1;
+			}
+		}
+		if (is_imm64(insn))
+			i++;
+	}
+	return 0;
+}
+
+struct bpf_multi *bpf_multi_create(struct bpf_prog *const *progs,
+		size_t nr_progs)
+{
+	struct bpf_multi *multi;
+	size_t *all, i;
+
+	if (!nr_progs) {
+		fprintf(stderr, "Error: Empty program set\n");
+		return NULL;
+	}
+	multi = calloc(1, sizeof(*multi));
+	if (!multi)
+		return NULL;
+	multi->progs = malloc(nr_progs * sizeof(*multi->progs));
+	all = malloc(nr_progs * sizeof(*all));
+	if (!multi->progs || !all) {
+		free(all);
+		goto error;
+	}
+	memcpy(multi->progs, progs, nr_progs * sizeof(*progs));
+	multi->nr_progs = nr_progs;
+	for (i = 0; i < nr_progs; i++) {
+		if (multi_check_prog(progs[i])) {
+			free(all);
+			goto error;
+		}
+		if (progs[i]->ctx_size > multi->ctx_size)
+			multi->ctx_size = progs[i]->ctx_size;
+		all[i] = i;
+	}
+	multi->root = multi_build(multi, all, nr_progs, 0);
+	if (!multi->root)
+		goto error;
+	return multi;
+
+error:
+	bpf_multi_destroy(multi);
+	return NULL;
+}
+
+void bpf_multi_destroy(struct bpf_multi *multi)
+{
+	if (!multi)
+		return;
+	multi_node_free(multi->root);
+	free(multi->progs);
+	free(multi);
+}
+
+size_t bpf_multi_nr_insns(const struct bpf_multi *multi)
+{
+	return multi->nr_insns;
+}
+
+static
+void multi_match(const struct bpf_multi_node *node, __u64 *matched)
+{
+	size_t i;
+
+	for (i = 0; i < node->nr_progs; i++)
+		matched[node->progs[i] / 64] |= 1ULL << (node->progs[i] % 64);
+}
+
+/*
+ * Record the failure of the programs of @node with @err, if one of
+ * them comes before the first failed program so far, *@fail.
+ */
+static
+void multi_fail(const struct bpf_multi_node *node, int err, size_t *fail,
+		int *errp)
+{
+	size_t i;
+
+	for (i = 0; i < node->nr_progs; i++) {
+		if (node->progs[i] < *fail) {
+			*fail = node->progs[i];
+			*errp = err;
+		}
+	}
+}
+
+/* Resume the run of @node at @pc. */
+static
+void multi_run_node(const struct bpf_multi_node *node, __s64 *reg,
+		__u64 *stack, size_t pc, __u64 *matched, size_t *fail, int *errp)
+{
+	__s64 saved_reg[MAX_BPF_REG];
+	__u64 saved_stack[BPF_STACK_SIZE / sizeof(__u64)];
+	int err;
+	size_t i;
+
+	if (pc < node->lcp || !node->nr_children) {
+		err = run_segment(node->insns, node->len, reg, &pc,
+				node->nr_children ? node->lcp : 0);
+		if (err != BPF_SEGMENT_STOPPED) {
+			/* Exit or error in the common prefix. */
+			if (err)
+				multi_fail(node, err, fail, errp);
+			else if (reg[BPF_REG_0])
+				multi_match(node, matched);
+			return;
+		}
+	}
+	if (node->nr_children > 1) {
+		memcpy(saved_reg, reg, sizeof(saved_reg));
+		memcpy(saved_stack, stack, sizeof(saved_stack));
+	}
+	for (i = 0; i < node->nr_children; i++) {
+		if (i) {
+			memcpy(reg, saved_reg, sizeof(saved_reg));
+			memcpy(stack, saved_stack, sizeof(saved_stack));
+		}
+		multi_run_node(node->children[i], reg, stack, pc, matched, fail,
+			errp);
+	}
+}
+
+int bpf_multi_run(const struct bpf_multi *multi, void *ctx, size_t ctx_len,
+		__u64 *matched)
+{
+	__s64 reg[MAX_BPF_REG] = { 0 };
+	__u64 stack[BPF_STACK_SIZE / sizeof(__u64)];
+	size_t fail = multi->nr_progs;
+	int err = BPF_ERR_NONE;
+
+	if (ctx_len < multi->ctx_size)
+		return BPF_ERR_CTX_SIZE;
+	memset(matched, 0, (multi->nr_progs + 63) / 64 * sizeof(*matched));
+	reg[BPF_REG_1] = (unsigned long) ctx;
+	reg[BPF_REG_2] = ctx_len;
+	reg[BPF_REG_10] = (unsigned long) stack + sizeof(stack);
+	bpf_read_lock();
+	multi_run_node(multi->root, reg, stack, 0, matched, &fail, &err);
+	bpf_read_unlock();
+	return err;
+}
@@ -0,0 +1,962 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+/*
+ * Bytecode optimizer, run by bpf_prog_load() between validation and
+ * engine preparation. Each pass rewrites the bytecode in place into an
+ * equivalent, shorter program which still validates:
+ *
+ * - constant propagation and folding, including register operands
+ *   turned into immediates and branches on constant conditions,
+ * - dead code elimination: register writes never read, stack stores
+ *   overwritten or dropped before any load, unreachable code,
+ * - jump threading through unconditional jumps and repeated tests,
+ *
+ * then removed instructions are squeezed out and jump offsets fixed
+ * up. Instructions which can fail at runtime (division by zero, shift
+ * out of range) are never folded nor removed, so errors are preserved.
+ * Only r0 and memory are preserved on exit, other registers may hold
+ * different values.
+ */
+
+#define OPT_MAX_PASSES		8
+
+enum val_kind {
+	VAL_UNDEF = 0,		/* nothing known yet */
+	VAL_CONST,		/* known scalar */
+	VAL_FP,			/* frame pointer plus a known offset */
+	VAL_VARYING,
+};
+
+struct val {
+	enum val_kind	kind;
+	__s64		v;
+};
+
+struct opt_state {
+	struct val	reg[MAX_BPF_REG];
+	bool		reached;
+};
+
+/* Live registers and stack bytes at an instruction. */
+struct opt_live {
+	__u16		regs;
+	__u64		stack[BPF_STACK_SIZE / 64];
+};
+
+struct opt_ctx {
+	struct bpf_insn		*insns;
+	size_t			len;
+	bool			*removed;
+	size_t			*order;		/* topological order */
+	size_t			nr_order;
+	struct opt_state	*states;	/* at instruction entry */
+	struct opt_live		*live;		/* at instruction entry */
+	size_t			*scratch;
+};
+
+static
+bool is_jump(const struct bpf_insn *insn)
+{
+	unsigned int bpf_class = BPF_CLASS(insn->code);
+
+	return (bpf_class == BPF_JMP || bpf_class == BPF_JMP32)
+		&& insn->code != (BPF_JMP | BPF_CALL)
+		&& insn->code != (BPF_JMP | BPF_EXIT);
+}
+
+static
+bool is_cond_jump(const struct bpf_insn *insn)
+{
+	return is_jump(insn) && BPF_OP(insn->code) != BPF_JA;
+}
+
+static
+size_t insn_width(const struct bpf_insn *insn)
+{
+	return is_imm64(insn) ? 2 : 1;
+}
+
+static
+void remove_insn(struct opt_ctx *ctx, size_t pc)
+{
+	ctx->removed[pc] = true;
+	if (is_imm64(&ctx->insns[pc]))
+		ctx->removed[pc + 1] = true;
+}
+
+/* Replace @pc by @insn, returns whether anything changed. */
+static
+bool rewrite_insn(struct opt_ctx *ctx, size_t pc, const struct bpf_insn *insn)
+{
+	if (!memcmp(&ctx->insns[pc], insn, sizeof(*insn)))
+		return false;
+	ctx->insns[pc] = *insn;
+	return true;
+}
+
+/*
+ * Depth-first search from the entry point: store the reachable
+ * instructions in topological order, and remove the others. Validated
+ * bytecode has no loop.
+ */
+static
+int topo_order(struct opt_ctx *ctx)
+{
+	size_t len = ctx->len, *stack = ctx->scratch, *next, sp = 0, n = 0, i;
+	bool *visited;
+
+	visited = calloc(len, sizeof(*visited));
+	next = calloc(len, sizeof(*next));
+	if (!visited || !next) {
+		free(next);
+		free(visited);
+		return -1;
+	}
+	visited[0] = true;
+	stack[sp++] = 0;
+	while (sp) {
+		size_t pc = stack[sp - 1];
+		ssize_t succ[2];
+		int nr_succ = cfg_successors(ctx->insns, pc, succ);
+
+		if (next[pc] < nr_succ) {
+			size_t target = succ[next[pc]++];
+
+			if (target < len && !visited[target]) {
+				visited[target] = true;
+				stack[sp++] = target;
+			}
+			continue;
+		}
+		/* Post-order, reversed below. */
+		ctx->order[n++] = pc;
+		sp--;
+	}
+	for (i = 0; i < n / 2; i++) {
+		size_t tmp = ctx->order[i];
+
+		ctx->order[i] = ctx->order[n - 1 - i];
+		ctx->order[n - 1 - i] = tmp;
+	}
+	ctx->nr_order = n;
+	for (i = 0; i < len; i += insn_width(&ctx->insns[i])) {
+		if (!visited[i])
+			remove_insn(ctx, i);
+	}
+	free(next);
+	free(visited);
+	return 0;
+}
+
+/* Compute @d op @s as the engines do, returns -1 on runtime error. */
+static
+int eval_alu(__u8 code, __s64 d, __s64 s, __s64 *res)
+{
+	bool alu64 = BPF_CLASS(code) == BPF_ALU64;
+	__s64 width = alu64 ? 64 : 32;
+	__u64 r;
+
+	switch (BPF_OP(code)) {
+	case BPF_ADD:
+		r = (__u64) d + s;
+		break;
+	case BPF_SUB:
+		r = (__u64) d - s;
+		break;
+	case BPF_MUL:
+		r = (__u64) d * s;
+		break;
+	case BPF_DIV:
+		if (!s)
+			return -1;
+		r = bpf_sdiv(d, s);
+		break;
+	case BPF_MOD:
+		if (s <= 0)
+			return -1;
+		r = d % s;
+		break;
+	case BPF_OR:
+		r = d | s;
+		break;
+	case BPF_AND:
+		r = d & s;
+		break;
+	case BPF_XOR:
+		r = d ^ s;
+		break;
+	case BPF_LSH:
+		if (s < 0 || s >= width)
+			return -1;
+		r = (__u64) d << s;
+		break;
+	case BPF_RSH:
+		if (s < 0 || s >= width)
+			return -1;
+		r = (__u64) d >> s;
+		break;
+	case BPF_ARSH:
+		if (s < 0 || s >= width)
+			return -1;
+		r = d >> s;
+		break;
+	case BPF_NEG:
+		r = -(__u64) d;
+		break;
+	case BPF_MOV:
+		r = s;
+		break;
+	default:
+		return -1;
+	}
+	*res = alu64 ? r : (__u32) r;
+	return 0;
+}
+
+/* Outcome of a conditional jump on known operands. */
+static
+bool eval_jmp(__u8 code, __s64 d, __s64 s)
+{
+	__u64 ud = d, us = s;
+
+	if (BPF_CLASS(code) == BPF_JMP32) {
+		ud = (__u32) d;
+		us = (__u32) s;
+		d = (__s32) d;
+		s = (__s32) s;
+	}
+	switch (BPF_OP(code)) {
+	case BPF_JEQ:
+		return ud == us;
+	case BPF_JNE:
+		return ud != us;
+	case BPF_JGT:
+		return ud > us;
+	case BPF_JGE:
+		return ud >= us;
+	case BPF_JLT:
+		return ud < us;
+	case BPF_JLE:
+		return ud <= us;
+	case BPF_JSET:
+		return ud & us;
+	case BPF_JSGT:
+		return d > s;
+	case BPF_JSGE:
+		return d >= s;
+	case BPF_JSLT:
+		return d < s;
+	case BPF_JSLE:
+		return d <= s;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Whether the register operand @s of @code can be replaced by a 32-bit
+ * immediate, which the engines sign-extend.
+ */
+static
+bool imm_fits(__u8 code, __s64 s)
+{
+	if (s == (__s32) s)
+		return true;
+	switch (BPF_CLASS(code)) {
+	case BPF_ALU:
+		/* Only the low 32 bits of the operands matter. */
+		switch (BPF_OP(code)) {
+		case BPF_ADD:
+		case BPF_SUB:
+		case BPF_MUL:
+		case BPF_OR:
+		case BPF_AND:
+		case BPF_XOR:
+		case BPF_MOV:
+			return true;
+		}
+		return false;
+	case BPF_JMP32:
+		return true;
+	case BPF_STX:
+		return BPF_SIZE(code) != BPF_DW;
+	default:
+		return false;
+	}
+}
+
+static
+void merge_val(struct val *dst, const struct val *src)
+{
+	if (dst->kind != src->kind || dst->v != src->v) {
+		dst->kind = VAL_VARYING;
+		dst->v = 0;
+	}
+}
+
+static
+void merge_opt_state(struct opt_state *dst, const struct opt_state *src)
+{
+	int i;
+
+	if (!dst->reached) {
+		*dst = *src;
+		return;
+	}
+	for (i = 0; i < MAX_BPF_REG; i++)
+		merge_val(&dst->reg[i], &src->reg[i]);
+}
+
+static
+void set_val(struct val *r, enum val_kind kind, __s64 v)
+{
+	r->kind = kind;
+	r->v = v;
+}
+
+/* Fold an ALU instruction, and compute its result. */
+static
+bool fold_alu(struct opt_ctx *ctx, size_t pc, struct opt_state *st)
+{
+	struct bpf_insn insn = ctx->insns[pc];
+	bool alu64 = BPF_CLASS(insn.code) == BPF_ALU64;
+	int op = BPF_OP(insn.code);
+	struct val *dst = &st->reg[insn.dst_reg], s = { VAL_CONST, insn.imm };
+	bool changed = false;
+	__s64 r;
+
+	if (BPF_SRC(insn.code) == BPF_X && op != BPF_NEG) {
+		s = st->reg[insn.src_reg];
+		if (s.kind == VAL_CONST && imm_fits(insn.code, s.v)) {
+			insn.code = BPF_CLASS(insn.code) | op | BPF_K;
+			insn.src_reg = 0;
+			insn.imm = s.v;
+			changed |= rewrite_insn(ctx, pc, &insn);
+		}
+	}
+	if (op == BPF_MOV) {
+		if (s.kind == VAL_CONST) {
+			eval_alu(insn.code, 0, s.v, &r);
+			set_val(dst, VAL_CONST, r);
+		} else if (s.kind == VAL_FP && alu64)
+			*dst = s;
+		else
+			set_val(dst, VAL_VARYING, 0);
+		return changed;
+	}
+	if (dst->kind == VAL_CONST && (op == BPF_NEG || s.kind == VAL_CONST)
+	    && !eval_alu(insn.code, dst->v, s.v, &r)) {
+		set_val(dst, VAL_CONST, r);
+		/* Materialize the result with a single move. */
+		if (alu64 && r == (__s32) r)
+			insn.code = BPF_ALU64 | BPF_MOV | BPF_K;
+		else if ((__u64) r <= UINT32_MAX)
+			insn.code = BPF_ALU | BPF_MOV | BPF_K;
+		else
+			return changed;
+		insn.src_reg = 0;
+		insn.off = 0;
+		insn.imm = r;
+		return rewrite_insn(ctx, pc, &insn) || changed;
+	}
+	if (dst->kind == VAL_FP && alu64 && s.kind == VAL_CONST
+	    && (op == BPF_ADD || op == BPF_SUB)) {
+		dst->v = op == BPF_ADD ? (__u64) dst->v + s.v : (__u64) dst->v - s.v;
+		return changed;
+	}
+	set_val(dst, VAL_VARYING, 0);
+	return changed;
+}
+
+/*
+ * Fold a conditional jump. Returns its outcome: 1 when always taken,
+ * 0 when never taken, -1 when unknown.
+ */
+static
+int fold_jmp(struct opt_ctx *ctx, size_t pc, struct opt_state *st,
+		bool *changed)
+{
+	struct bpf_insn insn = ctx->insns[pc];
+	struct val d = st->reg[insn.dst_reg], s = { VAL_CONST, insn.imm };
+
+	if (BPF_SRC(insn.code) == BPF_X) {
+		s = st->reg[insn.src_reg];
+		if (s.kind == VAL_CONST && imm_fits(insn.code, s.v)) {
+			insn.code = BPF_CLASS(insn.code) | BPF_OP(insn.code) | BPF_K;
+			insn.src_reg = 0;
+			insn.imm = s.v;
+			*changed |= rewrite_insn(ctx, pc, &insn);
+		}
+	}
+	if (d.kind != VAL_CONST || s.kind != VAL_CONST)
+		return -1;
+	return eval_jmp(insn.code, d.v, s.v);
+}
+
+/*
+ * Forward pass in topological order: propagate constants and frame
+ * pointer offsets, fold what they decide, and remove the branches
+ * never taken and the code they guarded.
+ */
+static
+bool fold_constants(struct opt_ctx *ctx)
+{
+	struct opt_state *states = ctx->states;
+	bool changed = false;
+	size_t k, i;
+
+	memset(states, 0, ctx->len * sizeof(*states));
+	/* Nothing is assumed about the registers on entry. */
+	for (i = 0; i < MAX_BPF_REG; i++)
+		set_val(&states[0].reg[i], VAL_VARYING, 0);
+	set_val(&states[0].reg[BPF_REG_10], VAL_FP, 0);
+	states[0].reached = true;
+
+	for (k = 0; k < ctx->nr_order; k++) {
+		size_t pc = ctx->order[k];
+		struct bpf_insn *insn = &ctx->insns[pc];
+		struct opt_state st = states[pc];
+		ssize_t succ[2];
+		int j, nr_succ, taken;
+
+		if (!st.reached)
+			continue;
+		switch (BPF_CLASS(insn->code)) {
+		case BPF_LD:
+			if (is_packet_load(insn)) {
+				for (i = BPF_REG_0; i <= BPF_REG_5; i++)
+					set_val(&st.reg[i], VAL_VARYING, 0);
+			} else if (insn->src_reg == BPF_PSEUDO_MAP_IDX)
+				set_val(&st.reg[insn->dst_reg], VAL_VARYING, 0);
+			else if (is_imm64(insn))
+				set_val(&st.reg[insn->dst_reg], VAL_CONST,
+					((__u64) (insn + 1)->imm << 32) | (__u32) insn->imm);
+			else
+				set_val(&st.reg[insn->dst_reg], VAL_CONST, insn->imm);
+			break;
+		case BPF_LDX:
+			set_val(&st.reg[insn->dst_reg], VAL_VARYING, 0);
+			break;
+		case BPF_STX:
+			if (BPF_MODE(insn->code) == BPF_ATOMIC) {
+				int op = atomic_op(insn->imm);
+
+				if (op == BPF_AOP_CMPXCHG)
+					set_val(&st.reg[BPF_REG_0], VAL_VARYING, 0);
+				else if (op >= BPF_AOP_FETCH_ADD)
+					set_val(&st.reg[insn->src_reg], VAL_VARYING, 0);
+			} else if (st.reg[insn->src_reg].kind == VAL_CONST
+				   && imm_fits(insn->code, st.reg[insn->src_reg].v)) {
+				struct bpf_insn st_insn = *insn;
+
+				st_insn.code = BPF_ST | BPF_SIZE(insn->code)
+					| BPF_MODE(insn->code);
+				st_insn.src_reg = 0;
+				st_insn.imm = st.reg[insn->src_reg].v;
+				changed |= rewrite_insn(ctx, pc, &st_insn);
+			}
+			break;
+		case BPF_ALU:
+		case BPF_ALU64:
+			changed |= fold_alu(ctx, pc, &st);
+			break;
+		case BPF_JMP:
+		case BPF_JMP32:
+			if (insn->code == (BPF_JMP | BPF_CALL)) {
+				for (i = BPF_REG_0; i <= BPF_REG_5; i++)
+					set_val(&st.reg[i], VAL_VARYING, 0);
+				break;
+			}
+			if (!is_cond_jump(insn))
+				break;
+			taken = fold_jmp(ctx, pc, &st, &changed);
+			if (taken == 1) {
+				struct bpf_insn ja = {
+					.code = BPF_JMP | BPF_JA,
+					.off = insn->off,
+				};
+
+				changed |= rewrite_insn(ctx, pc, &ja);
+			} else if (!taken) {
+				remove_insn(ctx, pc);
+				changed = true;
+			}
+			break;
+		}
+
+		if (ctx->removed[pc]) {
+			nr_succ = 1;
+			succ[0] = pc + 1;
+		} else
+			nr_succ = cfg_successors(ctx->insns, pc, succ);
+		for (j = 0; j < nr_succ; j++) {
+			if ((size_t) succ[j] < ctx->len)
+				merge_opt_state(&states[succ[j]], &st);
+		}
+	}
+	/* Code only reachable through branches never taken. */
+	for (k = 0; k < ctx->nr_order; k++) {
+		size_t pc = ctx->order[k];
+
+		if (!states[pc].reached) {
+			remove_insn(ctx, pc);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+/* Registers read and written by @insn. */
+static
+void insn_regs(const struct bpf_insn *insn, __u16 *use, __u16 *def)
+{
+	__u16 dst = 1U << insn->dst_reg, src = 1U << insn->src_reg;
+	int op;
+
+	*use = 0;
+	*def = 0;
+	switch (BPF_CLASS(insn->code)) {
+	case BPF_LD:
+		if (is_packet_load(insn)) {
+			*use = 1U << BPF_REG_6;
+			if (BPF_MODE(insn->code) == BPF_IND)
+				*use |= src;
+			*def = 0x3f;	/* r0-r5 */
+		} else
+			*def = dst;
+		break;
+	case BPF_LDX:
+		*use = src;
+		*def = dst;
+		break;
+	case BPF_ST:
+		*use = dst;
+		break;
+	case BPF_STX:
+		*use = dst | src;
+		if (BPF_MODE(insn->code) != BPF_ATOMIC)
+			break;
+		op = atomic_op(insn->imm);
+		if (op == BPF_AOP_CMPXCHG) {
+			*use |= 1U << BPF_REG_0;
+			*def = 1U << BPF_REG_0;
+		} else if (op >= BPF_AOP_FETCH_ADD)
+			*def = src;
+		break;
+	case BPF_ALU:
+	case BPF_ALU64:
+		if (BPF_OP(insn->code) != BPF_MOV)
+			*use = dst;
+		if (BPF_SRC(insn->code) == BPF_X && BPF_OP(insn->code) != BPF_NEG)
+			*use |= src;
+		*def = dst;
+		break;
+	case BPF_JMP:
+	case BPF_JMP32:
+		if (insn->code == (BPF_JMP | BPF_CALL)) {
+			*use = 0x3e;	/* r1-r5 */
+			*def = 0x3f;	/* r0-r5 */
+		} else if (insn->code == (BPF_JMP | BPF_EXIT))
+			*use = 1U << BPF_REG_0;
+		else if (is_cond_jump(insn)) {
+			*use = dst;
+			if (BPF_SRC(insn->code) == BPF_X)
+				*use |= src;
+		}
+		break;
+	}
+}
+
+/* Whether the engines may fail on @insn (and so must execute it). */
+static
+bool insn_may_fail(const struct bpf_insn *insn)
+{
+	__s32 width = BPF_CLASS(insn->code) == BPF_ALU64 ? 64 : 32;
+	bool reg = BPF_SRC(insn->code) == BPF_X;
+
+	switch (BPF_OP(insn->code)) {
+	case BPF_DIV:
+		return reg || !insn->imm || insn->imm == -1;
+	case BPF_MOD:
+		return reg || insn->imm <= 0;
+	case BPF_LSH:
+	case BPF_RSH:
+	case BPF_ARSH:
+		return reg || insn->imm < 0 || insn->imm >= width;
+	default:
+		return false;
+	}
+}
+
+/* 64-bit operations leaving their destination unchanged. */
+static
+bool insn_is_nop(const struct bpf_insn *insn)
+{
+	if (BPF_CLASS(insn->code) != BPF_ALU64)
+		return false;
+	if (BPF_SRC(insn->code) == BPF_X)
+		return BPF_OP(insn->code) == BPF_MOV && insn->dst_reg == insn->src_reg;
+	switch (BPF_OP(insn->code)) {
+	case BPF_ADD:
+	case BPF_SUB:
+	case BPF_OR:
+	case BPF_XOR:
+	case BPF_LSH:
+	case BPF_RSH:
+	case BPF_ARSH:
+		return !insn->imm;
+	case BPF_MUL:
+	case BPF_DIV:
+		return insn->imm == 1;
+	default:
+		return false;
+	}
+}
+
+/* Write-only instructions, removable when their result is dead. */
+static
+bool insn_is_pure(const struct bpf_insn *insn)
+{
+	switch (BPF_CLASS(insn->code)) {
+	case BPF_LD:
+		/* Packet loads may exit. */
+		return !is_packet_load(insn);
+	case BPF_LDX:
+		return BPF_MODE(insn->code) == BPF_MEM;
+	case BPF_ALU:
+	case BPF_ALU64:
+		return !insn_may_fail(insn);
+	default:
+		return false;
+	}
+}
+
+static
+void merge_live(struct opt_live *dst, const struct opt_live *src)
+{
+	size_t i;
+
+	dst->regs |= src->regs;
+	for (i = 0; i < BPF_STACK_SIZE / 64; i++)
+		dst->stack[i] |= src->stack[i];
+}
+
+static
+int mem_size(const struct bpf_insn *insn)
+{
+	switch (BPF_SIZE(insn->code)) {
+	case BPF_B:
+		return 1;
+	case BPF_H:
+		return 2;
+	case BPF_W:
+		return 4;
+	default:
+		return 8;
+	}
+}
+
+static
+void stack_set(struct opt_live *live, int lo, int size, bool set)
+{
+	int i;
+
+	for (i = lo; i < lo + size; i++) {
+		if (set)
+			live->stack[i / 64] |= 1ULL << (i % 64);
+		else
+			live->stack[i / 64] &= ~(1ULL << (i % 64));
+	}
+}
+
+static
+bool stack_is_live(const struct opt_live *live, int lo, int size)
+{
+	int i;
+
+	for (i = lo; i < lo + size; i++) {
+		if (live->stack[i / 64] & (1ULL << (i % 64)))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Stack bytes accessed by a memory instruction through a frame pointer
+ * based register: returns the offset of the first byte from the bottom
+ * of the stack, or -1 when unknown.
+ */
+static
+int stack_access(const struct opt_state *st, const struct bpf_insn *insn,
+		int size)
+{
+	int base = BPF_CLASS(insn->code) == BPF_LDX ? insn->src_reg : insn->dst_reg;
+	const struct val *r = &st->reg[base];
+	__s64 lo;
+
+	if (r->kind != VAL_FP)
+		return -1;
+	lo = r->v + insn->off + BPF_STACK_SIZE;
+	if (lo < 0 || lo + size > BPF_STACK_SIZE)
+		return -1;
+	return lo;
+}
+
+/*
+ * Backward liveness pass: remove register writes and stack stores
+ * which nothing reads before the next write or the program exit.
+ */
+static
+bool eliminate_dead_code(struct opt_ctx *ctx)
+{
+	struct opt_live *live = ctx->live;
+	bool changed = false;
+	size_t k;
+
+	/* Falling off the end exits: r0 is read, the stack dies. */
+	memset(&live[ctx->len], 0, sizeof(live[ctx->len]));
+	live[ctx->len].regs = 1U << BPF_REG_0;
+
+	for (k = ctx->nr_order; k-- > 0;) {
+		size_t pc = ctx->order[k];
+		struct bpf_insn *insn = &ctx->insns[pc];
+		const struct opt_state *st = &ctx->states[pc];
+		struct opt_live out = { 0 };
+		ssize_t succ[2];
+		int j, nr_succ, size, lo;
+		__u16 use, def;
+
+		if (!st->reached)
+			continue;
+		if (ctx->removed[pc]) {
+			live[pc] = live[pc + insn_width(insn)];
+			continue;
+		}
+		nr_succ = cfg_successors(ctx->insns, pc, succ);
+		for (j = 0; j < nr_succ; j++)
+			merge_live(&out, &live[succ[j]]);
+		insn_regs(insn, &use, &def);
+		if (insn_is_nop(insn)
+		    || (insn_is_pure(insn) && !(out.regs & def))) {
+			remove_insn(ctx, pc);
+			live[pc] = out;
+			changed = true;
+			continue;
+		}
+		size = mem_size(insn);
+		switch (BPF_CLASS(insn->code)) {
+		case BPF_LDX:
+			lo = stack_access(st, insn, size);
+			if (lo < 0)
+				memset(out.stack, 0xff, sizeof(out.stack));
+			else
+				stack_set(&out, lo, size, true);
+			break;
+		case BPF_ST:
+		case BPF_STX:
+			lo = stack_access(st, insn, size);
+			if (BPF_MODE(insn->code) == BPF_ATOMIC) {
+				if (lo < 0)
+					memset(out.stack, 0xff, sizeof(out.stack));
+				else
+					stack_set(&out, lo, size, true);
+				break;
+			}
+			if (lo < 0)
+				break;
+			if (BPF_MODE(insn->code) == BPF_MEM
+			    && !stack_is_live(&out, lo, size)) {
+				remove_insn(ctx, pc);
+				live[pc] = out;
+				changed = true;
+				continue;
+			}
+			stack_set(&out, lo, size, false);
+			break;
+		case BPF_JMP:
+			if (insn->code == (BPF_JMP | BPF_CALL))
+				/* Helpers may read the stack through pointers. */
+				memset(out.stack, 0xff, sizeof(out.stack));
+			else if (insn->code == (BPF_JMP | BPF_EXIT))
+				memset(out.stack, 0, sizeof(out.stack));
+			break;
+		}
+		out.regs = (out.regs & ~def) | use;
+		live[pc] = out;
+	}
+	return changed;
+}
+
+/*
+ * Squeeze out removed instructions. Jumps to a removed instruction
+ * land on the next one kept.
+ */
+static
+bool compact(struct opt_ctx *ctx)
+{
+	size_t *new_pc = ctx->scratch, n = 0, i;
+
+	for (i = 0; i < ctx->len; i++) {
+		new_pc[i] = n;
+		if (!ctx->removed[i])
+			n++;
+	}
+	new_pc[ctx->len] = n;
+	if (n == ctx->len)
+		return false;
+	for (i = 0; i < ctx->len; i++) {
+		struct bpf_insn *insn = &ctx->insns[i];
+
+		if (ctx->removed[i])
+			continue;
+		if (is_jump(insn))
+			insn->off = new_pc[i + insn->off + 1] - new_pc[i] - 1;
+		ctx->insns[new_pc[i]] = *insn;
+		if (is_imm64(insn)) {
+			ctx->insns[new_pc[i] + 1] = ctx->insns[i + 1];
+			i++;
+		}
+	}
+	if (!n) {
+		/* Nothing left but falling off the end. */
+		ctx->insns[0] = (struct bpf_insn) { .code = BPF_JMP | BPF_EXIT };
+		n = 1;
+	}
+	ctx->len = n;
+	memset(ctx->removed, 0, n * sizeof(*ctx->removed));
+	return true;
+}
+
+/* Conditional jump taken when @a is not taken, with the same operands. */
+static
+bool is_inverse_jmp(const struct bpf_insn *a, const struct bpf_insn *b)
+{
+	static const __u8 inverse[16] = {
+		[BPF_JEQ >> 4] = BPF_JNE,
+		[BPF_JNE >> 4] = BPF_JEQ,
+		[BPF_JGT >> 4] = BPF_JLE,
+		[BPF_JLE >> 4] = BPF_JGT,
+		[BPF_JGE >> 4] = BPF_JLT,
+		[BPF_JLT >> 4] = BPF_JGE,
+		[BPF_JSGT >> 4] = BPF_JSLE,
+		[BPF_JSLE >> 4] = BPF_JSGT,
+		[BPF_JSGE >> 4] = BPF_JSLT,
+		[BPF_JSLT >> 4] = BPF_JSGE,
+	};
+	__u8 op = inverse[BPF_OP(a->code) >> 4];
+
+	return op && b->code == (BPF_CLASS(a->code) | op | BPF_SRC(a->code));
+}
+
+static
+bool same_operands(const struct bpf_insn *a, const struct bpf_insn *b)
+{
+	if (a->dst_reg != b->dst_reg)
+		return false;
+	if (BPF_SRC(a->code) == BPF_X)
+		return a->src_reg == b->src_reg;
+	return a->imm == b->imm;
+}
+
+/*
+ * Retarget jumps landing on an unconditional jump, or on a test whose
+ * outcome is implied by the jump taken. Unconditional jumps to an exit
+ * become the exit, jumps to the next instruction are removed.
+ */
+static
+bool thread_jumps(struct opt_ctx *ctx)
+{
+	bool changed = false;
+	size_t i;
+
+	for (i = 0; i < ctx->len; i += insn_width(&ctx->insns[i])) {
+		struct bpf_insn *insn = &ctx->insns[i];
+		size_t target, hops;
+
+		if (!is_jump(insn))
+			continue;
+		target = i + insn->off + 1;
+		for (hops = 0; hops < ctx->len && target < ctx->len; hops++) {
+			const struct bpf_insn *next = &ctx->insns[target];
+
+			if (next->code == (BPF_JMP | BPF_JA)
+			    || next->code == (BPF_JMP32 | BPF_JA))
+				target += next->off + 1;
+			else if (is_cond_jump(insn) && is_cond_jump(next)
+				 && same_operands(insn, next)
+				 && next->code == insn->code)
+				target += next->off + 1;
+			else if (is_cond_jump(insn) && is_cond_jump(next)
+				 && same_operands(insn, next)
+				 && is_inverse_jmp(insn, next))
+				target++;
+			else
+				break;
+		}
+		if (BPF_OP(insn->code) == BPF_JA
+		    && (target == ctx->len
+		        || ctx->insns[target].code == (BPF_JMP | BPF_EXIT))) {
+			*insn = (struct bpf_insn) { .code = BPF_JMP | BPF_EXIT };
+			changed = true;
+			continue;
+		}
+		if (target == i + 1) {
+			remove_insn(ctx, i);
+			changed = true;
+		} else if (target != i + insn->off + 1) {
+			insn->off = target - i - 1;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+/*
+ * Optimize validated @bytecode in place, updating @len. Returns 0 on
+ * success, -1 on allocation failure, leaving the bytecode equivalent.
+ */
+int optimize_bytecode(struct bpf_insn *bytecode, size_t *len)
+{
+	struct opt_ctx ctx = {
+		.insns = bytecode,
+		.len = *len,
+	};
+	int pass, ret = -1;
+	bool changed = true;
+
+	ctx.removed = calloc(*len + 1, sizeof(*ctx.removed));
+	ctx.order = calloc(*len, sizeof(*ctx.order));
+	ctx.states = calloc(*len, sizeof(*ctx.states));
+	ctx.live = calloc(*len + 1, sizeof(*ctx.live));
+	ctx.scratch = calloc(*len + 1, sizeof(*ctx.scratch));
+	if (!ctx.removed || !ctx.order || !ctx.states || !ctx.live
+	    || !ctx.scratch)
+		goto end;
+	for (pass = 0; pass < OPT_MAX_PASSES && changed; pass++) {
+		if (topo_order(&ctx))
+			goto end;
+		changed = fold_constants(&ctx);
+		changed |= eliminate_dead_code(&ctx);
+		compact(&ctx);
+		changed |= thread_jumps(&ctx);
+		compact(&ctx);
+	}
+	/* Threading may leave unreachable code behind. */
+	if (topo_order(&ctx))
+		goto end;
+	compact(&ctx);
+	*len = ctx.len;
+	ret = 0;
+end:
+	free(ctx.scratch);
+	free(ctx.live);
+	free(ctx.states);
+	free(ctx.order);
+	free(ctx.removed);
+	return ret;
+}
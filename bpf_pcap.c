@@ -0,0 +1,402 @@
+#include "./bpf.h"
+#include "./bpf_prog.h"
+#include "./bpf_cbpf.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Offline packet filter: run a program over every packet of a pcap
+ * capture, mapped in memory, report the throughput and optionally
+ * write the matching packets (r0 != 0) to another capture. Programs
+ * run on a struct bpf_packet holding the captured bytes of each
+ * packet. They are raw eBPF bytecode (an array of struct bpf_insn, as
+ * written in memory), or classic programs as printed by tcpdump -ddd
+ * with -C.
+ */
+
+#define PCAP_MAGIC		0xa1b2c3d4	/* microsecond timestamps */
+#define PCAP_MAGIC_NS		0xa1b23c4d	/* nanosecond timestamps */
+
+struct pcap_hdr {
+	__u32	magic;
+	__u16	version_major;
+	__u16	version_minor;
+	__s32	thiszone;
+	__u32	sigfigs;
+	__u32	snaplen;
+	__u32	linktype;
+};
+
+struct pcap_rec_hdr {
+	__u32	ts_sec;
+	__u32	ts_frac;
+	__u32	incl_len;
+	__u32	orig_len;
+};
+
+struct capture {
+	const __u8		*addr;
+	size_t			size;
+	struct bpf_packet	*pkts;
+	size_t			nr_pkts;
+};
+
+static const struct {
+	const char		*name;
+	enum bpf_engine		engine;
+} engines[] = {
+	{ "switch", BPF_ENGINE_SWITCH },
+	{ "threaded", BPF_ENGINE_THREADED },
+	{ "jit", BPF_ENGINE_JIT },
+	{ "aot", BPF_ENGINE_AOT },
+	{ "tiered", BPF_ENGINE_TIERED },
+};
+
+static
+__u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static
+void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-C] [-O] [-e engine] [-n passes] program capture [matches]\n"
+		"  -C         classic program, as printed by tcpdump -ddd\n"
+		"  -O         optimize (load with BPF_F_OPTIMIZE)\n"
+		"  -e engine  switch, threaded, jit (default), aot or tiered\n"
+		"  -n passes  filter the capture this many times, for timing\n",
+		name);
+}
+
+static
+__u32 swab32(__u32 x)
+{
+	return __builtin_bswap32(x);
+}
+
+/*
+ * Map @path and index its packets. Captures of the other byte order
+ * are supported. Returns 0 on success, -1 on error.
+ */
+static
+int capture_open(struct capture *cap, const char *path)
+{
+	const struct pcap_hdr *hdr;
+	bool swapped;
+	struct stat st;
+	size_t off, nr_alloc = 0;
+	int fd;
+
+	memset(cap, 0, sizeof(*cap));
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if (fstat(fd, &st) || st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "Error: %s is not a pcap capture\n", path);
+		close(fd);
+		return -1;
+	}
+	cap->size = st.st_size;
+	cap->addr = mmap(NULL, cap->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cap->addr == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+	madvise((void *) cap->addr, cap->size, MADV_SEQUENTIAL);
+
+	hdr = (const struct pcap_hdr *) cap->addr;
+	swapped = hdr->magic == swab32(PCAP_MAGIC)
+		|| hdr->magic == swab32(PCAP_MAGIC_NS);
+	if (!swapped && hdr->magic != PCAP_MAGIC && hdr->magic != PCAP_MAGIC_NS) {
+		fprintf(stderr, "Error: %s is not a pcap capture\n", path);
+		goto error;
+	}
+	for (off = sizeof(*hdr); off < cap->size; ) {
+		struct pcap_rec_hdr rec;
+		__u32 len;
+
+		if (cap->size - off < sizeof(rec)) {
+			fprintf(stderr, "Error: truncated record at offset %zu\n",
+				off);
+			goto error;
+		}
+		memcpy(&rec, cap->addr + off, sizeof(rec));
+		len = swapped ? swab32(rec.incl_len) : rec.incl_len;
+		off += sizeof(rec);
+		if (cap->size - off < len) {
+			fprintf(stderr, "Error: truncated packet at offset %zu\n",
+				off);
+			goto error;
+		}
+		if (cap->nr_pkts == nr_alloc) {
+			struct bpf_packet *pkts;
+
+			nr_alloc = nr_alloc ? 2 * nr_alloc : 4096;
+			pkts = realloc(cap->pkts, nr_alloc * sizeof(*pkts));
+			if (!pkts)
+				goto error;
+			cap->pkts = pkts;
+		}
+		cap->pkts[cap->nr_pkts].data = cap->addr + off;
+		cap->pkts[cap->nr_pkts].len = len;
+		cap->nr_pkts++;
+		off += len;
+	}
+	return 0;
+
+error:
+	munmap((void *) cap->addr, cap->size);
+	free(cap->pkts);
+	return -1;
+}
+
+static
+void capture_close(struct capture *cap)
+{
+	munmap((void *) cap->addr, cap->size);
+	free(cap->pkts);
+}
+
+/* Write the capture header and the records of the matching packets. */
+static
+int capture_write(const struct capture *cap, const bool *matched,
+		const char *path)
+{
+	FILE *out;
+	size_t i;
+	int ret = 0;
+
+	out = fopen(path, "wb");
+	if (!out) {
+		perror(path);
+		return -1;
+	}
+	if (fwrite(cap->addr, sizeof(struct pcap_hdr), 1, out) != 1)
+		ret = -1;
+	for (i = 0; !ret && i < cap->nr_pkts; i++) {
+		const __u8 *rec = (const __u8 *) cap->pkts[i].data
+			- sizeof(struct pcap_rec_hdr);
+		size_t size = sizeof(struct pcap_rec_hdr) + cap->pkts[i].len;
+
+		if (matched[i] && fwrite(rec, 1, size, out) != size)
+			ret = -1;
+	}
+	if (fclose(out))
+		ret = -1;
+	if (ret)
+		fprintf(stderr, "Error: cannot write %s\n", path);
+	return ret;
+}
+
+/* Read a classic program as printed by tcpdump -ddd. */
+static
+struct bpf_cbpf_insn *read_cbpf(const char *path, size_t *len)
+{
+	struct bpf_cbpf_insn *filter;
+	unsigned int code, jt, jf, k;
+	size_t i;
+	FILE *in;
+
+	in = fopen(path, "r");
+	if (!in) {
+		perror(path);
+		return NULL;
+	}
+	if (fscanf(in, "%zu", len) != 1 || !*len || *len > BPF_MAXINSNS) {
+		fprintf(stderr, "Error: %s is not a tcpdump -ddd program\n", path);
+		fclose(in);
+		return NULL;
+	}
+	filter = calloc(*len, sizeof(*filter));
+	if (!filter) {
+		fclose(in);
+		return NULL;
+	}
+	for (i = 0; i < *len; i++) {
+		if (fscanf(in, "%u %u %u %u", &code, &jt, &jf, &k) != 4) {
+			fprintf(stderr, "Error: %s: truncated at insn %zu\n",
+				path, i);
+			free(filter);
+			fclose(in);
+			return NULL;
+		}
+		filter[i] = (struct bpf_cbpf_insn) {
+			.code = code, .jt = jt, .jf = jf, .k = k,
+		};
+	}
+	fclose(in);
+	return filter;
+}
+
+/* Read raw eBPF bytecode, as bpf_aotc does. */
+static
+struct bpf_insn *read_bytecode(const char *path, size_t *len)
+{
+	struct bpf_insn *bytecode;
+	FILE *in;
+
+	bytecode = calloc(BPF_MAXINSNS + 1, sizeof(*bytecode));
+	if (!bytecode)
+		return NULL;
+	in = fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		free(bytecode);
+		return NULL;
+	}
+	*len = fread(bytecode, sizeof(*bytecode), BPF_MAXINSNS + 1, in);
+	fclose(in);
+	if (*len > BPF_MAXINSNS) {
+		fprintf(stderr, "Error: %s exceeds %d insn\n", path,
+			BPF_MAXINSNS);
+		free(bytecode);
+		return NULL;
+	}
+	return bytecode;
+}
+
+static
+struct bpf_prog *load_prog(const char *path, bool classic,
+		struct bpf_prog_opts *opts)
+{
+	struct bpf_cbpf_insn *filter = NULL;
+	struct bpf_insn *bytecode;
+	struct bpf_prog *prog = NULL;
+	char so_path[64];
+	size_t len;
+
+	if (classic) {
+		filter = read_cbpf(path, &len);
+		if (!filter)
+			return NULL;
+		if (bpf_cbpf_translate(filter, len, &bytecode, &len)) {
+			free(filter);
+			return NULL;
+		}
+		free(filter);
+	} else {
+		bytecode = read_bytecode(path, &len);
+		if (!bytecode)
+			return NULL;
+	}
+	opts->ctx_size = sizeof(struct bpf_packet);
+	if (opts->engine == BPF_ENGINE_AOT) {
+		snprintf(so_path, sizeof(so_path), "/tmp/bpf_pcap_%d.so",
+			(int) getpid());
+		if (bpf_prog_aot_compile(bytecode, len, opts, so_path))
+			goto end;
+		opts->aot_path = so_path;
+	}
+	prog = bpf_prog_load(bytecode, len, opts);
+	if (opts->engine == BPF_ENGINE_AOT)
+		unlink(so_path);
+end:
+	free(bytecode);
+	return prog;
+}
+
+int main(int argc, char **argv)
+{
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_JIT,
+	};
+	struct capture cap;
+	struct bpf_prog *prog;
+	unsigned long nr_passes = 1, pass;
+	size_t i, nr_matched = 0;
+	bool classic = false, *matched;
+	__u64 start, end, r0;
+	int opt, err, ret = 1;
+
+	while ((opt = getopt(argc, argv, "COe:n:")) != -1) {
+		switch (opt) {
+		case 'C':
+			classic = true;
+			break;
+		case 'O':
+			opts.flags |= BPF_F_OPTIMIZE;
+			break;
+		case 'e':
+			for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+				if (!strcmp(optarg, engines[i].name))
+					break;
+			}
+			if (i == sizeof(engines) / sizeof(engines[0])) {
+				usage(argv[0]);
+				return 1;
+			}
+			opts.engine = engines[i].engine;
+			break;
+		case 'n':
+			nr_passes = strtoul(optarg, NULL, 0);
+			if (!nr_passes) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind != 2 && argc - optind != 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	prog = load_prog(argv[optind], classic, &opts);
+	if (!prog)
+		return 1;
+	if (capture_open(&cap, argv[optind + 1]))
+		goto end_prog;
+	matched = calloc(cap.nr_pkts + 1, sizeof(*matched));
+	if (!matched)
+		goto end_cap;
+
+	start = now_ns();
+	for (pass = 0; pass < nr_passes; pass++) {
+		for (i = 0; i < cap.nr_pkts; i++) {
+			err = bpf_prog_run(prog, &cap.pkts[i], sizeof(cap.pkts[i]),
+					&r0);
+			if (err) {
+				fprintf(stderr, "Error: packet %zu: %s\n", i,
+					bpf_strerror(err));
+				goto end_matched;
+			}
+			matched[i] = r0;
+		}
+	}
+	end = now_ns();
+	for (i = 0; i < cap.nr_pkts; i++)
+		nr_matched += matched[i];
+
+	printf("%zu packets, %zu matched, %lu passes in %.3f ms: %.2f ns/packet, %.2f Mpackets/s\n",
+		cap.nr_pkts, nr_matched, nr_passes, (end - start) / 1e6,
+		cap.nr_pkts ? (double) (end - start) / (nr_passes * cap.nr_pkts) : 0,
+		end > start ? nr_passes * cap.nr_pkts * 1e3 / (end - start) : 0);
+	if (argc - optind == 3
+	    && capture_write(&cap, matched, argv[optind + 2]))
+		goto end_matched;
+	ret = 0;
+end_matched:
+	free(matched);
+end_cap:
+	capture_close(&cap);
+end_prog:
+	bpf_prog_destroy(prog);
+	return ret;
+}
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE	/* sched_getcpu() */
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+#if defined(__GLIBC__) && defined(__has_include)
+# if __has_include(<sys/rseq.h>)
+#  include <sys/rseq.h>
+#  define HAVE_RSEQ
+# endif
+#endif
+
+/*
+ * Per-CPU maps. The current CPU number comes from the rseq area which
+ * glibc registers for each thread: reading it costs a load, compared
+ * to a system call (or vDSO call) for sched_getcpu().
+ */
+
+#define CACHE_LINE_SIZE		64
+
+static int nr_possible_cpus;
+
+int bpf_num_possible_cpus(void)
+{
+	int nr = __atomic_load_n(&nr_possible_cpus, __ATOMIC_RELAXED);
+
+	if (!nr) {
+		nr = sysconf(_SC_NPROCESSORS_CONF);
+		if (nr < 1)
+			nr = 1;
+		__atomic_store_n(&nr_possible_cpus, nr, __ATOMIC_RELAXED);
+	}
+	return nr;
+}
+
+#ifdef HAVE_RSEQ
+static inline
+struct rseq *rseq_area(void)
+{
+	struct rseq *rs;
+
+	if (!__rseq_size)
+		return NULL;
+	rs = (struct rseq *) ((char *) __builtin_thread_pointer() + __rseq_offset);
+	/* Registration failed, or is not done yet. */
+	if ((__s32) __atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED) < 0)
+		return NULL;
+	return rs;
+}
+#endif
+
+static inline
+int clamp_cpu(int cpu)
+{
+	int nr = bpf_num_possible_cpus();
+
+	/* CPU numbers past the configured ones share slots. */
+	return cpu >= 0 && cpu < nr ? cpu : (unsigned int) cpu % nr;
+}
+
+int bpf_current_cpu(void)
+{
+#ifdef HAVE_RSEQ
+	struct rseq *rs = rseq_area();
+
+	if (rs)
+		return clamp_cpu(__atomic_load_n(&rs->cpu_id_start,
+			__ATOMIC_RELAXED));
+#endif
+	return clamp_cpu(sched_getcpu());
+}
+
+#if defined(HAVE_RSEQ) && defined(__x86_64__)
+/*
+ * Add @count to *@v if the thread still runs on @cpu, as a restartable
+ * sequence: the kernel aborts it on preemption, migration or signal
+ * delivery, and the add is a single (non-atomic) instruction commit.
+ * Returns 0 on success, -1 when aborted.
+ */
+static inline
+int rseq_addv(struct rseq *rs, __u64 *v, __u64 count, int cpu)
+{
+	__asm__ __volatile__ goto (
+		/* Critical section descriptor: start, length and abort. */
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0x0, 0x0\n\t"
+		".quad 1f, (2f - 1f), 4f\n\t"
+		".popsection\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %[rseq_cs]\n\t"
+		"1:\n\t"
+		"cmpl %[cpu_id], %[cpu]\n\t"
+		"jnz %l[abort]\n\t"
+		"addq %[count], %[v]\n\t"
+		"2:\n\t"
+		/* The abort handler is preceded by the rseq signature. */
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long %c[sig]\n\t"
+		"4:\n\t"
+		"jmp %l[abort]\n\t"
+		".popsection\n\t"
+		:
+		: [rseq_cs] "m" (rs->rseq_cs), [cpu_id] "m" (rs->cpu_id),
+		  [cpu] "r" (cpu), [v] "m" (*v), [count] "er" (count),
+		  [sig] "i" (RSEQ_SIG)
+		: "memory", "cc", "rax"
+		: abort);
+	return 0;
+abort:
+	return -1;
+}
+#endif
+
+/* Add @delta to the first 64-bit word of the current CPU slot. */
+static
+int percpu_add(struct bpf_map *map, const void *key, __u64 delta)
+{
+	__u64 *v;
+#if defined(HAVE_RSEQ) && defined(__x86_64__)
+	struct rseq *rs = rseq_area();
+	int cpu;
+
+	while (rs) {
+		cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+		v = map->ops->lookup_cpu(map, key, clamp_cpu(cpu));
+		if (!v)
+			return -ENOENT;
+		/* Shared slot, see clamp_cpu(). */
+		if (cpu >= bpf_num_possible_cpus())
+			break;
+		if (!rseq_addv(rs, v, delta, cpu))
+			return 0;
+	}
+#endif
+	/* No rseq: another thread may use the same slot. */
+	v = map->ops->lookup_cpu(map, key, bpf_current_cpu());
+	if (!v)
+		return -ENOENT;
+	__atomic_fetch_add(v, delta, __ATOMIC_RELAXED);
+	return 0;
+}
+
+__u64 bpf_helper_map_percpu_add(__u64 r1, __u64 r2, __u64 r3, __u64 r4,
+		__u64 r5)
+{
+	struct bpf_map *map = (struct bpf_map *) (unsigned long) r1;
+
+	if (!map->ops->lookup_cpu)
+		return -EINVAL;
+	return percpu_add(map, (void *) (unsigned long) r2, r3);
+}
+
+/*
+ * Per-CPU array: each CPU owns a contiguous, cache-line aligned region
+ * holding its values of all the elements.
+ */
+struct bpf_percpu_array {
+	struct bpf_map		map;
+	size_t			cpu_size;	/* per-CPU region size */
+	char			*values;
+};
+
+static
+void *percpu_array_lookup_cpu(struct bpf_map *map, const void *key, int cpu)
+{
+	struct bpf_percpu_array *array = (struct bpf_percpu_array *) map;
+	__u32 idx = *(const __u32 *) key;
+
+	if (idx >= map->max_entries)
+		return NULL;
+	return array->values + cpu * array->cpu_size
+		+ (size_t) idx * map->value_size;
+}
+
+static
+void *percpu_array_lookup(struct bpf_map *map, const void *key)
+{
+	return percpu_array_lookup_cpu(map, key, bpf_current_cpu());
+}
+
+static
+int percpu_array_update(struct bpf_map *map, const void *key,
+		const void *value, __u64 flags)
+{
+	void *slot = percpu_array_lookup(map, key);
+
+	if (!slot)
+		return -E2BIG;
+	if (flags == BPF_NOEXIST)
+		return -EEXIST;
+	memcpy(slot, value, map->value_size);
+	return 0;
+}
+
+static
+int percpu_array_delete(struct bpf_map *map, const void *key)
+{
+	return -EINVAL;
+}
+
+static
+void percpu_array_free(struct bpf_map *map)
+{
+	struct bpf_percpu_array *array = (struct bpf_percpu_array *) map;
+
+	free(array->values);
+	free(array);
+}
+
+static const struct bpf_map_ops percpu_array_ops = {
+	.lookup = percpu_array_lookup,
+	.update = percpu_array_update,
+	.delete = percpu_array_delete,
+	.free = percpu_array_free,
+	.lookup_cpu = percpu_array_lookup_cpu,
+};
+
+struct bpf_map *percpu_array_map_alloc(const struct bpf_map_attr *attr)
+{
+	struct bpf_percpu_array *array;
+	size_t size;
+
+	if (attr->key_size != sizeof(__u32)) {
+		fprintf(stderr, "Error: array keys are 32-bit indexes\n");
+		return NULL;
+	}
+	array = calloc(1, sizeof(*array));
+	if (!array)
+		return NULL;
+	array->map.ops = &percpu_array_ops;
+	array->cpu_size = ((size_t) attr->max_entries * attr->value_size
+		+ CACHE_LINE_SIZE - 1) & ~(size_t) (CACHE_LINE_SIZE - 1);
+	size = array->cpu_size * bpf_num_possible_cpus();
+	array->values = aligned_alloc(CACHE_LINE_SIZE, size);
+	if (!array->values) {
+		free(array);
+		return NULL;
+	}
+	memset(array->values, 0, size);
+	return &array->map;
+}
@@ -0,0 +1,438 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/*
+ * Worker pool with work-stealing deques, see bpf_pool_create().
+ *
+ * Submitted work goes to a queue shared by all workers, linked through
+ * the work items. A worker takes the whole range of contexts of a work
+ * item from the queue, and splits it: it pushes the upper half of its
+ * range to the bottom of its deque, and goes on with the lower half,
+ * down to BPF_POOL_CHUNK contexts, which it runs as a batch. Then it
+ * pops the last range it pushed, the smallest, and splits it in turn.
+ * Idle workers steal from the top of the other deques, where the
+ * largest ranges are, and split them the same way.
+ *
+ * The deques are the Chase-Lev deques of "Correct and Efficient
+ * Work-Stealing for Weak Memory Models" (Le et al.), on a fixed array:
+ * ranges are split in halves, so that a deque holds at most one range
+ * per bit of size_t. A worker which finds its deque full runs the
+ * range without splitting it.
+ *
+ * Workers with nothing to run or steal sleep on pool->work_cond.
+ * Workers pushing to their deque wake one of them up, and so does
+ * bpf_pool_submit().
+ */
+
+#define POOL_DEQUE_SIZE		128	/* power of 2 */
+#define POOL_STEAL_SPINS	64	/* steal attempts before sleeping */
+
+struct pool_range {
+	struct bpf_work		*work;
+	size_t			start, end;
+};
+
+struct pool_deque {
+	long			top __attribute__((aligned(64)));
+	long			bottom __attribute__((aligned(64)));
+	struct pool_range	ranges[POOL_DEQUE_SIZE];
+};
+
+struct pool_worker {
+	struct bpf_pool		*pool;
+	pthread_t		tid;
+	unsigned int		id;
+	struct pool_deque	deque;
+};
+
+struct bpf_pool {
+	struct pool_worker	*workers;
+	unsigned int		nr_workers;
+	pthread_mutex_t		lock;
+	pthread_cond_t		work_cond;
+	pthread_cond_t		done_cond;
+	/* Protected by lock. */
+	struct bpf_work		*head, *tail;
+	bool			stop;
+	/* Atomic. */
+	unsigned long		nr_pending;	/* submitted, not completed */
+	unsigned int		nr_sleeping;
+	unsigned int		nr_waiting;	/* on done_cond */
+};
+
+/*
+ * Range accesses of the deque: thieves may read a range while its
+ * owner writes it, before failing to take it.
+ */
+static
+void range_load(const struct pool_range *slot, struct pool_range *range)
+{
+	range->work = __atomic_load_n(&slot->work, __ATOMIC_RELAXED);
+	range->start = __atomic_load_n(&slot->start, __ATOMIC_RELAXED);
+	range->end = __atomic_load_n(&slot->end, __ATOMIC_RELAXED);
+}
+
+static
+void range_store(struct pool_range *slot, const struct pool_range *range)
+{
+	__atomic_store_n(&slot->work, range->work, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->start, range->start, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->end, range->end, __ATOMIC_RELAXED);
+}
+
+/* Push to the bottom of the deque of the calling worker. */
+static
+bool deque_push(struct pool_deque *d, const struct pool_range *range)
+{
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+	if (b - t >= POOL_DEQUE_SIZE)
+		return false;
+	range_store(&d->ranges[b & (POOL_DEQUE_SIZE - 1)], range);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/* Pop from the bottom of the deque of the calling worker. */
+static
+bool deque_pop(struct pool_deque *d, struct pool_range *range)
+{
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	long t;
+	bool ret = true;
+
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	range_load(&d->ranges[b & (POOL_DEQUE_SIZE - 1)], range);
+	if (t == b) {
+		/* Last range, race with thieves for it. */
+		ret = __atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return ret;
+}
+
+/* Steal from the top of the deque of another worker. */
+static
+bool deque_steal(struct pool_deque *d, struct pool_range *range)
+{
+	long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	long b;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return false;
+	range_load(&d->ranges[t & (POOL_DEQUE_SIZE - 1)], range);
+	return __atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static
+bool deque_empty(struct pool_deque *d)
+{
+	return __atomic_load_n(&d->top, __ATOMIC_SEQ_CST)
+		>= __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+}
+
+/* Wake up a sleeping worker, if any. */
+static
+void pool_wake(struct bpf_pool *pool)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&pool->nr_sleeping, __ATOMIC_SEQ_CST))
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Wake up the threads waiting for work to complete, if any. */
+static
+void pool_wake_waiting(struct bpf_pool *pool)
+{
+	if (!__atomic_load_n(&pool->nr_waiting, __ATOMIC_SEQ_CST))
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->done_cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static
+void work_complete(struct bpf_pool *pool, struct bpf_work *work)
+{
+	if (work->done)
+		work->done(work);
+	else
+		__atomic_store_n(&work->completed, 1, __ATOMIC_SEQ_CST);
+	/* @work may be gone. */
+	__atomic_fetch_sub(&pool->nr_pending, 1, __ATOMIC_SEQ_CST);
+	pool_wake_waiting(pool);
+}
+
+/*
+ * Run @range as a batch. The worker completing the last range of a
+ * work item completes it.
+ */
+static
+void range_run(struct bpf_pool *pool, const struct pool_range *range)
+{
+	struct bpf_work *work = range->work;
+	size_t nr = range->end - range->start, n;
+	int err;
+
+	/* No need to run past a failed run. */
+	if (range->start < __atomic_load_n(&work->nr_done, __ATOMIC_RELAXED)) {
+		if (work->ctxs)
+			n = bpf_prog_run_batch(work->prog,
+				work->ctxs + range->start, nr, work->ctx_len,
+				work->r0 + range->start, &err);
+		else
+			n = bpf_prog_run_strided(work->prog,
+				(char *) work->base + range->start * work->stride,
+				work->stride, nr, work->ctx_len,
+				work->r0 + range->start, &err);
+		if (n < nr) {
+			pthread_mutex_lock(&pool->lock);
+			if (range->start + n < work->nr_done) {
+				__atomic_store_n(&work->nr_done, range->start + n,
+					__ATOMIC_RELAXED);
+				work->err = err;
+			}
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+	if (__atomic_sub_fetch(&work->remaining, nr, __ATOMIC_ACQ_REL) == 0)
+		work_complete(pool, work);
+}
+
+/* Split @range down to BPF_POOL_CHUNK contexts, and run it. */
+static
+void range_split_run(struct pool_worker *w, struct pool_range *range)
+{
+	struct pool_range upper;
+	bool pushed = false;
+
+	while (range->end - range->start > BPF_POOL_CHUNK) {
+		upper = *range;
+		upper.start = range->start + (range->end - range->start) / 2;
+		if (!deque_push(&w->deque, &upper))
+			break;
+		range->end = upper.start;
+		pushed = true;
+	}
+	if (pushed)
+		pool_wake(w->pool);
+	range_run(w->pool, range);
+}
+
+static
+bool pool_steal(struct pool_worker *w, struct pool_range *range)
+{
+	struct bpf_pool *pool = w->pool;
+	unsigned int i, victim;
+
+	for (i = 1; i < pool->nr_workers; i++) {
+		victim = (w->id + i) % pool->nr_workers;
+		if (deque_steal(&pool->workers[victim].deque, range))
+			return true;
+	}
+	return false;
+}
+
+static
+bool pool_has_ranges(struct bpf_pool *pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->nr_workers; i++) {
+		if (!deque_empty(&pool->workers[i].deque))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Take a range from the queue, or sleep until there is one to steal.
+ * Returns false when the pool stops.
+ */
+static
+bool pool_wait_range(struct pool_worker *w, struct pool_range *range)
+{
+	struct bpf_pool *pool = w->pool;
+	struct bpf_work *work;
+	bool ret = true;
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_fetch_add(&pool->nr_sleeping, 1, __ATOMIC_SEQ_CST);
+	for (;;) {
+		work = pool->head;
+		if (work) {
+			pool->head = work->next;
+			if (!pool->head)
+				pool->tail = NULL;
+			range->work = work;
+			range->start = 0;
+			range->end = work->nr;
+			break;
+		}
+		if (pool->stop) {
+			ret = false;
+			break;
+		}
+		/* Pushers check nr_sleeping after pushing. */
+		if (pool_has_ranges(pool)) {
+			range->work = NULL;
+			break;
+		}
+		pthread_cond_wait(&pool->work_cond, &pool->lock);
+	}
+	__atomic_fetch_sub(&pool->nr_sleeping, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pool->lock);
+	return ret;
+}
+
+static
+void *pool_worker(void *arg)
+{
+	struct pool_worker *w = arg;
+	struct pool_range range;
+	unsigned int spins = 0;
+
+	for (;;) {
+		if (deque_pop(&w->deque, &range) || pool_steal(w, &range)) {
+			range_split_run(w, &range);
+			spins = 0;
+			continue;
+		}
+		if (++spins < POOL_STEAL_SPINS)
+			continue;
+		spins = 0;
+		if (!pool_wait_range(w, &range))
+			break;
+		if (range.work)
+			range_split_run(w, &range);
+	}
+	return NULL;
+}
+
+struct bpf_pool *bpf_pool_create(unsigned int nr_threads)
+{
+	struct bpf_pool *pool;
+	unsigned int i;
+	long nr_cpus;
+
+	if (!nr_threads) {
+		nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = nr_cpus > 0 ? nr_cpus : 1;
+	}
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	if (posix_memalign((void **) &pool->workers, 64,
+			nr_threads * sizeof(*pool->workers))) {
+		free(pool);
+		return NULL;
+	}
+	memset(pool->workers, 0, nr_threads * sizeof(*pool->workers));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	pool->nr_workers = nr_threads;
+	for (i = 0; i < nr_threads; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].id = i;
+	}
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&pool->workers[i].tid, NULL, pool_worker,
+				&pool->workers[i])) {
+			fprintf(stderr, "Error: cannot create pool worker %u\n",
+				i);
+			pool->nr_workers = i;
+			bpf_pool_destroy(pool);
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+void bpf_pool_destroy(struct bpf_pool *pool)
+{
+	unsigned int i;
+
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	__atomic_fetch_add(&pool->nr_waiting, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&pool->nr_pending, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	__atomic_fetch_sub(&pool->nr_waiting, 1, __ATOMIC_SEQ_CST);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+	/* Workers may still be waking others up, after completing. */
+	for (i = 0; i < pool->nr_workers; i++)
+		pthread_join(pool->workers[i].tid, NULL);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
+
+unsigned int bpf_pool_nr_threads(const struct bpf_pool *pool)
+{
+	return pool->nr_workers;
+}
+
+void bpf_pool_submit(struct bpf_pool *pool, struct bpf_work *work)
+{
+	work->nr_done = work->nr;
+	work->err = BPF_ERR_NONE;
+	work->pool = pool;
+	work->next = NULL;
+	work->remaining = work->nr;
+	work->completed = 0;
+	__atomic_fetch_add(&pool->nr_pending, 1, __ATOMIC_SEQ_CST);
+	if (!work->nr) {
+		work_complete(pool, work);
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail)
+		pool->tail->next = work;
+	else
+		pool->head = work;
+	pool->tail = work;
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int bpf_work_wait(struct bpf_work *work)
+{
+	struct bpf_pool *pool = work->pool;
+
+	if (!__atomic_load_n(&work->completed, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pool->lock);
+		__atomic_fetch_add(&pool->nr_waiting, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&work->completed, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&pool->done_cond, &pool->lock);
+		__atomic_fetch_sub(&pool->nr_waiting, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return work->err;
+}
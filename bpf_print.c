@@ -114,10 +114,39 @@ int print_mode(const struct bpf_insn *insn)
 	case BPF_MEM_ACQ_REL:
 		printf("mode=mem-acq-rel");
 		break;
+	case BPF_ATOMIC:
+	{
+		static const char *const names[BPF_NR_ATOMIC_OPS] = {
+			[BPF_AOP_ADD] = "add",
+			[BPF_AOP_OR] = "or",
+			[BPF_AOP_AND] = "and",
+			[BPF_AOP_XOR] = "xor",
+			[BPF_AOP_FETCH_ADD] = "fetch-add",
+			[BPF_AOP_FETCH_OR] = "fetch-or",
+			[BPF_AOP_FETCH_AND] = "fetch-and",
+			[BPF_AOP_FETCH_XOR] = "fetch-xor",
+			[BPF_AOP_XCHG] = "xchg",
+			[BPF_AOP_CMPXCHG] = "cmpxchg",
+		};
+		int op = atomic_op(insn->imm);
+
+		if (op < 0) {
+			fprintf(stderr, "Error: atomic op %#x not implemented\n",
+				insn->imm);
+			return -1;
+		}
+		printf("mode=atomic,op=%s", names[op]);
+		break;
+	}
 
-		/* Modes not implemented. */
 	case BPF_ABS:
+		printf("mode=abs,imm=%u", (__u32) insn->imm);
+		break;
 	case BPF_IND:
+		printf("mode=ind,src_reg=%d,imm=%d", insn->src_reg, insn->imm);
+		break;
+
+		/* Modes not implemented. */
 	case BPF_LEN:
 	case BPF_MSH:
 	default:
@@ -280,6 +309,12 @@ int print_jmp_op(const struct bpf_insn *insn)
 	case BPF_JSLE:
 		printf("op=jsle");
 		break;
+	case BPF_CALL:
+		printf("op=call");
+		break;
+	case BPF_EXIT:
+		printf("op=exit");
+		return 0;
 
 		/* Unsupported jmp ops. */
 	default:
@@ -293,6 +328,9 @@ int print_jmp_op(const struct bpf_insn *insn)
 	case BPF_JA:
 		printf("off=%d", insn->off);
 		break;
+	case BPF_CALL:
+		printf("imm=%d", insn->imm);
+		break;
 	case BPF_JEQ:
 	case BPF_JGT:
 	case BPF_JGE:
@@ -368,6 +406,7 @@ int print_insn(const struct bpf_insn *insn)
 		if (print_reg(insn->src_reg))
 			return -1;
 		printf(",off=%d", (int) insn->off);
+		break;
 	case BPF_ST:
 		printf(",");
 		if (print_size(insn))
@@ -422,13 +461,101 @@ int print_insn(const struct bpf_insn *insn)
 
 int print_bytecode(const struct bpf_insn *bytecode, size_t len)
 {
+	return print_bytecode_profile(bytecode, len, NULL);
+}
+
+/*
+ * Print the bytecode, each instruction preceded by its execution count
+ * and share of all executed instructions when @prof is set. The first
+ * instruction of each basic block also gets the average clock ticks
+ * per entry into the block and the block share of all ticks, from the
+ * timed runs.
+ */
+int print_bytecode_profile(const struct bpf_insn *bytecode, size_t len,
+		const struct bpf_profile *prof)
+{
+	__u64 nr_insns = 0, nr_ticks = 0, nr_timed = 0;
 	size_t i;
 
+	if (prof) {
+		for (i = 0; i < len; i++) {
+			nr_insns += prof->counts[i];
+			nr_ticks += prof->cycles[i];
+		}
+		nr_timed = prof->samples[0];
+		printf("runs: %llu, timed: %llu, insns: %llu, ticks: %llu\n",
+			(unsigned long long) prof->nr_runs,
+			(unsigned long long) nr_timed,
+			(unsigned long long) nr_insns,
+			(unsigned long long) nr_ticks);
+		printf("%12s %7s %10s %7s\n", "count", "insns", "ticks/blk",
+			"ticks");
+	}
 	for (i = 0; i < len; i++) {
 		const struct bpf_insn *insn = &bytecode[i];
 
+		if (prof) {
+			printf("%12llu %6.2f%% ",
+				(unsigned long long) prof->counts[i],
+				nr_insns ? 100.0 * prof->counts[i] / nr_insns : 0);
+			if (prof->block_start[i] && prof->samples[i])
+				printf("%10.1f %6.2f%% ",
+					(double) prof->cycles[i] / prof->samples[i],
+					nr_ticks ? 100.0 * prof->cycles[i] / nr_ticks : 0);
+			else
+				printf("%10s %7s ", "", "");
+		}
 		if (print_insn(insn))
 			return -1;
 	}
 	return 0;
 }
+
+static const char *const fusion_names[BPF_NR_FUSIONS] = {
+	[BPF_FUSE_LDX_B_JEQ_K] = "ldx_b+jeq_k",
+	[BPF_FUSE_LDX_H_JEQ_K] = "ldx_h+jeq_k",
+	[BPF_FUSE_LDX_W_JEQ_K] = "ldx_w+jeq_k",
+	[BPF_FUSE_LDX_DW_JEQ_K] = "ldx_dw+jeq_k",
+	[BPF_FUSE_LDX_B_JNE_K] = "ldx_b+jne_k",
+	[BPF_FUSE_LDX_H_JNE_K] = "ldx_h+jne_k",
+	[BPF_FUSE_LDX_W_JNE_K] = "ldx_w+jne_k",
+	[BPF_FUSE_LDX_DW_JNE_K] = "ldx_dw+jne_k",
+	[BPF_FUSE_MOV_ADD_K] = "mov64_x+add64_k",
+	[BPF_FUSE_MOV_AND_K] = "mov64_x+and64_k",
+	[BPF_FUSE_MOV_OR_K] = "mov64_x+or64_k",
+	[BPF_FUSE_MOV_XOR_K] = "mov64_x+xor64_k",
+	[BPF_FUSE_MOV_LSH_K] = "mov64_x+lsh64_k",
+	[BPF_FUSE_MOV_RSH_K] = "mov64_x+rsh64_k",
+	[BPF_FUSE_LD_IMM64_JEQ_X] = "ld_imm64+jeq_x",
+	[BPF_FUSE_LD_IMM64_JNE_X] = "ld_imm64+jne_x",
+	[BPF_FUSE_LD_IMM64_ADD_X] = "ld_imm64+add64_x",
+	[BPF_FUSE_LD_IMM64_AND_X] = "ld_imm64+and64_x",
+	[BPF_FUSE_LD_IMM64_OR_X] = "ld_imm64+or64_x",
+	[BPF_FUSE_LD_IMM64_XOR_X] = "ld_imm64+xor64_x",
+};
+
+/*
+ * Print the superinstructions of a decoded program, one per line with
+ * its pc, then the number of each kind. Returns the number of fused
+ * pairs.
+ */
+size_t print_fusions(const struct bpf_dinsn *insns, size_t len)
+{
+	size_t i, count[BPF_NR_FUSIONS] = { 0 }, nr_fused = 0;
+	int fusion;
+
+	for (i = 0; i < len; i++) {
+		if (insns[i].op < BPF_DOP_FUSED || insns[i].op >= BPF_DOP_MAX)
+			continue;
+		fusion = insns[i].op - BPF_DOP_FUSED;
+		printf("pc %zu: %s\n", i, fusion_names[fusion]);
+		count[fusion]++;
+		nr_fused++;
+	}
+	for (fusion = 0; fusion < BPF_NR_FUSIONS; fusion++) {
+		if (count[fusion])
+			printf("%s: %zu\n", fusion_names[fusion], count[fusion]);
+	}
+	printf("fused pairs: %zu\n", nr_fused);
+	return nr_fused;
+}
@@ -1,8 +1,363 @@
 #include "./bpf.h"
+#include "./bpf_prog.h"
+#include "./bpf_map.h"
 #include <stdio.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
 
+/*
+ * Engine used by interpret_bytecode() and bpf_prog_load() without
+ * options. Override at build time with e.g.
+ * -DBPF_DEFAULT_ENGINE=BPF_ENGINE_SWITCH.
+ */
+#ifndef BPF_DEFAULT_ENGINE
+#define BPF_DEFAULT_ENGINE		BPF_ENGINE_THREADED
+#endif
+
+/*
+ * Compiled program. The entry point loads the BPF registers from @reg,
+ * stores them back on exit along with the final pc, and returns an
+ * enum bpf_error.
+ */
+typedef int (*bpf_jit_func_t)(__s64 *reg, __u32 *pc);
+
+struct bpf_jit {
+	bpf_jit_func_t	func;
+	void		*image;		/* mmap'd code, read-only/executable */
+	size_t		size;		/* image mapping size */
+};
+
+/*
+ * Program compiled ahead of time into a shared object, see bpf_aot.c.
+ * The entry point has the conventions of the JIT one, and gets the
+ * program maps and its helper call targets, in bytecode order.
+ */
+typedef int (*bpf_aot_func_t)(__s64 *reg, size_t *pc, struct bpf_map **maps,
+		const bpf_helper_fn_t *helpers);
+
+struct bpf_aot {
+	bpf_aot_func_t	func;
+	void		*handle;	/* dlopen() handle */
+	bpf_helper_fn_t	*helpers;	/* helper call targets */
+};
+
+/*
+ * Pre-decoded instruction, produced at load time by decode_bytecode()
+ * and executed by the threaded interpreter. Register numbers are
+ * indexes into the register file, immediates are widened to 64-bit,
+ * jump targets are absolute and helper calls point to the function.
+ */
+struct bpf_dinsn {
+	__u16	op;		/* opcode, or internal pseudo-opcode */
+	__u8	dst;		/* dest register */
+	__u8	src;		/* source register */
+	__s16	off;		/* memory offset */
+	__u16	target;		/* absolute jump target */
+	union {
+		__s64		imm;	/* immediate constant */
+		bpf_helper_fn_t	fn;	/* BPF_CALL target */
+	};
+};
+
+/* Internal pseudo-opcodes, above the 8-bit bytecode opcode space. */
+#define BPF_DOP_END		0x100	/* bytecode terminates */
+#define BPF_DOP_PC_OVERFLOW	0x101	/* jump target out of bounds */
+#define BPF_DOP_ATOMIC_W	0x102	/* + enum bpf_atomic_op, 32-bit */
+#define BPF_DOP_ATOMIC_DW	(BPF_DOP_ATOMIC_W + BPF_NR_ATOMIC_OPS)
+#define BPF_DOP_FUSED		(BPF_DOP_ATOMIC_DW + BPF_NR_ATOMIC_OPS)	/* + enum bpf_fusion */
+#define BPF_DOP_MAX		(BPF_DOP_FUSED + BPF_NR_FUSIONS)
+
+/*
+ * Decoded BPF_LD | BPF_ABS loads hold the packet offset in the low 32
+ * bits of imm, and in the high 32 bits the packet length to check
+ * before loading: the end of the furthest load of their run, or 0 when
+ * the first load of the run checked it. See decode_bytecode().
+ */
+#define DINSN_ABS_OFF(insn)	((__u32) (insn)->imm)
+#define DINSN_ABS_CHECK(insn)	((__u32) ((__u64) (insn)->imm >> 32))
+
+/*
+ * Signed division of the engines, by a non-zero @b. INT64_MIN / -1,
+ * which traps on x86-64, gives INT64_MIN: division by -1 negates.
+ */
+static inline
+__s64 bpf_sdiv(__s64 a, __s64 b)
+{
+	return b == -1 ? (__s64) -(__u64) a : a / b;
+}
+
+/* Big-endian value of @size bytes at @p, for packet loads. */
+static inline
+__s64 packet_read(const __u8 *p, __u32 size)
+{
+	switch (size) {
+	case 1:
+		return p[0];
+	case 2:
+		return (p[0] << 8) | p[1];
+	default:
+		return ((__u32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	}
+}
+
+/*
+ * Operations of BPF_STX | BPF_ATOMIC, selected by the immediate.
+ * Without BPF_FETCH, the operation is relaxed. Fetching operations,
+ * exchange and compare-exchange are sequentially consistent.
+ */
+enum bpf_atomic_op {
+	BPF_AOP_ADD,
+	BPF_AOP_OR,
+	BPF_AOP_AND,
+	BPF_AOP_XOR,
+	BPF_AOP_FETCH_ADD,
+	BPF_AOP_FETCH_OR,
+	BPF_AOP_FETCH_AND,
+	BPF_AOP_FETCH_XOR,
+	BPF_AOP_XCHG,
+	BPF_AOP_CMPXCHG,
+	BPF_NR_ATOMIC_OPS,
+};
+
+/*
+ * Superinstructions of the threaded engine, see fuse_decoded(). Each
+ * one executes the instruction it replaces and the next one (after
+ * the second slot for 64-bit immediate loads) in a single dispatch.
+ */
+enum bpf_fusion {
+	/* Context field load, then test against an immediate. */
+	BPF_FUSE_LDX_B_JEQ_K,
+	BPF_FUSE_LDX_H_JEQ_K,
+	BPF_FUSE_LDX_W_JEQ_K,
+	BPF_FUSE_LDX_DW_JEQ_K,
+	BPF_FUSE_LDX_B_JNE_K,
+	BPF_FUSE_LDX_H_JNE_K,
+	BPF_FUSE_LDX_W_JNE_K,
+	BPF_FUSE_LDX_DW_JNE_K,
+	/* 64-bit register copy, then operation on the copy. */
+	BPF_FUSE_MOV_ADD_K,
+	BPF_FUSE_MOV_AND_K,
+	BPF_FUSE_MOV_OR_K,
+	BPF_FUSE_MOV_XOR_K,
+	BPF_FUSE_MOV_LSH_K,
+	BPF_FUSE_MOV_RSH_K,
+	/* 64-bit immediate load, then use as operand. */
+	BPF_FUSE_LD_IMM64_JEQ_X,
+	BPF_FUSE_LD_IMM64_JNE_X,
+	BPF_FUSE_LD_IMM64_ADD_X,
+	BPF_FUSE_LD_IMM64_AND_X,
+	BPF_FUSE_LD_IMM64_OR_X,
+	BPF_FUSE_LD_IMM64_XOR_X,
+	BPF_NR_FUSIONS,
+};
+
+/*
+ * Execution profile of a BPF_F_PROFILE program, updated by
+ * run_profiled(). Basic block times are sampled: one run out of
+ * @period reads the clock at each block entry, and charges the elapsed
+ * time to the block it leaves. Block counters are indexed by the first
+ * pc of the block.
+ */
+struct bpf_profile {
+	__u64		*counts;	/* executions per pc */
+	__u64		*cycles;	/* clock ticks per block, timed runs */
+	__u64		*samples;	/* entries per block, timed runs */
+	__u8		*block_start;	/* pc starts a basic block */
+	__u64		nr_runs;
+	unsigned int	period;
+};
+
+/*
+ * SIMD lane engine, see bpf_simd.c. Runs @prog on the @nr contexts of
+ * @ctxs (at most the lanes of the engine), and stores the r0 and enum bpf_error
+ * of the run on each context into @r0 and @err.
+ */
+typedef void (*bpf_simd_func_t)(const struct bpf_prog *prog,
+		void *const *ctxs, size_t nr, size_t ctx_len, __u64 *r0,
+		int *err);
+
+enum simd_isa {
+	SIMD_ISA_SSE42,
+	SIMD_ISA_AVX2,
+	SIMD_ISA_AVX512,
+	SIMD_NR_ISAS,
+};
+
+struct bpf_simd {
+	const char		*name;
+	bpf_simd_func_t		run;
+	unsigned int		lanes;		/* at most BPF_SIMD_LANES */
+};
+
+/* Returned by run_segment() at its stop pc, not an enum bpf_error. */
+#define BPF_SEGMENT_STOPPED	(-1)
+
+/* Loaded program, see bpf_prog.h. */
+struct bpf_prog {
+	enum bpf_engine		engine;
+	size_t			ctx_size;
+	size_t			len;
+	struct bpf_insn		*insns;		/* validated copy */
+	bool			insns_borrowed;	/* insns not owned, see prog_load() */
+	struct bpf_dinsn	*dinsns;	/* threaded engine form */
+	bool			dinsns_borrowed; /* dinsns in the cache entry */
+	struct bpf_jit		*jit;		/* JIT engine form */
+	struct bpf_aot		*aot;		/* AOT engine form */
+	struct bpf_tier		*tier;		/* tiered engine state */
+	struct bpf_profile	*profile;	/* BPF_F_PROFILE counters */
+	const struct bpf_simd	*simd;		/* BPF_F_SIMD batch engine */
+	size_t			*yield_pcs;	/* BPF_F_INTERLEAVE lookups */
+	size_t			nr_yields;
+	struct bpf_cache	*cache;		/* mapped cache entry */
+	struct bpf_map		**maps;		/* BPF_PSEUDO_MAP_IDX targets */
+	size_t			nr_maps;
+	bpf_debug_hook_t	debug_hook;
+	void			*debug_priv;
+};
+
+/* Map implementation, selected by map type at creation. */
+struct bpf_map_ops {
+	void *(*lookup)(struct bpf_map *map, const void *key);
+	int (*update)(struct bpf_map *map, const void *key, const void *value,
+			__u64 flags);
+	int (*delete)(struct bpf_map *map, const void *key);
+	void (*free)(struct bpf_map *map);
+	/* Per-CPU maps only: slot of @cpu, NULL if @key is absent. */
+	void *(*lookup_cpu)(struct bpf_map *map, const void *key, int cpu);
+	/*
+	 * Optional: prefetch step @step of a lookup of @key, each step
+	 * reading what the previous one prefetched. Returns false when
+	 * there is nothing left to prefetch.
+	 */
+	bool (*prefetch)(struct bpf_map *map, const void *key,
+			unsigned int step);
+};
+
+/* Common map header, embedded first in each map implementation. */
+struct bpf_map {
+	const struct bpf_map_ops *ops;
+	enum bpf_map_type	type;
+	__u32			key_size;
+	__u32			value_size;
+	__u32			max_entries;
+};
+
+/*
+ * Reader of map elements, one per thread, see bpf_epoch.c. Maps reuse
+ * an unlinked element only once every reader has left the read section
+ * it was in at the unlink.
+ */
+struct bpf_reader {
+	__u64			epoch;		/* 0 outside read sections */
+	unsigned int		nesting;
+	bool			registered;
+	struct bpf_reader	*next, **pprev;	/* protected by readers_lock */
+};
+
+extern __u64 bpf_epoch;
+extern bool bpf_epoch_reader_fence;
+extern __thread struct bpf_reader bpf_reader;
+
+void bpf_reader_register(void);
+__u64 bpf_epoch_retire(void);
+__u64 bpf_epoch_advance(void);
+
+static inline
+void bpf_read_lock(void)
+{
+	struct bpf_reader *r = &bpf_reader;
+
+	if (r->nesting++)
+		return;
+	if (!r->registered)
+		bpf_reader_register();
+	__atomic_store_n(&r->epoch, __atomic_load_n(&bpf_epoch,
+		__ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	if (__atomic_load_n(&bpf_epoch_reader_fence, __ATOMIC_RELAXED))
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	else
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline
+void bpf_read_unlock(void)
+{
+	struct bpf_reader *r = &bpf_reader;
+
+	if (!--r->nesting)
+		__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+struct bpf_prog *prog_load(const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts, bool borrow);
 int validate_bytecode(struct bpf_insn *bytecode, size_t len);
+int validate_types(const struct bpf_prog *prog);
+int cfg_successors(const struct bpf_insn *bytecode, size_t i, ssize_t *succ);
+int optimize_bytecode(struct bpf_insn *bytecode, size_t *len);
+const struct bpf_helper *bpf_helper_lookup(__s32 id);
+struct bpf_map *htab_map_alloc(const struct bpf_map_attr *attr);
+struct bpf_map *percpu_array_map_alloc(const struct bpf_map_attr *attr);
+int bpf_current_cpu(void);
+__u64 bpf_helper_map_lookup_elem(__u64 r1, __u64 r2, __u64 r3, __u64 r4,
+		__u64 r5);
+__u64 bpf_helper_map_update_elem(__u64 r1, __u64 r2, __u64 r3, __u64 r4,
+		__u64 r5);
+__u64 bpf_helper_map_delete_elem(__u64 r1, __u64 r2, __u64 r3, __u64 r4,
+		__u64 r5);
+__u64 bpf_helper_map_percpu_add(__u64 r1, __u64 r2, __u64 r3, __u64 r4,
+		__u64 r5);
 int interpret_bytecode(const struct bpf_insn *bytecode, size_t len);
+int interpret_bytecode_engine(const struct bpf_insn *bytecode, size_t len,
+		enum bpf_engine engine);
+struct bpf_dinsn *decode_bytecode(const struct bpf_insn *bytecode, size_t len);
+size_t fuse_decoded(struct bpf_dinsn *insns, size_t len);
+int run_bytecode(const struct bpf_insn *bytecode, size_t len, __s64 *reg,
+		size_t *pc);
+int run_profiled(const struct bpf_insn *bytecode, size_t len,
+		struct bpf_profile *prof, __s64 *reg, size_t *pc);
+int run_segment(const struct bpf_insn *bytecode, size_t len, __s64 *reg,
+		size_t *pc, size_t stop);
+int run_decoded(const struct bpf_dinsn *insns, size_t len, __s64 *reg,
+		size_t *pc);
+struct bpf_jit *jit_compile(const struct bpf_dinsn *insns, size_t len);
+int run_jit(const struct bpf_jit *jit, __s64 *reg, size_t *pc);
+void jit_free(struct bpf_jit *jit);
+int aot_emit(const struct bpf_insn *bytecode, size_t len, FILE *out);
+int aot_build(const char *c_path, const char *so_path);
+struct bpf_aot *aot_open(const char *path, const struct bpf_insn *bytecode,
+		size_t len);
+int run_aot(const struct bpf_aot *aot, struct bpf_map **maps, __s64 *reg,
+		size_t *pc);
+void aot_free(struct bpf_aot *aot);
+struct bpf_tier *tier_init(struct bpf_prog *prog, unsigned long threshold);
+int run_tiered(const struct bpf_prog *prog, __s64 *reg, size_t *pc);
+void tier_free(struct bpf_tier *tier);
+int cache_lookup(struct bpf_prog *prog, const char *dir,
+		const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts);
+int cache_store(const struct bpf_prog *prog, const char *dir,
+		const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts);
+void cache_free(struct bpf_cache *cache);
+const struct bpf_simd *simd_isa(enum simd_isa isa);
+const struct bpf_simd *simd_select(void);
+int interleave_init(struct bpf_prog *prog);
+size_t interleave_run(const struct bpf_prog *prog, void *const *ctxs,
+		char *base, size_t stride, size_t nr, size_t ctx_len, __u64 *r0,
+		int *errp);
+struct bpf_cbpf_insn;
+__u32 cbpf_run(const struct bpf_cbpf_insn *filter, size_t len,
+		const struct bpf_packet *pkt);
+struct bpf_profile *profile_alloc(const struct bpf_insn *bytecode, size_t len,
+		unsigned int period);
+void profile_reset(struct bpf_profile *prof, size_t len);
+void profile_free(struct bpf_profile *prof);
+void show_regs(size_t pc, const __s64 *reg, int nr_regs);
 int print_bytecode(const struct bpf_insn *bytecode, size_t len);
+int print_bytecode_profile(const struct bpf_insn *bytecode, size_t len,
+		const struct bpf_profile *prof);
+size_t print_fusions(const struct bpf_dinsn *insns, size_t len);
 bool is_imm64(const struct bpf_insn *insn);
+bool is_packet_load(const struct bpf_insn *insn);
+int atomic_op(__s32 imm);
@@ -0,0 +1,71 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+/*
+ * Allocate the profile of validated @bytecode, marking the first pc of
+ * each basic block: the entry, jump targets and instructions following
+ * a conditional jump. Time one run out of @period (at least 1).
+ * Returns NULL on error.
+ */
+struct bpf_profile *profile_alloc(const struct bpf_insn *bytecode, size_t len,
+		unsigned int period)
+{
+	struct bpf_profile *prof;
+	ssize_t succ[2];
+	size_t i;
+	int n, j;
+
+	prof = calloc(1, sizeof(*prof));
+	if (!prof)
+		return NULL;
+	prof->counts = calloc(len, sizeof(*prof->counts));
+	prof->cycles = calloc(len, sizeof(*prof->cycles));
+	prof->samples = calloc(len, sizeof(*prof->samples));
+	prof->block_start = calloc(len, sizeof(*prof->block_start));
+	if (!prof->counts || !prof->cycles || !prof->samples
+	    || !prof->block_start) {
+		profile_free(prof);
+		return NULL;
+	}
+	prof->period = period ? period : 1;
+	prof->block_start[0] = 1;
+	for (i = 0; i < len; i++) {
+		unsigned int bpf_class = BPF_CLASS(bytecode[i].code);
+
+		n = cfg_successors(bytecode, i, succ);
+		if ((bpf_class == BPF_JMP || bpf_class == BPF_JMP32)
+		    && bytecode[i].code != (BPF_JMP | BPF_CALL)) {
+			/* Successor len is the program exit. */
+			for (j = 0; j < n; j++) {
+				if ((size_t) succ[j] < len)
+					prof->block_start[succ[j]] = 1;
+			}
+		}
+		if (is_imm64(&bytecode[i]))
+			i++;
+	}
+	return prof;
+}
+
+void profile_reset(struct bpf_profile *prof, size_t len)
+{
+	memset(prof->counts, 0, len * sizeof(*prof->counts));
+	memset(prof->cycles, 0, len * sizeof(*prof->cycles));
+	memset(prof->samples, 0, len * sizeof(*prof->samples));
+	prof->nr_runs = 0;
+}
+
+void profile_free(struct bpf_profile *prof)
+{
+	if (!prof)
+		return;
+	free(prof->counts);
+	free(prof->cycles);
+	free(prof->samples);
+	free(prof->block_start);
+	free(prof);
+}
@@ -0,0 +1,519 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include "./bpf_prog.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+const char *bpf_strerror(int err)
+{
+	switch (err) {
+	case BPF_ERR_NONE:
+		return "Success";
+	case BPF_ERR_DIV_BY_ZERO:
+		return "Divide by 0";
+	case BPF_ERR_MODULO:
+		return "Modulo by negative or zero value";
+	case BPF_ERR_SHIFT:
+		return "Shift out of range";
+	case BPF_ERR_PC_OVERFLOW:
+		return "pc overflows bytecode length";
+	case BPF_ERR_UNSUPPORTED:
+		return "Unsupported insn code";
+	case BPF_ERR_CTX_SIZE:
+		return "Context smaller than declared at load";
+	default:
+		return "Unknown error";
+	}
+}
+
+void bpf_debug_print(const struct bpf_prog *prog, int err, size_t pc,
+		const __s64 *reg, void *priv)
+{
+	if (err)
+		fprintf(stderr, "Error: %s at pc %zu\n", bpf_strerror(err), pc);
+	show_regs(pc, reg, MAX_BPF_REG);
+}
+
+/*
+ * Replace map indexes by map pointers, once validated, in the bytecode
+ * and in the decoded form. Also point the decoded helper calls to the
+ * helpers of this process, for decoded forms from the cache.
+ */
+static
+int resolve_maps(struct bpf_prog *prog)
+{
+	size_t i;
+
+	for (i = 0; i < prog->len; i++) {
+		struct bpf_insn *insn = &prog->insns[i];
+		const struct bpf_helper *helper;
+		unsigned long map;
+
+		if (insn->code == (BPF_JMP | BPF_CALL) && prog->dinsns) {
+			helper = bpf_helper_lookup(insn->imm);
+			if (!helper) {
+				fprintf(stderr, "Error: unknown helper %d at pc %zu\n",
+					insn->imm, i);
+				return -1;
+			}
+			prog->dinsns[i].fn = helper->fn;
+		}
+		if (!is_imm64(insn))
+			continue;
+		if (insn->src_reg == BPF_PSEUDO_MAP_IDX) {
+			map = (unsigned long) prog->maps[insn->imm];
+			insn->src_reg = 0;
+			insn->imm = (__u32) map;
+			(insn + 1)->imm = (__u64) map >> 32;
+			if (prog->dinsns) {
+				prog->dinsns[i].src = 0;
+				prog->dinsns[i].imm = map;
+			}
+		}
+		i++;
+	}
+	return 0;
+}
+
+/*
+ * Programs only write their instructions to optimize them, and to
+ * resolve map indexes.
+ */
+static
+bool prog_needs_copy(const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts)
+{
+	size_t i;
+
+	if (opts && (opts->flags & BPF_F_OPTIMIZE))
+		return true;
+	for (i = 0; i < len; i++) {
+		if (is_imm64(&insns[i]) && insns[i].src_reg == BPF_PSEUDO_MAP_IDX)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Copy, validate and optimize @insns, up to the engine specific
+ * preparation, or map them from the cache. Map indexes are not
+ * resolved yet. With @borrow, the program runs @insns in place when it
+ * does not need to modify them: they must then outlive the program.
+ */
+static
+struct bpf_prog *prog_prepare(const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts, bool borrow)
+{
+	struct bpf_prog *prog;
+
+	if (!len) {
+		fprintf(stderr, "Error: Empty program\n");
+		return NULL;
+	}
+	prog = calloc(1, sizeof(*prog));
+	if (!prog)
+		return NULL;
+	prog->engine = opts ? opts->engine : BPF_DEFAULT_ENGINE;
+	prog->ctx_size = opts ? opts->ctx_size : 0;
+	/* Only the switch engine profiles. */
+	if (opts && (opts->flags & BPF_F_PROFILE))
+		prog->engine = BPF_ENGINE_SWITCH;
+#ifndef __GNUC__
+	/* Computed goto is unavailable, use the reference engine. */
+	if (prog->engine == BPF_ENGINE_THREADED)
+		prog->engine = BPF_ENGINE_SWITCH;
+#endif
+	if (opts && opts->nr_maps) {
+		prog->maps = malloc(opts->nr_maps * sizeof(*prog->maps));
+		if (!prog->maps)
+			goto error;
+		memcpy(prog->maps, opts->maps, opts->nr_maps * sizeof(*prog->maps));
+		prog->nr_maps = opts->nr_maps;
+	}
+	if (opts && opts->cache_dir
+	    && !cache_lookup(prog, opts->cache_dir, insns, len, opts))
+		return prog;
+	prog->len = len;
+	if (borrow && !prog_needs_copy(insns, len, opts)) {
+		/* Validation only reads the instructions. */
+		prog->insns = (struct bpf_insn *) insns;
+		prog->insns_borrowed = true;
+	} else {
+		prog->insns = malloc(len * sizeof(*insns));
+		if (!prog->insns)
+			goto error;
+		memcpy(prog->insns, insns, len * sizeof(*insns));
+	}
+	if (validate_bytecode(prog->insns, len) || validate_types(prog)) {
+		fprintf(stderr, "Error validating bytecode\n");
+		goto error;
+	}
+	if (opts && (opts->flags & BPF_F_OPTIMIZE)) {
+		if (optimize_bytecode(prog->insns, &prog->len))
+			goto error;
+		/* The optimized program must be as safe as the original. */
+		if (validate_bytecode(prog->insns, prog->len)
+		    || validate_types(prog)) {
+			fprintf(stderr, "Error validating optimized bytecode\n");
+			goto error;
+		}
+	}
+	return prog;
+
+error:
+	bpf_prog_destroy(prog);
+	return NULL;
+}
+
+/*
+ * Load @insns, running them in place if possible, see prog_prepare().
+ * bpf_prog_load() always works on a copy.
+ */
+struct bpf_prog *prog_load(const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts, bool borrow)
+{
+	struct bpf_prog *prog;
+
+	prog = prog_prepare(insns, len, opts, borrow);
+	if (!prog)
+		return NULL;
+	if (opts && (opts->flags & BPF_F_PROFILE)) {
+		prog->profile = profile_alloc(prog->insns, prog->len,
+			opts->profile_period ? opts->profile_period :
+				BPF_PROFILE_PERIOD);
+		if (!prog->profile)
+			goto error;
+	}
+	if (prog->engine == BPF_ENGINE_AOT) {
+		/* The shared object keeps map indexes, check before resolving. */
+		if (!opts || !opts->aot_path) {
+			fprintf(stderr, "Error: no shared object for AOT engine\n");
+			goto error;
+		}
+		prog->aot = aot_open(opts->aot_path, prog->insns, prog->len);
+		if (!prog->aot)
+			goto error;
+	}
+	/* Decode before resolving maps, to cache the unresolved form. */
+	if (!prog->dinsns && (prog->engine == BPF_ENGINE_THREADED
+			|| prog->engine == BPF_ENGINE_JIT
+			|| prog->engine == BPF_ENGINE_TIERED)) {
+		prog->dinsns = decode_bytecode(prog->insns, prog->len);
+		if (!prog->dinsns)
+			goto error;
+		/* The JIT expects the unfused form. */
+		if (prog->engine != BPF_ENGINE_JIT)
+			fuse_decoded(prog->dinsns, prog->len);
+	}
+	/* Without SSE4.2, batches run in the program engine. */
+	if (opts && (opts->flags & BPF_F_SIMD) && !prog->profile)
+		prog->simd = simd_select();
+	if (opts && (opts->flags & BPF_F_INTERLEAVE) && !prog->profile
+	    && interleave_init(prog))
+		goto error;
+	/* A failure to store only costs the next load. */
+	if (opts && opts->cache_dir && !prog->cache)
+		cache_store(prog, opts->cache_dir, insns, len, opts);
+	if (resolve_maps(prog))
+		goto error;
+
+	switch (prog->engine) {
+	case BPF_ENGINE_SWITCH:
+	case BPF_ENGINE_THREADED:
+	case BPF_ENGINE_AOT:
+		break;
+	case BPF_ENGINE_JIT:
+		prog->jit = jit_compile(prog->dinsns, prog->len);
+		if (!prog->jit)
+			goto error;
+		/* The decoded form is only needed to compile. */
+		if (!prog->dinsns_borrowed)
+			free(prog->dinsns);
+		prog->dinsns = NULL;
+		break;
+	case BPF_ENGINE_TIERED:
+		prog->tier = tier_init(prog, opts ? opts->tier_threshold : 0);
+		if (!prog->tier)
+			goto error;
+		break;
+	default:
+		fprintf(stderr, "Error: Unknown engine %d\n", prog->engine);
+		goto error;
+	}
+	return prog;
+
+error:
+	bpf_prog_destroy(prog);
+	return NULL;
+}
+
+struct bpf_prog *bpf_prog_load(const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts)
+{
+	return prog_load(insns, len, opts, false);
+}
+
+void bpf_prog_destroy(struct bpf_prog *prog)
+{
+	if (!prog)
+		return;
+	/* Before freeing the code the compiler thread may publish. */
+	tier_free(prog->tier);
+	jit_free(prog->jit);
+	aot_free(prog->aot);
+	profile_free(prog->profile);
+	free(prog->yield_pcs);
+	if (!prog->dinsns_borrowed)
+		free(prog->dinsns);
+	if (!prog->insns_borrowed)
+		free(prog->insns);
+	/* Last, insns and dinsns may be in the entry. */
+	cache_free(prog->cache);
+	free(prog->maps);
+	free(prog);
+}
+
+int bpf_prog_aot_emit(const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts, FILE *out)
+{
+	struct bpf_prog *prog;
+	int ret;
+
+	prog = prog_prepare(insns, len, opts, false);
+	if (!prog)
+		return -1;
+	ret = aot_emit(prog->insns, prog->len, out);
+	bpf_prog_destroy(prog);
+	return ret;
+}
+
+int bpf_prog_aot_compile(const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts, const char *path)
+{
+	char c_path[] = "/tmp/bpf_aot_XXXXXX.c";
+	FILE *out;
+	int fd, ret;
+
+	fd = mkstemps(c_path, 2);
+	if (fd < 0) {
+		perror("mkstemps");
+		return -1;
+	}
+	out = fdopen(fd, "w");
+	if (!out) {
+		perror("fdopen");
+		close(fd);
+		unlink(c_path);
+		return -1;
+	}
+	ret = bpf_prog_aot_emit(insns, len, opts, out);
+	if (fclose(out))
+		ret = -1;
+	if (!ret)
+		ret = aot_build(c_path, path);
+	unlink(c_path);
+	return ret;
+}
+
+enum bpf_engine bpf_prog_engine(const struct bpf_prog *prog)
+{
+	if (prog->engine != BPF_ENGINE_TIERED)
+		return prog->engine;
+	if (__atomic_load_n(&prog->jit, __ATOMIC_ACQUIRE))
+		return BPF_ENGINE_JIT;
+	return BPF_ENGINE_THREADED;
+}
+
+const char *bpf_prog_simd_isa(const struct bpf_prog *prog)
+{
+	return prog->simd ? prog->simd->name : NULL;
+}
+
+size_t bpf_prog_print_fusions(const struct bpf_prog *prog)
+{
+	if (!prog->dinsns)
+		return 0;
+	return print_fusions(prog->dinsns, prog->len);
+}
+
+int bpf_prog_print_profile(const struct bpf_prog *prog)
+{
+	if (!prog->profile) {
+		fprintf(stderr, "Error: program is not profiled\n");
+		return -1;
+	}
+	return print_bytecode_profile(prog->insns, prog->len, prog->profile);
+}
+
+void bpf_prog_reset_profile(struct bpf_prog *prog)
+{
+	if (prog->profile)
+		profile_reset(prog->profile, prog->len);
+}
+
+void bpf_prog_set_debug_hook(struct bpf_prog *prog, bpf_debug_hook_t hook,
+		void *priv)
+{
+	prog->debug_hook = hook;
+	prog->debug_priv = priv;
+}
+
+/*
+ * Run @prog on its set up register file @reg, with the engine of @prog.
+ * Runs of programs using maps are read sections, see bpf_map.h.
+ */
+static inline __attribute__((always_inline))
+int prog_run_regs(const struct bpf_prog *prog, __s64 *reg)
+{
+	size_t pc = 0;
+	int err;
+
+	if (prog->nr_maps)
+		bpf_read_lock();
+	switch (prog->engine) {
+#ifdef __GNUC__
+	case BPF_ENGINE_THREADED:
+		err = run_decoded(prog->dinsns, prog->len, reg, &pc);
+		break;
+#endif
+	case BPF_ENGINE_JIT:
+		err = run_jit(prog->jit, reg, &pc);
+		break;
+	case BPF_ENGINE_AOT:
+		err = run_aot(prog->aot, prog->maps, reg, &pc);
+		break;
+	case BPF_ENGINE_TIERED:
+		err = run_tiered(prog, reg, &pc);
+		break;
+	default:
+		if (prog->profile)
+			err = run_profiled(prog->insns, prog->len,
+				prog->profile, reg, &pc);
+		else
+			err = run_bytecode(prog->insns, prog->len, reg, &pc);
+		break;
+	}
+	if (prog->nr_maps)
+		bpf_read_unlock();
+	if (prog->debug_hook)
+		prog->debug_hook(prog, err, pc, reg, prog->debug_priv);
+	return err;
+}
+
+int bpf_prog_run(const struct bpf_prog *prog, void *ctx, size_t ctx_len,
+		__u64 *r0)
+{
+	__s64 reg[MAX_BPF_REG] = { 0 };
+	__u64 stack[BPF_STACK_SIZE / sizeof(__u64)];
+	int err;
+
+	if (ctx_len < prog->ctx_size)
+		return BPF_ERR_CTX_SIZE;
+	reg[BPF_REG_1] = (unsigned long) ctx;
+	reg[BPF_REG_2] = ctx_len;
+	reg[BPF_REG_10] = (unsigned long) stack + sizeof(stack);
+	err = prog_run_regs(prog, reg);
+	if (!err)
+		*r0 = reg[BPF_REG_0];
+	return err;
+}
+
+/*
+ * Batch of runs, on the contexts of @ctxs, or else @stride bytes apart
+ * from @base. The context length check and the stack are shared by the
+ * runs, and the context BATCH_PREFETCH runs ahead is prefetched, its
+ * first line and the line of its last byte.
+ */
+#define BATCH_PREFETCH		4
+
+/* Batch of runs in the SIMD lane engine, one run per lane at a time. */
+static
+size_t prog_run_lanes(const struct bpf_prog *prog, void *const *ctxs,
+		char *base, size_t stride, size_t nr, size_t ctx_len, __u64 *r0,
+		int *errp)
+{
+	void *lane_ctxs[BPF_SIMD_LANES];
+	__u64 lane_r0[BPF_SIMD_LANES];
+	int lane_err[BPF_SIMD_LANES];
+	size_t i, j, n;
+
+	for (i = 0; i < nr; i += n) {
+		n = nr - i < prog->simd->lanes ? nr - i : prog->simd->lanes;
+		for (j = 0; j < n; j++)
+			lane_ctxs[j] = ctxs ? ctxs[i + j] : base + (i + j) * stride;
+		if (prog->nr_maps)
+			bpf_read_lock();
+		prog->simd->run(prog, lane_ctxs, n, ctx_len, lane_r0, lane_err);
+		if (prog->nr_maps)
+			bpf_read_unlock();
+		for (j = 0; j < n; j++) {
+			if (lane_err[j]) {
+				*errp = lane_err[j];
+				return i + j;
+			}
+			r0[i + j] = lane_r0[j];
+		}
+	}
+	*errp = BPF_ERR_NONE;
+	return nr;
+}
+
+static
+size_t prog_run_batch(const struct bpf_prog *prog, void *const *ctxs,
+		char *base, size_t stride, size_t nr, size_t ctx_len, __u64 *r0,
+		int *errp)
+{
+	__u64 stack[BPF_STACK_SIZE / sizeof(__u64)];
+	__s64 reg[MAX_BPF_REG];
+	size_t i;
+	int err;
+
+	if (ctx_len < prog->ctx_size) {
+		*errp = BPF_ERR_CTX_SIZE;
+		return 0;
+	}
+	if (prog->nr_yields && !prog->debug_hook)
+		return interleave_run(prog, ctxs, base, stride, nr, ctx_len, r0,
+			errp);
+	if (prog->simd && !prog->debug_hook)
+		return prog_run_lanes(prog, ctxs, base, stride, nr, ctx_len, r0,
+			errp);
+	for (i = 0; i < nr; i++) {
+		char *ctx = ctxs ? ctxs[i] : base + i * stride;
+
+		if (i + BATCH_PREFETCH < nr && prog->ctx_size) {
+			char *next = ctxs ? ctxs[i + BATCH_PREFETCH]
+				: ctx + BATCH_PREFETCH * stride;
+
+			__builtin_prefetch(next);
+			__builtin_prefetch(next + prog->ctx_size - 1);
+		}
+		memset(reg, 0, sizeof(reg));
+		reg[BPF_REG_1] = (unsigned long) ctx;
+		reg[BPF_REG_2] = ctx_len;
+		reg[BPF_REG_10] = (unsigned long) stack + sizeof(stack);
+		err = prog_run_regs(prog, reg);
+		if (err) {
+			*errp = err;
+			return i;
+		}
+		r0[i] = reg[BPF_REG_0];
+	}
+	*errp = BPF_ERR_NONE;
+	return nr;
+}
+
+size_t bpf_prog_run_batch(const struct bpf_prog *prog, void *const *ctxs,
+		size_t nr, size_t ctx_len, __u64 *r0, int *err)
+{
+	return prog_run_batch(prog, ctxs, NULL, 0, nr, ctx_len, r0, err);
+}
+
+size_t bpf_prog_run_strided(const struct bpf_prog *prog, void *base,
+		size_t stride, size_t nr, size_t ctx_len, __u64 *r0, int *err)
+{
+	return prog_run_batch(prog, NULL, base, stride, nr, ctx_len, r0, err);
+}
@@ -0,0 +1,377 @@
+#ifndef _BPF_PROG_H
+#define _BPF_PROG_H
+
+/*
+ * Embedding API: load a program once, then run it any number of
+ * times against a context. The run path does no allocation and no
+ * stdio; diagnostics go through an optional debug hook.
+ */
+
+#include "./bpf.h"
+#include <stddef.h>
+#include <stdio.h>
+
+/* Stack available below the read-only frame pointer r10. */
+#define BPF_STACK_SIZE		512
+
+enum bpf_engine {
+	BPF_ENGINE_SWITCH,	/* Reference switch-based interpreter. */
+	BPF_ENGINE_THREADED,	/* Direct-threaded (computed goto) interpreter. */
+	BPF_ENGINE_JIT,		/* Native code (x86-64 only). */
+	BPF_ENGINE_AOT,		/* Shared object from bpf_prog_aot_compile(). */
+	BPF_ENGINE_TIERED,	/* Threaded, then JIT once the program is hot. */
+};
+
+/* Default BPF_ENGINE_TIERED runs before compiling. */
+#define BPF_TIER_THRESHOLD	1000
+
+/* Runtime errors, returned by bpf_prog_run() and the engines. */
+enum bpf_error {
+	BPF_ERR_NONE = 0,
+	BPF_ERR_DIV_BY_ZERO,
+	BPF_ERR_MODULO,
+	BPF_ERR_SHIFT,
+	BPF_ERR_PC_OVERFLOW,
+	BPF_ERR_UNSUPPORTED,
+	BPF_ERR_CTX_SIZE,	/* context smaller than declared at load */
+};
+
+struct bpf_prog;
+struct bpf_map;
+
+/*
+ * Helpers: native functions called by BPF_JMP | BPF_CALL with the
+ * helper id as immediate. Arguments are passed in r1-r5 and the result
+ * is returned in r0. r1-r5 are clobbered by the call, r6-r10 are
+ * preserved.
+ */
+#define BPF_MAX_HELPERS		256
+
+typedef __u64 (*bpf_helper_fn_t)(__u64 r1, __u64 r2, __u64 r3, __u64 r4,
+		__u64 r5);
+
+/* Helper argument types, checked by the validator at each call. */
+enum bpf_arg_type {
+	BPF_ARG_NONE = 0,	/* unused, and all following arguments */
+	BPF_ARG_ANYTHING,	/* any initialized register */
+	BPF_ARG_SCALAR,		/* not a pointer */
+	BPF_ARG_PTR_TO_CTX,	/* the context pointer, unmodified */
+	BPF_ARG_PTR_TO_MEM,	/* readable memory, size in the next argument */
+	BPF_ARG_CONST_SIZE,	/* scalar with a known upper bound */
+	BPF_ARG_CONST_MAP_PTR,	/* map loaded with BPF_PSEUDO_MAP_IDX */
+	BPF_ARG_PTR_TO_MAP_KEY,	/* key_size bytes, map in the first argument */
+	BPF_ARG_PTR_TO_MAP_VALUE, /* value_size bytes, map in the first argument */
+};
+
+enum bpf_ret_type {
+	BPF_RET_SCALAR = 0,
+	BPF_RET_MAP_VALUE_OR_NULL,	/* value of the map in the first argument */
+};
+
+/* Helper without side effects, which bpf_multi_create() accepts. */
+#define BPF_HELPER_F_PURE	(1U << 0)
+
+struct bpf_helper {
+	__u32			id;
+	const char		*name;
+	bpf_helper_fn_t		fn;
+	enum bpf_arg_type	args[5];
+	enum bpf_ret_type	ret;
+	__u32			flags;		/* BPF_HELPER_F_* */
+};
+
+/*
+ * Register a helper under @helper->id, which must be below
+ * BPF_MAX_HELPERS and not yet registered. Registration must happen
+ * before loading programs which call the helper. Returns 0 on success,
+ * -1 on error.
+ */
+int bpf_helper_register(const struct bpf_helper *helper);
+
+/*
+ * Called at the end of each run when set, with the run result, the
+ * final pc and the register file.
+ */
+typedef void (*bpf_debug_hook_t)(const struct bpf_prog *prog, int err,
+		size_t pc, const __s64 *reg, void *priv);
+
+/*
+ * Load flags. BPF_F_OPTIMIZE rewrites the validated program into a
+ * shorter equivalent one (constant folding, dead code elimination,
+ * jump threading) and validates it again. Only r0 and memory are
+ * preserved: the pc and other registers seen by the debug hook refer
+ * to the optimized program.
+ */
+#define BPF_F_OPTIMIZE		(1U << 0)
+
+/*
+ * BPF_F_PROFILE runs the program in the switch engine, whatever the
+ * engine requested, counting executions of each instruction and timing
+ * basic blocks on one run out of profile_period (default
+ * BPF_PROFILE_PERIOD). Read the counters with bpf_prog_print_profile().
+ * Programs loaded without the flag run no profiling code.
+ */
+#define BPF_F_PROFILE		(1U << 1)
+
+#define BPF_PROFILE_PERIOD	64
+
+/*
+ * BPF_F_SIMD runs batches (bpf_prog_run_batch() and
+ * bpf_prog_run_strided()) several contexts at a time, in lockstep on
+ * vector registers, with the widest of AVX-512F (8 contexts), AVX2
+ * (4) and SSE4.2 (2) the CPU supports. Lanes which take different
+ * branches are masked, and atomics run lane by lane in the switch
+ * engine. Other runs use the engine of the program, and so do
+ * batches without SSE4.2, with a debug hook, or with BPF_F_PROFILE.
+ * Helper calls and memory accesses of the lanes are ordered by lane,
+ * instruction by instruction.
+ */
+#define BPF_F_SIMD		(1U << 2)
+
+/* Most contexts a BPF_F_SIMD batch runs at a time. */
+#define BPF_SIMD_LANES		8
+
+/*
+ * BPF_F_INTERLEAVE runs batches of programs calling map_lookup_elem as
+ * BPF_INTERLEAVE_WAYS coroutines. At a lookup in a hash map, a run
+ * prefetches the bucket and yields to the next run, then the element,
+ * and looks it up once scheduled again, which hides cache misses on
+ * tables larger than the caches. Runs go in the switch engine between
+ * lookups. Other runs use the engine of the program, and so do batches
+ * of programs without lookups, with a debug hook, or with
+ * BPF_F_PROFILE. BPF_F_INTERLEAVE takes precedence over BPF_F_SIMD.
+ */
+#define BPF_F_INTERLEAVE	(1U << 3)
+
+#define BPF_INTERLEAVE_WAYS	8
+
+struct bpf_prog_opts {
+	enum bpf_engine	engine;
+	size_t		ctx_size;	/* bytes the program may access at r1 */
+	struct bpf_map	**maps;		/* indexed by BPF_PSEUDO_MAP_IDX loads */
+	size_t		nr_maps;
+	unsigned int	flags;		/* BPF_F_* */
+	const char	*aot_path;	/* BPF_ENGINE_AOT shared object */
+	unsigned long	tier_threshold;	/* BPF_ENGINE_TIERED, 0 for default */
+	unsigned int	profile_period;	/* BPF_F_PROFILE, 0 for default */
+	const char	*cache_dir;	/* verified-program cache, or NULL */
+};
+
+/*
+ * Validate, copy and prepare @insns for execution with the engine
+ * selected in @opts (default engine and no context access if @opts is
+ * NULL). Every memory access must be proven within the context, the
+ * stack or a map value at load time. Returns NULL on error.
+ *
+ * With @opts->cache_dir, programs which were loaded before with the
+ * same configuration and map attributes are mapped from the cache
+ * instead of optimized and decoded again. Others are stored there once
+ * validated. Cached bytecode is validated again, but the cached decoded
+ * form is only checked for integrity: the directory must exist, and
+ * only trusted users may write to it.
+ */
+struct bpf_prog *bpf_prog_load(const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts);
+void bpf_prog_destroy(struct bpf_prog *prog);
+
+/*
+ * Ahead-of-time compilation. Validate @insns like bpf_prog_load() with
+ * @opts, then write their C translation to @out, or build it into a
+ * shared object at @path with $CC (default cc). Programs load the
+ * shared object with BPF_ENGINE_AOT and @opts->aot_path, along with
+ * the same bytecode, flags and map types; loading fails if it was
+ * built from other bytecode. dlopen() does not reload a path which is
+ * already open, so rebuild programs under new paths. Returns 0 on
+ * success, -1 on error.
+ */
+int bpf_prog_aot_emit(const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts, FILE *out);
+int bpf_prog_aot_compile(const struct bpf_insn *insns, size_t len,
+		const struct bpf_prog_opts *opts, const char *path);
+
+/*
+ * Run @prog with r1 = @ctx and r2 = @ctx_len, r10 pointing to the top
+ * of a BPF_STACK_SIZE stack and all other registers zeroed. @ctx_len
+ * must be at least the ctx_size given at load time. On success, stores
+ * r0 into @r0 and returns BPF_ERR_NONE. Otherwise returns an enum
+ * bpf_error and leaves @r0 untouched.
+ */
+int bpf_prog_run(const struct bpf_prog *prog, void *ctx, size_t ctx_len,
+		__u64 *r0);
+
+/*
+ * Batch execution: run @prog as bpf_prog_run() would on @nr contexts
+ * of @ctx_len bytes, the pointers of @ctxs or every @stride bytes from
+ * @base, storing the r0 of run i into @r0[i]. Setup is done once per
+ * batch, and upcoming contexts are prefetched. Returns the number of
+ * runs done: @nr, or the index of the first run which failed. Stores
+ * its enum bpf_error into *@err, BPF_ERR_NONE when all runs succeeded.
+ * With BPF_F_SIMD, runs after the failed one in the same group of
+ * (at most BPF_SIMD_LANES) contexts also ran. With BPF_F_INTERLEAVE,
+ * so did the runs in flight when it failed, at most
+ * BPF_INTERLEAVE_WAYS - 1.
+ */
+size_t bpf_prog_run_batch(const struct bpf_prog *prog, void *const *ctxs,
+		size_t nr, size_t ctx_len, __u64 *r0, int *err);
+size_t bpf_prog_run_strided(const struct bpf_prog *prog, void *base,
+		size_t stride, size_t nr, size_t ctx_len, __u64 *r0, int *err);
+
+/*
+ * Instruction set BPF_F_SIMD batches of @prog run with: "avx512f",
+ * "avx2" or "sse4.2", or NULL when they run in the program engine.
+ */
+const char *bpf_prog_simd_isa(const struct bpf_prog *prog);
+
+/*
+ * Packet context, for programs using packet loads. BPF_LD | BPF_ABS
+ * loads the big-endian value of BPF_SIZE bytes (at most BPF_W) at
+ * offset imm (not negative) of the packet whose struct bpf_packet is
+ * pointed to by r6, into r0. BPF_LD | BPF_IND loads at offset
+ * (__u32) (src_reg + imm). A load out of the packet exits the program
+ * with r0 = 0, and packet loads clobber r1-r5. These are the classic
+ * BPF semantics, see bpf_cbpf.h. Programs must be loaded with a
+ * ctx_size of at least sizeof(struct bpf_packet), and may not store
+ * into their context, so that the packet does not change while they
+ * run.
+ *
+ * Engines other than BPF_ENGINE_SWITCH check the packet length once
+ * for a run of BPF_ABS loads in straight-line code without side
+ * effects: when any load of the run is out of the packet, the program
+ * exits at the first one, with the same result.
+ */
+struct bpf_packet {
+	const void	*data;
+	__u32		len;
+};
+
+struct bpf_multi;
+
+/*
+ * Evaluate a set of filter programs in one pass: their bytecode is
+ * merged into a prefix tree, and instruction prefixes shared by
+ * several programs run once. Programs are run with the switch
+ * interpreter, whatever their engine, and may only store to their
+ * stack and call helpers flagged BPF_HELPER_F_PURE (of the built-in
+ * ones, map_lookup_elem), as a shared prefix calls them once for all
+ * programs. @progs must outlive the returned object. Returns NULL on
+ * error.
+ */
+struct bpf_multi *bpf_multi_create(struct bpf_prog *const *progs,
+		size_t nr_progs);
+void bpf_multi_destroy(struct bpf_multi *multi);
+
+/*
+ * Run the programs of @multi as bpf_prog_run() would, and set bit i of
+ * the bitmap @matched ((nr_progs + 63) / 64 words) when program i ran
+ * without error and returned non-zero. All programs run even if some
+ * fail. Returns BPF_ERR_NONE, or the enum bpf_error of the failed
+ * program with the lowest index.
+ */
+int bpf_multi_run(const struct bpf_multi *multi, void *ctx, size_t ctx_len,
+		__u64 *matched);
+
+/* Number of distinct instructions in the prefix tree of @multi. */
+size_t bpf_multi_nr_insns(const struct bpf_multi *multi);
+
+struct bpf_pool;
+struct bpf_work;
+
+typedef void (*bpf_work_done_t)(struct bpf_work *work);
+
+/*
+ * Batch submitted to a pool: run @prog on @nr contexts, as
+ * bpf_prog_run_batch() (@ctxs) or bpf_prog_run_strided() (@ctxs NULL,
+ * @base and @stride) would. The caller owns the work item, and sets
+ * the fields up to @priv before submitting it.
+ */
+struct bpf_work {
+	const struct bpf_prog	*prog;
+	void *const		*ctxs;
+	void			*base;
+	size_t			stride;
+	size_t			nr;
+	size_t			ctx_len;
+	__u64			*r0;		/* @nr results */
+	bpf_work_done_t		done;		/* or NULL, see bpf_work_wait() */
+	void			*priv;
+	/* Results, once done. */
+	size_t			nr_done;	/* as returned by batch runs */
+	int			err;		/* enum bpf_error */
+	/* Private to the pool. */
+	struct bpf_pool		*pool;
+	struct bpf_work		*next;
+	size_t			remaining;
+	int			completed;
+};
+
+/*
+ * Pool of worker threads running batches. Each worker owns a deque of
+ * ranges of contexts: it splits the range it runs in halves down to
+ * BPF_POOL_CHUNK contexts, pushing the upper halves to its deque, and
+ * idle workers steal the largest ranges left from the other deques.
+ * Workers run batches with the registers and stack of their thread,
+ * and submitting and running work allocates nothing.
+ *
+ * Create the pool with @nr_threads workers, or one per online CPU if
+ * 0. Returns NULL on error. Destroying the pool waits for the work
+ * submitted to complete.
+ */
+#define BPF_POOL_CHUNK		256
+
+struct bpf_pool *bpf_pool_create(unsigned int nr_threads);
+void bpf_pool_destroy(struct bpf_pool *pool);
+unsigned int bpf_pool_nr_threads(const struct bpf_pool *pool);
+
+/*
+ * Queue @work to the workers of @pool. Once all its runs are done, its
+ * done callback is called from a worker thread, as the last access of
+ * the pool to @work. The callback may submit more work. Ranges of
+ * contexts run in parallel, so that when a run fails, runs after it
+ * may have run as well: @work->nr_done is the index of the first run
+ * which failed, as with bpf_prog_run_batch(), and @work->err its enum
+ * bpf_error.
+ */
+void bpf_pool_submit(struct bpf_pool *pool, struct bpf_work *work);
+
+/*
+ * Wait for @work, submitted without done callback, to complete. Returns
+ * @work->err.
+ */
+int bpf_work_wait(struct bpf_work *work);
+
+/*
+ * Engine running @prog now. With BPF_ENGINE_TIERED, this is
+ * BPF_ENGINE_THREADED until the program was run tier_threshold times
+ * and compiled in the background, then BPF_ENGINE_JIT. Runs are not
+ * blocked while compiling: those started before the switch complete
+ * in the interpreter.
+ */
+enum bpf_engine bpf_prog_engine(const struct bpf_prog *prog);
+
+/*
+ * Print the superinstructions (fused instruction pairs) used to run
+ * @prog, with their pc. Only the threaded engine fuses instructions.
+ * Returns the number of fused pairs.
+ */
+size_t bpf_prog_print_fusions(const struct bpf_prog *prog);
+
+/*
+ * Print the bytecode of a BPF_F_PROFILE program annotated with its
+ * profile: execution count and share of executed instructions of each
+ * instruction, average clock ticks (TSC cycles on x86-64, nanoseconds
+ * elsewhere) per basic block entry and share of all ticks of each
+ * block. Returns 0 on success, -1 if @prog is not profiled.
+ */
+int bpf_prog_print_profile(const struct bpf_prog *prog);
+void bpf_prog_reset_profile(struct bpf_prog *prog);
+
+void bpf_prog_set_debug_hook(struct bpf_prog *prog, bpf_debug_hook_t hook,
+		void *priv);
+
+/* Debug hook printing errors to stderr and registers to stdout. */
+void bpf_debug_print(const struct bpf_prog *prog, int err, size_t pc,
+		const __s64 *reg, void *priv);
+
+const char *bpf_strerror(int err);
+
+#endif /* _BPF_PROG_H */
@@ -0,0 +1,324 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * SIMD lane engine: run one program on several contexts in lockstep.
+ * Each register is a vector of the values of each lane, so that ALU
+ * operations and jump conditions run on all lanes at once. Memory
+ * accesses, packet loads and helper calls loop over the lanes.
+ *
+ * Lanes at the same pc run unmasked: the registers of lanes which
+ * exited do not matter anymore. When a conditional jump splits them,
+ * each lane gets its own pc, and each step runs the lanes at the
+ * lowest pc, blending their results into the registers with a mask.
+ * Lanes behind catch up with the others where the branches join, and
+ * run unmasked again from there.
+ *
+ * Instructions without a vector form (atomics) run lane by lane in the
+ * switch engine, with the lane registers and stack, and the lanes go
+ * on from their next pc.
+ *
+ * The engine is built for AVX-512F (8 lanes), AVX2 (4 lanes) and
+ * SSE4.2 (2 lanes, 64-bit compares need SSE4.2): one native vector
+ * register per BPF register. Wider vectors than the registers are
+ * split by the compiler, through memory more often than not, which
+ * costs more than the lanes gain. simd_select() picks the widest
+ * instruction set the CPU supports.
+ */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+
+#include <immintrin.h>
+
+/* One bit per lane, to turn lane bitmasks into vector masks. */
+static const __u64 simd_lane_bit[BPF_SIMD_LANES] = {
+	1, 2, 4, 8, 16, 32, 64, 128,
+};
+
+/*
+ * Run the instruction at *@pcp of lane @l in the switch engine, with
+ * @reg holding the registers of @lanes lanes each. Returns true when
+ * the lane exited, with its r0 and enum bpf_error in @r0 and @err,
+ * false with its next pc in *@pcp.
+ */
+static
+bool simd_scalar(const struct bpf_prog *prog, __u64 *reg,
+		unsigned int lanes, unsigned int l, size_t *pcp, __u64 *r0,
+		int *err)
+{
+	__s64 lane_reg[MAX_BPF_REG];
+	int i, ret;
+
+	for (i = 0; i < MAX_BPF_REG; i++)
+		lane_reg[i] = reg[i * lanes + l];
+	ret = run_segment(prog->insns, prog->len, lane_reg, pcp, *pcp + 1);
+	if (ret != BPF_SEGMENT_STOPPED) {
+		err[l] = ret;
+		r0[l] = lane_reg[BPF_REG_0];
+		return true;
+	}
+	for (i = 0; i < MAX_BPF_REG; i++)
+		reg[i * lanes + l] = lane_reg[i];
+	return false;
+}
+
+/*
+ * Helpers of bpf_simd_engine.h, on the lanes_t and slanes_t vector
+ * types it defines.
+ */
+
+/* Loop over the lanes of the bitmask @bits, with @l the lane. */
+#define for_each_lane(l, m, bits)	\
+	for ((m) = (bits); (m) && ((l) = __builtin_ctz(m), 1); (m) &= (m) - 1)
+
+/* @v in all lanes. */
+#define LANES_SPLAT(v)		((lanes_t) { 0 } + (__u64) (v))
+
+/* All ones in the lanes of the bitmask @bits, zero in the others. */
+#define LANES_MASK(bits)	((lanes_t) ((LANES_SPLAT(bits) & lane_bit) != 0))
+
+/* Lanes of the vector mask @c, as a bitmask. */
+#define LANES_BITS(c)		SIMD_BITS(c)
+
+/* Operands of ALU and jump instructions. */
+#define LANES_K			LANES_SPLAT((__s64) insn->imm)
+#define LANES_X			reg[insn->src_reg]
+
+/*
+ * Store @expr into the destination register, and go to the next
+ * instruction. Lanes not at this pc keep their value.
+ */
+#define LANES_ALU64(expr)						\
+	do {								\
+		lanes_t __v = (expr);					\
+									\
+		if (split)						\
+			__v = (__v & act_mask) | (reg[dst] & ~act_mask);\
+		reg[dst] = __v;						\
+		goto next;						\
+	} while (0)
+#define LANES_ALU32(expr)	LANES_ALU64((expr) & 0xffffffff)
+
+#define LANES_ALU_CASES(op, oper)					\
+	case BPF_ALU64 | op | BPF_K:					\
+		LANES_ALU64(reg[dst] oper LANES_K);			\
+	case BPF_ALU64 | op | BPF_X:					\
+		LANES_ALU64(reg[dst] oper LANES_X);			\
+	case BPF_ALU | op | BPF_K:					\
+		LANES_ALU32(reg[dst] oper LANES_K);			\
+	case BPF_ALU | op | BPF_X:					\
+		LANES_ALU32(reg[dst] oper LANES_X);
+
+#define LANES_LSH(v, n)		((v) << (n))
+#define LANES_RSH(v, n)		((v) >> (n))
+#define LANES_ARSH(v, n)	((lanes_t) ((slanes_t) (v) >> (slanes_t) (n)))
+
+/*
+ * Lanes of @act where @cond holds fail with @error. Lanes which exited
+ * may hold any operand.
+ */
+#define LANES_CHECK(cond, error)					\
+	do {								\
+		c = (lanes_t) (cond);					\
+		bits = LANES_BITS(c) & act;				\
+		if (bits) {						\
+			ret = (error);					\
+			goto lane_error;				\
+		}							\
+	} while (0)
+
+/* Shift of @width bits, negative counts are out of range as well. */
+#define LANES_SHIFT(alu, width, shift, count)				\
+	do {								\
+		LANES_CHECK((count) >= (width), BPF_ERR_SHIFT);		\
+		alu(shift(reg[dst], (count) & 63));			\
+	} while (0)
+
+#define LANES_SHIFT_CASES(op, shift)					\
+	case BPF_ALU64 | op | BPF_K:					\
+		LANES_SHIFT(LANES_ALU64, 64, shift, LANES_K);		\
+	case BPF_ALU64 | op | BPF_X:					\
+		LANES_SHIFT(LANES_ALU64, 64, shift, LANES_X);		\
+	case BPF_ALU | op | BPF_K:					\
+		LANES_SHIFT(LANES_ALU32, 32, shift, LANES_K);		\
+	case BPF_ALU | op | BPF_X:					\
+		LANES_SHIFT(LANES_ALU32, 32, shift, LANES_X);
+
+/*
+ * Signed division or modulo by @divisor, failing with @error where
+ * @bad holds for the divisor @b. Lanes not at this pc divide by 1, so
+ * that they do not trap, and so do lanes dividing by -1, which get
+ * @minus_one instead: INT64_MIN / -1 traps.
+ */
+#define LANES_DIV(alu, oper, divisor, bad, error, minus_one)		\
+	do {								\
+		lanes_t __n;						\
+									\
+		b = (divisor);						\
+		LANES_CHECK(bad, error);				\
+		__n = (lanes_t) (b == LANES_SPLAT(-1));			\
+		c = LANES_MASK(act) & ~__n;				\
+		b = (b & c) | (~c & 1);					\
+		alu(((lanes_t) ((slanes_t) reg[dst] oper (slanes_t) b)	\
+			& ~__n) | ((minus_one) & __n));			\
+	} while (0)
+
+#define LANES_DIV_CASES(op, oper, bad, error, minus_one)		\
+	case BPF_ALU64 | op | BPF_K:					\
+		LANES_DIV(LANES_ALU64, oper, LANES_K, bad, error,	\
+			minus_one);					\
+	case BPF_ALU64 | op | BPF_X:					\
+		LANES_DIV(LANES_ALU64, oper, LANES_X, bad, error,	\
+			minus_one);					\
+	case BPF_ALU | op | BPF_K:					\
+		LANES_DIV(LANES_ALU32, oper, LANES_K, bad, error,	\
+			minus_one);					\
+	case BPF_ALU | op | BPF_X:					\
+		LANES_DIV(LANES_ALU32, oper, LANES_X, bad, error,	\
+			minus_one);
+
+/* Compare operands, unsigned or signed, on 64 or 32 bits. */
+#define LANES_U(v)		(v)
+#define LANES_U32(v)		((v) & 0xffffffff)
+#define LANES_S(v)		((slanes_t) (v))
+#define LANES_S32(v)		((slanes_t) ((v) << 32) >> 32)
+
+/* Jump with the lanes where @cond holds. */
+#define LANES_JMP(cond)							\
+	do {								\
+		c = (lanes_t) (cond);					\
+		bits = LANES_BITS(c) & act;				\
+		goto branch;						\
+	} while (0)
+
+#define LANES_CMP_CASES(op, cmp, cast)					\
+	case BPF_JMP | op | BPF_K:					\
+		LANES_JMP(cast(reg[dst]) cmp cast(LANES_K));		\
+	case BPF_JMP | op | BPF_X:					\
+		LANES_JMP(cast(reg[dst]) cmp cast(LANES_X));		\
+	case BPF_JMP32 | op | BPF_K:					\
+		LANES_JMP(cast##32(reg[dst]) cmp cast##32(LANES_K));	\
+	case BPF_JMP32 | op | BPF_X:					\
+		LANES_JMP(cast##32(reg[dst]) cmp cast##32(LANES_X));
+
+/*
+ * Loads write the lanes of the destination register in place, which
+ * leaves the other lanes as they are.
+ */
+#define LANES_LOAD(type)						\
+	do {								\
+		for_each_lane(l, m, act)				\
+			reg[dst][l] = *(type *) (LANES_X[l] + insn->off);\
+		goto next;						\
+	} while (0)
+
+#define LANES_LOAD_ACQ(type)						\
+	do {								\
+		for_each_lane(l, m, act)				\
+			reg[dst][l] = __atomic_load_n(			\
+				(type *) (LANES_X[l] + insn->off),	\
+				__ATOMIC_ACQUIRE);			\
+		goto next;						\
+	} while (0)
+
+#define LANES_STORE_REL(type, v)					\
+	do {								\
+		b = (v);						\
+		for_each_lane(l, m, act)				\
+			__atomic_store_n((type *) (reg[dst][l] + insn->off),\
+				b[l], __ATOMIC_RELEASE);		\
+		goto next;						\
+	} while (0)
+
+#define LANES_STORE(type, v)						\
+	do {								\
+		b = (v);						\
+		for_each_lane(l, m, act)				\
+			*(type *) (reg[dst][l] + insn->off) = b[l];	\
+		goto next;						\
+	} while (0)
+
+#define SIMD_RUN	simd_run_avx512
+#define SIMD_TARGET	"avx512f"
+#define SIMD_LANES	8
+#define SIMD_BITS(c)	_mm512_test_epi64_mask((__m512i) (c), (__m512i) (c))
+#include "./bpf_simd_engine.h"
+#undef SIMD_RUN
+#undef SIMD_TARGET
+#undef SIMD_LANES
+#undef SIMD_BITS
+
+#define SIMD_RUN	simd_run_avx2
+#define SIMD_TARGET	"avx2"
+#define SIMD_LANES	4
+#define SIMD_BITS(c)	_mm256_movemask_pd((__m256d) (c))
+#include "./bpf_simd_engine.h"
+#undef SIMD_RUN
+#undef SIMD_TARGET
+#undef SIMD_LANES
+#undef SIMD_BITS
+
+#define SIMD_RUN	simd_run_sse42
+#define SIMD_TARGET	"sse4.2"
+#define SIMD_LANES	2
+#define SIMD_BITS(c)	_mm_movemask_pd((__m128d) (c))
+#include "./bpf_simd_engine.h"
+#undef SIMD_RUN
+#undef SIMD_TARGET
+#undef SIMD_LANES
+#undef SIMD_BITS
+
+static const struct bpf_simd simd_isas[] = {
+	[SIMD_ISA_SSE42] = { "sse4.2", simd_run_sse42, 2 },
+	[SIMD_ISA_AVX2] = { "avx2", simd_run_avx2, 4 },
+	[SIMD_ISA_AVX512] = { "avx512f", simd_run_avx512, 8 },
+};
+
+const struct bpf_simd *simd_isa(enum simd_isa isa)
+{
+	bool supported;
+
+	__builtin_cpu_init();
+	switch (isa) {
+	case SIMD_ISA_SSE42:
+		supported = __builtin_cpu_supports("sse4.2");
+		break;
+	case SIMD_ISA_AVX2:
+		supported = __builtin_cpu_supports("avx2");
+		break;
+	case SIMD_ISA_AVX512:
+		supported = __builtin_cpu_supports("avx512f");
+		break;
+	default:
+		supported = false;
+		break;
+	}
+	return supported ? &simd_isas[isa] : NULL;
+}
+
+#else
+
+const struct bpf_simd *simd_isa(enum simd_isa isa)
+{
+	return NULL;
+}
+
+#endif
+
+const struct bpf_simd *simd_select(void)
+{
+	const struct bpf_simd *simd;
+	int isa;
+
+	for (isa = SIMD_NR_ISAS - 1; isa >= 0; isa--) {
+		simd = simd_isa(isa);
+		if (simd)
+			return simd;
+	}
+	return NULL;
+}
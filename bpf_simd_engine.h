@@ -0,0 +1,293 @@
+/*
+ * SIMD lane engine body, included by bpf_simd.c once per instruction
+ * set with SIMD_RUN (function name), SIMD_TARGET (target attribute),
+ * SIMD_LANES (lanes of a native vector register) and SIMD_BITS (vector
+ * mask to bitmask) defined.
+ *
+ * Runs @prog on the @nr contexts of @ctxs, storing the r0 and enum
+ * bpf_error of each lane into @r0 and @err. Lanes are retired as they
+ * exit: @live is the bitmask of running lanes, @act the one of lanes at
+ * @pc. While @split, the pc of each lane is in @pcs. Instructions are
+ * dispatched on their whole opcode, with a single jump table.
+ */
+static __attribute__((target(SIMD_TARGET)))
+void SIMD_RUN(const struct bpf_prog *prog, void *const *ctxs, size_t nr,
+		size_t ctx_len, __u64 *r0, int *err)
+{
+	typedef __u64 lanes_t __attribute__((vector_size(SIMD_LANES * sizeof(__u64))));
+	typedef __s64 slanes_t __attribute__((vector_size(SIMD_LANES * sizeof(__s64))));
+	__u64 stack[SIMD_LANES][BPF_STACK_SIZE / sizeof(__u64)];
+	const struct bpf_insn *insn;
+	const struct bpf_helper *helper;
+	const struct bpf_packet *pkt;
+	lanes_t reg[MAX_BPF_REG], pcs = { 0 }, act_mask = { 0 }, lane_bit, b, c;
+	unsigned int live, act, bits, m, l, dst, step, size;
+	size_t pc = 0;
+	bool split = false;
+	__u32 off;
+	int ret;
+
+	memcpy(&lane_bit, simd_lane_bit, sizeof(lane_bit));
+	memset(reg, 0, sizeof(reg));
+	for (l = 0; l < nr; l++) {
+		reg[BPF_REG_1][l] = (unsigned long) ctxs[l];
+		reg[BPF_REG_2][l] = ctx_len;
+		reg[BPF_REG_10][l] = (unsigned long) stack[l] + sizeof(stack[l]);
+	}
+	live = act = (1U << nr) - 1;
+
+	for (;;) {
+		if (split) {
+			/* Run the lanes at the lowest pc. */
+			b = pcs | ~LANES_MASK(live);
+			pc = b[0];
+			for (l = 1; l < SIMD_LANES; l++)
+				pc = b[l] < pc ? b[l] : pc;
+			act_mask = (lanes_t) (b == pc);
+			act = LANES_BITS(act_mask);
+			split = act != live;
+		}
+		if (pc >= prog->len) {
+			ret = pc == prog->len ? BPF_ERR_NONE : BPF_ERR_PC_OVERFLOW;
+			goto finish;
+		}
+		insn = &prog->insns[pc];
+		dst = insn->dst_reg;
+		step = 1;
+
+		switch (insn->code) {
+		LANES_ALU_CASES(BPF_ADD, +)
+		LANES_ALU_CASES(BPF_SUB, -)
+		LANES_ALU_CASES(BPF_MUL, *)
+		LANES_ALU_CASES(BPF_OR, |)
+		LANES_ALU_CASES(BPF_AND, &)
+		LANES_ALU_CASES(BPF_XOR, ^)
+		case BPF_ALU64 | BPF_MOV | BPF_K:
+			LANES_ALU64(LANES_K);
+		case BPF_ALU64 | BPF_MOV | BPF_X:
+			LANES_ALU64(LANES_X);
+		case BPF_ALU | BPF_MOV | BPF_K:
+			LANES_ALU32(LANES_K);
+		case BPF_ALU | BPF_MOV | BPF_X:
+			LANES_ALU32(LANES_X);
+		case BPF_ALU64 | BPF_NEG:
+			LANES_ALU64(-reg[dst]);
+		case BPF_ALU | BPF_NEG:
+			LANES_ALU32(-reg[dst]);
+		LANES_SHIFT_CASES(BPF_LSH, LANES_LSH)
+		LANES_SHIFT_CASES(BPF_RSH, LANES_RSH)
+		LANES_SHIFT_CASES(BPF_ARSH, LANES_ARSH)
+		LANES_DIV_CASES(BPF_DIV, /, b == 0, BPF_ERR_DIV_BY_ZERO,
+			-reg[dst])
+		LANES_DIV_CASES(BPF_MOD, %, (slanes_t) b <= 0, BPF_ERR_MODULO,
+			LANES_SPLAT(0))
+
+		case BPF_JMP | BPF_JA:
+		case BPF_JMP32 | BPF_JA:
+			bits = act;
+			goto branch;
+		LANES_CMP_CASES(BPF_JEQ, ==, LANES_U)
+		LANES_CMP_CASES(BPF_JNE, !=, LANES_U)
+		LANES_CMP_CASES(BPF_JGT, >, LANES_U)
+		LANES_CMP_CASES(BPF_JGE, >=, LANES_U)
+		LANES_CMP_CASES(BPF_JLT, <, LANES_U)
+		LANES_CMP_CASES(BPF_JLE, <=, LANES_U)
+		LANES_CMP_CASES(BPF_JSGT, >, LANES_S)
+		LANES_CMP_CASES(BPF_JSGE, >=, LANES_S)
+		LANES_CMP_CASES(BPF_JSLT, <, LANES_S)
+		LANES_CMP_CASES(BPF_JSLE, <=, LANES_S)
+		case BPF_JMP | BPF_JSET | BPF_K:
+			LANES_JMP((reg[dst] & LANES_K) != 0);
+		case BPF_JMP | BPF_JSET | BPF_X:
+			LANES_JMP((reg[dst] & LANES_X) != 0);
+		case BPF_JMP32 | BPF_JSET | BPF_K:
+			LANES_JMP(LANES_U32(reg[dst] & LANES_K) != 0);
+		case BPF_JMP32 | BPF_JSET | BPF_X:
+			LANES_JMP(LANES_U32(reg[dst] & LANES_X) != 0);
+		case BPF_JMP | BPF_CALL:
+			helper = bpf_helper_lookup(insn->imm);
+			if (!helper) {
+				ret = BPF_ERR_UNSUPPORTED;
+				goto finish;
+			}
+			for_each_lane(l, m, act) {
+				reg[BPF_REG_0][l] = helper->fn(reg[BPF_REG_1][l],
+					reg[BPF_REG_2][l], reg[BPF_REG_3][l],
+					reg[BPF_REG_4][l], reg[BPF_REG_5][l]);
+			}
+			goto next;
+		case BPF_JMP | BPF_EXIT:
+			ret = BPF_ERR_NONE;
+			goto finish;
+
+		case BPF_LD | BPF_W | BPF_IMM:
+			LANES_ALU64(LANES_K);
+		case BPF_LD | BPF_DW | BPF_IMM:
+			step = 2;
+			LANES_ALU64(LANES_SPLAT(((__u64) (insn + 1)->imm << 32)
+				| (__u32) insn->imm));
+		case BPF_LD | BPF_W | BPF_ABS:
+		case BPF_LD | BPF_W | BPF_IND:
+			size = 4;
+			goto packet;
+		case BPF_LD | BPF_H | BPF_ABS:
+		case BPF_LD | BPF_H | BPF_IND:
+			size = 2;
+			goto packet;
+		case BPF_LD | BPF_B | BPF_ABS:
+		case BPF_LD | BPF_B | BPF_IND:
+			size = 1;
+			goto packet;
+
+		case BPF_LDX | BPF_W | BPF_MEM:
+			LANES_LOAD(__u32);
+		case BPF_LDX | BPF_H | BPF_MEM:
+			LANES_LOAD(__u16);
+		case BPF_LDX | BPF_B | BPF_MEM:
+			LANES_LOAD(__u8);
+		case BPF_LDX | BPF_DW | BPF_MEM:
+			LANES_LOAD(__u64);
+		case BPF_STX | BPF_W | BPF_MEM:
+			LANES_STORE(__u32, LANES_X);
+		case BPF_STX | BPF_H | BPF_MEM:
+			LANES_STORE(__u16, LANES_X);
+		case BPF_STX | BPF_B | BPF_MEM:
+			LANES_STORE(__u8, LANES_X);
+		case BPF_STX | BPF_DW | BPF_MEM:
+			LANES_STORE(__u64, LANES_X);
+		case BPF_ST | BPF_W | BPF_MEM:
+			LANES_STORE(__u32, LANES_K);
+		case BPF_ST | BPF_H | BPF_MEM:
+			LANES_STORE(__u16, LANES_K);
+		case BPF_ST | BPF_B | BPF_MEM:
+			LANES_STORE(__u8, LANES_K);
+		case BPF_ST | BPF_DW | BPF_MEM:
+			LANES_STORE(__u64, LANES_K);
+		case BPF_LDX | BPF_W | BPF_MEM_ACQ_REL:
+			LANES_LOAD_ACQ(__u32);
+		case BPF_LDX | BPF_H | BPF_MEM_ACQ_REL:
+			LANES_LOAD_ACQ(__u16);
+		case BPF_LDX | BPF_B | BPF_MEM_ACQ_REL:
+			LANES_LOAD_ACQ(__u8);
+		case BPF_LDX | BPF_DW | BPF_MEM_ACQ_REL:
+			LANES_LOAD_ACQ(__u64);
+		case BPF_STX | BPF_W | BPF_MEM_ACQ_REL:
+			LANES_STORE_REL(__u32, LANES_X);
+		case BPF_STX | BPF_H | BPF_MEM_ACQ_REL:
+			LANES_STORE_REL(__u16, LANES_X);
+		case BPF_STX | BPF_B | BPF_MEM_ACQ_REL:
+			LANES_STORE_REL(__u8, LANES_X);
+		case BPF_STX | BPF_DW | BPF_MEM_ACQ_REL:
+			LANES_STORE_REL(__u64, LANES_X);
+		case BPF_ST | BPF_W | BPF_MEM_ACQ_REL:
+			LANES_STORE_REL(__u32, LANES_K);
+		case BPF_ST | BPF_H | BPF_MEM_ACQ_REL:
+			LANES_STORE_REL(__u16, LANES_K);
+		case BPF_ST | BPF_B | BPF_MEM_ACQ_REL:
+			LANES_STORE_REL(__u8, LANES_K);
+		case BPF_ST | BPF_DW | BPF_MEM_ACQ_REL:
+			LANES_STORE_REL(__u64, LANES_K);
+
+		default:
+			goto scalar;
+		}
+
+next:
+		if (split)
+			pcs += act_mask & step;
+		else
+			pc += step;
+		continue;
+
+		/* Packet load, lanes out of the packet exit with r0 = 0. */
+packet:
+		bits = 0;
+		for_each_lane(l, m, act) {
+			pkt = (const struct bpf_packet *) reg[BPF_REG_6][l];
+			off = insn->imm;
+			if (BPF_MODE(insn->code) == BPF_IND)
+				off += reg[insn->src_reg][l];
+			if (pkt->len < size || off > pkt->len - size) {
+				r0[l] = 0;
+				err[l] = BPF_ERR_NONE;
+				bits |= 1U << l;
+			}
+		}
+		if (bits)
+			goto retire;
+		for_each_lane(l, m, act) {
+			pkt = (const struct bpf_packet *) reg[BPF_REG_6][l];
+			off = insn->imm;
+			if (BPF_MODE(insn->code) == BPF_IND)
+				off += reg[insn->src_reg][l];
+			reg[BPF_REG_0][l] = packet_read(
+				(const __u8 *) pkt->data + off, size);
+		}
+		goto next;
+
+		/* Lanes of @bits jump, the others of @act go on. */
+branch:
+		if (!insn->off)
+			goto next;
+		if (!split) {
+			if (bits == act) {
+				pc += insn->off + 1;
+				continue;
+			}
+			if (!bits) {
+				pc++;
+				continue;
+			}
+			split = true;
+			pcs = LANES_SPLAT(pc);
+			act_mask = LANES_MASK(act);
+		}
+		c = LANES_MASK(bits);
+		pcs = (c & LANES_SPLAT(pc + insn->off + 1))
+			| (~c & (pcs + (act_mask & 1)));
+		continue;
+
+lane_error:
+		for_each_lane(l, m, bits)
+			err[l] = ret;
+		goto retire;
+
+		/* Lanes go on from their own pc, or exit. */
+scalar:
+		if (!split) {
+			split = true;
+			pcs = LANES_SPLAT(pc);
+		}
+		bits = 0;
+		for_each_lane(l, m, act) {
+			size_t lane_pc = pc;
+
+			if (simd_scalar(prog, (__u64 *) reg, SIMD_LANES, l,
+					&lane_pc, r0, err))
+				bits |= 1U << l;
+			else
+				pcs[l] = lane_pc;
+		}
+		goto retire;
+
+finish:
+		for_each_lane(l, m, act) {
+			r0[l] = reg[BPF_REG_0][l];
+			err[l] = ret;
+		}
+		bits = act;
+		/*
+		 * Lanes of @bits exited. Others of @act run the instruction
+		 * again on the next step, none of them changed state yet,
+		 * unless they ran it in the switch engine.
+		 */
+retire:
+		live &= ~bits;
+		if (!live)
+			return;
+		if (!split) {
+			split = true;
+			pcs = LANES_SPLAT(pc);
+		}
+	}
+}
@@ -0,0 +1,161 @@
+#include "./bpf.h"
+#include "./bpf_private.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ * Tiered execution: programs start in the threaded interpreter, and
+ * count their runs. The run reaching the threshold queues the program
+ * to a background compiler thread, shared by all programs, which
+ * publishes the JIT code with a release store of prog->jit. Runs load
+ * it with acquire semantic, so running threads are never blocked:
+ * runs which started in the interpreter finish there, and later runs
+ * use the compiled code.
+ */
+
+struct bpf_tier {
+	struct bpf_prog		*prog;
+	unsigned long		threshold;
+	unsigned long		nr_runs;	/* interpreted runs */
+	bool			queued;
+	struct bpf_tier		*next;		/* compile queue */
+};
+
+static pthread_once_t tier_once = PTHREAD_ONCE_INIT;
+static bool tier_worker_running;
+static pthread_mutex_t tier_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tier_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t tier_done_cond = PTHREAD_COND_INITIALIZER;
+/* Protected by tier_lock. */
+static struct bpf_tier *tier_head, *tier_tail;
+static struct bpf_tier *tier_compiling;
+
+static
+void tier_compile(struct bpf_prog *prog)
+{
+	struct bpf_dinsn *insns;
+	struct bpf_jit *jit;
+
+	/* The interpreter runs the fused form, the JIT needs its own. */
+	insns = decode_bytecode(prog->insns, prog->len);
+	if (!insns)
+		return;
+	jit = jit_compile(insns, prog->len);
+	free(insns);
+	/* On failure, the program stays in the interpreter. */
+	if (jit)
+		__atomic_store_n(&prog->jit, jit, __ATOMIC_RELEASE);
+}
+
+static
+void *tier_worker(void *arg)
+{
+	struct bpf_tier *tier;
+
+	pthread_mutex_lock(&tier_lock);
+	for (;;) {
+		while (!tier_head)
+			pthread_cond_wait(&tier_work_cond, &tier_lock);
+		tier = tier_head;
+		tier_head = tier->next;
+		if (!tier_head)
+			tier_tail = NULL;
+		tier->queued = false;
+		tier_compiling = tier;
+		pthread_mutex_unlock(&tier_lock);
+
+		tier_compile(tier->prog);
+
+		pthread_mutex_lock(&tier_lock);
+		tier_compiling = NULL;
+		pthread_cond_broadcast(&tier_done_cond);
+	}
+	return NULL;
+}
+
+static
+void tier_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (!pthread_create(&tid, &attr, tier_worker, NULL))
+		tier_worker_running = true;
+	pthread_attr_destroy(&attr);
+}
+
+static
+void tier_enqueue(struct bpf_tier *tier)
+{
+	pthread_mutex_lock(&tier_lock);
+	tier->queued = true;
+	tier->next = NULL;
+	if (tier_tail)
+		tier_tail->next = tier;
+	else
+		tier_head = tier;
+	tier_tail = tier;
+	pthread_cond_signal(&tier_work_cond);
+	pthread_mutex_unlock(&tier_lock);
+}
+
+/*
+ * Prepare tiered execution of @prog, whose threaded engine form is
+ * ready. Compile after @threshold interpreted runs. Returns NULL on
+ * error.
+ */
+struct bpf_tier *tier_init(struct bpf_prog *prog, unsigned long threshold)
+{
+	struct bpf_tier *tier;
+
+	pthread_once(&tier_once, tier_start);
+	if (!tier_worker_running) {
+		fprintf(stderr, "Error: cannot start the compiler thread\n");
+		return NULL;
+	}
+	tier = calloc(1, sizeof(*tier));
+	if (!tier)
+		return NULL;
+	tier->prog = prog;
+	tier->threshold = threshold ? threshold : BPF_TIER_THRESHOLD;
+	return tier;
+}
+
+/* Cancel or wait for the compilation of the program. */
+void tier_free(struct bpf_tier *tier)
+{
+	struct bpf_tier **p, *prev = NULL;
+
+	if (!tier)
+		return;
+	pthread_mutex_lock(&tier_lock);
+	if (tier->queued) {
+		for (p = &tier_head; *p != tier; p = &(*p)->next)
+			prev = *p;
+		*p = tier->next;
+		if (tier_tail == tier)
+			tier_tail = prev;
+	}
+	while (tier_compiling == tier)
+		pthread_cond_wait(&tier_done_cond, &tier_lock);
+	pthread_mutex_unlock(&tier_lock);
+	free(tier);
+}
+
+/* Run with the current tier, returns an enum bpf_error. */
+int run_tiered(const struct bpf_prog *prog, __s64 *reg, size_t *pc)
+{
+	struct bpf_jit *jit = __atomic_load_n(&prog->jit, __ATOMIC_ACQUIRE);
+	struct bpf_tier *tier = prog->tier;
+
+	if (jit)
+		return run_jit(jit, reg, pc);
+	if (__atomic_add_fetch(&tier->nr_runs, 1, __ATOMIC_RELAXED)
+	    == tier->threshold)
+		tier_enqueue(tier);
+	return run_decoded(prog->dinsns, prog->len, reg, pc);
+}
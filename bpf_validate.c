@@ -1,5 +1,8 @@
 #include "./bpf.h"
 #include "./bpf_private.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 bool is_imm64(const struct bpf_insn *insn)
 {
@@ -27,6 +30,43 @@ bool is_imm64(const struct bpf_insn *insn)
 	return false;
 }
 
+/* BPF_LD | BPF_ABS and BPF_LD | BPF_IND, see struct bpf_packet. */
+bool is_packet_load(const struct bpf_insn *insn)
+{
+	return BPF_CLASS(insn->code) == BPF_LD
+		&& (BPF_MODE(insn->code) == BPF_ABS
+		    || BPF_MODE(insn->code) == BPF_IND);
+}
+
+/* Returns the enum bpf_atomic_op for an atomic immediate, or -1. */
+int atomic_op(__s32 imm)
+{
+	switch (imm) {
+	case BPF_ADD:
+		return BPF_AOP_ADD;
+	case BPF_OR:
+		return BPF_AOP_OR;
+	case BPF_AND:
+		return BPF_AOP_AND;
+	case BPF_XOR:
+		return BPF_AOP_XOR;
+	case BPF_ADD | BPF_FETCH:
+		return BPF_AOP_FETCH_ADD;
+	case BPF_OR | BPF_FETCH:
+		return BPF_AOP_FETCH_OR;
+	case BPF_AND | BPF_FETCH:
+		return BPF_AOP_FETCH_AND;
+	case BPF_XOR | BPF_FETCH:
+		return BPF_AOP_FETCH_XOR;
+	case BPF_XCHG:
+		return BPF_AOP_XCHG;
+	case BPF_CMPXCHG:
+		return BPF_AOP_CMPXCHG;
+	default:
+		return -1;
+	}
+}
+
 /*
  * When loading a 64-bit immediate, the following instruction appears
  * as a 32-bit immediate load.
@@ -46,9 +86,33 @@ int validate_insn(struct bpf_insn *insn, size_t i, size_t len)
 	switch (insn->code) {
 		/* Load from immediate. */
 	case BPF_LD | BPF_W | BPF_IMM:
+		if (insn->dst_reg >= MAX_BPF_REG)
+			return -1;
+		break;
 	case BPF_LD | BPF_DW | BPF_IMM:
 		if (insn->dst_reg >= MAX_BPF_REG)
 			return -1;
+		if (insn->src_reg && insn->src_reg != BPF_PSEUDO_MAP_IDX)
+			return -1;
+		break;
+
+		/* Load from packet, to r0. */
+	case BPF_LD | BPF_W | BPF_ABS:
+	case BPF_LD | BPF_H | BPF_ABS:
+	case BPF_LD | BPF_B | BPF_ABS:
+		if (insn->dst_reg || insn->src_reg || insn->off)
+			return -1;
+		/* Negative offsets are the kernel ancillary data. */
+		if (insn->imm < 0)
+			return -1;
+		break;
+	case BPF_LD | BPF_W | BPF_IND:
+	case BPF_LD | BPF_H | BPF_IND:
+	case BPF_LD | BPF_B | BPF_IND:
+		if (insn->dst_reg || insn->off)
+			return -1;
+		if (insn->src_reg >= MAX_BPF_REG)
+			return -1;
 		break;
 
 		/* Load from address. */
@@ -113,6 +177,20 @@ int validate_insn(struct bpf_insn *insn, size_t i, size_t len)
 			return -1;
 		break;
 
+		/* Atomic read-modify-write. */
+	case BPF_STX | BPF_W | BPF_ATOMIC:
+	case BPF_STX | BPF_DW | BPF_ATOMIC:
+		if (insn->dst_reg >= MAX_BPF_REG)
+			return -1;
+		if (insn->src_reg >= MAX_BPF_REG)
+			return -1;
+		if (atomic_op(insn->imm) < 0) {
+			fprintf(stderr, "Error: unknown atomic operation %#x at pc %zu\n",
+				insn->imm, i);
+			return -1;
+		}
+		break;
+
 	case BPF_ALU | BPF_ADD | BPF_K:
 	case BPF_ALU | BPF_SUB | BPF_K:
 	case BPF_ALU | BPF_MUL | BPF_K:
@@ -175,8 +253,6 @@ int validate_insn(struct bpf_insn *insn, size_t i, size_t len)
 
 	case BPF_JMP | BPF_JA:
 	case BPF_JMP32 | BPF_JA:
-		if (insn->off == -1)
-			insn->off = -2;
 		break;
 
 	case BPF_JMP | BPF_JEQ | BPF_K:
@@ -201,8 +277,6 @@ int validate_insn(struct bpf_insn *insn, size_t i, size_t len)
 	case BPF_JMP32 | BPF_JSGE | BPF_K:
 	case BPF_JMP32 | BPF_JSLT | BPF_K:
 	case BPF_JMP32 | BPF_JSLE | BPF_K:
-		if (insn->off == -1)
-			insn->off = -2;
 		if (insn->dst_reg >= MAX_BPF_REG)
 			return -1;
 		break;
@@ -229,14 +303,27 @@ int validate_insn(struct bpf_insn *insn, size_t i, size_t len)
 	case BPF_JMP32 | BPF_JSGE | BPF_X:
 	case BPF_JMP32 | BPF_JSLT | BPF_X:
 	case BPF_JMP32 | BPF_JSLE | BPF_X:
-		if (insn->off == -1)
-			insn->off = -2;
 		if (insn->dst_reg >= MAX_BPF_REG)
 			return -1;
 		if (insn->src_reg >= MAX_BPF_REG)
 			return -1;
 		break;
 
+	case BPF_JMP | BPF_CALL:
+		if (insn->dst_reg || insn->src_reg || insn->off)
+			return -1;
+		if (!bpf_helper_lookup(insn->imm)) {
+			fprintf(stderr, "Error: unknown helper %d at pc %zu\n",
+				insn->imm, i);
+			return -1;
+		}
+		break;
+
+	case BPF_JMP | BPF_EXIT:
+		if (insn->dst_reg || insn->src_reg || insn->off || insn->imm)
+			return -1;
+		break;
+
 	default:
 		fprintf(stderr, "Error: Unsupported insn code %d\n",
 			insn->code);
@@ -245,15 +332,1036 @@ int validate_insn(struct bpf_insn *insn, size_t i, size_t len)
 	return 0;
 }
 
+enum cfg_state {
+	CFG_UNVISITED = 0,
+	CFG_ON_PATH,		/* on the current depth-first path */
+	CFG_DONE,
+	CFG_IMM64_HI,		/* second half of a 64-bit immediate load */
+};
+
+/*
+ * Fill @succ with the successors of instruction @i, return their
+ * number. Successor @len is the program exit.
+ */
+int cfg_successors(const struct bpf_insn *bytecode, size_t i, ssize_t *succ)
+{
+	const struct bpf_insn *insn = &bytecode[i];
+	unsigned int bpf_class = BPF_CLASS(insn->code);
+
+	if (insn->code == (BPF_JMP | BPF_EXIT))
+		return 0;
+	if (insn->code == (BPF_JMP | BPF_CALL)) {
+		succ[0] = i + 1;
+		return 1;
+	}
+	if (bpf_class == BPF_JMP || bpf_class == BPF_JMP32) {
+		succ[0] = (ssize_t) i + insn->off + 1;
+		if (BPF_OP(insn->code) == BPF_JA)
+			return 1;
+		succ[1] = i + 1;
+		return 2;
+	}
+	succ[0] = i + (is_imm64(insn) ? 2 : 1);
+	return 1;
+}
+
+/*
+ * Check the control-flow graph: jump targets must be within the
+ * bytecode (or at its end, which exits) and must not land in the middle
+ * of a 64-bit immediate load, every instruction must be reachable, and
+ * there must be no loop. An acyclic program executes each instruction
+ * at most once, so it terminates within len instructions and needs no
+ * runtime budget.
+ */
+static
+int validate_cfg(const struct bpf_insn *bytecode, size_t len)
+{
+	enum cfg_state *state;
+	size_t *stack, *next, sp = 0, i;
+	int ret = -1;
+
+	state = calloc(len + 1, sizeof(*state));
+	stack = calloc(len + 1, sizeof(*stack));
+	next = calloc(len + 1, sizeof(*next));
+	if (!state || !stack || !next)
+		goto end;
+	for (i = 0; i + 1 < len; i++) {
+		if (is_imm64(&bytecode[i]))
+			state[++i] = CFG_IMM64_HI;
+	}
+
+	/* Iterative depth-first search from the entry point. */
+	state[0] = CFG_ON_PATH;
+	stack[sp++] = 0;
+	while (sp) {
+		size_t pc = stack[sp - 1];
+		ssize_t succ[2], target;
+		int nr_succ;
+
+		if (pc == len) {
+			state[pc] = CFG_DONE;
+			sp--;
+			continue;
+		}
+		nr_succ = cfg_successors(bytecode, pc, succ);
+		if (next[pc] == nr_succ) {
+			state[pc] = CFG_DONE;
+			sp--;
+			continue;
+		}
+		target = succ[next[pc]++];
+		if (target < 0 || (size_t) target > len) {
+			fprintf(stderr, "Error: jump out of bounds at pc %zu\n", pc);
+			goto end;
+		}
+		switch (state[target]) {
+		case CFG_UNVISITED:
+			state[target] = CFG_ON_PATH;
+			stack[sp++] = target;
+			break;
+		case CFG_ON_PATH:
+			fprintf(stderr, "Error: loop detected at pc %zu\n", pc);
+			goto end;
+		case CFG_DONE:
+			break;
+		case CFG_IMM64_HI:
+			fprintf(stderr, "Error: jump into 64-bit immediate load at pc %zu\n",
+				pc);
+			goto end;
+		}
+	}
+
+	for (i = 0; i < len; i++) {
+		if (state[i] == CFG_UNVISITED) {
+			fprintf(stderr, "Error: unreachable insn at pc %zu\n", i);
+			goto end;
+		}
+	}
+	ret = 0;
+end:
+	free(next);
+	free(stack);
+	free(state);
+	return ret;
+}
+
+/*
+ * Check each instruction, then the control flow. Programs accepted by
+ * the validator are guaranteed to terminate.
+ */
 int validate_bytecode(struct bpf_insn *bytecode, size_t len)
 {
 	size_t i;
 
+	if (len > BPF_MAXINSNS) {
+		fprintf(stderr, "Error: bytecode length (%zu) exceeds %d insn\n",
+			len, BPF_MAXINSNS);
+		return -1;
+	}
 	for (i = 0; i < len; i++) {
 		struct bpf_insn *insn = &bytecode[i];
 
 		if (validate_insn(insn, i, len))
 			return -1;
 	}
+	return validate_cfg(bytecode, len);
+}
+
+/*
+ * Register types tracked by validate_types(). Scalars carry a signed
+ * value range, pointers a range of offsets from the start of their
+ * region (from the frame pointer for the stack). Registers clobbered
+ * by helper calls cannot be read.
+ */
+enum reg_type {
+	SCALAR = 0,
+	PTR_TO_CTX,
+	PTR_TO_STACK,
+	PTR_TO_MAP_VALUE,
+	PTR_TO_MAP_VALUE_OR_NULL,	/* map lookup result, until checked */
+	CONST_PTR_TO_MAP,
+	NOT_INIT,
+};
+
+struct reg_state {
+	enum reg_type	type;
+	__s64		min, max;
+	struct bpf_map	*map;		/* for map types */
+	size_t		id;		/* lookup call pc + 1, for OR_NULL */
+};
+
+struct type_state {
+	struct reg_state reg[MAX_BPF_REG];
+	__u8		stack_init[BPF_STACK_SIZE / 8];	/* bitmap */
+	bool		visited;
+};
+
+/* Bound on pointer offsets, keeps offset arithmetic from overflowing. */
+#define MAX_PTR_OFF		(1LL << 29)
+
+static
+void mark_unknown(struct reg_state *r)
+{
+	r->type = SCALAR;
+	r->min = INT64_MIN;
+	r->max = INT64_MAX;
+	r->map = NULL;
+	r->id = 0;
+}
+
+static
+void mark_const(struct reg_state *r, __s64 v)
+{
+	r->type = SCALAR;
+	r->min = v;
+	r->max = v;
+	r->map = NULL;
+	r->id = 0;
+}
+
+static
+bool is_const(const struct reg_state *r)
+{
+	return r->type == SCALAR && r->min == r->max;
+}
+
+static
+int check_reg_init(const struct type_state *st, int regno, size_t pc)
+{
+	if (st->reg[regno].type != NOT_INIT)
+		return 0;
+	fprintf(stderr, "Error: r%d is not initialized at pc %zu\n", regno, pc);
+	return -1;
+}
+
+/* Result of a 32-bit operation, truncated to its low 32 bits. */
+static
+void truncate32(struct reg_state *r)
+{
+	if (r->type != SCALAR || r->min < 0 || r->max > UINT32_MAX) {
+		r->type = SCALAR;
+		r->min = 0;
+		r->max = UINT32_MAX;
+		r->map = NULL;
+		r->id = 0;
+	}
+}
+
+/* Both operands constant: compute the result as the engines do. */
+static
+void scalar_alu_const(struct reg_state *dst, __s64 s, int op)
+{
+	__s64 d = dst->min;
+
+	switch (op) {
+	case BPF_ADD:
+		mark_const(dst, (__u64) d + (__u64) s);
+		return;
+	case BPF_SUB:
+		mark_const(dst, (__u64) d - (__u64) s);
+		return;
+	case BPF_MUL:
+		mark_const(dst, (__u64) d * (__u64) s);
+		return;
+	case BPF_OR:
+		mark_const(dst, d | s);
+		return;
+	case BPF_AND:
+		mark_const(dst, d & s);
+		return;
+	case BPF_XOR:
+		mark_const(dst, d ^ s);
+		return;
+	case BPF_LSH:
+		if (s >= 0 && s < 64) {
+			mark_const(dst, (__u64) d << s);
+			return;
+		}
+		break;
+	case BPF_RSH:
+		if (s >= 0 && s < 64) {
+			mark_const(dst, (__u64) d >> s);
+			return;
+		}
+		break;
+	case BPF_ARSH:
+		if (s >= 0 && s < 64) {
+			mark_const(dst, d >> s);
+			return;
+		}
+		break;
+	case BPF_DIV:
+		if (s) {
+			mark_const(dst, bpf_sdiv(d, s));
+			return;
+		}
+		break;
+	case BPF_MOD:
+		if (s > 0) {
+			mark_const(dst, d % s);
+			return;
+		}
+		break;
+	}
+	/* Runtime error, the result is never used. */
+	mark_unknown(dst);
+}
+
+/* 64-bit operation on scalar ranges. */
+static
+void scalar_alu(struct reg_state *dst, const struct reg_state *src, int op)
+{
+	__s64 lo, hi;
+
+	if (is_const(dst) && is_const(src)) {
+		scalar_alu_const(dst, src->min, op);
+		return;
+	}
+	switch (op) {
+	case BPF_ADD:
+		if (__builtin_add_overflow(dst->min, src->min, &lo)
+		    || __builtin_add_overflow(dst->max, src->max, &hi))
+			break;
+		dst->min = lo;
+		dst->max = hi;
+		return;
+	case BPF_SUB:
+		if (__builtin_sub_overflow(dst->min, src->max, &lo)
+		    || __builtin_sub_overflow(dst->max, src->min, &hi))
+			break;
+		dst->min = lo;
+		dst->max = hi;
+		return;
+	case BPF_MUL:
+		if (dst->min < 0 || src->min < 0
+		    || __builtin_mul_overflow(dst->max, src->max, &hi))
+			break;
+		dst->min *= src->min;
+		dst->max = hi;
+		return;
+	case BPF_AND:
+		/* The result has a subset of the bits of any non-negative operand. */
+		if (src->min >= 0 && dst->min >= 0) {
+			dst->max = dst->max < src->max ? dst->max : src->max;
+		} else if (src->min >= 0) {
+			dst->max = src->max;
+		} else if (dst->min < 0) {
+			break;
+		}
+		dst->min = 0;
+		return;
+	case BPF_RSH:
+		if (!is_const(src) || src->min < 0 || src->min >= 64)
+			break;
+		if (dst->min >= 0) {
+			dst->min >>= src->min;
+			dst->max >>= src->min;
+		} else if (src->min > 0) {
+			dst->min = 0;
+			dst->max = UINT64_MAX >> src->min;
+		} else {
+			break;
+		}
+		return;
+	case BPF_DIV:
+		if (!is_const(src) || src->min <= 0 || dst->min < 0)
+			break;
+		dst->min /= src->min;
+		dst->max /= src->min;
+		return;
+	case BPF_MOD:
+		/* Signed modulo, the result has the sign of the dividend. */
+		if (src->min <= 0)
+			break;
+		dst->min = dst->min >= 0 ? 0 : -(src->max - 1);
+		dst->max = src->max - 1;
+		return;
+	}
+	mark_unknown(dst);
+}
+
+/* Pointers which only helpers and null checks may use. */
+static
+bool is_opaque_ptr(const struct reg_state *r)
+{
+	return r->type == CONST_PTR_TO_MAP || r->type == PTR_TO_MAP_VALUE_OR_NULL;
+}
+
+static
+int check_alu(struct type_state *st, const struct bpf_insn *insn, size_t pc)
+{
+	struct reg_state *dst = &st->reg[insn->dst_reg], src;
+	bool is64 = BPF_CLASS(insn->code) == BPF_ALU64;
+	int op = BPF_OP(insn->code);
+	__s64 lo, hi;
+
+	if (insn->dst_reg == BPF_REG_10) {
+		fprintf(stderr, "Error: frame pointer is read-only at pc %zu\n", pc);
+		return -1;
+	}
+	if (op != BPF_MOV && check_reg_init(st, insn->dst_reg, pc))
+		return -1;
+	if (BPF_SRC(insn->code) == BPF_X && op != BPF_NEG) {
+		if (check_reg_init(st, insn->src_reg, pc))
+			return -1;
+		src = st->reg[insn->src_reg];
+	} else if (op == BPF_MOV && !is64)
+		mark_const(&src, (__u32) insn->imm);
+	else
+		mark_const(&src, insn->imm);
+
+	if (op != BPF_MOV && (is_opaque_ptr(dst) || is_opaque_ptr(&src))) {
+		fprintf(stderr, "Error: arithmetic on map pointer at pc %zu\n", pc);
+		return -1;
+	}
+	if (op == BPF_MOV) {
+		*dst = src;
+	} else if (op == BPF_NEG) {
+		if (is_const(dst) && dst->min != INT64_MIN)
+			mark_const(dst, -dst->min);
+		else
+			mark_unknown(dst);
+	} else if (dst->type == SCALAR && src.type == SCALAR) {
+		scalar_alu(dst, &src, op);
+	} else if (is64 && (op == BPF_ADD || op == BPF_SUB)
+		   && dst->type != SCALAR && src.type == SCALAR) {
+		/* Pointer arithmetic: move the offset range. */
+		if (src.min < -MAX_PTR_OFF || src.max > MAX_PTR_OFF)
+			goto unbounded;
+		if (op == BPF_ADD) {
+			lo = dst->min + src.min;
+			hi = dst->max + src.max;
+		} else {
+			lo = dst->min - src.max;
+			hi = dst->max - src.min;
+		}
+		if (lo < -MAX_PTR_OFF || hi > MAX_PTR_OFF)
+			goto unbounded;
+		dst->min = lo;
+		dst->max = hi;
+	} else if (is64 && op == BPF_ADD && dst->type == SCALAR) {
+		/* scalar + pointer */
+		if (dst->min < -MAX_PTR_OFF || dst->max > MAX_PTR_OFF)
+			goto unbounded;
+		src.min += dst->min;
+		src.max += dst->max;
+		if (src.min < -MAX_PTR_OFF || src.max > MAX_PTR_OFF)
+			goto unbounded;
+		*dst = src;
+	} else {
+		/* Any other use of a pointer produces an unknown scalar. */
+		mark_unknown(dst);
+	}
+	if (!is64)
+		truncate32(dst);
+	return 0;
+
+unbounded:
+	fprintf(stderr, "Error: unbounded pointer arithmetic at pc %zu\n", pc);
+	return -1;
+}
+
+/*
+ * Check that a @size bytes access at @off from pointer @ptr stays
+ * within its region, for every offset the pointer may hold.
+ */
+static
+int check_mem_access(const struct bpf_prog *prog, struct type_state *st,
+		const struct reg_state *ptr, int regno, __s16 off, int size,
+		bool write, size_t pc)
+{
+	__s64 lo, hi, i;
+
+	if (ptr->type == SCALAR) {
+		fprintf(stderr, "Error: r%d is not a pointer at pc %zu\n",
+			regno, pc);
+		return -1;
+	}
+	if (is_opaque_ptr(ptr)) {
+		fprintf(stderr, "Error: invalid access through r%d at pc %zu%s\n",
+			regno, pc, ptr->type == PTR_TO_MAP_VALUE_OR_NULL ?
+				", missing NULL check" : "");
+		return -1;
+	}
+	lo = ptr->min + off;
+	hi = ptr->max + off + size;
+	switch (ptr->type) {
+	case PTR_TO_CTX:
+		if (lo < 0 || hi > (__s64) prog->ctx_size)
+			goto out_of_bounds;
+		break;
+	case PTR_TO_STACK:
+		if (lo < -BPF_STACK_SIZE || hi > 0)
+			goto out_of_bounds;
+		lo += BPF_STACK_SIZE;
+		hi += BPF_STACK_SIZE;
+		if (write) {
+			/* Only a fixed offset store initializes the stack. */
+			if (ptr->min != ptr->max)
+				break;
+			for (i = lo; i < hi; i++)
+				st->stack_init[i / 8] |= 1U << (i % 8);
+		} else {
+			for (i = lo; i < hi; i++) {
+				if (!(st->stack_init[i / 8] & (1U << (i % 8)))) {
+					fprintf(stderr, "Error: read from uninitialized stack at pc %zu\n",
+						pc);
+					return -1;
+				}
+			}
+		}
+		break;
+	case PTR_TO_MAP_VALUE:
+		if (lo < 0 || hi > ptr->map->value_size)
+			goto out_of_bounds;
+		break;
+	default:
+		break;
+	}
+	return 0;
+
+out_of_bounds:
+	fprintf(stderr, "Error: out of bounds access through r%d at pc %zu\n",
+		regno, pc);
+	return -1;
+}
+
+/*
+ * Atomics operate on naturally aligned scalars, in the stack or a map
+ * value. Fetching forms load the old value into the source register,
+ * or r0 for BPF_CMPXCHG.
+ */
+static
+int check_atomic(const struct bpf_prog *prog, struct type_state *st,
+		const struct bpf_insn *insn, int size, size_t pc)
+{
+	const struct reg_state *ptr = &st->reg[insn->dst_reg];
+	int op = atomic_op(insn->imm), fetch_reg = -1;
+
+	if (op >= BPF_AOP_FETCH_ADD)
+		fetch_reg = op == BPF_AOP_CMPXCHG ? BPF_REG_0 : insn->src_reg;
+	if (check_reg_init(st, insn->dst_reg, pc)
+	    || check_reg_init(st, insn->src_reg, pc)
+	    || (fetch_reg >= 0 && check_reg_init(st, fetch_reg, pc)))
+		return -1;
+	if (st->reg[insn->src_reg].type != SCALAR
+	    || (fetch_reg >= 0 && st->reg[fetch_reg].type != SCALAR)) {
+		fprintf(stderr, "Error: atomic operand is not a scalar at pc %zu\n",
+			pc);
+		return -1;
+	}
+	if (ptr->type != PTR_TO_STACK && ptr->type != PTR_TO_MAP_VALUE) {
+		fprintf(stderr, "Error: atomic access through r%d at pc %zu\n",
+			insn->dst_reg, pc);
+		return -1;
+	}
+	/* The stack and map values are 8-byte aligned. */
+	if (ptr->min != ptr->max || (ptr->min + insn->off) % size) {
+		fprintf(stderr, "Error: misaligned atomic access at pc %zu\n", pc);
+		return -1;
+	}
+	if (check_mem_access(prog, st, ptr, insn->dst_reg, insn->off, size,
+			false, pc))
+		return -1;
+	if (fetch_reg >= 0) {
+		struct reg_state *r = &st->reg[fetch_reg];
+
+		if (size == 8)
+			mark_unknown(r);
+		else {
+			mark_const(r, 0);
+			r->max = UINT32_MAX;
+		}
+	}
+	return 0;
+}
+
+/*
+ * @packet is set for programs with packet loads, which may not store
+ * into their context: the struct bpf_packet they load from must keep
+ * the data and length it was run with.
+ */
+static
+int check_mem(const struct bpf_prog *prog, struct type_state *st,
+		const struct bpf_insn *insn, bool packet, size_t pc)
+{
+	static const int size[] = {
+		[BPF_W >> 3] = 4,
+		[BPF_H >> 3] = 2,
+		[BPF_B >> 3] = 1,
+		[BPF_DW >> 3] = 8,
+	};
+	int sz = size[BPF_SIZE(insn->code) >> 3];
+	struct reg_state *dst = &st->reg[insn->dst_reg];
+
+	if (BPF_CLASS(insn->code) == BPF_LDX) {
+		if (check_reg_init(st, insn->src_reg, pc))
+			return -1;
+		if (check_mem_access(prog, st, &st->reg[insn->src_reg],
+				insn->src_reg, insn->off, sz, false, pc))
+			return -1;
+		if (insn->dst_reg == BPF_REG_10) {
+			fprintf(stderr, "Error: frame pointer is read-only at pc %zu\n",
+				pc);
+			return -1;
+		}
+		/* Loads zero-extend. */
+		if (sz == 8)
+			mark_unknown(dst);
+		else {
+			dst->type = SCALAR;
+			dst->min = 0;
+			dst->max = (1ULL << (sz * 8)) - 1;
+		}
+		return 0;
+	}
+	if (BPF_CLASS(insn->code) == BPF_STX
+	    && BPF_MODE(insn->code) == BPF_ATOMIC)
+		return check_atomic(prog, st, insn, sz, pc);
+	if (check_reg_init(st, insn->dst_reg, pc)
+	    || (BPF_CLASS(insn->code) == BPF_STX
+	        && check_reg_init(st, insn->src_reg, pc)))
+		return -1;
+	if (packet && dst->type == PTR_TO_CTX) {
+		fprintf(stderr, "Error: store into the context of a program with packet loads at pc %zu\n",
+			pc);
+		return -1;
+	}
+	return check_mem_access(prog, st, dst, insn->dst_reg, insn->off, sz,
+		true, pc);
+}
+
+/*
+ * Packet loads read the struct bpf_packet context in r6, at an offset
+ * from a scalar for BPF_IND. Bounds are checked at runtime. Like helper
+ * calls, they clobber r1-r5.
+ */
+static
+int check_packet_load(const struct bpf_prog *prog, struct type_state *st,
+		const struct bpf_insn *insn, size_t pc)
+{
+	const struct reg_state *ctx = &st->reg[BPF_REG_6];
+	struct reg_state *r0 = &st->reg[BPF_REG_0];
+	int sz, i;
+
+	if (check_reg_init(st, BPF_REG_6, pc))
+		return -1;
+	if (ctx->type != PTR_TO_CTX || ctx->min || ctx->max
+	    || prog->ctx_size < sizeof(struct bpf_packet)) {
+		fprintf(stderr, "Error: packet load without packet context in r6 at pc %zu\n",
+			pc);
+		return -1;
+	}
+	if (BPF_MODE(insn->code) == BPF_IND) {
+		if (check_reg_init(st, insn->src_reg, pc))
+			return -1;
+		if (st->reg[insn->src_reg].type != SCALAR) {
+			fprintf(stderr, "Error: r%d is not a scalar at pc %zu\n",
+				insn->src_reg, pc);
+			return -1;
+		}
+	}
+	for (i = BPF_REG_1; i <= BPF_REG_5; i++)
+		st->reg[i].type = NOT_INIT;
+	switch (BPF_SIZE(insn->code)) {
+	case BPF_B:
+		sz = 1;
+		break;
+	case BPF_H:
+		sz = 2;
+		break;
+	default:
+		sz = 4;
+		break;
+	}
+	r0->type = SCALAR;
+	r0->min = 0;
+	r0->max = (1ULL << (sz * 8)) - 1;
+	return 0;
+}
+
+/* Check helper arguments against the helper signature. */
+static
+int check_call(const struct bpf_prog *prog, struct type_state *st,
+		const struct bpf_insn *insn, size_t pc)
+{
+	const struct bpf_helper *helper = bpf_helper_lookup(insn->imm);
+	struct bpf_map *map = NULL;
+	int i;
+
+	for (i = 0; i < 5 && helper->args[i] != BPF_ARG_NONE; i++) {
+		int regno = BPF_REG_1 + i;
+		const struct reg_state *r = &st->reg[regno], *size;
+
+		if (check_reg_init(st, regno, pc))
+			return -1;
+		switch (helper->args[i]) {
+		case BPF_ARG_SCALAR:
+			if (r->type != SCALAR)
+				goto bad_arg;
+			break;
+		case BPF_ARG_PTR_TO_CTX:
+			if (r->type != PTR_TO_CTX || r->min || r->max)
+				goto bad_arg;
+			break;
+		case BPF_ARG_PTR_TO_MEM:
+			size = r + 1;
+			if (check_reg_init(st, regno + 1, pc))
+				return -1;
+			if (size->type != SCALAR || size->min < 0
+			    || size->max > MAX_PTR_OFF) {
+				fprintf(stderr, "Error: unbounded size in r%d for %s at pc %zu\n",
+					regno + 1, helper->name, pc);
+				return -1;
+			}
+			if (check_mem_access(prog, st, r, regno, 0, size->max,
+					false, pc))
+				return -1;
+			break;
+		case BPF_ARG_CONST_MAP_PTR:
+			if (r->type != CONST_PTR_TO_MAP)
+				goto bad_arg;
+			map = r->map;
+			break;
+		case BPF_ARG_PTR_TO_MAP_KEY:
+			if (check_mem_access(prog, st, r, regno, 0,
+					map->key_size, false, pc))
+				return -1;
+			break;
+		case BPF_ARG_PTR_TO_MAP_VALUE:
+			if (check_mem_access(prog, st, r, regno, 0,
+					map->value_size, false, pc))
+				return -1;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* r1-r5 are clobbered, r0 holds the result. */
+	for (i = BPF_REG_1; i <= BPF_REG_5; i++)
+		st->reg[i].type = NOT_INIT;
+	mark_unknown(&st->reg[BPF_REG_0]);
+	if (helper->ret == BPF_RET_MAP_VALUE_OR_NULL) {
+		st->reg[BPF_REG_0].type = PTR_TO_MAP_VALUE_OR_NULL;
+		st->reg[BPF_REG_0].min = st->reg[BPF_REG_0].max = 0;
+		st->reg[BPF_REG_0].map = map;
+		st->reg[BPF_REG_0].id = pc + 1;
+	}
 	return 0;
+
+bad_arg:
+	fprintf(stderr, "Error: invalid type in r%d for %s at pc %zu\n",
+		BPF_REG_1 + i, helper->name, pc);
+	return -1;
+}
+
+/* Narrow the range of @r to values for which the jump goes @taken. */
+static
+void refine_range(struct reg_state *r, int op, __s64 c, bool taken)
+{
+	struct reg_state orig = *r;
+	__s64 ule = -1, uge = -1, sle = INT64_MAX, sge = INT64_MIN;
+
+	switch (op) {
+	case BPF_JEQ:
+	case BPF_JNE:
+		if (taken == (op == BPF_JEQ))
+			sle = sge = c;
+		break;
+	case BPF_JGT:
+		if (taken)
+			uge = c == INT64_MAX ? -1 : c + 1;
+		else
+			ule = c;
+		break;
+	case BPF_JGE:
+		if (taken)
+			uge = c;
+		else
+			ule = c - 1;
+		break;
+	case BPF_JLT:
+		if (taken)
+			ule = c - 1;
+		else
+			uge = c;
+		break;
+	case BPF_JLE:
+		if (taken)
+			ule = c;
+		else
+			uge = c == INT64_MAX ? -1 : c + 1;
+		break;
+	case BPF_JSGT:
+		if (taken)
+			sge = c == INT64_MAX ? c : c + 1;
+		else
+			sle = c;
+		break;
+	case BPF_JSGE:
+		if (taken)
+			sge = c;
+		else
+			sle = c == INT64_MIN ? c : c - 1;
+		break;
+	case BPF_JSLT:
+		if (taken)
+			sle = c == INT64_MIN ? c : c - 1;
+		else
+			sge = c;
+		break;
+	case BPF_JSLE:
+		if (taken)
+			sle = c;
+		else
+			sge = c == INT64_MAX ? c : c + 1;
+		break;
+	default:
+		return;
+	}
+	/* Unsigned bounds only help with non-negative constants. */
+	if (ule >= 0) {
+		if (r->min < 0)
+			r->min = 0;
+		if (r->max > ule)
+			r->max = ule;
+	}
+	if (uge >= 0 && r->min >= 0 && r->min < uge)
+		r->min = uge;
+	if (r->min < sge)
+		r->min = sge;
+	if (r->max > sle)
+		r->max = sle;
+	/* The path is never taken, keep the state as is. */
+	if (r->min > r->max)
+		*r = orig;
+}
+
+static
+void refine_branch(struct type_state *st, const struct bpf_insn *insn,
+		bool taken)
+{
+	struct reg_state *dst = &st->reg[insn->dst_reg];
+	int op = BPF_OP(insn->code);
+	size_t i;
+	__s64 c;
+
+	if (dst->type == PTR_TO_MAP_VALUE_OR_NULL) {
+		/*
+		 * Comparison against NULL: resolve the lookup result in
+		 * every register holding a copy of it.
+		 */
+		if (BPF_CLASS(insn->code) != BPF_JMP
+		    || (op != BPF_JEQ && op != BPF_JNE)
+		    || (BPF_SRC(insn->code) == BPF_K ? insn->imm
+		        : !is_const(&st->reg[insn->src_reg])
+		          || st->reg[insn->src_reg].min))
+			return;
+		for (i = 0; i < MAX_BPF_REG; i++) {
+			struct reg_state *r = &st->reg[i];
+
+			if (r->type != PTR_TO_MAP_VALUE_OR_NULL || r->id != dst->id
+			    || r == dst)
+				continue;
+			if (taken == (op == BPF_JEQ))
+				mark_const(r, 0);
+			else {
+				r->type = PTR_TO_MAP_VALUE;
+				r->id = 0;
+			}
+		}
+		if (taken == (op == BPF_JEQ))
+			mark_const(dst, 0);
+		else {
+			dst->type = PTR_TO_MAP_VALUE;
+			dst->id = 0;
+		}
+		return;
+	}
+	if (dst->type != SCALAR)
+		return;
+	if (BPF_SRC(insn->code) == BPF_K)
+		c = insn->imm;
+	else if (is_const(&st->reg[insn->src_reg]))
+		c = st->reg[insn->src_reg].min;
+	else
+		return;
+	/*
+	 * 32-bit comparisons match the 64-bit ones when both sides are
+	 * within [0, INT32_MAX].
+	 */
+	if (BPF_CLASS(insn->code) == BPF_JMP32
+	    && (dst->min < 0 || dst->max > INT32_MAX || c < 0 || c > INT32_MAX))
+		return;
+	refine_range(dst, BPF_OP(insn->code), c, taken);
+}
+
+static
+void merge_state(struct type_state *dst, const struct type_state *src)
+{
+	size_t i;
+
+	if (!dst->visited) {
+		*dst = *src;
+		dst->visited = true;
+		return;
+	}
+	for (i = 0; i < MAX_BPF_REG; i++) {
+		struct reg_state *d = &dst->reg[i];
+		const struct reg_state *s = &src->reg[i];
+
+		if (d->type == NOT_INIT || s->type == NOT_INIT) {
+			d->type = NOT_INIT;
+			continue;
+		}
+		if (d->type != s->type || d->map != s->map || d->id != s->id) {
+			mark_unknown(d);
+			continue;
+		}
+		if (s->min < d->min)
+			d->min = s->min;
+		if (s->max > d->max)
+			d->max = s->max;
+	}
+	for (i = 0; i < sizeof(dst->stack_init); i++)
+		dst->stack_init[i] &= src->stack_init[i];
+}
+
+/*
+ * Abstract interpretation of a program accepted by validate_bytecode()
+ * for the context size of @prog. Tracks the type and range of each
+ * register along the (acyclic) control-flow graph, merging states
+ * where paths join, and proves that every memory access stays within
+ * the context, the stack or a map value. Engines then run these
+ * accesses without any runtime check.
+ *
+ * On entry, r1 points to the context, r2 holds its length, r10 is the
+ * read-only frame pointer and other registers are zero.
+ */
+int validate_types(const struct bpf_prog *prog)
+{
+	const struct bpf_insn *bytecode = prog->insns;
+	size_t len = prog->len, *queue = NULL, head = 0, tail = 0, i;
+	struct type_state *states, st;
+	__u16 *nr_preds = NULL;
+	bool packet = false;
+	int ret = -1;
+
+	states = calloc(len, sizeof(*states));
+	nr_preds = calloc(len + 1, sizeof(*nr_preds));
+	queue = calloc(len, sizeof(*queue));
+	if (!states || !nr_preds || !queue)
+		goto end;
+	for (i = 0; i < len; i++) {
+		ssize_t succ[2];
+		int j, nr_succ;
+
+		nr_succ = cfg_successors(bytecode, i, succ);
+		for (j = 0; j < nr_succ; j++)
+			nr_preds[succ[j]]++;
+		packet |= is_packet_load(&bytecode[i]);
+		if (is_imm64(&bytecode[i]))
+			i++;
+	}
+
+	for (i = 0; i < MAX_BPF_REG; i++)
+		mark_const(&states[0].reg[i], 0);
+	states[0].reg[BPF_REG_1].type = PTR_TO_CTX;
+	states[0].reg[BPF_REG_2].max = INT64_MAX;
+	states[0].reg[BPF_REG_10].type = PTR_TO_STACK;
+	states[0].visited = true;
+
+	/* Visit in topological order, once all predecessors are merged. */
+	queue[tail++] = 0;
+	while (head < tail) {
+		size_t pc = queue[head++];
+		const struct bpf_insn *insn = &bytecode[pc];
+		struct type_state taken;
+		ssize_t succ[2];
+		int j, nr_succ;
+
+		st = states[pc];
+		switch (BPF_CLASS(insn->code)) {
+		case BPF_LD:
+			if (is_packet_load(insn)) {
+				if (check_packet_load(prog, &st, insn, pc))
+					goto end;
+				break;
+			}
+			if (insn->dst_reg == BPF_REG_10) {
+				fprintf(stderr, "Error: frame pointer is read-only at pc %zu\n",
+					pc);
+				goto end;
+			}
+			if (insn->src_reg == BPF_PSEUDO_MAP_IDX) {
+				struct reg_state *r = &st.reg[insn->dst_reg];
+
+				if ((__u32) insn->imm >= prog->nr_maps
+				    || (insn + 1)->imm) {
+					fprintf(stderr, "Error: invalid map index at pc %zu\n",
+						pc);
+					goto end;
+				}
+				r->type = CONST_PTR_TO_MAP;
+				r->min = r->max = 0;
+				r->map = prog->maps[insn->imm];
+				r->id = 0;
+			} else if (is_imm64(insn))
+				mark_const(&st.reg[insn->dst_reg],
+					((__u64) (insn + 1)->imm << 32) | (__u32) insn->imm);
+			else
+				mark_const(&st.reg[insn->dst_reg], insn->imm);
+			break;
+		case BPF_LDX:
+		case BPF_ST:
+		case BPF_STX:
+			if (check_mem(prog, &st, insn, packet, pc))
+				goto end;
+			break;
+		case BPF_ALU:
+		case BPF_ALU64:
+			if (check_alu(&st, insn, pc))
+				goto end;
+			break;
+		case BPF_JMP:
+		case BPF_JMP32:
+			if (insn->code == (BPF_JMP | BPF_CALL)) {
+				if (check_call(prog, &st, insn, pc))
+					goto end;
+			} else if (insn->code == (BPF_JMP | BPF_EXIT)) {
+				if (check_reg_init(&st, BPF_REG_0, pc))
+					goto end;
+			} else if (BPF_OP(insn->code) != BPF_JA) {
+				if (check_reg_init(&st, insn->dst_reg, pc)
+				    || (BPF_SRC(insn->code) == BPF_X
+				        && check_reg_init(&st, insn->src_reg, pc)))
+					goto end;
+			}
+			break;
+		}
+
+		nr_succ = cfg_successors(bytecode, pc, succ);
+		if (nr_succ == 2) {
+			/* Conditional jump: succ[0] is the taken target. */
+			taken = st;
+			refine_branch(&taken, insn, true);
+			refine_branch(&st, insn, false);
+		}
+		for (j = 0; j < nr_succ; j++) {
+			size_t target = succ[j];
+
+			if (target == len)
+				continue;
+			merge_state(&states[target], nr_succ == 2 && !j ? &taken : &st);
+			if (!--nr_preds[target])
+				queue[tail++] = target;
+		}
+	}
+	ret = 0;
+end:
+	free(queue);
+	free(nr_preds);
+	free(states);
+	return ret;
 }
@@ -1,9 +1,18 @@
 #include "./bpf.h"
 #include "./bpf_private.h"
+#include "./bpf_prog.h"
+#include "./bpf_map.h"
+#include "./bpf_elf.h"
+#include "./bpf_cbpf.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <elf.h>
+#include <dirent.h>
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
@@ -22,12 +31,24 @@
 			.imm = (__u32)(((__u64) (v)) >> 32),	\
 		},
 
+/* Load the map at index @idx of the program maps. */
+#define BPF_LD_MAP(reg, idx)					\
+		{						\
+			.code = BPF_LD | BPF_DW | BPF_IMM,	\
+			.dst_reg = (reg),			\
+			.src_reg = BPF_PSEUDO_MAP_IDX,		\
+			.imm = (idx),				\
+		},						\
+		{						\
+			.code = BPF_LD | BPF_W | BPF_IMM,	\
+		},
+
 static
 int test_st = 0;
 static
 int test_stx = 0;
 
-int do_test(void)
+int do_test(enum bpf_engine engine)
 {
 	struct bpf_insn bytecode[] = {
 		{
@@ -81,7 +102,7 @@ int do_test(void)
 		fprintf(stderr, "Error printing bytecode\n");
 		return -1;
 	}
-	if (interpret_bytecode(bytecode, ARRAY_SIZE(bytecode))) {
+	if (interpret_bytecode_engine(bytecode, ARRAY_SIZE(bytecode), engine)) {
 		fprintf(stderr, "Error interpreting bytecode\n");
 		return -1;
 	}
@@ -90,7 +111,7 @@ int do_test(void)
 	return 0;
 }
 
-int do_loop(void)
+int do_loop(enum bpf_engine engine)
 {
 	struct bpf_insn bytecode[] = {
 		{
@@ -103,6 +124,7 @@ int do_loop(void)
 			.off = -2,
 		},
 	};
+	/* Expect the validator to reject the loop. */
 	if (validate_bytecode(bytecode, ARRAY_SIZE(bytecode))) {
 		fprintf(stderr, "Error validating bytecode\n");
 		return -1;
@@ -111,20 +133,4252 @@ int do_loop(void)
 		fprintf(stderr, "Error printing bytecode\n");
 		return -1;
 	}
-	/* Expect error. */
-	if (interpret_bytecode(bytecode, ARRAY_SIZE(bytecode))) {
+	if (interpret_bytecode_engine(bytecode, ARRAY_SIZE(bytecode), engine)) {
 		fprintf(stderr, "Error interpreting bytecode\n");
 		return -1;
 	}
 	return 0;
 }
 
-int main(int argc, char **argv)
+#define CFG_MAX_LEN	8
+
+struct cfg_test {
+	const char *name;
+	bool valid;
+	size_t len;
+	struct bpf_insn bytecode[CFG_MAX_LEN];
+};
+
+/* Control-flow checks done by the validator. */
+int do_cfg(void)
+{
+	struct cfg_test tests[] = {
+		{
+			.name = "self loop",
+			.len = 1,
+			.bytecode = {
+				{ .code = BPF_JMP | BPF_JA, .off = -1 },
+			},
+		},
+		{
+			.name = "conditional loop",
+			.len = 2,
+			.bytecode = {
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .imm = 1 },
+				{ .code = BPF_JMP | BPF_JLT | BPF_K, .imm = 10, .off = -2 },
+			},
+		},
+		{
+			.name = "jump past end",
+			.len = 2,
+			.bytecode = {
+				{ .code = BPF_JMP | BPF_JEQ | BPF_K, .off = 2 },
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .imm = 1 },
+			},
+		},
+		{
+			.name = "jump before start",
+			.len = 1,
+			.bytecode = {
+				{ .code = BPF_JMP32 | BPF_JEQ | BPF_K, .off = -2 },
+			},
+		},
+		{
+			.name = "unreachable insn",
+			.len = 2,
+			.bytecode = {
+				{ .code = BPF_JMP | BPF_JA, .off = 1 },
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .imm = 1 },
+			},
+		},
+		{
+			.name = "jump into 64-bit immediate",
+			.len = 3,
+			.bytecode = {
+				{ .code = BPF_JMP | BPF_JEQ | BPF_K, .off = 1 },
+				{ .code = BPF_LD | BPF_DW | BPF_IMM, .imm = 1 },
+				{ .code = BPF_LD | BPF_W | BPF_IMM },
+			},
+		},
+		{
+			.name = "jump to end",
+			.valid = true,
+			.len = 2,
+			.bytecode = {
+				{ .code = BPF_JMP | BPF_JEQ | BPF_K, .off = 1 },
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .imm = 1 },
+			},
+		},
+		{
+			.name = "backward jump without loop",
+			.valid = true,
+			.len = 4,
+			.bytecode = {
+				{ .code = BPF_JMP | BPF_JA, .off = 1 },
+				{ .code = BPF_JMP | BPF_JA, .off = 1 },
+				{ .code = BPF_JMP | BPF_JA, .off = -2 },
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .imm = 1 },
+			},
+		},
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		struct cfg_test *test = &tests[i];
+		bool valid;
+
+		valid = !validate_bytecode(test->bytecode, test->len);
+		if (valid != test->valid) {
+			fprintf(stderr, "Error: %s: expected %s\n", test->name,
+				test->valid ? "valid" : "invalid");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+#define TYPES_CTX_SIZE	16
+
+/* Memory accesses the validator must prove in bounds at load time. */
+int do_types(void)
+{
+	struct cfg_test tests[] = {
+		{
+			.name = "ctx load",
+			.valid = true,
+			.len = 1,
+			.bytecode = {
+				{ .code = BPF_LDX | BPF_DW | BPF_MEM, .src_reg = BPF_REG_1, .off = 8 },
+			},
+		},
+		{
+			.name = "ctx load past end",
+			.len = 1,
+			.bytecode = {
+				{ .code = BPF_LDX | BPF_DW | BPF_MEM, .src_reg = BPF_REG_1, .off = 9 },
+			},
+		},
+		{
+			.name = "ctx load before start",
+			.len = 1,
+			.bytecode = {
+				{ .code = BPF_LDX | BPF_B | BPF_MEM, .src_reg = BPF_REG_1, .off = -1 },
+			},
+		},
+		{
+			.name = "load through scalar",
+			.len = 1,
+			.bytecode = {
+				{ .code = BPF_LDX | BPF_W | BPF_MEM, .src_reg = BPF_REG_2 },
+			},
+		},
+		{
+			.name = "store through scalar",
+			.len = 1,
+			.bytecode = {
+				{ .code = BPF_ST | BPF_W | BPF_MEM, .dst_reg = BPF_REG_3 },
+			},
+		},
+		{
+			.name = "unbounded ctx index",
+			.len = 2,
+			.bytecode = {
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_1, .src_reg = BPF_REG_2 },
+				{ .code = BPF_LDX | BPF_B | BPF_MEM, .src_reg = BPF_REG_1 },
+			},
+		},
+		{
+			.name = "masked ctx index",
+			.valid = true,
+			.len = 3,
+			.bytecode = {
+				{ .code = BPF_ALU64 | BPF_AND | BPF_K, .dst_reg = BPF_REG_2, .imm = 7 },
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_1, .src_reg = BPF_REG_2 },
+				{ .code = BPF_LDX | BPF_DW | BPF_MEM, .src_reg = BPF_REG_1 },
+			},
+		},
+		{
+			.name = "bounds-checked ctx index",
+			.valid = true,
+			.len = 4,
+			.bytecode = {
+				{ .code = BPF_LDX | BPF_B | BPF_MEM, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_1 },
+				{ .code = BPF_JMP | BPF_JGE | BPF_K, .dst_reg = BPF_REG_3, .imm = 13, .off = 2 },
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_1, .src_reg = BPF_REG_3 },
+				{ .code = BPF_LDX | BPF_W | BPF_MEM, .src_reg = BPF_REG_1 },
+			},
+		},
+		{
+			.name = "off by one ctx index",
+			.len = 4,
+			.bytecode = {
+				{ .code = BPF_LDX | BPF_B | BPF_MEM, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_1 },
+				{ .code = BPF_JMP | BPF_JGT | BPF_K, .dst_reg = BPF_REG_3, .imm = 13, .off = 2 },
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_1, .src_reg = BPF_REG_3 },
+				{ .code = BPF_LDX | BPF_W | BPF_MEM, .src_reg = BPF_REG_1 },
+			},
+		},
+		{
+			.name = "stack store and load",
+			.valid = true,
+			.len = 2,
+			.bytecode = {
+				{ .code = BPF_STX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_1, .off = -8 },
+				{ .code = BPF_LDX | BPF_W | BPF_MEM, .src_reg = BPF_REG_10, .off = -4 },
+			},
+		},
+		{
+			.name = "uninitialized stack load",
+			.len = 2,
+			.bytecode = {
+				{ .code = BPF_ST | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .off = -4 },
+				{ .code = BPF_LDX | BPF_DW | BPF_MEM, .src_reg = BPF_REG_10, .off = -8 },
+			},
+		},
+		{
+			.name = "stack overflow",
+			.len = 1,
+			.bytecode = {
+				{ .code = BPF_ST | BPF_B | BPF_MEM, .dst_reg = BPF_REG_10, .off = -BPF_STACK_SIZE - 1 },
+			},
+		},
+		{
+			.name = "spilled pointer is a scalar",
+			.len = 3,
+			.bytecode = {
+				{ .code = BPF_STX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_1, .off = -8 },
+				{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_10, .off = -8 },
+				{ .code = BPF_LDX | BPF_B | BPF_MEM, .src_reg = BPF_REG_3 },
+			},
+		},
+		{
+			.name = "frame pointer write",
+			.len = 1,
+			.bytecode = {
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_10, .imm = -8 },
+			},
+		},
+		{
+			.name = "pointer merged with scalar",
+			.len = 3,
+			.bytecode = {
+				{ .code = BPF_JMP | BPF_JEQ | BPF_K, .dst_reg = BPF_REG_2, .off = 1 },
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_1, .src_reg = BPF_REG_2 },
+				{ .code = BPF_LDX | BPF_B | BPF_MEM, .src_reg = BPF_REG_1 },
+			},
+		},
+	};
+	struct bpf_prog_opts opts = { .ctx_size = TYPES_CTX_SIZE };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		struct cfg_test *test = &tests[i];
+		struct bpf_prog *prog;
+
+		prog = bpf_prog_load(test->bytecode, test->len, &opts);
+		if (!!prog != test->valid) {
+			fprintf(stderr, "Error: %s: expected %s\n", test->name,
+				test->valid ? "valid" : "invalid");
+			bpf_prog_destroy(prog);
+			return -1;
+		}
+		bpf_prog_destroy(prog);
+	}
+	return 0;
+}
+
+enum {
+	TEST_HELPER_ADD3 = 100,
+	TEST_HELPER_SUM_MEM,
+	TEST_HELPER_BAD,
+};
+
+static
+__u64 test_add3(__u64 r1, __u64 r2, __u64 r3, __u64 r4, __u64 r5)
+{
+	return r1 + r2 + r3;
+}
+
+static
+__u64 test_sum_mem(__u64 r1, __u64 r2, __u64 r3, __u64 r4, __u64 r5)
+{
+	const __u8 *p = (const __u8 *) (unsigned long) r1;
+	__u64 sum = 0;
+
+	while (r2--)
+		sum += *p++;
+	return sum;
+}
+
+int do_register_helpers(void)
+{
+	struct bpf_helper helpers[] = {
+		{
+			.id = TEST_HELPER_ADD3,
+			.name = "add3",
+			.fn = test_add3,
+			.args = { BPF_ARG_SCALAR, BPF_ARG_SCALAR, BPF_ARG_SCALAR },
+		},
+		{
+			.id = TEST_HELPER_SUM_MEM,
+			.name = "sum_mem",
+			.fn = test_sum_mem,
+			.args = { BPF_ARG_PTR_TO_MEM, BPF_ARG_CONST_SIZE },
+		},
+	};
+	struct bpf_helper bad = {
+		.id = TEST_HELPER_BAD,
+		.name = "bad",
+		.fn = test_add3,
+		.args = { BPF_ARG_CONST_SIZE },
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(helpers); i++) {
+		if (bpf_helper_register(&helpers[i]))
+			return -1;
+	}
+	/* Invalid signature, and id already taken. */
+	if (!bpf_helper_register(&bad) || !bpf_helper_register(&helpers[0]))
+		return -1;
+	return 0;
+}
+
+/*
+ * Sum the first 8 bytes of the context through a helper, add 30 with
+ * another, and exit early unless the sum is 0.
+ */
+int do_helpers(enum bpf_engine engine)
+{
+	struct bpf_insn bytecode[] = {
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_1 },
+		{ .code = BPF_STX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_3, .off = -8 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_1, .src_reg = BPF_REG_10 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_1, .imm = -8 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_2, .imm = 8 },
+		{ .code = BPF_JMP | BPF_CALL, .imm = TEST_HELPER_SUM_MEM },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_1, .src_reg = BPF_REG_0 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_2, .imm = 10 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = 20 },
+		{ .code = BPF_JMP | BPF_CALL, .imm = TEST_HELPER_ADD3 },
+		{ .code = BPF_JMP | BPF_JEQ | BPF_K, .dst_reg = BPF_REG_0, .imm = 30, .off = 1 },
+		{ .code = BPF_JMP | BPF_EXIT },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = -1 },
+	};
+	struct cfg_test bad[] = {
+		{
+			.name = "read clobbered register",
+			.len = 3,
+			.bytecode = {
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_1 },
+				{ .code = BPF_JMP | BPF_CALL, .imm = TEST_HELPER_ADD3 },
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .src_reg = BPF_REG_1 },
+			},
+		},
+		{
+			.name = "unknown helper",
+			.len = 1,
+			.bytecode = {
+				{ .code = BPF_JMP | BPF_CALL, .imm = BPF_MAX_HELPERS - 1 },
+			},
+		},
+		{
+			.name = "pointer as scalar argument",
+			.len = 1,
+			.bytecode = {
+				{ .code = BPF_JMP | BPF_CALL, .imm = TEST_HELPER_ADD3 },
+			},
+		},
+		{
+			.name = "memory argument out of bounds",
+			.len = 2,
+			.bytecode = {
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_2, .imm = 9 },
+				{ .code = BPF_JMP | BPF_CALL, .imm = TEST_HELPER_SUM_MEM },
+			},
+		},
+		{
+			.name = "code after exit",
+			.len = 2,
+			.bytecode = {
+				{ .code = BPF_JMP | BPF_EXIT },
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .imm = 1 },
+			},
+		},
+	};
+	__u8 ctx[8] = { 1, 2, 3, 4, 5, 6, 7, 8 }, zero[8] = { 0 };
+	struct bpf_prog_opts opts = {
+		.engine = engine,
+		.ctx_size = sizeof(ctx),
+	};
+	struct bpf_prog *prog;
+	__u64 r0 = 0, r0_zero = 0;
+	int i, err;
+
+	for (i = 0; i < ARRAY_SIZE(bad); i++) {
+		prog = bpf_prog_load(bad[i].bytecode, bad[i].len, &opts);
+		if (prog) {
+			fprintf(stderr, "Error: %s: expected invalid\n", bad[i].name);
+			bpf_prog_destroy(prog);
+			return -1;
+		}
+	}
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!prog)
+		return -1;
+	err = bpf_prog_run(prog, ctx, sizeof(ctx), &r0)
+		|| bpf_prog_run(prog, zero, sizeof(zero), &r0_zero);
+	bpf_prog_destroy(prog);
+	if (err || r0 != 36 + 30 || r0_zero != (__u64) -1) {
+		fprintf(stderr, "Error: unexpected helper results %llu/%llu\n",
+			(unsigned long long) r0, (unsigned long long) r0_zero);
+		return -1;
+	}
+	return 0;
+}
+
+#define HASHMAP_NR_THREADS	4
+#define HASHMAP_NR_KEYS		256
+#define HASHMAP_NR_ITER		200
+
+static
+void *hashmap_thread(void *arg)
+{
+	struct bpf_map *map = arg;
+	static __u32 next_base;
+	__u32 base, key, i;
+	__u64 value, *p;
+	int iter;
+
+	base = __atomic_fetch_add(&next_base, HASHMAP_NR_KEYS, __ATOMIC_RELAXED);
+	/*
+	 * Keys are private to each thread, buckets, elements and the
+	 * freelist are shared. Leave the even keys in the map.
+	 */
+	for (iter = 0; iter < HASHMAP_NR_ITER; iter++) {
+		for (i = 0; i < HASHMAP_NR_KEYS; i++) {
+			key = base + i;
+			value = (__u64) iter << 32 | key;
+			if (bpf_map_update_elem(map, &key, &value,
+					iter ? BPF_EXIST : BPF_NOEXIST))
+				return (void *) -1L;
+			p = bpf_map_lookup_elem(map, &key);
+			if (!p || *p != value)
+				return (void *) -1L;
+		}
+		for (i = 1; i < HASHMAP_NR_KEYS; i += 2) {
+			key = base + i;
+			if (bpf_map_delete_elem(map, &key)
+			    || bpf_map_lookup_elem(map, &key))
+				return (void *) -1L;
+			value = (__u64) iter << 32 | key;
+			if (bpf_map_update_elem(map, &key, &value, BPF_NOEXIST))
+				return (void *) -1L;
+			if (iter == HASHMAP_NR_ITER - 1
+			    && bpf_map_delete_elem(map, &key))
+				return (void *) -1L;
+		}
+	}
+	return NULL;
+}
+
+/* Host API semantics, then concurrent updates from several threads. */
+int do_hashmap(void)
+{
+	struct bpf_map_attr attr = {
+		.type = BPF_MAP_TYPE_HASH,
+		.key_size = sizeof(__u32),
+		.value_size = sizeof(__u64),
+		.max_entries = 2,
+	};
+	pthread_t threads[HASHMAP_NR_THREADS];
+	__u32 key = 1, key2 = 2, key3 = 3, i;
+	__u64 value = 10, *p;
+	struct bpf_map *map;
+	void *thread_ret;
+	int ret = -1;
+
+	attr.max_entries = UINT32_MAX;
+	if (bpf_map_create(&attr)) {
+		fprintf(stderr, "Error: hash map of %u entries created\n",
+			attr.max_entries);
+		return -1;
+	}
+	attr.max_entries = 2;
+	map = bpf_map_create(&attr);
+	if (!map)
+		return -1;
+	if (bpf_map_lookup_elem(map, &key)
+	    || bpf_map_update_elem(map, &key, &value, BPF_EXIST) != -ENOENT
+	    || bpf_map_update_elem(map, &key, &value, BPF_NOEXIST)
+	    || bpf_map_update_elem(map, &key, &value, BPF_NOEXIST) != -EEXIST
+	    || bpf_map_update_elem(map, &key2, &value, BPF_ANY)
+	    || bpf_map_update_elem(map, &key3, &value, BPF_ANY) != -E2BIG
+	    || bpf_map_update_elem(map, &key, &value, BPF_EXIST + 1) != -EINVAL
+	    || bpf_map_delete_elem(map, &key3) != -ENOENT
+	    || bpf_map_delete_elem(map, &key2)
+	    || bpf_map_update_elem(map, &key3, &value, BPF_ANY)) {
+		fprintf(stderr, "Error: unexpected hash map update result\n");
+		goto end;
+	}
+	value = 20;
+	if (bpf_map_update_elem(map, &key, &value, BPF_ANY)
+	    || !(p = bpf_map_lookup_elem(map, &key)) || *p != 20
+	    || bpf_map_lookup_elem(map, &key2)) {
+		fprintf(stderr, "Error: unexpected hash map lookup result\n");
+		goto end;
+	}
+	bpf_map_destroy(map);
+
+	attr.max_entries = HASHMAP_NR_THREADS * HASHMAP_NR_KEYS;
+	map = bpf_map_create(&attr);
+	if (!map)
+		return -1;
+	for (i = 0; i < HASHMAP_NR_THREADS; i++) {
+		if (pthread_create(&threads[i], NULL, hashmap_thread, map))
+			abort();
+	}
+	ret = 0;
+	for (i = 0; i < HASHMAP_NR_THREADS; i++) {
+		pthread_join(threads[i], &thread_ret);
+		if (thread_ret)
+			ret = -1;
+	}
+	for (key = 0; key < HASHMAP_NR_THREADS * HASHMAP_NR_KEYS; key++) {
+		p = bpf_map_lookup_elem(map, &key);
+		if ((key & 1) ? !!p
+		    : !p || *p != ((__u64) (HASHMAP_NR_ITER - 1) << 32 | key))
+			ret = -1;
+	}
+	if (ret)
+		fprintf(stderr, "Error: concurrent hash map updates\n");
+end:
+	bpf_map_destroy(map);
+	return ret;
+}
+
+#define HASHMAP_READS_NR_KEYS		8
+#define HASHMAP_READS_NR_WORDS		8
+#define HASHMAP_READS_NR_UPDATES	100000
+
+struct hashmap_reads {
+	struct bpf_map		*map;
+	struct bpf_prog		*prog;
+	__u32			writer;
+	bool			stop;
+	int			nr_torn;
+};
+
+/*
+ * Replace and delete values of a few keys, all the words of a value
+ * holding its key and the writer sequence number.
+ */
+static
+void *hashmap_writer(void *arg)
+{
+	struct hashmap_reads *reads = arg;
+	__u64 value[HASHMAP_READS_NR_WORDS];
+	__u32 writer, key, i, j;
+
+	writer = __atomic_fetch_add(&reads->writer, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < HASHMAP_READS_NR_UPDATES; i++) {
+		key = (i * 7 + writer) % HASHMAP_READS_NR_KEYS;
+		if (i % 16 == 15) {
+			bpf_map_delete_elem(reads->map, &key);
+			continue;
+		}
+		for (j = 0; j < HASHMAP_READS_NR_WORDS; j++)
+			value[j] = ((__u64) writer << 32 | i) << 8 | key;
+		if (bpf_map_update_elem(reads->map, &key, value, BPF_ANY))
+			return (void *) -1L;
+	}
+	return NULL;
+}
+
+/*
+ * Check the values found by the program, and by the host in a read
+ * section, where it reads each value twice.
+ */
+static
+void *hashmap_reader(void *arg)
+{
+	struct hashmap_reads *reads = arg;
+	const volatile __u64 *p;
+	__u32 key = 0, j;
+	__u64 r0, v;
+
+	while (!__atomic_load_n(&reads->stop, __ATOMIC_RELAXED)) {
+		key = (key + 1) % HASHMAP_READS_NR_KEYS;
+		if (bpf_prog_run(reads->prog, &key, sizeof(key), &r0) || r0 == 2)
+			__atomic_add_fetch(&reads->nr_torn, 1, __ATOMIC_RELAXED);
+		bpf_map_read_lock();
+		p = bpf_map_lookup_elem(reads->map, &key);
+		if (p) {
+			v = p[0];
+			for (j = 0; j < 2 * HASHMAP_READS_NR_WORDS; j++) {
+				if (p[j % HASHMAP_READS_NR_WORDS] != v
+				    || (v & 0xff) != key)
+					__atomic_add_fetch(&reads->nr_torn, 1,
+						__ATOMIC_RELAXED);
+			}
+		}
+		bpf_map_read_unlock();
+	}
+	return NULL;
+}
+
+/*
+ * Lookups concurrent with replacements and deletes of the same keys
+ * see values in full, and for their key: the elements they hold are
+ * not reused.
+ */
+int do_hashmap_reads(void)
+{
+	struct bpf_insn bytecode[] = {
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1 },
+		{ .code = BPF_STX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_6, .off = -4 },
+		BPF_LD_MAP(BPF_REG_1, 0)
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_10 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -4 },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_lookup_elem },
+		{ .code = BPF_JMP | BPF_JNE | BPF_K, .dst_reg = BPF_REG_0, .off = 2 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 0 },
+		{ .code = BPF_JMP | BPF_EXIT },
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_1, .src_reg = BPF_REG_0 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1 },
+		{ .code = BPF_ALU64 | BPF_AND | BPF_K, .dst_reg = BPF_REG_2, .imm = 0xff },
+		{ .code = BPF_JMP | BPF_JNE | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_6, .off = 16 },
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_0, .off = 8 },
+		{ .code = BPF_JMP | BPF_JNE | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = 14 },
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_0, .off = 16 },
+		{ .code = BPF_JMP | BPF_JNE | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = 12 },
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_0, .off = 24 },
+		{ .code = BPF_JMP | BPF_JNE | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = 10 },
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_0, .off = 32 },
+		{ .code = BPF_JMP | BPF_JNE | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = 8 },
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_0, .off = 40 },
+		{ .code = BPF_JMP | BPF_JNE | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = 6 },
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_0, .off = 48 },
+		{ .code = BPF_JMP | BPF_JNE | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = 4 },
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_0, .off = 56 },
+		{ .code = BPF_JMP | BPF_JNE | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = 2 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 1 },
+		{ .code = BPF_JMP | BPF_EXIT },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 2 },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	struct bpf_map_attr attr = {
+		.type = BPF_MAP_TYPE_HASH,
+		.key_size = sizeof(__u32),
+		.value_size = HASHMAP_READS_NR_WORDS * sizeof(__u64),
+		.max_entries = HASHMAP_READS_NR_KEYS,
+	};
+	struct hashmap_reads reads = { 0 };
+	struct bpf_prog_opts opts = {
+		.ctx_size = sizeof(__u32),
+		.maps = &reads.map,
+		.nr_maps = 1,
+	};
+	pthread_t threads[HASHMAP_NR_THREADS];
+	void *thread_ret;
+	int i, ret = 0;
+
+	reads.map = bpf_map_create(&attr);
+	if (!reads.map)
+		return -1;
+	reads.prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!reads.prog) {
+		bpf_map_destroy(reads.map);
+		return -1;
+	}
+	for (i = 0; i < HASHMAP_NR_THREADS; i++) {
+		if (pthread_create(&threads[i], NULL, i % 2 ? hashmap_reader
+				: hashmap_writer, &reads))
+			abort();
+	}
+	for (i = 0; i < HASHMAP_NR_THREADS; i += 2) {
+		pthread_join(threads[i], &thread_ret);
+		if (thread_ret)
+			ret = -1;
+	}
+	__atomic_store_n(&reads.stop, true, __ATOMIC_RELAXED);
+	for (i = 1; i < HASHMAP_NR_THREADS; i += 2)
+		pthread_join(threads[i], NULL);
+	if (ret || reads.nr_torn) {
+		fprintf(stderr, "Error: %d torn or reused hash map values\n",
+			reads.nr_torn);
+		ret = -1;
+	}
+	bpf_prog_destroy(reads.prog);
+	bpf_map_destroy(reads.map);
+	return ret;
+}
+
+/*
+ * Count events per key (the first 4 bytes of the context) in a hash
+ * map: insert 1 on the first event, then increment in place.
+ */
+int do_map_prog(enum bpf_engine engine)
+{
+	struct bpf_insn bytecode[] = {
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1 },
+		{ .code = BPF_STX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_2, .off = -4 },
+		BPF_LD_MAP(BPF_REG_1, 0)
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_10 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -4 },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_lookup_elem },
+		{ .code = BPF_JMP | BPF_JNE | BPF_K, .dst_reg = BPF_REG_0, .off = 11 },
+		{ .code = BPF_ST | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_10, .off = -16, .imm = 1 },
+		BPF_LD_MAP(BPF_REG_1, 0)
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_10 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -4 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_10 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_3, .imm = -16 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_4, .imm = BPF_NOEXIST },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_update_elem },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 1 },
+		{ .code = BPF_JMP | BPF_EXIT },
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_1, .src_reg = BPF_REG_0 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_1, .imm = 1 },
+		{ .code = BPF_STX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_1 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_1 },
+	};
+	struct cfg_test bad[] = {
+		{
+			.name = "invalid map index",
+			.len = 2,
+			.bytecode = {
+				BPF_LD_MAP(BPF_REG_1, 1)
+			},
+		},
+		{
+			.name = "map pointer arithmetic",
+			.len = 3,
+			.bytecode = {
+				BPF_LD_MAP(BPF_REG_1, 0)
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_1, .imm = 8 },
+			},
+		},
+		{
+			.name = "key out of bounds",
+			.len = 6,
+			.bytecode = {
+				{ .code = BPF_ST | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .off = -4 },
+				BPF_LD_MAP(BPF_REG_1, 0)
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_10 },
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -2 },
+				{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_lookup_elem },
+			},
+		},
+		{
+			.name = "value access without NULL check",
+			.len = 7,
+			.bytecode = {
+				{ .code = BPF_ST | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .off = -4 },
+				BPF_LD_MAP(BPF_REG_1, 0)
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_10 },
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -4 },
+				{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_lookup_elem },
+				{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_0 },
+			},
+		},
+		{
+			.name = "value access out of bounds",
+			.len = 8,
+			.bytecode = {
+				{ .code = BPF_ST | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .off = -4 },
+				BPF_LD_MAP(BPF_REG_1, 0)
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_10 },
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -4 },
+				{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_lookup_elem },
+				{ .code = BPF_JMP | BPF_JEQ | BPF_K, .dst_reg = BPF_REG_0, .off = 1 },
+				{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_0, .off = 1 },
+			},
+		},
+	};
+	struct bpf_map_attr attr = {
+		.type = BPF_MAP_TYPE_HASH,
+		.key_size = sizeof(__u32),
+		.value_size = sizeof(__u64),
+		.max_entries = 16,
+	};
+	struct bpf_map *map;
+	struct bpf_prog_opts opts = {
+		.engine = engine,
+		.ctx_size = sizeof(__u32),
+		.maps = &map,
+		.nr_maps = 1,
+	};
+	struct bpf_prog *prog;
+	__u32 key = 5;
+	__u64 r0, *value;
+	int i, ret = -1;
+
+	map = bpf_map_create(&attr);
+	if (!map)
+		return -1;
+	for (i = 0; i < ARRAY_SIZE(bad); i++) {
+		prog = bpf_prog_load(bad[i].bytecode, bad[i].len, &opts);
+		if (prog) {
+			fprintf(stderr, "Error: %s: expected invalid\n", bad[i].name);
+			bpf_prog_destroy(prog);
+			goto end;
+		}
+	}
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!prog)
+		goto end;
+	for (i = 1; i <= 3; i++) {
+		if (bpf_prog_run(prog, &key, sizeof(key), &r0) || r0 != i) {
+			fprintf(stderr, "Error: unexpected count %llu\n",
+				(unsigned long long) r0);
+			goto end_prog;
+		}
+	}
+	value = bpf_map_lookup_elem(map, &key);
+	if (!value || *value != 3) {
+		fprintf(stderr, "Error: map not updated by program\n");
+		goto end_prog;
+	}
+	ret = 0;
+end_prog:
+	bpf_prog_destroy(prog);
+end:
+	bpf_map_destroy(map);
+	return ret;
+}
+
+#define PERCPU_NR_THREADS	4
+#define PERCPU_NR_RUNS		10000
+
+struct percpu_thread {
+	pthread_t		tid;
+	struct bpf_prog		*prog;
+	int			ret;
+};
+
+static
+void *percpu_thread(void *arg)
+{
+	struct percpu_thread *t = arg;
+	__u32 key = 1;
+	__u64 r0;
+	int i;
+
+	for (i = 0; i < PERCPU_NR_RUNS; i++) {
+		if (bpf_prog_run(t->prog, &key, sizeof(key), &r0) || r0) {
+			t->ret = -1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Count from several threads with map_percpu_add into per-CPU array
+ * and hash maps, then check the sums aggregated over all CPUs.
+ */
+int do_percpu(enum bpf_engine engine)
+{
+	struct bpf_insn add_prog[] = {
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1 },
+		{ .code = BPF_STX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_2, .off = -4 },
+		BPF_LD_MAP(BPF_REG_1, 0)
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_10 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -4 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = 1 },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_percpu_add },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	struct bpf_map_attr attrs[] = {
+		{
+			.type = BPF_MAP_TYPE_PERCPU_ARRAY,
+			.key_size = sizeof(__u32),
+			.value_size = sizeof(__u64),
+			.max_entries = 4,
+		},
+		{
+			.type = BPF_MAP_TYPE_PERCPU_HASH,
+			.key_size = sizeof(__u32),
+			.value_size = sizeof(__u64),
+			.max_entries = 4,
+		},
+	};
+	struct percpu_thread threads[PERCPU_NR_THREADS];
+	struct bpf_map *map;
+	struct bpf_prog_opts opts = {
+		.engine = engine,
+		.ctx_size = sizeof(__u32),
+		.maps = &map,
+		.nr_maps = 1,
+	};
+	__u64 zero = 0, sum;
+	__u32 key = 1;
+	int i, j, ret;
+
+	for (i = 0; i < ARRAY_SIZE(attrs); i++) {
+		map = bpf_map_create(&attrs[i]);
+		if (!map)
+			return -1;
+		ret = bpf_map_update_elem(map, &key, &zero, BPF_ANY);
+		for (j = 0; j < PERCPU_NR_THREADS; j++) {
+			threads[j].prog = bpf_prog_load(add_prog,
+				ARRAY_SIZE(add_prog), &opts);
+			threads[j].ret = 0;
+			if (!threads[j].prog
+			    || pthread_create(&threads[j].tid, NULL,
+					percpu_thread, &threads[j]))
+				abort();
+		}
+		for (j = 0; j < PERCPU_NR_THREADS; j++) {
+			pthread_join(threads[j].tid, NULL);
+			ret |= threads[j].ret;
+			bpf_prog_destroy(threads[j].prog);
+		}
+		ret |= bpf_map_sum_percpu_elem(map, &key, &sum);
+		bpf_map_destroy(map);
+		if (ret || sum != PERCPU_NR_THREADS * PERCPU_NR_RUNS) {
+			fprintf(stderr, "Error: per-CPU count %llu\n",
+				(unsigned long long) sum);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Host side per-CPU map semantics. */
+int do_percpu_api(void)
+{
+	struct bpf_map_attr attr = {
+		.type = BPF_MAP_TYPE_PERCPU_HASH,
+		.key_size = sizeof(__u32),
+		.value_size = 2 * sizeof(__u64),
+		.max_entries = 4,
+	};
+	int nr_cpus = bpf_num_possible_cpus(), cpu;
+	__u64 value[2] = { 5, 6 }, sum[2], *values, *p;
+	__u32 key = 7, bad_key = 4;
+	struct bpf_map *map;
+	int ret = -1;
+
+	values = calloc(nr_cpus, sizeof(value));
+	if (!values)
+		return -1;
+	map = bpf_map_create(&attr);
+	if (!map)
+		goto end;
+	if (bpf_map_sum_percpu_elem(map, &key, sum) != -ENOENT
+	    || bpf_map_update_elem(map, &key, value, BPF_NOEXIST)
+	    || bpf_map_sum_percpu_elem(map, &key, sum)
+	    || sum[0] != 5 || sum[1] != 6
+	    || !(p = bpf_map_lookup_elem(map, &key)) || p[0] != 5
+	    || bpf_map_lookup_percpu_elem(map, &key, values)) {
+		fprintf(stderr, "Error: unexpected per-CPU hash result\n");
+		goto end;
+	}
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		/* Other CPUs' slots start zeroed. */
+		if (values[2 * cpu] && values[2 * cpu] != 5)
+			goto end;
+		sum[0] -= values[2 * cpu];
+	}
+	if (sum[0] || bpf_map_delete_elem(map, &key)
+	    || bpf_map_lookup_elem(map, &key))
+		goto end;
+	bpf_map_destroy(map);
+
+	attr.type = BPF_MAP_TYPE_PERCPU_ARRAY;
+	map = bpf_map_create(&attr);
+	if (!map)
+		goto end;
+	if (bpf_map_delete_elem(map, &key) != -EINVAL
+	    || bpf_map_update_elem(map, &key, value, BPF_NOEXIST) != -E2BIG
+	    || bpf_map_lookup_elem(map, &bad_key)
+	    || bpf_map_sum_percpu_elem(map, &key, sum) != -ENOENT) {
+		fprintf(stderr, "Error: unexpected per-CPU array result\n");
+		goto end;
+	}
+	key = 3;
+	if (bpf_map_update_elem(map, &key, value, BPF_NOEXIST) != -EEXIST
+	    || bpf_map_sum_percpu_elem(map, &key, sum) || sum[0] || sum[1]
+	    || bpf_map_update_elem(map, &key, value, BPF_EXIST)
+	    || bpf_map_sum_percpu_elem(map, &key, sum) || sum[0] != 5) {
+		fprintf(stderr, "Error: unexpected per-CPU array result\n");
+		goto end;
+	}
+	bpf_map_destroy(map);
+
+	/* Per-CPU values are arrays of 64-bit counters. */
+	attr.value_size = 12;
+	map = bpf_map_create(&attr);
+	if (map)
+		goto end;
+	attr.type = BPF_MAP_TYPE_HASH;
+	map = bpf_map_create(&attr);
+	if (!map || bpf_map_sum_percpu_elem(map, &key, sum) != -EINVAL)
+		goto end;
+	ret = 0;
+end:
+	bpf_map_destroy(map);
+	free(values);
+	return ret;
+}
+
+/* Lookup key 0 of map 0 into r6, return 0 if missing. */
+#define ATOMIC_LOOKUP_VALUE						\
+		{ .code = BPF_ST | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .off = -4 }, \
+		BPF_LD_MAP(BPF_REG_1, 0)				\
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_10 }, \
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -4 }, \
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_lookup_elem }, \
+		{ .code = BPF_JMP | BPF_JNE | BPF_K, .dst_reg = BPF_REG_0, .off = 1 }, \
+		{ .code = BPF_JMP | BPF_EXIT },				\
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_0 },
+
+/* Single-threaded semantics of each atomic operation on a map value. */
+int do_atomics(enum bpf_engine engine)
+{
+	struct bpf_insn bytecode[] = {
+		ATOMIC_LOOKUP_VALUE
+		/* v[0] += 3 */
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_1, .imm = 3 },
+		{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1, .imm = BPF_ADD },
+		/* r2 = fetch_or(v[1], 0x0f) */
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_2, .imm = 0x0f },
+		{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_2, .off = 8, .imm = BPF_OR | BPF_FETCH },
+		/* r3 = fetch_and(v[2], 0x3c) */
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = 0x3c },
+		{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_3, .off = 16, .imm = BPF_AND | BPF_FETCH },
+		/* r4 = fetch_xor(v[3], 0xff) */
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_4, .imm = 0xff },
+		{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_4, .off = 24, .imm = BPF_XOR | BPF_FETCH },
+		/* r5 = xchg(v[4], 9) */
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_5, .imm = 9 },
+		{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_5, .off = 32, .imm = BPF_XCHG },
+		/* cmpxchg(v[4], 9, 11) succeeds */
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 9 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_7, .imm = 11 },
+		{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_7, .off = 32, .imm = BPF_CMPXCHG },
+		/* r8 = cmpxchg(v[4], 1, 11) fails */
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 1 },
+		{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_7, .off = 32, .imm = BPF_CMPXCHG },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_8, .src_reg = BPF_REG_0 },
+		/* r9 = fetch_add((u32) v[5], -1), no carry into the high word */
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_9, .imm = -1 },
+		{ .code = BPF_STX | BPF_W | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_9, .off = 40, .imm = BPF_ADD | BPF_FETCH },
+		/* r0 = cmpxchg((u32) v[5], -1, r9) fails, zero-extended */
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = -1 },
+		{ .code = BPF_STX | BPF_W | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_9, .off = 40, .imm = BPF_CMPXCHG },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_2 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_3 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_4 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_5 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_8 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_9 },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	struct cfg_test bad[] = {
+		{
+			.name = "atomic on context",
+			.len = 2,
+			.bytecode = {
+				{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_1, .src_reg = BPF_REG_0, .imm = BPF_ADD },
+				{ .code = BPF_JMP | BPF_EXIT },
+			},
+		},
+		{
+			.name = "misaligned atomic",
+			.len = 3,
+			.bytecode = {
+				{ .code = BPF_ST | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_10, .off = -16 },
+				{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_0, .off = -12, .imm = BPF_ADD },
+				{ .code = BPF_JMP | BPF_EXIT },
+			},
+		},
+		{
+			.name = "unknown atomic operation",
+			.len = 3,
+			.bytecode = {
+				{ .code = BPF_ST | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_10, .off = -8 },
+				{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_0, .off = -8, .imm = BPF_SUB },
+				{ .code = BPF_JMP | BPF_EXIT },
+			},
+		},
+		{
+			.name = "atomic on uninitialized stack",
+			.len = 2,
+			.bytecode = {
+				{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_0, .off = -8, .imm = BPF_ADD },
+				{ .code = BPF_JMP | BPF_EXIT },
+			},
+		},
+		{
+			.name = "atomic pointer operand",
+			.len = 3,
+			.bytecode = {
+				{ .code = BPF_ST | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_10, .off = -8 },
+				{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_10, .off = -8, .imm = BPF_XCHG },
+				{ .code = BPF_JMP | BPF_EXIT },
+			},
+		},
+	};
+	struct bpf_map_attr attr = {
+		.type = BPF_MAP_TYPE_HASH,
+		.key_size = sizeof(__u32),
+		.value_size = 6 * sizeof(__u64),
+		.max_entries = 1,
+	};
+	struct bpf_map *map;
+	struct bpf_prog_opts opts = {
+		.engine = engine,
+		.maps = &map,
+		.nr_maps = 1,
+	};
+	__u64 init[6] = { 10, 0xf0, 0xff, 0x0f, 5, 0x100000007ULL };
+	__u64 expect[6] = { 13, 0xff, 0x3c, 0xf0, 11, 0x100000006ULL };
+	struct bpf_prog *prog;
+	__u64 r0 = 0, *v;
+	__u32 key = 0;
+	int i, ret = -1;
+
+	map = bpf_map_create(&attr);
+	if (!map)
+		return -1;
+	for (i = 0; i < ARRAY_SIZE(bad); i++) {
+		prog = bpf_prog_load(bad[i].bytecode, bad[i].len, &opts);
+		if (prog) {
+			fprintf(stderr, "Error: %s: expected invalid\n", bad[i].name);
+			bpf_prog_destroy(prog);
+			goto end;
+		}
+	}
+	if (bpf_map_update_elem(map, &key, init, BPF_ANY))
+		goto end;
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!prog)
+		goto end;
+	ret = bpf_prog_run(prog, NULL, 0, &r0);
+	bpf_prog_destroy(prog);
+	v = bpf_map_lookup_elem(map, &key);
+	/* Fetched: 0xf0 + 0xff + 0x0f + 5 + 11 + 7 + 6 */
+	if (ret || r0 != 539 || memcmp(v, expect, sizeof(expect))) {
+		fprintf(stderr, "Error: unexpected atomic results %llu\n",
+			(unsigned long long) r0);
+		ret = -1;
+	}
+end:
+	bpf_map_destroy(map);
+	return ret;
+}
+
+#define ATOMIC_NR_THREADS	4
+#define ATOMIC_NR_RUNS		10000
+
+struct atomic_thread {
+	pthread_t		tid;
+	struct bpf_prog		*prog;
+	__u64			runs;
+	__u64			locked;
+	int			ret;
+};
+
+static
+void *atomic_thread(void *arg)
 {
-	if (do_test()) {
+	struct atomic_thread *t = arg;
+	__u64 r0, done = 0;
+
+	/* Retry until ATOMIC_NR_RUNS compare-and-exchange increments. */
+	while (done < ATOMIC_NR_RUNS) {
+		if (bpf_prog_run(t->prog, NULL, 0, &r0)) {
+			t->ret = -1;
+			break;
+		}
+		t->runs++;
+		done += r0 & 1;
+		t->locked += r0 >> 1;
+	}
+	return NULL;
+}
+
+/*
+ * Several threads update the same map value with each kind of atomic
+ * operation, and take a test-and-set lock (xchg, then store-release)
+ * around a plain read-modify-write. No update may be lost.
+ */
+int do_atomics_mt(enum bpf_engine engine)
+{
+	struct bpf_insn bytecode[] = {
+		ATOMIC_LOOKUP_VALUE
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_1, .imm = 1 },
+		{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1, .imm = BPF_ADD },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_1, .imm = 1 },
+		{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1, .off = 8, .imm = BPF_ADD | BPF_FETCH },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_1, .imm = 1 },
+		{ .code = BPF_STX | BPF_W | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1, .off = 16, .imm = BPF_ADD | BPF_FETCH },
+		/* r7 = cmpxchg(v[3], r2, r2 + 1) == r2 */
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM_ACQ_REL, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_6, .off = 24 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_2 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_1, .src_reg = BPF_REG_2 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_1, .imm = 1 },
+		{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1, .off = 24, .imm = BPF_CMPXCHG },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_7, .imm = 0 },
+		{ .code = BPF_JMP | BPF_JNE | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_2, .off = 1 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_7, .imm = 1 },
+		/* if (!xchg(v[4], 1)) { v[5]++; store_release(v[4], 0); r7 |= 2; } */
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_1, .imm = 1 },
+		{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1, .off = 32, .imm = BPF_XCHG },
+		{ .code = BPF_JMP | BPF_JNE | BPF_K, .dst_reg = BPF_REG_1, .off = 5 },
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_6, .off = 40 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = 1 },
+		{ .code = BPF_STX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_2, .off = 40 },
+		{ .code = BPF_ST | BPF_DW | BPF_MEM_ACQ_REL, .dst_reg = BPF_REG_6, .off = 32 },
+		{ .code = BPF_ALU64 | BPF_OR | BPF_K, .dst_reg = BPF_REG_7, .imm = 2 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_7 },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	struct bpf_map_attr attr = {
+		.type = BPF_MAP_TYPE_HASH,
+		.key_size = sizeof(__u32),
+		.value_size = 6 * sizeof(__u64),
+		.max_entries = 1,
+	};
+	struct atomic_thread threads[ATOMIC_NR_THREADS];
+	struct bpf_map *map;
+	struct bpf_prog_opts opts = {
+		.engine = engine,
+		.maps = &map,
+		.nr_maps = 1,
+	};
+	__u64 zero[6] = { 0 }, runs = 0, locked = 0, *v;
+	struct bpf_prog *prog;
+	__u32 key = 0;
+	int i, ret = -1;
+
+	map = bpf_map_create(&attr);
+	if (!map)
+		return -1;
+	if (bpf_map_update_elem(map, &key, zero, BPF_ANY))
+		goto end;
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!prog)
+		goto end;
+	memset(threads, 0, sizeof(threads));
+	for (i = 0; i < ATOMIC_NR_THREADS; i++) {
+		threads[i].prog = prog;
+		if (pthread_create(&threads[i].tid, NULL, atomic_thread,
+				&threads[i]))
+			abort();
+	}
+	ret = 0;
+	for (i = 0; i < ATOMIC_NR_THREADS; i++) {
+		pthread_join(threads[i].tid, NULL);
+		ret |= threads[i].ret;
+		runs += threads[i].runs;
+		locked += threads[i].locked;
+	}
+	bpf_prog_destroy(prog);
+	v = bpf_map_lookup_elem(map, &key);
+	if (ret || v[0] != runs || v[1] != runs || v[2] != (__u32) runs
+	    || v[3] != ATOMIC_NR_THREADS * ATOMIC_NR_RUNS || v[4]
+	    || v[5] != locked) {
+		fprintf(stderr, "Error: lost atomic updates\n");
+		ret = -1;
+	}
+end:
+	bpf_map_destroy(map);
+	return ret;
+}
+
+struct opt_test {
+	const char *name;
+	size_t len;
+	struct bpf_insn bytecode[CFG_MAX_LEN];
+	size_t opt_len;		/* length once optimized */
+	__u32 ctx;
+	__u64 r0;
+	int err;
+};
+
+/*
+ * Load each program with and without BPF_F_OPTIMIZE: both must produce
+ * the same result, the optimized one with the expected length.
+ */
+int do_optimize(enum bpf_engine engine)
+{
+	struct opt_test tests[] = {
+		{
+			.name = "constant chain",
+			.len = 6,
+			.bytecode = {
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 2 },
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_1, .imm = 3 },
+				{ .code = BPF_ALU64 | BPF_MUL | BPF_X, .dst_reg = BPF_REG_1, .src_reg = BPF_REG_0 },
+				{ .code = BPF_ALU | BPF_ADD | BPF_K, .dst_reg = BPF_REG_1, .imm = 4 },
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_1 },
+				{ .code = BPF_JMP | BPF_EXIT },
+			},
+			.opt_len = 2,
+			.r0 = 10,
+		},
+		{
+			.name = "constant branch",
+			.len = 6,
+			.bytecode = {
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_2, .imm = 1 },
+				{ .code = BPF_JMP | BPF_JEQ | BPF_K, .dst_reg = BPF_REG_2, .off = 2 },
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 7 },
+				{ .code = BPF_JMP | BPF_JA, .off = 1 },
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 9 },
+				{ .code = BPF_JMP | BPF_EXIT },
+			},
+			.opt_len = 2,
+			.r0 = 7,
+		},
+		{
+			.name = "repeated test",
+			.len = 8,
+			.bytecode = {
+				{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1 },
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 1 },
+				{ .code = BPF_JMP | BPF_JGT | BPF_K, .dst_reg = BPF_REG_2, .imm = 10, .off = 1 },
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 2 },
+				{ .code = BPF_JMP | BPF_JGT | BPF_K, .dst_reg = BPF_REG_2, .imm = 10, .off = 2 },
+				{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_0, .imm = 10 },
+				{ .code = BPF_JMP | BPF_JA },
+				{ .code = BPF_JMP | BPF_EXIT },
+			},
+			.opt_len = 8,
+			.ctx = 20,
+			.r0 = 1,
+		},
+		{
+			.name = "dead stack store",
+			.len = 4,
+			.bytecode = {
+				{ .code = BPF_ST | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_10, .off = -8, .imm = 1 },
+				{ .code = BPF_ST | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_10, .off = -8, .imm = 2 },
+				{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_10, .off = -8 },
+				{ .code = BPF_JMP | BPF_EXIT },
+			},
+			.opt_len = 3,
+			.r0 = 2,
+		},
+		{
+			.name = "runtime error kept",
+			.len = 5,
+			.bytecode = {
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_1, .imm = 0 },
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 5 },
+				{ .code = BPF_ALU64 | BPF_DIV | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_1 },
+				{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 1 },
+				{ .code = BPF_JMP | BPF_EXIT },
+			},
+			.opt_len = 4,
+			.err = BPF_ERR_DIV_BY_ZERO,
+		},
+	};
+	struct bpf_prog_opts opts = {
+		.engine = engine,
+		.ctx_size = sizeof(__u32),
+	};
+	struct bpf_prog *prog, *opt_prog;
+	__u64 r0, opt_r0;
+	int i, err, opt_err;
+
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		struct opt_test *t = &tests[i];
+
+		opts.flags = 0;
+		prog = bpf_prog_load(t->bytecode, t->len, &opts);
+		opts.flags = BPF_F_OPTIMIZE;
+		opt_prog = bpf_prog_load(t->bytecode, t->len, &opts);
+		if (!prog || !opt_prog) {
+			fprintf(stderr, "Error: %s: load failed\n", t->name);
+			bpf_prog_destroy(prog);
+			bpf_prog_destroy(opt_prog);
+			return -1;
+		}
+		r0 = opt_r0 = 0;
+		err = bpf_prog_run(prog, &t->ctx, sizeof(t->ctx), &r0);
+		opt_err = bpf_prog_run(opt_prog, &t->ctx, sizeof(t->ctx), &opt_r0);
+		if (err != t->err || opt_err != t->err || r0 != t->r0
+		    || opt_r0 != t->r0 || opt_prog->len != t->opt_len) {
+			fprintf(stderr, "Error: %s: unexpected result %d/%d %llu/%llu, %zu insns\n",
+				t->name, err, opt_err, (unsigned long long) r0,
+				(unsigned long long) opt_r0, opt_prog->len);
+			print_bytecode(opt_prog->insns, opt_prog->len);
+			err = -1;
+		} else
+			err = 0;
+		bpf_prog_destroy(prog);
+		bpf_prog_destroy(opt_prog);
+		if (err)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * A verified program runs without instruction budget, even well
+ * beyond the 128 instructions the interpreter used to allow.
+ */
+int do_long_prog(enum bpf_engine engine)
+{
+	struct bpf_insn bytecode[BPF_MAXINSNS];
+	struct bpf_prog_opts opts = { .engine = engine };
+	struct bpf_prog *prog;
+	__u64 r0 = 0;
+	size_t i;
+	int err;
+
+	for (i = 0; i < ARRAY_SIZE(bytecode); i++) {
+		bytecode[i] = (struct bpf_insn) {
+			.code = BPF_ALU64 | BPF_ADD | BPF_K,
+			.dst_reg = BPF_REG_0,
+			.imm = 3,
+		};
+	}
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!prog)
+		return -1;
+	err = bpf_prog_run(prog, NULL, 0, &r0);
+	bpf_prog_destroy(prog);
+	if (err || r0 != 3 * ARRAY_SIZE(bytecode)) {
+		fprintf(stderr, "Error: unexpected result %d/%llu\n", err,
+			(unsigned long long) r0);
+		return -1;
+	}
+	return 0;
+}
+
+static
+__u64 fuzz_rand(__u64 *state)
+{
+	/* xorshift64 */
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/*
+ * Generate a random program: load random values into r0-r8, then mix
+ * ALU, forward jumps and memory accesses relative to r9, which the
+ * caller points to a scratch buffer of @mem_len bytes.
+ */
+static
+size_t fuzz_gen(struct bpf_insn *bytecode, size_t max_len, __u64 *state,
+		size_t mem_len)
+{
+	static const __u8 alu_ops[] = {
+		BPF_ADD, BPF_SUB, BPF_MUL, BPF_DIV, BPF_OR, BPF_AND,
+		BPF_LSH, BPF_RSH, BPF_NEG, BPF_MOD, BPF_XOR, BPF_MOV,
+		BPF_ARSH,
+	};
+	static const __u8 jmp_ops[] = {
+		BPF_JA, BPF_JEQ, BPF_JGT, BPF_JGE, BPF_JSET, BPF_JNE,
+		BPF_JLT, BPF_JLE, BPF_JSGT, BPF_JSGE, BPF_JSLT, BPF_JSLE,
+	};
+	static const __u8 sizes[] = { BPF_B, BPF_H, BPF_W, BPF_DW };
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < 9; i++) {
+		__u64 v = fuzz_rand(state);
+
+		/* Small values hit more edge cases. */
+		if (fuzz_rand(state) & 1)
+			v = (__s64) (__s8) v;
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_LD | BPF_DW | BPF_IMM,
+			.dst_reg = i,
+			.imm = (__u32) v,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_LD | BPF_W | BPF_IMM,
+			.imm = (__u32) (v >> 32),
+		};
+	}
+	while (len < max_len) {
+		__u64 r = fuzz_rand(state);
+		__u8 src = (r >> 16) & 1 ? BPF_X : BPF_K;
+		__u8 size = sizes[(r >> 40) % 4], op;
+		struct bpf_insn insn = {
+			.dst_reg = r % 9,
+			.src_reg = (r >> 8) % 9,
+			.imm = (__s32) (r >> 32),
+		};
+
+		if ((r >> 20) & 1)
+			insn.imm = (__s8) insn.imm;
+		switch ((r >> 24) % 8) {
+		case 0:
+		case 1:
+		case 2:
+		case 3:
+			op = alu_ops[(r >> 40) % sizeof(alu_ops)];
+			insn.code = ((r >> 48) & 1 ? BPF_ALU64 : BPF_ALU) | op;
+			if (op == BPF_NEG)
+				src = BPF_K;
+			/* Mostly keep shift counts in range. */
+			if ((op == BPF_LSH || op == BPF_RSH || op == BPF_ARSH)
+			    && ((r >> 56) & 7)) {
+				src = BPF_K;
+				insn.imm &= BPF_CLASS(insn.code) == BPF_ALU64 ? 63 : 31;
+			}
+			/* Mostly keep divisors in range. */
+			if (op == BPF_DIV || op == BPF_MOD) {
+				src = BPF_K;
+				if (insn.imm <= 0 && ((r >> 56) & 7))
+					insn.imm = (insn.imm & 0xff) + 1;
+			}
+			insn.code |= src;
+			break;
+		case 4:
+		case 5:
+			op = jmp_ops[(r >> 40) % sizeof(jmp_ops)];
+			if (op == BPF_JA) {
+				if (len + 1 == max_len)
+					op = BPF_JNE;
+				src = BPF_K;
+			}
+			if (op == BPF_JA) {
+				/*
+				 * Keep the code skipped by the unconditional
+				 * jump reachable, with a conditional jump over
+				 * it.
+				 */
+				bytecode[len++] = (struct bpf_insn) {
+					.code = BPF_JMP | BPF_JNE | BPF_K,
+					.dst_reg = insn.dst_reg,
+					.imm = insn.imm,
+					.off = 1,
+				};
+			}
+			insn.code = ((r >> 48) & 1 ? BPF_JMP : BPF_JMP32) | op | src;
+			insn.off = (r >> 52) % (max_len - len);
+			break;
+		case 6:
+			insn.code = ((r >> 48) & 1 ? BPF_LDX : BPF_STX)
+				| size | BPF_MEM;
+			if (BPF_CLASS(insn.code) == BPF_LDX)
+				insn.src_reg = BPF_REG_9;
+			else
+				insn.dst_reg = BPF_REG_9;
+			insn.off = (r >> 52) % (mem_len - 7);
+			break;
+		case 7:
+			insn.code = BPF_ST | size | BPF_MEM;
+			insn.dst_reg = BPF_REG_9;
+			insn.off = (r >> 52) % (mem_len - 7);
+			break;
+		}
+		bytecode[len++] = insn;
+	}
+	return len;
+}
+
+/*
+ * Run random programs on every engine, each with its own copy of the
+ * scratch memory, and compare the outcome. The threaded engine runs
+ * both the plain and the fused decoded forms.
+ */
+int do_fuzz_engines(void)
+{
+	__u64 state = 0x2545F4914F6CDD1DULL;
+	size_t nr_fused = 0;
+	int iter;
+
+	for (iter = 0; iter < 2000; iter++) {
+		struct bpf_insn bytecode[64];
+		__s64 reg[4][MAX_BPF_REG] = { { 0 } };
+		__u64 mem[4][8];
+		size_t pc[4], len;
+		struct bpf_dinsn *insns, *fused;
+		struct bpf_jit *jit;
+		int ret[4], i;
+
+		len = fuzz_gen(bytecode, ARRAY_SIZE(bytecode), &state,
+			sizeof(mem[0]));
+		if (validate_bytecode(bytecode, len)) {
+			fprintf(stderr, "Error validating bytecode\n");
+			return -1;
+		}
+		insns = decode_bytecode(bytecode, len);
+		if (!insns)
+			return -1;
+		fused = decode_bytecode(bytecode, len);
+		if (!fused) {
+			free(insns);
+			return -1;
+		}
+		nr_fused += fuse_decoded(fused, len);
+		jit = jit_compile(insns, len);
+		if (!jit) {
+			free(fused);
+			free(insns);
+			return -1;
+		}
+		for (i = 0; i < 8; i++)
+			mem[0][i] = fuzz_rand(&state);
+		for (i = 0; i < 4; i++) {
+			memcpy(mem[i], mem[0], sizeof(mem[0]));
+			reg[i][BPF_REG_9] = (unsigned long) mem[i];
+		}
+		ret[0] = run_bytecode(bytecode, len, reg[0], &pc[0]);
+		ret[1] = run_decoded(insns, len, reg[1], &pc[1]);
+		ret[2] = run_jit(jit, reg[2], &pc[2]);
+		ret[3] = run_decoded(fused, len, reg[3], &pc[3]);
+		free(fused);
+		free(insns);
+		jit_free(jit);
+
+		for (i = 1; i < 4; i++) {
+			reg[i][BPF_REG_9] = reg[0][BPF_REG_9];
+			if (ret[i] != ret[0] || pc[i] != pc[0]
+			    || memcmp(reg[i], reg[0], sizeof(reg[0]))
+			    || memcmp(mem[i], mem[0], sizeof(mem[0]))) {
+				fprintf(stderr, "Error: engine %d mismatch on program %d\n",
+					i, iter);
+				print_bytecode(bytecode, len);
+				return -1;
+			}
+		}
+	}
+	if (!nr_fused) {
+		fprintf(stderr, "Error: no superinstruction in random programs\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Build a program with one instance of each superinstruction, and
+ * check that the fused form runs like the bytecode, including when a
+ * jump lands on the second instruction of a pair. r0 accumulates the
+ * branches taken and the values computed.
+ */
+int do_fusion(void)
+{
+	static const __u8 sizes[] = { BPF_B, BPF_H, BPF_W, BPF_DW };
+	static const __u8 mov_ops[] = {
+		BPF_ADD, BPF_AND, BPF_OR, BPF_XOR, BPF_LSH, BPF_RSH,
+	};
+	static const __u8 imm64_ops[] = {
+		BPF_ADD, BPF_AND, BPF_OR, BPF_XOR,
+	};
+	struct bpf_insn bytecode[128];
+	size_t head[BPF_NR_FUSIONS], len = 0, pc[2];
+	__u64 ctx = 0x80, r0;
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_THREADED,
+		.ctx_size = sizeof(ctx),
+	};
+	struct bpf_dinsn *insns;
+	struct bpf_prog *prog;
+	int f = 0, i, skip, ret[2];
+
+	/* Skip the first load when r2 is 0. */
+	bytecode[len++] = (struct bpf_insn) {
+		.code = BPF_JMP | BPF_JEQ | BPF_K,
+		.dst_reg = BPF_REG_2,
+		.off = 1,
+	};
+	for (i = 0; i < 8; i++) {
+		head[f++] = len;
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_LDX | sizes[i % 4] | BPF_MEM,
+			.dst_reg = BPF_REG_3,
+			.src_reg = BPF_REG_1,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_JMP | (i < 4 ? BPF_JEQ : BPF_JNE) | BPF_K,
+			.dst_reg = BPF_REG_3,
+			.imm = 0x80,
+			.off = 1,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_ALU64 | BPF_ADD | BPF_K,
+			.dst_reg = BPF_REG_0,
+			.imm = 1 << i,
+		};
+	}
+	for (i = 0; i < ARRAY_SIZE(mov_ops); i++) {
+		head[f++] = len;
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_ALU64 | BPF_MOV | BPF_X,
+			.dst_reg = BPF_REG_4,
+			.src_reg = BPF_REG_0,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_ALU64 | mov_ops[i] | BPF_K,
+			.dst_reg = BPF_REG_4,
+			.imm = 3,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_ALU64 | BPF_ADD | BPF_X,
+			.dst_reg = BPF_REG_0,
+			.src_reg = BPF_REG_4,
+		};
+	}
+	for (i = 0; i < 2; i++) {
+		head[f++] = len;
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_LD | BPF_DW | BPF_IMM,
+			.dst_reg = BPF_REG_5,
+			.imm = 0x80,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_LD | BPF_W | BPF_IMM,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_JMP | (i ? BPF_JNE : BPF_JEQ) | BPF_X,
+			.dst_reg = BPF_REG_3,
+			.src_reg = BPF_REG_5,
+			.off = 1,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_ALU64 | BPF_ADD | BPF_K,
+			.dst_reg = BPF_REG_0,
+			.imm = 0x100 << i,
+		};
+	}
+	for (i = 0; i < ARRAY_SIZE(imm64_ops); i++) {
+		head[f++] = len;
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_LD | BPF_DW | BPF_IMM,
+			.dst_reg = BPF_REG_5,
+			.imm = 0x9abcdef0,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_LD | BPF_W | BPF_IMM,
+			.imm = 0x12345678,
+		};
+		bytecode[len++] = (struct bpf_insn) {
+			.code = BPF_ALU64 | imm64_ops[i] | BPF_X,
+			.dst_reg = BPF_REG_0,
+			.src_reg = BPF_REG_5,
+		};
+	}
+	bytecode[len++] = (struct bpf_insn) {
+		.code = BPF_JMP | BPF_EXIT,
+	};
+
+	if (validate_bytecode(bytecode, len)) {
+		fprintf(stderr, "Error validating bytecode\n");
+		return -1;
+	}
+	insns = decode_bytecode(bytecode, len);
+	if (!insns)
+		return -1;
+	if (fuse_decoded(insns, len) != BPF_NR_FUSIONS) {
+		fprintf(stderr, "Error: unexpected number of fused pairs\n");
+		goto error;
+	}
+	for (f = 0; f < BPF_NR_FUSIONS; f++) {
+		if (insns[head[f]].op != BPF_DOP_FUSED + f) {
+			fprintf(stderr, "Error: pc %zu not fused\n", head[f]);
+			goto error;
+		}
+	}
+	for (skip = 0; skip < 2; skip++) {
+		__s64 reg[2][MAX_BPF_REG] = { { 0 } };
+
+		for (i = 0; i < 2; i++) {
+			reg[i][BPF_REG_1] = (unsigned long) &ctx;
+			reg[i][BPF_REG_2] = !skip;
+		}
+		ret[0] = run_bytecode(bytecode, len, reg[0], &pc[0]);
+		ret[1] = run_decoded(insns, len, reg[1], &pc[1]);
+		if (ret[0] || ret[1] || pc[1] != pc[0]
+		    || memcmp(reg[1], reg[0], sizeof(reg[0]))) {
+			fprintf(stderr, "Error: fused form mismatch (skip %d)\n",
+				skip);
+			goto error;
+		}
+	}
+	free(insns);
+
+	prog = bpf_prog_load(bytecode, len, &opts);
+	if (!prog)
+		return -1;
+	if (bpf_prog_print_fusions(prog) != BPF_NR_FUSIONS
+	    || bpf_prog_run(prog, &ctx, sizeof(ctx), &r0)) {
+		bpf_prog_destroy(prog);
+		return -1;
+	}
+	bpf_prog_destroy(prog);
+	return 0;
+
+error:
+	free(insns);
+	return -1;
+}
+
+#define TIER_NR_THREADS		4
+#define TIER_NR_RUNS		20000
+
+/* r0 = ctx * 3 + 1 if ctx is odd, ctx otherwise. */
+static const struct bpf_insn tier_prog[] = {
+	{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_1 },
+	{ .code = BPF_JMP | BPF_JSET | BPF_K, .dst_reg = BPF_REG_0, .imm = 1, .off = 1 },
+	{ .code = BPF_JMP | BPF_EXIT },
+	{ .code = BPF_ALU64 | BPF_MUL | BPF_K, .dst_reg = BPF_REG_0, .imm = 3 },
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_0, .imm = 1 },
+	{ .code = BPF_JMP | BPF_EXIT },
+};
+
+struct tier_thread {
+	pthread_t		tid;
+	struct bpf_prog		*prog;
+	int			ret;
+};
+
+static
+int tier_run(struct bpf_prog *prog, __u64 ctx)
+{
+	__u64 r0;
+
+	if (bpf_prog_run(prog, &ctx, sizeof(ctx), &r0)
+	    || r0 != (ctx & 1 ? ctx * 3 + 1 : ctx)) {
+		fprintf(stderr, "Error: unexpected result for %llu\n",
+			(unsigned long long) ctx);
+		return -1;
+	}
+	return 0;
+}
+
+static
+void *tier_thread(void *arg)
+{
+	struct tier_thread *t = arg;
+	__u64 i;
+
+	for (i = 0; i < TIER_NR_RUNS; i++) {
+		if (tier_run(t->prog, i)) {
+			t->ret = -1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Wait for the background compilation, up to 10 seconds. */
+static
+int tier_wait(struct bpf_prog *prog)
+{
+	int i;
+
+	for (i = 0; i < 10000; i++) {
+		if (bpf_prog_engine(prog) == BPF_ENGINE_JIT)
+			return 0;
+		usleep(1000);
+	}
+	fprintf(stderr, "Error: program not promoted\n");
+	return -1;
+}
+
+/*
+ * Tiered execution: interpret up to the threshold, then switch to the
+ * JIT while other threads keep running the program.
+ */
+int do_tiered(void)
+{
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_TIERED,
+		.ctx_size = sizeof(__u64),
+		.tier_threshold = 10,
+	};
+	struct tier_thread threads[TIER_NR_THREADS];
+	struct bpf_prog *prog;
+	int i, ret = -1;
+
+	prog = bpf_prog_load(tier_prog, ARRAY_SIZE(tier_prog), &opts);
+	if (!prog)
+		return -1;
+	for (i = 0; i < 9; i++) {
+		if (tier_run(prog, i))
+			goto end;
+	}
+	if (bpf_prog_engine(prog) != BPF_ENGINE_THREADED) {
+		fprintf(stderr, "Error: program promoted before threshold\n");
+		goto end;
+	}
+	if (tier_run(prog, 9) || tier_wait(prog) || tier_run(prog, 11))
+		goto end;
+	bpf_prog_destroy(prog);
+
+	/* Promotion while threads run the program. */
+	opts.tier_threshold = 100;
+	prog = bpf_prog_load(tier_prog, ARRAY_SIZE(tier_prog), &opts);
+	if (!prog)
+		return -1;
+	for (i = 0; i < TIER_NR_THREADS; i++) {
+		threads[i].prog = prog;
+		threads[i].ret = 0;
+		if (pthread_create(&threads[i].tid, NULL, tier_thread,
+				&threads[i])) {
+			fprintf(stderr, "Error: pthread_create\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < TIER_NR_THREADS; i++) {
+		pthread_join(threads[i].tid, NULL);
+		if (threads[i].ret)
+			goto end;
+	}
+	if (tier_wait(prog))
+		goto end;
+	bpf_prog_destroy(prog);
+
+	/* Destroy while the program may still be queued or compiling. */
+	opts.tier_threshold = 1;
+	for (i = 0; i < 16; i++) {
+		prog = bpf_prog_load(tier_prog, ARRAY_SIZE(tier_prog), &opts);
+		if (!prog)
+			return -1;
+		if (tier_run(prog, i))
+			goto end;
+		bpf_prog_destroy(prog);
+	}
+	return 0;
+
+end:
+	bpf_prog_destroy(prog);
+	return ret;
+}
+
+/*
+ * Profiling: count the executions of each instruction and time basic
+ * blocks, whatever the engine requested.
+ */
+int do_profile(void)
+{
+	static const struct bpf_insn bytecode[] = {
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0 },
+		{
+			.code = BPF_LDX | BPF_DW | BPF_MEM,
+			.dst_reg = BPF_REG_3,
+			.src_reg = BPF_REG_1,
+		},
+		{
+			.code = BPF_JMP | BPF_JGT | BPF_K,
+			.dst_reg = BPF_REG_3,
+			.imm = 4,
+			.off = 1,
+		},
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_0, .imm = 1 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_0, .imm = 2 },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	static const __u64 counts[] = { 10, 10, 10, 5, 10, 10 };
+	static const __u64 samples[] = { 10, 0, 0, 5, 10, 0 };
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_JIT,
+		.ctx_size = sizeof(__u64),
+		.flags = BPF_F_PROFILE,
+		.profile_period = 1,
+	};
+	struct bpf_prog *prog;
+	__u64 ctx, r0;
+	int i, ret = -1;
+
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!prog)
+		return -1;
+	if (bpf_prog_engine(prog) != BPF_ENGINE_SWITCH) {
+		fprintf(stderr, "Error: profiled program not interpreted\n");
+		goto end;
+	}
+	for (ctx = 0; ctx < 10; ctx++) {
+		if (bpf_prog_run(prog, &ctx, sizeof(ctx), &r0)
+		    || r0 != (ctx > 4 ? 2 : 3)) {
+			fprintf(stderr, "Error: profiled run %llu failed\n",
+				(unsigned long long) ctx);
+			goto end;
+		}
+	}
+	for (i = 0; i < ARRAY_SIZE(bytecode); i++) {
+		if (prog->profile->counts[i] != counts[i]
+		    || prog->profile->samples[i] != samples[i]) {
+			fprintf(stderr, "Error: wrong profile at pc %d\n", i);
+			goto end;
+		}
+	}
+	if (bpf_prog_print_profile(prog))
+		goto end;
+	bpf_prog_reset_profile(prog);
+	if (prog->profile->nr_runs || prog->profile->counts[0])
+		goto end;
+	bpf_prog_destroy(prog);
+
+	/* Time one run out of four. */
+	opts.profile_period = 4;
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!prog)
+		return -1;
+	for (ctx = 0; ctx < 10; ctx++) {
+		if (bpf_prog_run(prog, &ctx, sizeof(ctx), &r0))
+			goto end;
+	}
+	if (prog->profile->counts[0] != 10 || prog->profile->samples[0] != 3) {
+		fprintf(stderr, "Error: wrong number of timed runs\n");
+		goto end;
+	}
+	bpf_prog_destroy(prog);
+
+	/* Without the flag, there is no profile to print. */
+	opts.flags = 0;
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!prog)
+		return -1;
+	if (!bpf_prog_print_profile(prog))
+		goto end;
+	ret = 0;
+end:
+	bpf_prog_destroy(prog);
+	return ret;
+}
+
+/*
+ * Compile random programs ahead of time, and compare the outcome with
+ * the reference interpreter. Each program is built by the system
+ * compiler, so fewer programs are run than with the other engines.
+ */
+int do_fuzz_aot(const char *dir)
+{
+	__u64 state = 0xD1B54A32D192ED03ULL;
+	int iter;
+
+	for (iter = 0; iter < 32; iter++) {
+		struct bpf_insn bytecode[64];
+		__s64 reg[2][MAX_BPF_REG] = { { 0 } };
+		__u64 mem[2][8];
+		char c_path[256], so_path[256];
+		size_t pc[2], len;
+		struct bpf_aot *aot;
+		FILE *out;
+		int ret[2], i;
+
+		len = fuzz_gen(bytecode, ARRAY_SIZE(bytecode), &state,
+			sizeof(mem[0]));
+		if (validate_bytecode(bytecode, len)) {
+			fprintf(stderr, "Error validating bytecode\n");
+			return -1;
+		}
+		snprintf(c_path, sizeof(c_path), "%s/fuzz%d.c", dir, iter);
+		snprintf(so_path, sizeof(so_path), "%s/fuzz%d.so", dir, iter);
+		out = fopen(c_path, "w");
+		if (!out)
+			return -1;
+		if (aot_emit(bytecode, len, out)) {
+			fclose(out);
+			return -1;
+		}
+		fclose(out);
+		if (aot_build(c_path, so_path))
+			return -1;
+		unlink(c_path);
+		aot = aot_open(so_path, bytecode, len);
+		unlink(so_path);
+		if (!aot)
+			return -1;
+
+		for (i = 0; i < 8; i++)
+			mem[0][i] = fuzz_rand(&state);
+		for (i = 0; i < 2; i++) {
+			memcpy(mem[i], mem[0], sizeof(mem[0]));
+			reg[i][BPF_REG_9] = (unsigned long) mem[i];
+		}
+		ret[0] = run_bytecode(bytecode, len, reg[0], &pc[0]);
+		ret[1] = run_aot(aot, NULL, reg[1], &pc[1]);
+		aot_free(aot);
+
+		reg[1][BPF_REG_9] = reg[0][BPF_REG_9];
+		if (ret[1] != ret[0] || pc[1] != pc[0]
+		    || memcmp(reg[1], reg[0], sizeof(reg[0]))
+		    || memcmp(mem[1], mem[0], sizeof(mem[0]))) {
+			fprintf(stderr, "Error: AOT mismatch on program %d\n",
+				iter);
+			print_bytecode(bytecode, len);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Build a program using a map and a helper into a shared object, then
+ * load it: it must count like the interpreter, and must not bind to
+ * other bytecode.
+ */
+int do_aot_prog(const char *dir)
+{
+	struct bpf_insn bytecode[] = {
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1 },
+		{ .code = BPF_STX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_2, .off = -4 },
+		BPF_LD_MAP(BPF_REG_1, 0)
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_10 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -4 },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_lookup_elem },
+		{ .code = BPF_JMP | BPF_JEQ | BPF_K, .dst_reg = BPF_REG_0, .off = 3 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_1, .imm = 1 },
+		{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_1, .imm = BPF_ADD | BPF_FETCH },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_1 },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	struct bpf_map_attr attr = {
+		.type = BPF_MAP_TYPE_HASH,
+		.key_size = sizeof(__u32),
+		.value_size = sizeof(__u64),
+		.max_entries = 16,
+	};
+	struct bpf_map *map;
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_AOT,
+		.ctx_size = sizeof(__u32),
+		.maps = &map,
+		.nr_maps = 1,
+	};
+	char path[256];
+	struct bpf_prog *prog;
+	__u32 key = 3;
+	__u64 r0, value = 0;
+	int i, ret = -1;
+
+	map = bpf_map_create(&attr);
+	if (!map)
+		return -1;
+	if (bpf_map_update_elem(map, &key, &value, BPF_NOEXIST))
+		goto end;
+	snprintf(path, sizeof(path), "%s/prog.so", dir);
+	if (bpf_prog_aot_compile(bytecode, ARRAY_SIZE(bytecode), &opts, path))
+		goto end;
+	opts.aot_path = path;
+
+	/* Same length, other immediate. */
+	bytecode[8].imm = 2;
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (prog) {
+		fprintf(stderr, "Error: shared object bound to other bytecode\n");
+		bpf_prog_destroy(prog);
+		goto end_path;
+	}
+	bytecode[8].imm = 1;
+
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!prog)
+		goto end_path;
+	for (i = 0; i < 3; i++) {
+		if (bpf_prog_run(prog, &key, sizeof(key), &r0) || r0 != i) {
+			fprintf(stderr, "Error: unexpected count %llu\n",
+				(unsigned long long) r0);
+			goto end_prog;
+		}
+	}
+	key = 4;
+	if (bpf_prog_run(prog, &key, sizeof(key), &r0) || r0 != 0)
+		goto end_prog;
+	ret = 0;
+end_prog:
+	bpf_prog_destroy(prog);
+end_path:
+	unlink(path);
+end:
+	bpf_map_destroy(map);
+	return ret;
+}
+
+int do_aot(void)
+{
+	char dir[] = "/tmp/test_bpf_XXXXXX";
+	int ret;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return -1;
+	}
+	ret = do_aot_prog(dir);
+	if (!ret)
+		ret = do_fuzz_aot(dir);
+	rmdir(dir);
+	return ret;
+}
+
+/* Sections of the ELF test object. */
+enum {
+	ELF_SEC_NULL,
+	ELF_SEC_SHSTRTAB,
+	ELF_SEC_STRTAB,
+	ELF_SEC_SYMTAB,
+	ELF_SEC_SOCKET,
+	ELF_SEC_REL_SOCKET,
+	ELF_SEC_FILTER,
+	ELF_SEC_MAPS,
+	ELF_NR_SECS,
+};
+
+/*
+ * Program looking up key 7 in map "counts", returning the value or,
+ * when absent, the absolute symbol "base" + 2.
+ */
+static const struct bpf_insn elf_socket_prog[] = {
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_1, .imm = 7 },
+	{
+		.code = BPF_STX | BPF_W | BPF_MEM,
+		.dst_reg = BPF_REG_10,
+		.src_reg = BPF_REG_1,
+		.off = -4,
+	},
+	{
+		.code = BPF_ALU64 | BPF_MOV | BPF_X,
+		.dst_reg = BPF_REG_2,
+		.src_reg = BPF_REG_10,
+	},
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -4 },
+	BPF_LD_IMM64(BPF_REG_1, 0)	/* relocated: counts */
+	{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_lookup_elem },
+	{ .code = BPF_JMP | BPF_JEQ | BPF_K, .dst_reg = BPF_REG_0, .off = 2 },
+	{
+		.code = BPF_LDX | BPF_DW | BPF_MEM,
+		.dst_reg = BPF_REG_0,
+		.src_reg = BPF_REG_0,
+	},
+	{ .code = BPF_JMP | BPF_EXIT },
+	BPF_LD_IMM64(BPF_REG_0, 2)	/* relocated: base */
+	{ .code = BPF_JMP | BPF_EXIT },
+};
+
+static const struct bpf_insn elf_filter_prog[] = {
+	{
+		.code = BPF_LDX | BPF_W | BPF_MEM,
+		.dst_reg = BPF_REG_0,
+		.src_reg = BPF_REG_1,
+	},
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_0, .imm = 1 },
+	{ .code = BPF_JMP | BPF_EXIT },
+};
+
+/*
+ * Write an object like clang -target bpf would, with a relocation of
+ * type @reloc_type for the map load.
+ */
+static
+int write_elf(const char *path, unsigned int reloc_type)
+{
+	static const char shstrtab[] =
+		"\0.shstrtab\0.strtab\0.symtab\0socket\0.relsocket\0filter\0maps";
+	static const char strtab[] = "\0counts\0other\0base";
+	const struct bpf_elf_map_def defs[] = {
+		{ .type = 1, .key_size = 4, .value_size = 8, .max_entries = 16 },
+		{ .type = 6, .key_size = 4, .value_size = 8, .max_entries = 1 },
+	};
+	const Elf64_Sym syms[] = {
+		{ 0 },
+		{
+			.st_name = 1,
+			.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_OBJECT),
+			.st_shndx = ELF_SEC_MAPS,
+			.st_size = sizeof(defs[0]),
+		},
+		{
+			.st_name = 8,
+			.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_OBJECT),
+			.st_shndx = ELF_SEC_MAPS,
+			.st_value = sizeof(defs[0]),
+			.st_size = sizeof(defs[1]),
+		},
+		{
+			.st_name = 14,
+			.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE),
+			.st_shndx = SHN_ABS,
+			.st_value = 0x100,
+		},
+	};
+	const Elf64_Rel rels[] = {
+		{ .r_offset = 4 * sizeof(struct bpf_insn),
+		  .r_info = ELF64_R_INFO(1, reloc_type) },
+		{ .r_offset = 10 * sizeof(struct bpf_insn),
+		  .r_info = ELF64_R_INFO(3, R_BPF_64_64) },
+	};
+	const struct {
+		const void	*data;
+		size_t		size;
+		Elf64_Word	type, link, info;
+		Elf64_Xword	flags, entsize;
+		Elf64_Word	name;
+	} secs[ELF_NR_SECS] = {
+		[ELF_SEC_SHSTRTAB] = { shstrtab, sizeof(shstrtab), SHT_STRTAB,
+			.name = 1 },
+		[ELF_SEC_STRTAB] = { strtab, sizeof(strtab), SHT_STRTAB,
+			.name = 11 },
+		[ELF_SEC_SYMTAB] = { syms, sizeof(syms), SHT_SYMTAB,
+			ELF_SEC_STRTAB, 1, .entsize = sizeof(syms[0]),
+			.name = 19 },
+		[ELF_SEC_SOCKET] = { elf_socket_prog, sizeof(elf_socket_prog),
+			SHT_PROGBITS, .flags = SHF_ALLOC | SHF_EXECINSTR,
+			.name = 27 },
+		[ELF_SEC_REL_SOCKET] = { rels, sizeof(rels), SHT_REL,
+			ELF_SEC_SYMTAB, ELF_SEC_SOCKET,
+			.entsize = sizeof(rels[0]), .name = 34 },
+		[ELF_SEC_FILTER] = { elf_filter_prog, sizeof(elf_filter_prog),
+			SHT_PROGBITS, .flags = SHF_ALLOC | SHF_EXECINSTR,
+			.name = 45 },
+		[ELF_SEC_MAPS] = { defs, sizeof(defs), SHT_PROGBITS,
+			.flags = SHF_ALLOC | SHF_WRITE, .name = 52 },
+	};
+	Elf64_Ehdr ehdr = {
+		.e_ident = { ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64,
+			ELFDATA2LSB, EV_CURRENT },
+		.e_type = ET_REL,
+		.e_machine = EM_BPF,
+		.e_version = EV_CURRENT,
+		.e_ehsize = sizeof(Elf64_Ehdr),
+		.e_shentsize = sizeof(Elf64_Shdr),
+		.e_shnum = ELF_NR_SECS,
+		.e_shstrndx = ELF_SEC_SHSTRTAB,
+	};
+	Elf64_Shdr shdrs[ELF_NR_SECS] = { { 0 } };
+	static const char pad[8];
+	size_t off = sizeof(ehdr);
+	FILE *out;
+	int i;
+
+	out = fopen(path, "wb");
+	if (!out)
+		return -1;
+	fseek(out, off, SEEK_SET);
+	for (i = 1; i < ELF_NR_SECS; i++) {
+		shdrs[i] = (Elf64_Shdr) {
+			.sh_name = secs[i].name,
+			.sh_type = secs[i].type,
+			.sh_flags = secs[i].flags,
+			.sh_offset = off,
+			.sh_size = secs[i].size,
+			.sh_link = secs[i].link,
+			.sh_info = secs[i].info,
+			.sh_addralign = 8,
+			.sh_entsize = secs[i].entsize,
+		};
+		fwrite(secs[i].data, secs[i].size, 1, out);
+		fwrite(pad, -secs[i].size & 7, 1, out);
+		off += (secs[i].size + 7) & ~7UL;
+	}
+	ehdr.e_shoff = off;
+	fwrite(shdrs, sizeof(shdrs), 1, out);
+	rewind(out);
+	fwrite(&ehdr, sizeof(ehdr), 1, out);
+	return fclose(out) ? -1 : 0;
+}
+
+/*
+ * ELF objects: maps are created and relocated, and programs without
+ * relocation run in place from the file mapping.
+ */
+int do_elf(void)
+{
+	char path[] = "/tmp/test_bpf_XXXXXX";
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_THREADED,
+		.ctx_size = sizeof(__u32),
+	};
+	struct bpf_prog *socket = NULL, *filter = NULL;
+	struct bpf_elf *obj;
+	__u32 ctx = 41, key = 7;
+	__u64 value = 1234, r0;
+	int fd, ret = -1;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return -1;
+	}
+	close(fd);
+	if (write_elf(path, R_BPF_64_64))
+		goto end;
+	obj = bpf_elf_open(path);
+	if (!obj)
+		goto end;
+	if (bpf_elf_nr_progs(obj) != 2
+	    || strcmp(bpf_elf_prog_name(obj, 0), "socket")
+	    || strcmp(bpf_elf_prog_name(obj, 1), "filter")
+	    || !bpf_elf_map(obj, "other") || bpf_elf_map(obj, "base")) {
+		fprintf(stderr, "Error: wrong ELF programs or maps\n");
+		goto close;
+	}
+	socket = bpf_elf_load_prog(obj, "socket", &opts);
+	filter = bpf_elf_load_prog(obj, "filter", &opts);
+	if (!socket || !filter)
+		goto close;
+	if (socket->insns_borrowed || !filter->insns_borrowed) {
+		fprintf(stderr, "Error: ELF program copied or not\n");
+		goto close;
+	}
+	if (bpf_prog_run(filter, &ctx, sizeof(ctx), &r0) || r0 != 42
+	    || bpf_prog_run(socket, &ctx, sizeof(ctx), &r0) || r0 != 0x102)
+		goto close;
+	/* Rebuilding the object does not change what was read. */
+	if (truncate(path, 0) || strcmp(bpf_elf_prog_name(obj, 1), "filter")
+	    || bpf_prog_run(filter, &ctx, sizeof(ctx), &r0) || r0 != 42) {
+		fprintf(stderr, "Error: ELF program changed with its file\n");
+		goto close;
+	}
+	if (bpf_map_update_elem(bpf_elf_map(obj, "counts"), &key, &value,
+			BPF_ANY)
+	    || bpf_prog_run(socket, &ctx, sizeof(ctx), &r0) || r0 != value)
+		goto close;
+	if (bpf_elf_load_prog(obj, "nosuch", &opts))
+		goto close;
+	bpf_prog_destroy(socket);
+	bpf_prog_destroy(filter);
+	socket = filter = NULL;
+
+	/* Optimized programs work on a copy. */
+	opts.flags = BPF_F_OPTIMIZE;
+	filter = bpf_elf_load_prog(obj, "filter", &opts);
+	if (!filter || filter->insns_borrowed)
+		goto close;
+	bpf_prog_destroy(filter);
+	filter = NULL;
+	bpf_elf_close(obj);
+
+	/* Function call relocations are not supported. */
+	if (write_elf(path, R_BPF_64_32))
+		goto end;
+	obj = bpf_elf_open(path);
+	if (obj)
+		goto close;
+	ret = 0;
+	goto end;
+
+close:
+	bpf_prog_destroy(socket);
+	bpf_prog_destroy(filter);
+	bpf_elf_close(obj);
+end:
+	unlink(path);
+	return ret;
+}
+
+/* Program returning the map value of the key in the context, or 0. */
+static const struct bpf_insn cache_prog[] = {
+	{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1 },
+	{ .code = BPF_STX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_2, .off = -4 },
+	BPF_LD_MAP(BPF_REG_1, 0)
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_10 },
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -4 },
+	{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_lookup_elem },
+	{ .code = BPF_JMP | BPF_JEQ | BPF_K, .dst_reg = BPF_REG_0, .off = 2 },
+	{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_0 },
+	{ .code = BPF_JMP | BPF_EXIT },
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0 },
+	{ .code = BPF_JMP | BPF_EXIT },
+};
+
+/*
+ * Load the cache program, from the cache when @hit, and check it finds
+ * @value under @key.
+ */
+static
+int cache_load_run(const struct bpf_prog_opts *opts, bool hit, __u32 key,
+		__u64 value)
+{
+	struct bpf_prog *prog;
+	__u64 r0;
+	int ret = -1;
+
+	prog = bpf_prog_load(cache_prog, ARRAY_SIZE(cache_prog), opts);
+	if (!prog)
+		return -1;
+	if (!prog->cache != !hit) {
+		fprintf(stderr, "Error: unexpected cache %s\n", hit ? "miss" : "hit");
+		goto end;
+	}
+	if (hit && (opts->engine == BPF_ENGINE_THREADED
+			|| opts->engine == BPF_ENGINE_TIERED)
+	    && !prog->dinsns_borrowed) {
+		fprintf(stderr, "Error: decoded form not cached\n");
+		goto end;
+	}
+	if (bpf_prog_run(prog, &key, sizeof(key), &r0) || r0 != value) {
+		fprintf(stderr, "Error: cached program returned %llu\n",
+			(unsigned long long) r0);
+		goto end;
+	}
+	ret = 0;
+end:
+	bpf_prog_destroy(prog);
+	return ret;
+}
+
+/*
+ * Count the entries of cache directory @dir, removing them if @clear.
+ * Copy the path of the last one to @path. Returns -1 on error.
+ */
+static
+int cache_scan(const char *dir, char *path, size_t size, bool clear)
+{
+	struct dirent *d;
+	int nr = 0;
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (!dp)
+		return -1;
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.')
+			continue;
+		snprintf(path, size, "%s/%s", dir, d->d_name);
+		if (clear)
+			unlink(path);
+		nr++;
+	}
+	closedir(dp);
+	return nr;
+}
+
+static
+int cache_flip_last_byte(const char *path)
+{
+	FILE *f = fopen(path, "r+b");
+	int c, ret = -1;
+
+	if (!f)
+		return -1;
+	if (!fseek(f, -1, SEEK_END) && (c = fgetc(f)) != EOF
+	    && !fseek(f, -1, SEEK_END) && fputc(c ^ 0x10, f) != EOF)
+		ret = 0;
+	if (fclose(f))
+		ret = -1;
+	return ret;
+}
+
+/*
+ * Verified-program cache: the second load of a program with the same
+ * configuration is a hit, and runs the same. Other configurations and
+ * corrupted entries miss.
+ */
+int do_cache(void)
+{
+	static const enum bpf_engine engines[] = {
+		BPF_ENGINE_SWITCH, BPF_ENGINE_THREADED, BPF_ENGINE_JIT,
+		BPF_ENGINE_TIERED,
+	};
+	char dir[] = "/tmp/test_bpf_XXXXXX";
+	struct bpf_map_attr attr = {
+		.type = BPF_MAP_TYPE_HASH,
+		.key_size = sizeof(__u32),
+		.value_size = sizeof(__u64),
+		.max_entries = 4,
+	};
+	struct bpf_map *maps[2] = { NULL, NULL };
+	struct bpf_prog_opts opts = {
+		.ctx_size = sizeof(__u32),
+		.maps = &maps[0],
+		.nr_maps = 1,
+		.cache_dir = dir,
+	};
+	__u32 key = 3;
+	__u64 value = 77, value16[2] = { 77 };
+	char path[4096];
+	int i, ret = -1;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return -1;
+	}
+	maps[0] = bpf_map_create(&attr);
+	attr.value_size = 16;
+	maps[1] = bpf_map_create(&attr);
+	if (!maps[0] || !maps[1]
+	    || bpf_map_update_elem(maps[0], &key, &value, BPF_ANY)
+	    || bpf_map_update_elem(maps[1], &key, value16, BPF_ANY))
+		goto end;
+	for (i = 0; i < ARRAY_SIZE(engines); i++) {
+		opts.engine = engines[i];
+		if (cache_load_run(&opts, false, key, value)
+		    || cache_load_run(&opts, true, key, value)
+		    || cache_load_run(&opts, true, 4, 0))
+			goto end;
+	}
+	opts.flags = BPF_F_OPTIMIZE;
+	if (cache_load_run(&opts, false, key, value)
+	    || cache_load_run(&opts, true, key, value))
+		goto end;
+	/* Map attributes are part of the key. */
+	opts.maps = &maps[1];
+	if (cache_load_run(&opts, false, key, value)
+	    || cache_load_run(&opts, true, key, value))
+		goto end;
+	if (cache_scan(dir, path, sizeof(path), true)
+	    != ARRAY_SIZE(engines) + 2) {
+		fprintf(stderr, "Error: wrong number of cache entries\n");
+		goto end;
+	}
+
+	/* Truncated entries miss, and are replaced. */
+	if (cache_load_run(&opts, false, key, value)
+	    || cache_scan(dir, path, sizeof(path), false) != 1
+	    || truncate(path, 100))
+		goto end;
+	if (cache_load_run(&opts, false, key, value)
+	    || cache_load_run(&opts, true, key, value))
+		goto end;
+
+	/* So do entries with a flipped bit in the decoded form. */
+	if (cache_flip_last_byte(path)
+	    || cache_load_run(&opts, false, key, value)
+	    || cache_load_run(&opts, true, key, value))
+		goto end;
+	ret = 0;
+end:
+	cache_scan(dir, path, sizeof(path), true);
+	rmdir(dir);
+	bpf_map_destroy(maps[0]);
+	bpf_map_destroy(maps[1]);
+	return ret;
+}
+
+/*
+ * Filter program of the multi-program test: match contexts { a, b, c }
+ * (__u32 each) with a == @a, b == @b and c <= @c, the last through the
+ * stack. Programs with odd @c compare with a 64-bit immediate, and
+ * return 2 instead of 1. Returns the program length.
+ */
+static
+size_t multi_gen(struct bpf_insn *insns, __u32 a, __u32 b, __u32 c)
+{
+	size_t len = 0, jmp[3], i;
+
+	insns[len++] = (struct bpf_insn) { .code = BPF_LDX | BPF_W | BPF_MEM,
+		.dst_reg = BPF_REG_2, .src_reg = BPF_REG_1 };
+	insns[len++] = (struct bpf_insn) { .code = BPF_ALU64 | BPF_MOV | BPF_K,
+		.dst_reg = BPF_REG_0 };
+	jmp[0] = len;
+	insns[len++] = (struct bpf_insn) { .code = BPF_JMP | BPF_JNE | BPF_K,
+		.dst_reg = BPF_REG_2, .imm = a };
+	insns[len++] = (struct bpf_insn) { .code = BPF_LDX | BPF_W | BPF_MEM,
+		.dst_reg = BPF_REG_3, .src_reg = BPF_REG_1, .off = 4 };
+	jmp[1] = len;
+	insns[len++] = (struct bpf_insn) { .code = BPF_JMP | BPF_JNE | BPF_K,
+		.dst_reg = BPF_REG_3, .imm = b };
+	insns[len++] = (struct bpf_insn) { .code = BPF_LDX | BPF_W | BPF_MEM,
+		.dst_reg = BPF_REG_4, .src_reg = BPF_REG_1, .off = 8 };
+	insns[len++] = (struct bpf_insn) { .code = BPF_STX | BPF_DW | BPF_MEM,
+		.dst_reg = BPF_REG_10, .src_reg = BPF_REG_4, .off = -8 };
+	insns[len++] = (struct bpf_insn) { .code = BPF_LDX | BPF_DW | BPF_MEM,
+		.dst_reg = BPF_REG_5, .src_reg = BPF_REG_10, .off = -8 };
+	jmp[2] = len;
+	if (c & 1) {
+		struct bpf_insn ld[] = { BPF_LD_IMM64(BPF_REG_6, c) };
+
+		memcpy(&insns[len], ld, sizeof(ld));
+		len += ARRAY_SIZE(ld);
+		jmp[2] = len;
+		insns[len++] = (struct bpf_insn) { .code = BPF_JMP | BPF_JGT | BPF_X,
+			.dst_reg = BPF_REG_5, .src_reg = BPF_REG_6 };
+	} else {
+		insns[len++] = (struct bpf_insn) { .code = BPF_JMP | BPF_JGT | BPF_K,
+			.dst_reg = BPF_REG_5, .imm = c };
+	}
+	insns[len++] = (struct bpf_insn) { .code = BPF_ALU64 | BPF_MOV | BPF_K,
+		.dst_reg = BPF_REG_0, .imm = 1 + (c & 1) };
+	for (i = 0; i < ARRAY_SIZE(jmp); i++)
+		insns[jmp[i]].off = len - jmp[i] - 1;
+	insns[len++] = (struct bpf_insn) { .code = BPF_JMP | BPF_EXIT };
+	return len;
+}
+
+/*
+ * Multi-program evaluation: the bitmap of 65 filters (one duplicate)
+ * matches their separate runs on random contexts, and shared prefixes
+ * are merged.
+ */
+int do_multi(void)
+{
+	static const struct bpf_insn ctx_store[] = {
+		{ .code = BPF_ST | BPF_W | BPF_MEM, .dst_reg = BPF_REG_1, .imm = 1 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0 },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	struct bpf_insn div_insns[] = {
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 1 },
+		{ .code = BPF_ALU64 | BPF_DIV | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_2 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 1 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_0 },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	struct bpf_insn map_call[] = {
+		{ .code = BPF_ST | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .off = -4 },
+		{ .code = BPF_ST | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_10, .off = -16 },
+		BPF_LD_MAP(BPF_REG_1, 0)
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_10 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -4 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_10 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_3, .imm = -16 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_4, .imm = BPF_ANY },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_lookup_elem },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0 },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	struct bpf_map_attr attr = {
+		.type = BPF_MAP_TYPE_HASH,
+		.key_size = sizeof(__u32),
+		.value_size = sizeof(__u64),
+		.max_entries = 1,
+	};
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_JIT,
+		.ctx_size = 3 * sizeof(__u32),
+	};
+	struct bpf_prog *progs[65] = { NULL }, *store;
+	struct bpf_map *map = NULL;
+	struct bpf_multi *multi = NULL;
+	struct bpf_insn insns[16];
+	__u64 state = 0x9E3779B97F4A7C15ULL, matched[2], r0;
+	size_t nr = 0, total = 0, len, i;
+	__u32 ctx[3];
+	int iter, err, ret = -1;
+
+	for (i = 0; i < 64; i++) {
+		len = multi_gen(insns, 1 + i / 32, i / 8 % 4, i % 8);
+		total += len;
+		progs[nr] = bpf_prog_load(insns, len, &opts);
+		if (!progs[nr++])
+			goto end;
+	}
+	/* Duplicate of program 5. */
+	len = multi_gen(insns, 1, 0, 5);
+	total += len;
+	progs[nr] = bpf_prog_load(insns, len, &opts);
+	if (!progs[nr++])
+		goto end;
+
+	multi = bpf_multi_create(progs, nr);
+	if (!multi)
+		goto end;
+	if (bpf_multi_nr_insns(multi) >= total / 2) {
+		fprintf(stderr, "Error: %zu distinct instructions out of %zu\n",
+			bpf_multi_nr_insns(multi), total);
+		goto end;
+	}
+	for (iter = 0; iter < 1000; iter++) {
+		ctx[0] = fuzz_rand(&state) % 4;
+		ctx[1] = fuzz_rand(&state) % 5;
+		ctx[2] = fuzz_rand(&state) % 10;
+		err = bpf_multi_run(multi, ctx, sizeof(ctx), matched);
+		if (err) {
+			fprintf(stderr, "Error: multi run: %s\n", bpf_strerror(err));
+			goto end;
+		}
+		for (i = 0; i < nr; i++) {
+			bool bit = matched[i / 64] & (1ULL << (i % 64));
+
+			if (bpf_prog_run(progs[i], ctx, sizeof(ctx), &r0))
+				goto end;
+			if (bit != !!r0) {
+				fprintf(stderr, "Error: multi program %zu on { %u, %u, %u }: %d, expected %d\n",
+					i, ctx[0], ctx[1], ctx[2], bit, !!r0);
+				goto end;
+			}
+		}
+	}
+	if (bpf_multi_run(multi, ctx, sizeof(ctx) - 1, matched)
+	    != BPF_ERR_CTX_SIZE) {
+		fprintf(stderr, "Error: multi run with short context\n");
+		goto end;
+	}
+
+	/*
+	 * A division by zero in the prefix shared by programs 1 and 2
+	 * fails both, and program 0 still matches.
+	 */
+	bpf_multi_destroy(multi);
+	multi = NULL;
+	for (i = 0; i < nr; i++)
+		bpf_prog_destroy(progs[i]);
+	nr = 0;
+	for (i = 0; i < 3; i++) {
+		div_insns[4].imm = i;
+		progs[nr] = bpf_prog_load(i ? div_insns : div_insns + 3,
+			i ? ARRAY_SIZE(div_insns) : 3, &opts);
+		if (!progs[nr++])
+			goto end;
+	}
+	multi = bpf_multi_create(progs, nr);
+	if (!multi)
+		goto end;
+	memset(ctx, 0, sizeof(ctx));
+	err = bpf_multi_run(multi, ctx, sizeof(ctx), matched);
+	ctx[0] = 1;
+	if (err != BPF_ERR_DIV_BY_ZERO || matched[0] != 1
+	    || bpf_multi_run(multi, ctx, sizeof(ctx), matched)
+	    || matched[0] != 7) {
+		fprintf(stderr, "Error: multi run error %s, matched %llx\n",
+			bpf_strerror(err), (unsigned long long) matched[0]);
+		goto end;
+	}
+
+	/* Stores outside the stack would not be undone between programs. */
+	store = bpf_prog_load(ctx_store, ARRAY_SIZE(ctx_store), &opts);
+	if (!store)
+		goto end;
+	bpf_multi_destroy(multi);
+	multi = bpf_multi_create(&store, 1);
+	bpf_prog_destroy(store);
+	if (multi) {
+		fprintf(stderr, "Error: multi accepted a context store\n");
+		goto end;
+	}
+
+	/* Neither would map updates: only lookups are allowed. */
+	map = bpf_map_create(&attr);
+	if (!map)
+		goto end;
+	opts.maps = &map;
+	opts.nr_maps = 1;
+	for (i = 0; i < 2; i++) {
+		if (i)
+			map_call[9].imm = BPF_FUNC_map_update_elem;
+		store = bpf_prog_load(map_call, ARRAY_SIZE(map_call), &opts);
+		if (!store)
+			goto end;
+		multi = bpf_multi_create(&store, 1);
+		bpf_prog_destroy(store);
+		if ((multi != NULL) == (i != 0)) {
+			fprintf(stderr, "Error: multi %s a call to %s\n",
+				i ? "accepted" : "rejected",
+				i ? "map_update_elem" : "map_lookup_elem");
+			goto end;
+		}
+		bpf_multi_destroy(multi);
+		multi = NULL;
+	}
+	ret = 0;
+end:
+	bpf_multi_destroy(multi);
+	bpf_map_destroy(map);
+	for (i = 0; i < nr; i++)
+		bpf_prog_destroy(progs[i]);
+	return ret;
+}
+
+/* tcpdump -d "ip and tcp dst port 80" */
+static const struct bpf_cbpf_insn cbpf_http[] = {
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x800, 0, 8),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 6),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+	BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),
+	BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 80, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, 262144),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+/* Arithmetic, scratch memory (M[5] never stored) and large divisors. */
+static const struct bpf_cbpf_insn cbpf_alu[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_IMM, 0x12345678),
+	BPF_STMT(BPF_ST, 0),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+	BPF_STMT(BPF_MISC | BPF_TAX, 0),
+	BPF_STMT(BPF_LD | BPF_W | BPF_MEM, 0),
+	BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+	BPF_STMT(BPF_ALU | BPF_LSH | BPF_X, 0),
+	BPF_STMT(BPF_ALU | BPF_XOR | BPF_K, 0xdeadbeef),
+	BPF_STMT(BPF_ALU | BPF_DIV | BPF_K, 0x80000003),
+	BPF_STMT(BPF_ALU | BPF_NEG, 0),
+	BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, 1000),
+	BPF_STMT(BPF_ST, 15),
+	BPF_STMT(BPF_LDX | BPF_W | BPF_LEN, 0),
+	BPF_STMT(BPF_LD | BPF_W | BPF_MEM, 15),
+	BPF_STMT(BPF_ALU | BPF_RSH | BPF_X, 0),
+	BPF_STMT(BPF_ALU | BPF_OR | BPF_K, 0x10000),
+	BPF_STMT(BPF_ALU | BPF_SUB | BPF_X, 0),
+	BPF_STMT(BPF_ALU | BPF_MUL | BPF_X, 0),
+	BPF_STMT(BPF_LDX | BPF_W | BPF_MEM, 5),
+	BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+	BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xfffff),
+	BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, 0xfffffff7),
+	BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 3),
+	BPF_STMT(BPF_ALU | BPF_DIV | BPF_X, 0),
+	BPF_STMT(BPF_RET | BPF_A, 0),
+};
+
+/* Each shape of conditional jump, and ret x. */
+static const struct bpf_cbpf_insn cbpf_jmp[] = {
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1),
+	BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 0x40),
+	BPF_JUMP(BPF_JMP | BPF_JGT | BPF_X, 0, 0, 4),
+	BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 1, 1, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x42, 2, 3),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0xc0, 0, 1),
+	BPF_STMT(BPF_JMP | BPF_JA, 2),
+	BPF_STMT(BPF_MISC | BPF_TXA, 0),
+	BPF_STMT(BPF_RET | BPF_A, 0),
+	BPF_STMT(BPF_LD | BPF_W | BPF_IND, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 5, 0, 0),
+	BPF_STMT(BPF_RET | BPF_X, 0),
+};
+
+/* Division and modulo by packet bytes, 0 returning 0. */
+static const struct bpf_cbpf_insn cbpf_div[] = {
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1),
+	BPF_STMT(BPF_MISC | BPF_TAX, 0),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 2),
+	BPF_STMT(BPF_ALU | BPF_DIV | BPF_X, 0),
+	BPF_STMT(BPF_ST, 1),
+	BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, 1),
+	BPF_STMT(BPF_LD | BPF_B | BPF_IND, 2),
+	BPF_STMT(BPF_MISC | BPF_TAX, 0),
+	BPF_STMT(BPF_LD | BPF_W | BPF_MEM, 1),
+	BPF_STMT(BPF_ALU | BPF_MOD | BPF_X, 0),
+	BPF_STMT(BPF_RET | BPF_A, 0),
+};
+
+/* The last word of packets of 20 bytes or more, else their length. */
+static const struct bpf_cbpf_insn cbpf_len[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 20, 0, 2),
+	BPF_STMT(BPF_LDX | BPF_W | BPF_LEN, 0),
+	BPF_STMT(BPF_LD | BPF_W | BPF_IND, -4),
+	BPF_STMT(BPF_RET | BPF_A, 0),
+};
+
+/* Dead code, which the kernel accepts: after a ret, and jumped over. */
+static const struct bpf_cbpf_insn cbpf_dead_ret[] = {
+	BPF_STMT(BPF_RET | BPF_K, 1),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+static const struct bpf_cbpf_insn cbpf_dead[] = {
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 0),
+	BPF_STMT(BPF_RET | BPF_K, 1),
+	BPF_STMT(BPF_ALU | BPF_DIV | BPF_X, 0),
+	BPF_STMT(BPF_RET | BPF_A, 0),
+	BPF_STMT(BPF_LD | BPF_W | BPF_MEM, 3),
+	BPF_STMT(BPF_RET | BPF_A, 0),
+};
+
+static const struct {
+	const struct bpf_cbpf_insn	*filter;
+	size_t				len;
+} cbpf_filters[] = {
+	{ cbpf_http, ARRAY_SIZE(cbpf_http) },
+	{ cbpf_alu, ARRAY_SIZE(cbpf_alu) },
+	{ cbpf_jmp, ARRAY_SIZE(cbpf_jmp) },
+	{ cbpf_div, ARRAY_SIZE(cbpf_div) },
+	{ cbpf_len, ARRAY_SIZE(cbpf_len) },
+	{ cbpf_dead_ret, ARRAY_SIZE(cbpf_dead_ret) },
+	{ cbpf_dead, ARRAY_SIZE(cbpf_dead) },
+};
+
+/* Random packet, often an IPv4 TCP one, sometimes to port 80. */
+static
+__u32 cbpf_gen_packet(__u8 *data, __u32 size, __u64 *state)
+{
+	__u32 len = fuzz_rand(state) % size, i;
+
+	for (i = 0; i < len; i++)
+		data[i] = fuzz_rand(state);
+	if (len < 38 || (fuzz_rand(state) & 1))
+		return len;
+	data[12] = 0x08;
+	data[13] = 0x00;
+	data[14] = 0x45;
+	data[20] &= 0xe0;
+	if (fuzz_rand(state) & 1)
+		data[21] = 0;
+	data[23] = 6;
+	data[36] = 0;
+	data[37] = 80;
+	return len;
+}
+
+/*
+ * Classic filters translated for each engine, with and without
+ * optimization, must return what the reference classic interpreter
+ * returns on random packets.
+ */
+int do_cbpf(void)
+{
+	static const struct bpf_cbpf_insn invalid[][2] = {
+		{ BPF_STMT(BPF_LD | BPF_W | BPF_IMM, 0),
+		  BPF_STMT(BPF_MISC | BPF_TAX, 0) },	/* no ret */
+		{ BPF_STMT(BPF_ALU | BPF_DIV | BPF_K, 0),
+		  BPF_STMT(BPF_RET | BPF_A, 0) },
+		{ BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 32),
+		  BPF_STMT(BPF_RET | BPF_A, 0) },
+		{ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0),
+		  BPF_STMT(BPF_RET | BPF_A, 0) },
+		{ BPF_STMT(BPF_LD | BPF_W | BPF_MEM, BPF_MEMWORDS),
+		  BPF_STMT(BPF_RET | BPF_A, 0) },
+		{ BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0xfffff000),
+		  BPF_STMT(BPF_RET | BPF_A, 0) },	/* SKF_AD_OFF + SKF_AD_PROTOCOL */
+	};
+	struct bpf_prog_opts variants[] = {
+		{ .engine = BPF_ENGINE_SWITCH },
+		{ .engine = BPF_ENGINE_THREADED },
+		{ .engine = BPF_ENGINE_JIT },
+		{ .engine = BPF_ENGINE_THREADED, .flags = BPF_F_OPTIMIZE },
+		{ .engine = BPF_ENGINE_JIT, .flags = BPF_F_OPTIMIZE },
+		{ .engine = BPF_ENGINE_AOT },
+	};
+	struct bpf_prog *progs[ARRAY_SIZE(cbpf_filters)][ARRAY_SIZE(variants)]
+		= { { NULL } };
+	char dir[] = "/tmp/test_bpf_XXXXXX", path[ARRAY_SIZE(cbpf_filters)][256];
+	__u64 state = 0x2545F4914F6CDD1DULL, r0;
+	struct bpf_packet pkt;
+	__u8 data[96];
+	size_t f, v;
+	int iter, err, ret = -1;
+
+	for (f = 0; f < ARRAY_SIZE(invalid); f++) {
+		struct bpf_prog *prog = bpf_cbpf_load(invalid[f], 2, NULL);
+
+		if (prog) {
+			fprintf(stderr, "Error: invalid classic program %zu loaded\n",
+				f);
+			bpf_prog_destroy(prog);
+			return -1;
+		}
+	}
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return -1;
+	}
+	for (f = 0; f < ARRAY_SIZE(cbpf_filters); f++) {
+		struct bpf_insn *insns;
+		size_t len;
+
+		path[f][0] = '\0';
+		if (bpf_cbpf_translate(cbpf_filters[f].filter, cbpf_filters[f].len,
+				&insns, &len))
+			goto end;
+		snprintf(path[f], sizeof(path[f]), "%s/cbpf%zu.so", dir, f);
+		variants[ARRAY_SIZE(variants) - 1].ctx_size = sizeof(pkt);
+		err = bpf_prog_aot_compile(insns, len,
+				&variants[ARRAY_SIZE(variants) - 1], path[f]);
+		free(insns);
+		if (err)
+			goto end;
+		for (v = 0; v < ARRAY_SIZE(variants); v++) {
+			variants[v].aot_path = path[f];
+			progs[f][v] = bpf_cbpf_load(cbpf_filters[f].filter,
+					cbpf_filters[f].len, &variants[v]);
+			if (!progs[f][v]) {
+				fprintf(stderr, "Error: loading classic program %zu, variant %zu\n",
+					f, v);
+				goto end;
+			}
+		}
+	}
+
+	for (iter = 0; iter < 2000; iter++) {
+		pkt.data = data;
+		pkt.len = cbpf_gen_packet(data, sizeof(data), &state);
+		for (f = 0; f < ARRAY_SIZE(cbpf_filters); f++) {
+			__u32 expected = cbpf_run(cbpf_filters[f].filter,
+					cbpf_filters[f].len, &pkt);
+
+			for (v = 0; v < ARRAY_SIZE(variants); v++) {
+				err = bpf_prog_run(progs[f][v], &pkt, sizeof(pkt), &r0);
+				if (err || r0 != expected) {
+					fprintf(stderr, "Error: classic program %zu, variant %zu, packet of %u bytes: %s, r0 %llu, expected %u\n",
+						f, v, pkt.len, bpf_strerror(err),
+						(unsigned long long) r0, expected);
+					goto end;
+				}
+			}
+		}
+	}
+	ret = 0;
+end:
+	for (f = 0; f < ARRAY_SIZE(cbpf_filters); f++) {
+		for (v = 0; v < ARRAY_SIZE(variants); v++)
+			bpf_prog_destroy(progs[f][v]);
+		if (path[f][0])
+			unlink(path[f]);
+	}
+	rmdir(dir);
+	return ret;
+}
+
+#define PKT_LD_ABS(size, k)						\
+	{ .code = BPF_LD | (size) | BPF_ABS, .imm = (k) }
+
+/*
+ * Runs of packet loads, with the packet length check expected on each
+ * BPF_ABS load once hoisted (0 when checked by the first of the run).
+ */
+static const struct bpf_insn pkt_run_prog[] = {
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1 },
+	PKT_LD_ABS(BPF_H, 12),
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_7, .src_reg = BPF_REG_0 },
+	PKT_LD_ABS(BPF_B, 23),
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_7, .src_reg = BPF_REG_0 },
+	{ .code = BPF_STX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_7, .off = -4 },
+	PKT_LD_ABS(BPF_W, 30),
+	{ .code = BPF_ALU64 | BPF_XOR | BPF_X, .dst_reg = BPF_REG_7, .src_reg = BPF_REG_0 },
+	PKT_LD_ABS(BPF_B, 9),
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_7 },
+	{ .code = BPF_JMP | BPF_JEQ | BPF_K, .dst_reg = BPF_REG_0, .imm = 5, .off = 1 },
+	PKT_LD_ABS(BPF_B, 40),
+	{ .code = BPF_JMP | BPF_EXIT },
+};
+static const __u32 pkt_run_checks[ARRAY_SIZE(pkt_run_prog)] = {
+	[1] = 34, [11] = 41,
+};
+
+/* Jump targets and instructions which may fail end runs. */
+static const struct bpf_insn pkt_split_prog[] = {
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1 },
+	PKT_LD_ABS(BPF_B, 0),
+	{ .code = BPF_JMP | BPF_JGT | BPF_K, .dst_reg = BPF_REG_0, .imm = 200, .off = 1 },
+	PKT_LD_ABS(BPF_B, 1),
+	PKT_LD_ABS(BPF_H, 20),
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_7, .imm = 1000 },
+	{ .code = BPF_ALU64 | BPF_DIV | BPF_X, .dst_reg = BPF_REG_7, .src_reg = BPF_REG_0 },
+	PKT_LD_ABS(BPF_W, 24),
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_7 },
+	{ .code = BPF_JMP | BPF_EXIT },
+};
+static const __u32 pkt_split_checks[ARRAY_SIZE(pkt_split_prog)] = {
+	[1] = 1, [3] = 2, [4] = 22, [7] = 28,
+};
+
+static
+int check_packet_prog(const char *dir, const struct bpf_insn *insns,
+		size_t len, const __u32 *checks)
+{
+	struct bpf_prog_opts variants[] = {
+		{ .engine = BPF_ENGINE_SWITCH },
+		{ .engine = BPF_ENGINE_THREADED },
+		{ .engine = BPF_ENGINE_JIT },
+		{ .engine = BPF_ENGINE_AOT },
+	};
+	struct bpf_prog *progs[ARRAY_SIZE(variants)] = { NULL };
+	struct bpf_dinsn *decoded;
+	struct bpf_packet pkt;
+	__u64 state = 0x5851F42D4C957F2DULL, r0[2];
+	__u8 data[48];
+	char path[256];
+	size_t i, v;
+	int err[2], ret = -1;
+
+	decoded = decode_bytecode(insns, len);
+	if (!decoded)
+		return -1;
+	for (i = 0; i < len; i++) {
+		if (BPF_MODE(insns[i].code) != BPF_ABS)
+			continue;
+		if (DINSN_ABS_CHECK(&decoded[i]) != checks[i]
+		    || DINSN_ABS_OFF(&decoded[i]) != insns[i].imm) {
+			fprintf(stderr, "Error: packet load at pc %zu checks %u, expected %u\n",
+				i, DINSN_ABS_CHECK(&decoded[i]), checks[i]);
+			free(decoded);
+			return -1;
+		}
+	}
+	free(decoded);
+
+	snprintf(path, sizeof(path), "%s/packet.so", dir);
+	for (v = 0; v < ARRAY_SIZE(variants); v++) {
+		variants[v].ctx_size = sizeof(pkt);
+		if (variants[v].engine == BPF_ENGINE_AOT) {
+			if (bpf_prog_aot_compile(insns, len, &variants[v], path))
+				goto end;
+			variants[v].aot_path = path;
+		}
+		progs[v] = bpf_prog_load(insns, len, &variants[v]);
+		if (variants[v].engine == BPF_ENGINE_AOT)
+			unlink(path);
+		if (!progs[v])
+			goto end;
+	}
+	pkt.data = data;
+	for (pkt.len = 0; pkt.len <= sizeof(data); pkt.len++) {
+		for (i = 0; i < 64; i++) {
+			size_t j;
+
+			for (j = 0; j < sizeof(data); j++)
+				data[j] = fuzz_rand(&state) % (i & 1 ? 4 : 256);
+			r0[0] = r0[1] = 0;
+			err[0] = bpf_prog_run(progs[0], &pkt, sizeof(pkt), &r0[0]);
+			for (v = 1; v < ARRAY_SIZE(variants); v++) {
+				r0[1] = 0;
+				err[1] = bpf_prog_run(progs[v], &pkt, sizeof(pkt),
+						&r0[1]);
+				if (err[1] != err[0] || r0[1] != r0[0]) {
+					fprintf(stderr, "Error: engine %d on a packet of %u bytes: %s, r0 %llu, expected %s, r0 %llu\n",
+						variants[v].engine, pkt.len,
+						bpf_strerror(err[1]),
+						(unsigned long long) r0[1],
+						bpf_strerror(err[0]),
+						(unsigned long long) r0[0]);
+					goto end;
+				}
+			}
+		}
+	}
+	ret = 0;
+end:
+	for (v = 0; v < ARRAY_SIZE(variants); v++)
+		bpf_prog_destroy(progs[v]);
+	return ret;
+}
+
+/*
+ * Packet loads: bounds checks hoisted to the first BPF_ABS load of a
+ * run give the results of per-load checks, at all packet lengths.
+ */
+int do_packet(void)
+{
+	static const struct bpf_insn negative[] = {
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1 },
+		PKT_LD_ABS(BPF_W, -4),
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	/* Points the packet to another object, and loads from it. */
+	static const struct bpf_insn ctx_store[] = {
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1 },
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_2, .imm = 0x1000 },
+		{ .imm = 0 },
+		{ .code = BPF_STX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_2 },
+		{ .code = BPF_ST | BPF_W | BPF_MEM, .dst_reg = BPF_REG_6, .off = 8, .imm = 0x7fffffff },
+		PKT_LD_ABS(BPF_W, 0),
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	/* Grows the packet after the check of a run of loads. */
+	static const struct bpf_insn len_store[] = {
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1 },
+		PKT_LD_ABS(BPF_W, 0),
+		{ .code = BPF_ST | BPF_W | BPF_MEM, .dst_reg = BPF_REG_6, .off = 8, .imm = 0x7fffffff },
+		PKT_LD_ABS(BPF_W, 4096),
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	struct bpf_prog_opts opts = {
+		.ctx_size = sizeof(struct bpf_packet),
+	};
+	char dir[] = "/tmp/test_bpf_XXXXXX";
+	struct bpf_prog *prog;
+	int ret;
+
+	prog = bpf_prog_load(negative, ARRAY_SIZE(negative), &opts);
+	if (prog) {
+		fprintf(stderr, "Error: negative packet offset accepted\n");
+		bpf_prog_destroy(prog);
+		return -1;
+	}
+	prog = bpf_prog_load(ctx_store, ARRAY_SIZE(ctx_store), &opts);
+	if (prog) {
+		fprintf(stderr, "Error: packet context store accepted\n");
+		bpf_prog_destroy(prog);
+		return -1;
+	}
+	prog = bpf_prog_load(len_store, ARRAY_SIZE(len_store), &opts);
+	if (prog) {
+		fprintf(stderr, "Error: packet length store accepted\n");
+		bpf_prog_destroy(prog);
+		return -1;
+	}
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return -1;
+	}
+	ret = check_packet_prog(dir, pkt_run_prog, ARRAY_SIZE(pkt_run_prog),
+			pkt_run_checks);
+	if (!ret)
+		ret = check_packet_prog(dir, pkt_split_prog,
+				ARRAY_SIZE(pkt_split_prog), pkt_split_checks);
+	rmdir(dir);
+	return ret;
+}
+
+/*
+ * Optimize random programs: the result must validate, fail with the
+ * same error or return the same r0, and leave memory the same.
+ */
+int do_fuzz_optimize(void)
+{
+	__u64 state = 0x9E3779B97F4A7C15ULL;
+	int iter;
+
+	for (iter = 0; iter < 2000; iter++) {
+		struct bpf_insn bytecode[64], opt[64];
+		__s64 reg[2][MAX_BPF_REG] = { { 0 } };
+		__u64 mem[2][8];
+		size_t pc[2], len, opt_len;
+		int ret[2], i;
+
+		len = fuzz_gen(bytecode, ARRAY_SIZE(bytecode), &state,
+			sizeof(mem[0]));
+		memcpy(opt, bytecode, sizeof(bytecode));
+		opt_len = len;
+		if (optimize_bytecode(opt, &opt_len))
+			return -1;
+		if (validate_bytecode(opt, opt_len)) {
+			fprintf(stderr, "Error validating optimized program %d\n",
+				iter);
+			print_bytecode(bytecode, len);
+			return -1;
+		}
+		for (i = 0; i < 8; i++)
+			mem[0][i] = fuzz_rand(&state);
+		memcpy(mem[1], mem[0], sizeof(mem[0]));
+		for (i = 0; i < 2; i++)
+			reg[i][BPF_REG_9] = (unsigned long) mem[i];
+		ret[0] = run_bytecode(bytecode, len, reg[0], &pc[0]);
+		ret[1] = run_bytecode(opt, opt_len, reg[1], &pc[1]);
+		if (ret[1] != ret[0]
+		    || (!ret[0] && reg[1][BPF_REG_0] != reg[0][BPF_REG_0])
+		    || memcmp(mem[1], mem[0], sizeof(mem[0]))) {
+			fprintf(stderr, "Error: optimized program %d mismatch\n",
+				iter);
+			print_bytecode(bytecode, len);
+			print_bytecode(opt, opt_len);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+struct div_ctx {
+	__s64	a, b;
+};
+
+/* Reference for div_prog: division by -1 negates, without trapping. */
+static
+int div_expected(const struct div_ctx *ctx, __u64 *r0)
+{
+	__s64 q, q32;
+
+	if (!ctx->b)
+		return BPF_ERR_DIV_BY_ZERO;
+	q = ctx->b == -1 ? (__s64) -(__u64) ctx->a : ctx->a / ctx->b;
+	q32 = (__u32) q;
+	*r0 = (q ^ (__s64) -(__u64) ctx->a) + q32;
+	return BPF_ERR_NONE;
+}
+
+/* r0 = (a / b ^ a / -1) + (__u32) (a / b), with a 32-bit division. */
+static const struct bpf_insn div_prog[] = {
+	{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1 },
+	{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_1, .off = 8 },
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_2 },
+	{ .code = BPF_ALU64 | BPF_DIV | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_3 },
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_4, .src_reg = BPF_REG_2 },
+	{ .code = BPF_ALU64 | BPF_DIV | BPF_K, .dst_reg = BPF_REG_4, .imm = -1 },
+	{ .code = BPF_ALU64 | BPF_XOR | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_4 },
+	{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_5, .src_reg = BPF_REG_2 },
+	{ .code = BPF_ALU | BPF_DIV | BPF_X, .dst_reg = BPF_REG_5, .src_reg = BPF_REG_3 },
+	{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_5 },
+	{ .code = BPF_JMP | BPF_EXIT },
+};
+
+/* INT64_MIN / -1, folded by the validator and BPF_F_OPTIMIZE. */
+static const struct bpf_insn div_const_prog[] = {
+	{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_0 },
+	{ .imm = INT32_MIN },
+	{ .code = BPF_ALU64 | BPF_DIV | BPF_K, .dst_reg = BPF_REG_0, .imm = -1 },
+	{ .code = BPF_JMP | BPF_EXIT },
+};
+
+/*
+ * Run div_prog (@p 0) or div_const_prog (@p 1) loaded for @engine with
+ * @flags on all div_ctxs, as a batch.
+ */
+static
+int check_div_prog(const char *dir, size_t p, enum bpf_engine engine,
+		unsigned int flags)
+{
+	static const struct div_ctx ctxs[] = {
+		{ INT64_MIN, -1 }, { INT64_MIN, 1 }, { INT64_MIN, 2 },
+		{ INT64_MAX, -1 }, { 5, -1 }, { -7, 3 }, { 0, -1 },
+		{ INT64_MIN, -3 }, { -1, -1 },
+	};
+	const struct bpf_insn *progs[] = { div_prog, div_const_prog };
+	size_t lens[] = { ARRAY_SIZE(div_prog), ARRAY_SIZE(div_const_prog) };
+	struct bpf_prog_opts opts = {
+		.engine = engine,
+		.ctx_size = sizeof(struct div_ctx),
+		.flags = flags,
+	};
+	struct div_ctx zero = { INT64_MIN, 0 };
+	__u64 r0[ARRAY_SIZE(ctxs)], expected = INT64_MIN;
+	struct bpf_prog *prog;
+	char path[256];
+	size_t i, n;
+	int err, ret = -1;
+
+	if (engine == BPF_ENGINE_AOT) {
+		snprintf(path, sizeof(path), "%s/div_%zu_%u.so", dir, p, flags);
+		if (bpf_prog_aot_compile(progs[p], lens[p], &opts, path))
+			return -1;
+		opts.aot_path = path;
+	}
+	prog = bpf_prog_load(progs[p], lens[p], &opts);
+	if (engine == BPF_ENGINE_AOT)
+		unlink(path);
+	if (!prog)
+		return -1;
+	memset(r0, 0, sizeof(r0));
+	n = bpf_prog_run_strided(prog, (void *) ctxs, sizeof(ctxs[0]),
+			ARRAY_SIZE(ctxs), sizeof(ctxs[0]), r0, &err);
+	for (i = 0; i < ARRAY_SIZE(ctxs); i++) {
+		if (!p)
+			div_expected(&ctxs[i], &expected);
+		if (n != ARRAY_SIZE(ctxs) || err || r0[i] != expected) {
+			fprintf(stderr, "Error: division %zu of program %zu, engine %d, flags %#x: %s, r0 %#llx, expected %#llx\n",
+				i, p, engine, flags, bpf_strerror(err),
+				(unsigned long long) r0[i],
+				(unsigned long long) expected);
+			goto end;
+		}
+	}
+	err = bpf_prog_run(prog, &zero, sizeof(zero), &r0[0]);
+	if (!p && err != BPF_ERR_DIV_BY_ZERO) {
+		fprintf(stderr, "Error: division by zero, engine %d, flags %#x: %s\n",
+			engine, flags, bpf_strerror(err));
+		goto end;
+	}
+	ret = 0;
+end:
+	bpf_prog_destroy(prog);
+	return ret;
+}
+
+/*
+ * INT64_MIN / -1 gives INT64_MIN instead of trapping, in every engine,
+ * in BPF_F_SIMD batches and once optimized.
+ */
+int do_div_overflow(void)
+{
+	static const enum bpf_engine engines[] = {
+		BPF_ENGINE_SWITCH, BPF_ENGINE_THREADED, BPF_ENGINE_JIT,
+		BPF_ENGINE_AOT, BPF_ENGINE_TIERED,
+	};
+	static const unsigned int flags[] = {
+		0, BPF_F_OPTIMIZE, BPF_F_SIMD, BPF_F_SIMD | BPF_F_OPTIMIZE,
+	};
+	char dir[] = "/tmp/test_bpf_XXXXXX";
+	size_t e, f, p;
+	int ret = 0;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return -1;
+	}
+	for (p = 0; p < 2 && !ret; p++) {
+		for (e = 0; e < ARRAY_SIZE(engines) && !ret; e++) {
+			for (f = 0; f < ARRAY_SIZE(flags) && !ret; f++)
+				ret = check_div_prog(dir, p, engines[e],
+						flags[f]);
+		}
+	}
+	rmdir(dir);
+	return ret;
+}
+
+static
+void prog_api_hook(const struct bpf_prog *prog, int err, size_t pc,
+		const __s64 *reg, void *priv)
+{
+	int *last_err = priv;
+
+	*last_err = err;
+}
+
+/*
+ * Load once, run many times against different contexts: r0 =
+ * ctx[0] + ctx[1] + ctx_len, or a division by zero when ctx[1] is 0.
+ */
+int do_prog_api(enum bpf_engine engine)
+{
+	struct bpf_insn bytecode[] = {
+		{
+			.code = BPF_LDX | BPF_W | BPF_MEM,
+			.dst_reg = BPF_REG_0,
+			.src_reg = BPF_REG_1,
+			.off = 0,
+		},
+		{
+			.code = BPF_LDX | BPF_W | BPF_MEM,
+			.dst_reg = BPF_REG_3,
+			.src_reg = BPF_REG_1,
+			.off = 4,
+		},
+		{
+			.code = BPF_ALU64 | BPF_MOV | BPF_X,
+			.dst_reg = BPF_REG_4,
+			.src_reg = BPF_REG_3,
+		},
+		{
+			.code = BPF_ALU64 | BPF_DIV | BPF_X,
+			.dst_reg = BPF_REG_4,
+			.src_reg = BPF_REG_3,
+		},
+		{
+			.code = BPF_ALU64 | BPF_ADD | BPF_X,
+			.dst_reg = BPF_REG_0,
+			.src_reg = BPF_REG_3,
+		},
+		{
+			.code = BPF_ALU64 | BPF_ADD | BPF_X,
+			.dst_reg = BPF_REG_0,
+			.src_reg = BPF_REG_2,
+		},
+	};
+	__u32 ctx[2];
+	struct bpf_prog_opts opts = {
+		.engine = engine,
+		.ctx_size = sizeof(ctx),
+	};
+	struct bpf_prog *prog;
+	__u64 r0;
+	int i, err, last_err = -1, ret = -1;
+
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!prog)
+		return -1;
+	for (i = 0; i < 100; i++) {
+		ctx[0] = i * 3;
+		ctx[1] = i + 1;
+		err = bpf_prog_run(prog, ctx, sizeof(ctx), &r0);
+		if (err || r0 != ctx[0] + ctx[1] + sizeof(ctx)) {
+			fprintf(stderr, "Error: unexpected result %d/%llu\n",
+				err, (unsigned long long) r0);
+			goto end;
+		}
+	}
+	if (bpf_prog_run(prog, ctx, sizeof(ctx) - 1, &r0) != BPF_ERR_CTX_SIZE) {
+		fprintf(stderr, "Error: expected context size error\n");
+		goto end;
+	}
+	bpf_prog_set_debug_hook(prog, prog_api_hook, &last_err);
+	ctx[1] = 0;
+	r0 = 42;
+	err = bpf_prog_run(prog, ctx, sizeof(ctx), &r0);
+	if (err != BPF_ERR_DIV_BY_ZERO || last_err != err || r0 != 42) {
+		fprintf(stderr, "Error: expected division by zero, got %d\n", err);
+		goto end;
+	}
+	ret = 0;
+end:
+	bpf_prog_destroy(prog);
+	return ret;
+}
+
+/*
+ * Batch runs, on context pointers and on a strided buffer, give the
+ * results of single runs and stop at the first failed run.
+ */
+/* Batch runs, also in the SIMD lane engine with @flags BPF_F_SIMD. */
+static
+int check_batch(enum bpf_engine engine, unsigned int flags)
+{
+	static const struct bpf_insn bytecode[] = {
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_1 },
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_1, .off = 4 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_4, .imm = 1000 },
+		{ .code = BPF_ALU64 | BPF_DIV | BPF_X, .dst_reg = BPF_REG_4, .src_reg = BPF_REG_3 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_4 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_2 },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	struct batch_event {
+		__u32	a, b;
+		__u32	pad[14];
+	};
+	enum { NR = 1000, FAIL = 700 };
+	struct bpf_prog_opts opts = {
+		.engine = engine,
+		.ctx_size = 2 * sizeof(__u32),
+		.flags = flags,
+	};
+	struct batch_event *evs;
+	struct bpf_prog *prog;
+	void **ctxs;
+	__u64 *r0, expected;
+	size_t i, n;
+	int err, ret = -1;
+
+	evs = calloc(NR, sizeof(*evs));
+	ctxs = calloc(NR, sizeof(*ctxs));
+	r0 = calloc(NR, sizeof(*r0));
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!evs || !ctxs || !r0 || !prog)
+		goto end;
+	for (i = 0; i < NR; i++) {
+		evs[i].a = i * 7;
+		evs[i].b = i + 1;
+		ctxs[i] = &evs[NR - 1 - i];
+	}
+
+	n = bpf_prog_run_batch(prog, ctxs, NR, sizeof(evs[0]), r0, &err);
+	if (n != NR || err) {
+		fprintf(stderr, "Error: batch ran %zu: %s\n", n, bpf_strerror(err));
+		goto end;
+	}
+	for (i = 0; i < NR; i++) {
+		if (bpf_prog_run(prog, ctxs[i], sizeof(evs[0]), &expected)
+		    || r0[i] != expected) {
+			fprintf(stderr, "Error: batch run %zu returned %llu, expected %llu\n",
+				i, (unsigned long long) r0[i],
+				(unsigned long long) expected);
+			goto end;
+		}
+	}
+
+	evs[FAIL].b = 0;
+	n = bpf_prog_run_strided(prog, evs, sizeof(evs[0]), NR, sizeof(evs[0]),
+			r0, &err);
+	if (n != FAIL || err != BPF_ERR_DIV_BY_ZERO) {
+		fprintf(stderr, "Error: strided batch stopped at %zu: %s\n", n,
+			bpf_strerror(err));
+		goto end;
+	}
+	n = bpf_prog_run_strided(prog, &evs[FAIL + 1], sizeof(evs[0]),
+			NR - FAIL - 1, sizeof(evs[0]), &r0[FAIL + 1], &err);
+	if (n != NR - FAIL - 1 || err)
+		goto end;
+	for (i = 0; i < NR; i++) {
+		if (i == FAIL)
+			continue;
+		expected = evs[i].a + 1000 / evs[i].b + sizeof(evs[0]);
+		if (r0[i] != expected) {
+			fprintf(stderr, "Error: strided run %zu returned %llu, expected %llu\n",
+				i, (unsigned long long) r0[i],
+				(unsigned long long) expected);
+			goto end;
+		}
+	}
+
+	n = bpf_prog_run_batch(prog, ctxs, NR, sizeof(__u32), r0, &err);
+	if (n || err != BPF_ERR_CTX_SIZE) {
+		fprintf(stderr, "Error: expected context size error\n");
+		goto end;
+	}
+	ret = 0;
+end:
+	bpf_prog_destroy(prog);
+	free(r0);
+	free(ctxs);
+	free(evs);
+	return ret;
+}
+
+int do_batch(enum bpf_engine engine)
+{
+	if (check_batch(engine, 0) || check_batch(engine, BPF_F_SIMD))
+		return -1;
+	return 0;
+}
+
+/*
+ * Lanes splitting on a 64-bit immediate load, with an atomic add on a
+ * stack slot of each lane where they join, run lane by lane.
+ */
+static
+int check_simd_split(void)
+{
+	static const struct bpf_insn bytecode[] = {
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_1 },
+		{ .code = BPF_STX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_0, .off = -8 },
+		{ .code = BPF_JMP | BPF_JGT | BPF_K, .dst_reg = BPF_REG_0, .off = 3, .imm = 100 },
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_2, .imm = 0 },
+		{ .imm = 1 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_2 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = 1 },
+		{ .code = BPF_STX | BPF_DW | BPF_ATOMIC, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_3, .off = -8, .imm = BPF_ADD | BPF_FETCH },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_3 },
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_10, .off = -8 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_3 },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	struct bpf_prog_opts opts = {
+		.ctx_size = sizeof(__u32),
+		.flags = BPF_F_SIMD,
+	};
+	__u32 vals[29];
+	__u64 r0[ARRAY_SIZE(vals)], expected;
+	struct bpf_prog *prog;
+	size_t i, n;
+	int err;
+
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!prog)
+		return -1;
+	for (i = 0; i < ARRAY_SIZE(vals); i++)
+		vals[i] = i * 37 % 200;
+	n = bpf_prog_run_strided(prog, vals, sizeof(vals[0]), ARRAY_SIZE(vals),
+			sizeof(vals[0]), r0, &err);
+	bpf_prog_destroy(prog);
+	for (i = 0; i < n; i++) {
+		expected = 3 * (__u64) vals[i] + 1
+			+ (vals[i] > 100 ? 0 : 1ULL << 32);
+		if (r0[i] != expected) {
+			fprintf(stderr, "Error: lane %zu returned %llu, expected %llu\n",
+				i, (unsigned long long) r0[i],
+				(unsigned long long) expected);
+			return -1;
+		}
+	}
+	if (n != ARRAY_SIZE(vals) || err) {
+		fprintf(stderr, "Error: split lanes ran %zu: %s\n", n,
+			bpf_strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Run random programs in the SIMD lane engine of each instruction set
+ * the CPU has, on contexts of random values so that lanes take
+ * different branches, and compare each lane with a scalar run. The
+ * programs load r0-r8 from the context, which r9 points to. Then run
+ * the classic filters on random packets.
+ */
+int do_simd(void)
+{
+	enum { NR_CTX = 3 * BPF_SIMD_LANES + 5, CTX_SIZE = 128 };
+	static __u64 mem[NR_CTX][CTX_SIZE / 8], ref[NR_CTX][CTX_SIZE / 8];
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_SWITCH,
+		.ctx_size = CTX_SIZE,
+	};
+	__u64 state = 0x2545F4914F6CDD1DULL, r0[NR_CTX], expected[NR_CTX];
+	int err[NR_CTX], expected_err[NR_CTX];
+	void *ctxs[NR_CTX];
+	struct bpf_packet pkts[NR_CTX];
+	__u8 data[NR_CTX][96];
+	size_t isa, i, j, f, nr_isas = 0, nr_split = 0;
+	int iter;
+
+	for (isa = 0; isa < SIMD_NR_ISAS; isa++)
+		nr_isas += !!simd_isa(isa);
+	if (!nr_isas) {
+		printf("SIMD lanes unsupported, skipped\n");
+		return 0;
+	}
+	if (check_simd_split())
+		return -1;
+	for (iter = 0; iter < 500; iter++) {
+		struct bpf_insn bytecode[64];
+		struct bpf_prog *prog;
+		size_t len;
+
+		len = fuzz_gen(bytecode, ARRAY_SIZE(bytecode), &state, CTX_SIZE);
+		bytecode[0] = (struct bpf_insn) {
+			.code = BPF_ALU64 | BPF_MOV | BPF_X,
+			.dst_reg = BPF_REG_9,
+			.src_reg = BPF_REG_1,
+		};
+		for (i = 0; i < 9; i++) {
+			bytecode[1 + i] = (struct bpf_insn) {
+				.code = BPF_LDX | BPF_DW | BPF_MEM,
+				.dst_reg = i,
+				.src_reg = BPF_REG_9,
+				.off = 8 * i,
+			};
+		}
+		for (i = 0; i < 8; i++) {
+			bytecode[10 + i] = (struct bpf_insn) {
+				.code = BPF_ALU64 | BPF_ADD | BPF_K,
+				.dst_reg = i,
+				.imm = (__s8) fuzz_rand(&state),
+			};
+		}
+		/* Some accesses without a vector form, run lane by lane. */
+		for (i = 18; i < len; i++) {
+			if (BPF_CLASS(bytecode[i].code) >= BPF_LDX
+			    && BPF_CLASS(bytecode[i].code) <= BPF_STX
+			    && BPF_MODE(bytecode[i].code) == BPF_MEM
+			    && !(fuzz_rand(&state) & 3))
+				bytecode[i].code ^= BPF_MEM ^ BPF_MEM_ACQ_REL;
+		}
+		prog = bpf_prog_load(bytecode, len, &opts);
+		if (!prog) {
+			print_bytecode(bytecode, len);
+			return -1;
+		}
+		for (i = 0; i < NR_CTX; i++) {
+			for (j = 0; j < CTX_SIZE / 8; j++) {
+				mem[i][j] = fuzz_rand(&state);
+				/* Small values hit more edge cases. */
+				if (mem[i][j] & 1)
+					mem[i][j] = (__s64) (__s8) mem[i][j];
+			}
+		}
+		memcpy(ref, mem, sizeof(mem));
+		for (i = 0; i < NR_CTX; i++)
+			expected_err[i] = bpf_prog_run(prog, ref[i], CTX_SIZE,
+					&expected[i]);
+		for (i = 1; i < NR_CTX; i++)
+			nr_split += expected[i] != expected[0];
+
+		for (isa = 0; isa < SIMD_NR_ISAS; isa++) {
+			const struct bpf_simd *simd = simd_isa(isa);
+			__u64 lanes_mem[NR_CTX][CTX_SIZE / 8];
+
+			if (!simd)
+				continue;
+			memcpy(lanes_mem, mem, sizeof(mem));
+			for (i = 0; i < NR_CTX; i++)
+				ctxs[i] = lanes_mem[i];
+			for (i = 0; i < NR_CTX; i += simd->lanes) {
+				simd->run(prog, &ctxs[i], NR_CTX - i < simd->lanes ?
+					NR_CTX - i : simd->lanes, CTX_SIZE, &r0[i],
+					&err[i]);
+			}
+			for (i = 0; i < NR_CTX; i++) {
+				if (err[i] != expected_err[i]
+				    || (!err[i] && r0[i] != expected[i])
+				    || memcmp(lanes_mem[i], ref[i], CTX_SIZE)) {
+					fprintf(stderr, "Error: %s lane %zu of program %d: %s, r0 %llu, expected %s, r0 %llu\n",
+						simd->name, i, iter, bpf_strerror(err[i]),
+						(unsigned long long) r0[i],
+						bpf_strerror(expected_err[i]),
+						(unsigned long long) expected[i]);
+					print_bytecode(bytecode, len);
+					bpf_prog_destroy(prog);
+					return -1;
+				}
+			}
+		}
+		bpf_prog_destroy(prog);
+	}
+	if (!nr_split) {
+		fprintf(stderr, "Error: no lanes took different branches\n");
+		return -1;
+	}
+
+	for (f = 0; f < ARRAY_SIZE(cbpf_filters); f++) {
+		struct bpf_prog_opts cbpf_opts = {
+			.flags = BPF_F_SIMD,
+		};
+		struct bpf_prog *prog;
+		size_t n;
+
+		prog = bpf_cbpf_load(cbpf_filters[f].filter, cbpf_filters[f].len,
+				&cbpf_opts);
+		if (!prog || !bpf_prog_simd_isa(prog)) {
+			bpf_prog_destroy(prog);
+			return -1;
+		}
+		for (iter = 0; iter < 100; iter++) {
+			for (i = 0; i < NR_CTX; i++) {
+				pkts[i].data = data[i];
+				pkts[i].len = cbpf_gen_packet(data[i],
+						sizeof(data[i]), &state);
+			}
+			n = bpf_prog_run_strided(prog, pkts, sizeof(pkts[0]),
+					NR_CTX, sizeof(pkts[0]), r0, &err[0]);
+			for (i = 0; i < NR_CTX; i++) {
+				__u32 filter_ret = cbpf_run(cbpf_filters[f].filter,
+						cbpf_filters[f].len, &pkts[i]);
+
+				if (n != NR_CTX || err[0] || r0[i] != filter_ret) {
+					fprintf(stderr, "Error: classic program %zu in %s lanes, packet of %u bytes: %s, r0 %llu, expected %u\n",
+						f, bpf_prog_simd_isa(prog), pkts[i].len,
+						bpf_strerror(err[0]),
+						(unsigned long long) r0[i], filter_ret);
+					bpf_prog_destroy(prog);
+					return -1;
+				}
+			}
+		}
+		bpf_prog_destroy(prog);
+	}
+	return 0;
+}
+
+/*
+ * Two hash map lookups per run, the second one skipped by a jump on
+ * some runs, against runs of the same program without interleaving.
+ * The last context field divides, to make a run fail.
+ */
+int do_interleave(void)
+{
+	struct bpf_insn bytecode[] = {
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_6, .src_reg = BPF_REG_1 },
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_6 },
+		{ .code = BPF_STX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_2, .off = -4 },
+		BPF_LD_MAP(BPF_REG_1, 0)
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_10 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -4 },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_lookup_elem },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_7, .imm = 1000000 },
+		{ .code = BPF_JMP | BPF_JEQ | BPF_K, .dst_reg = BPF_REG_0, .off = 1 },
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_7, .src_reg = BPF_REG_0 },
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_6, .off = 4 },
+		{ .code = BPF_JMP | BPF_JGT | BPF_K, .dst_reg = BPF_REG_2, .off = 9, .imm = 500 },
+		{ .code = BPF_STX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_10, .src_reg = BPF_REG_2, .off = -4 },
+		BPF_LD_MAP(BPF_REG_1, 0)
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_X, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_10 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_K, .dst_reg = BPF_REG_2, .imm = -4 },
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_map_lookup_elem },
+		{ .code = BPF_JMP | BPF_JEQ | BPF_K, .dst_reg = BPF_REG_0, .off = 2 },
+		{ .code = BPF_LDX | BPF_DW | BPF_MEM, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_0 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_7, .src_reg = BPF_REG_3 },
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_6, .off = 8 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 1000 },
+		{ .code = BPF_ALU64 | BPF_DIV | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_3 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_7 },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	struct bpf_map_attr attr = {
+		.type = BPF_MAP_TYPE_HASH,
+		.key_size = sizeof(__u32),
+		.value_size = sizeof(__u64),
+		.max_entries = 1024,
+	};
+	struct interleave_event {
+		__u32	a, b, c;
+	};
+	enum { NR = 1000, FAIL = 700 };
+	struct interleave_event evs[NR];
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_JIT,
+		.ctx_size = sizeof(struct interleave_event),
+		.nr_maps = 1,
+	};
+	struct bpf_prog *prog = NULL, *ref = NULL;
+	struct bpf_map *map;
+	__u64 r0[NR], expected, value;
+	__u64 state = 0x2545F4914F6CDD1DULL;
+	size_t i, n;
+	__u32 key;
+	int err, ret = -1;
+
+	map = bpf_map_create(&attr);
+	if (!map)
+		return -1;
+	for (key = 0; key < 1000; key += 2) {
+		value = 3 * key;
+		if (bpf_map_update_elem(map, &key, &value, BPF_NOEXIST))
+			goto end;
+	}
+	opts.maps = &map;
+	ref = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	opts.flags = BPF_F_INTERLEAVE;
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!ref || !prog)
+		goto end;
+	for (i = 0; i < NR; i++) {
+		evs[i].a = fuzz_rand(&state) % 1200;
+		evs[i].b = fuzz_rand(&state) % 1200;
+		evs[i].c = i % 7 + 1;
+	}
+
+	n = bpf_prog_run_strided(prog, evs, sizeof(evs[0]), NR, sizeof(evs[0]),
+			r0, &err);
+	if (n != NR || err) {
+		fprintf(stderr, "Error: interleaved batch ran %zu: %s\n", n,
+			bpf_strerror(err));
+		goto end;
+	}
+	for (i = 0; i < NR; i++) {
+		if (bpf_prog_run(ref, &evs[i], sizeof(evs[0]), &expected)
+		    || r0[i] != expected) {
+			fprintf(stderr, "Error: interleaved run %zu returned %llu, expected %llu\n",
+				i, (unsigned long long) r0[i],
+				(unsigned long long) expected);
+			goto end;
+		}
+	}
+
+	evs[FAIL].c = 0;
+	memset(r0, 0, sizeof(r0));
+	n = bpf_prog_run_strided(prog, evs, sizeof(evs[0]), NR, sizeof(evs[0]),
+			r0, &err);
+	if (n != FAIL || err != BPF_ERR_DIV_BY_ZERO) {
+		fprintf(stderr, "Error: interleaved batch stopped at %zu: %s\n",
+			n, bpf_strerror(err));
+		goto end;
+	}
+	for (i = 0; i < FAIL; i++) {
+		if (bpf_prog_run(ref, &evs[i], sizeof(evs[0]), &expected)
+		    || r0[i] != expected) {
+			fprintf(stderr, "Error: interleaved run %zu returned %llu, expected %llu\n",
+				i, (unsigned long long) r0[i],
+				(unsigned long long) expected);
+			goto end;
+		}
+	}
+	ret = 0;
+end:
+	bpf_prog_destroy(prog);
+	bpf_prog_destroy(ref);
+	bpf_map_destroy(map);
+	return ret;
+}
+
+struct pool_event {
+	__u32	a, c;
+};
+
+static unsigned long pool_nr_done;
+
+/* Count the work done, and submit the work in priv if any. */
+static
+void pool_done(struct bpf_work *work)
+{
+	struct bpf_work *next = work->priv;
+
+	if (work->nr_done == work->nr && !work->err)
+		__atomic_add_fetch(&pool_nr_done, 1, __ATOMIC_RELAXED);
+	if (next)
+		bpf_pool_submit(work->pool, next);
+}
+
+static
+int check_pool_results(const char *name, const struct pool_event *evs,
+		const __u64 *r0, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		if (r0[i] != 1000 / evs[i].c + 3ULL * evs[i].a) {
+			fprintf(stderr, "Error: %s: run %zu returned %llu\n",
+				name, i, (unsigned long long) r0[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int do_pool(void)
+{
+	struct bpf_insn bytecode[] = {
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1 },
+		{ .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_3, .src_reg = BPF_REG_1, .off = 4 },
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = 1000 },
+		{ .code = BPF_ALU64 | BPF_DIV | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_3 },
+		{ .code = BPF_ALU64 | BPF_MUL | BPF_K, .dst_reg = BPF_REG_2, .imm = 3 },
+		{ .code = BPF_ALU64 | BPF_ADD | BPF_X, .dst_reg = BPF_REG_0, .src_reg = BPF_REG_2 },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+	struct bpf_prog_opts opts = {
+		.engine = BPF_ENGINE_JIT,
+		.ctx_size = sizeof(struct pool_event),
+	};
+	enum { NR = 100000, FAIL = 70000, NR_WORKS = 8 };
+	static const size_t sizes[NR_WORKS] = {
+		0, 1, 255, 256, 257, 1000, 4097, 30000,
+	};
+	static struct pool_event evs[NR];
+	static __u64 r0[NR], r0s[NR_WORKS][NR];
+	static void *ctxs[NR];
+	struct bpf_work work = { 0 }, works[NR_WORKS] = { { 0 } };
+	struct bpf_pool *pool = NULL;
+	struct bpf_prog *prog;
+	__u64 state = 0x2545F4914F6CDD1DULL;
+	size_t i;
+	int err, ret = -1;
+
+	prog = bpf_prog_load(bytecode, ARRAY_SIZE(bytecode), &opts);
+	if (!prog)
+		return -1;
+	for (i = 0; i < NR; i++) {
+		evs[i].a = fuzz_rand(&state);
+		evs[i].c = i % 13 + 1;
+		ctxs[i] = &evs[NR - 1 - i];
+	}
+	pool_nr_done = 0;
+	pool = bpf_pool_create(4);
+	if (!pool || bpf_pool_nr_threads(pool) != 4)
+		goto end;
+
+	/* Strided, waited for. */
+	work.prog = prog;
+	work.base = evs;
+	work.stride = sizeof(evs[0]);
+	work.nr = NR;
+	work.ctx_len = sizeof(evs[0]);
+	work.r0 = r0;
+	bpf_pool_submit(pool, &work);
+	err = bpf_work_wait(&work);
+	if (err || work.nr_done != NR) {
+		fprintf(stderr, "Error: pool work ran %zu: %s\n", work.nr_done,
+			bpf_strerror(err));
+		goto end;
+	}
+	if (check_pool_results("pool work", evs, r0, NR))
+		goto end;
+
+	/*
+	 * Context pointers, with callbacks, each work submitting the next
+	 * one from its callback but the last, and all works of the first
+	 * half in flight at once.
+	 */
+	for (i = 0; i < NR_WORKS; i++) {
+		works[i].prog = prog;
+		works[i].ctxs = (void *const *) ctxs + i;
+		works[i].nr = sizes[i];
+		works[i].ctx_len = sizeof(evs[0]);
+		works[i].r0 = r0s[i];
+		works[i].done = pool_done;
+		works[i].priv = i >= NR_WORKS / 2 && i + 1 < NR_WORKS ?
+			&works[i + 1] : NULL;
+	}
+	for (i = 0; i <= NR_WORKS / 2; i++)
+		bpf_pool_submit(pool, &works[i]);
+	bpf_pool_destroy(pool);
+	pool = NULL;
+	if (pool_nr_done != NR_WORKS) {
+		fprintf(stderr, "Error: %lu pool works done, expected %d\n",
+			pool_nr_done, NR_WORKS);
+		goto end;
+	}
+	for (i = 0; i < NR_WORKS; i++) {
+		size_t j;
+
+		for (j = 0; j < sizes[i]; j++) {
+			const struct pool_event *ev = ctxs[i + j];
+
+			if (r0s[i][j] != 1000 / ev->c + 3ULL * ev->a) {
+				fprintf(stderr, "Error: pool work %zu: run %zu returned %llu\n",
+					i, j, (unsigned long long) r0s[i][j]);
+				goto end;
+			}
+		}
+	}
+
+	/* The first failed run is reported, whatever ran after it. */
+	pool = bpf_pool_create(0);
+	if (!pool)
+		goto end;
+	evs[FAIL].c = 0;
+	evs[FAIL + 20000].c = 0;
+	memset(r0, 0, sizeof(r0));
+	bpf_pool_submit(pool, &work);
+	err = bpf_work_wait(&work);
+	if (err != BPF_ERR_DIV_BY_ZERO || work.nr_done != FAIL) {
+		fprintf(stderr, "Error: failed pool work stopped at %zu: %s\n",
+			work.nr_done, bpf_strerror(err));
+		goto end;
+	}
+	if (check_pool_results("failed pool work", evs, r0, FAIL))
+		goto end;
+	ret = 0;
+end:
+	bpf_pool_destroy(pool);
+	bpf_prog_destroy(prog);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	enum bpf_engine engines[] = {
+		BPF_ENGINE_SWITCH,
+		BPF_ENGINE_THREADED,
+		BPF_ENGINE_JIT,
+	};
+	int i;
+
+	if (do_register_helpers()) {
+		return -1;
+	}
+	for (i = 0; i < ARRAY_SIZE(engines); i++) {
+		if (do_test(engines[i])) {
+			return -1;
+		}
+		if (do_loop(engines[i]) == 0) {
+			return -1;
+		}
+		if (do_prog_api(engines[i])) {
+			return -1;
+		}
+		if (do_batch(engines[i])) {
+			return -1;
+		}
+		if (do_long_prog(engines[i])) {
+			return -1;
+		}
+		if (do_helpers(engines[i])) {
+			return -1;
+		}
+		if (do_map_prog(engines[i])) {
+			return -1;
+		}
+		if (do_percpu(engines[i])) {
+			return -1;
+		}
+		if (do_atomics(engines[i])) {
+			return -1;
+		}
+		if (do_atomics_mt(engines[i])) {
+			return -1;
+		}
+		if (do_optimize(engines[i])) {
+			return -1;
+		}
+	}
+	if (do_hashmap()) {
+		return -1;
+	}
+	if (do_hashmap_reads()) {
+		return -1;
+	}
+	if (do_percpu_api()) {
+		return -1;
+	}
+	if (do_cfg()) {
+		return -1;
+	}
+	if (do_types()) {
+		return -1;
+	}
+	if (do_fuzz_engines()) {
+		return -1;
+	}
+	if (do_fusion()) {
+		return -1;
+	}
+	if (do_aot()) {
+		return -1;
+	}
+	if (do_tiered()) {
+		return -1;
+	}
+	if (do_profile()) {
+		return -1;
+	}
+	if (do_elf()) {
+		return -1;
+	}
+	if (do_cache()) {
+		return -1;
+	}
+	if (do_multi()) {
+		return -1;
+	}
+	if (do_cbpf()) {
+		return -1;
+	}
+	if (do_packet()) {
+		return -1;
+	}
+	if (do_simd()) {
+		return -1;
+	}
+	if (do_interleave()) {
+		return -1;
+	}
+	if (do_pool()) {
+		return -1;
+	}
+	if (do_fuzz_optimize()) {
 		return -1;
 	}
-	if (do_loop() == 0) {
+	if (do_div_overflow()) {
 		return -1;
 	}
 	return 0;